@@ -0,0 +1,228 @@
+#include <RcppEigen.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "Checkpoint.h"
+#include "TransformStore.h"
+
+static const char checkpointMagic[8] = { 'N', 'R', 'C', 'H', 'K', 'P', 'N', 'T' };
+static const uint32_t checkpointByteOrder = 0x01020304;
+static const int32_t checkpointVersion = 1;
+
+struct CheckpointHeader
+{
+    char magic[8];
+    uint32_t byteOrder;
+    int32_t version;
+    int32_t signatureLength, completedLength, parameterLength, imageCount;
+    uint32_t levelNumber, level;
+    int64_t perturbation, iteration, optimiserStateLength;
+    double stepSize;
+};
+
+// The xform matrices are stored as well as the geometry, so that the grids
+// are restored exactly rather than recalculated from the quaternion
+struct CheckpointImageRecord
+{
+    StoredGeometry geometry;
+    float xforms[4][16];
+};
+
+static double wallTime ()
+{
+#ifdef _OPENMP
+    return omp_get_wtime();
+#else
+    return double(clock()) / CLOCKS_PER_SEC;
+#endif
+}
+
+static void writeBlock (FILE *file, const void *data, const size_t size)
+{
+    if (size > 0 && fwrite(data, 1, size, file) != size)
+        throw std::runtime_error("Failed to write registration checkpoint");
+}
+
+static void readBlock (FILE *file, void *data, const size_t size)
+{
+    if (size > 0 && fread(data, 1, size, file) != size)
+        throw std::runtime_error("Registration checkpoint is truncated or unreadable");
+}
+
+template <typename ElementType>
+static void writeVector (FILE *file, const std::vector<ElementType> &vector)
+{
+    if (!vector.empty())
+        writeBlock(file, &vector.front(), vector.size() * sizeof(ElementType));
+}
+
+template <typename ElementType>
+static void readVector (FILE *file, std::vector<ElementType> &vector, const int64_t length)
+{
+    vector.resize(size_t(length));
+    if (length > 0)
+        readBlock(file, &vector.front(), vector.size() * sizeof(ElementType));
+}
+
+static void copyMatrix (const mat44 &matrix, float *values)
+{
+    for (int i=0; i<4; i++)
+    {
+        for (int j=0; j<4; j++)
+            values[i*4 + j] = matrix.m[i][j];
+    }
+}
+
+static void copyMatrix (const float *values, mat44 &matrix)
+{
+    for (int i=0; i<4; i++)
+    {
+        for (int j=0; j<4; j++)
+            matrix.m[i][j] = values[i*4 + j];
+    }
+}
+
+bool RegistrationCheckpoint::read ()
+{
+    FILE *file = fopen(fileName.c_str(), "rb");
+    if (file == NULL)
+        return false;
+
+    try
+    {
+        CheckpointHeader header;
+        readBlock(file, &header, sizeof(CheckpointHeader));
+        if (memcmp(header.magic, checkpointMagic, 8) != 0)
+            throw std::runtime_error("The file " + fileName + " is not a registration checkpoint");
+        if (header.byteOrder != checkpointByteOrder || header.version != checkpointVersion)
+            throw std::runtime_error("The registration checkpoint was written on another platform or by an incompatible version of this package");
+
+        std::vector<double> storedSignature;
+        readVector(file, storedSignature, header.signatureLength);
+        if (storedSignature != signature)
+            throw std::runtime_error("The registration checkpoint was written for different images or settings");
+
+        state.levelNumber = header.levelNumber;
+        state.level = header.level;
+        state.perturbation = size_t(header.perturbation);
+        state.iteration = size_t(header.iteration);
+        state.stepSize = header.stepSize;
+        readVector(file, state.completedIterations, header.completedLength);
+        readVector(file, state.parameters, header.parameterLength);
+        readVector(file, state.optimiserState, header.optimiserStateLength);
+
+        images.clear();
+        state.transformations.clear();
+        for (int i=0; i<header.imageCount; i++)
+        {
+            CheckpointImageRecord record;
+            readBlock(file, &record, sizeof(CheckpointImageRecord));
+            nifti_image *image = createImageFromGeometry(record.geometry);
+            copyMatrix(record.xforms[0], image->qto_xyz);
+            copyMatrix(record.xforms[1], image->qto_ijk);
+            copyMatrix(record.xforms[2], image->sto_xyz);
+            copyMatrix(record.xforms[3], image->sto_ijk);
+
+            // The image is owned by the vector before its data are read
+            images.push_back(RNifti::NiftiImage(image, false));
+            image->data = calloc(image->nvox, image->nbyper);
+            readBlock(file, image->data, image->nvox * image->nbyper);
+            state.transformations.push_back(image);
+        }
+    }
+    catch (...)
+    {
+        fclose(file);
+        throw;
+    }
+
+    fclose(file);
+    return true;
+}
+
+void RegistrationCheckpoint::write (const reg_checkpointState &state)
+{
+    const double startTime = wallTime();
+    const std::string temporaryFileName = fileName + ".tmp";
+
+    FILE *file = fopen(temporaryFileName.c_str(), "wb");
+    if (file == NULL)
+        throw std::runtime_error("Cannot open file " + temporaryFileName + " for writing");
+
+    try
+    {
+        CheckpointHeader header;
+        memset(&header, 0, sizeof(CheckpointHeader));
+        memcpy(header.magic, checkpointMagic, 8);
+        header.byteOrder = checkpointByteOrder;
+        header.version = checkpointVersion;
+        header.signatureLength = int32_t(signature.size());
+        header.completedLength = int32_t(state.completedIterations.size());
+        header.parameterLength = int32_t(state.parameters.size());
+        header.imageCount = int32_t(state.transformations.size());
+        header.levelNumber = state.levelNumber;
+        header.level = state.level;
+        header.perturbation = int64_t(state.perturbation);
+        header.iteration = int64_t(state.iteration);
+        header.optimiserStateLength = int64_t(state.optimiserState.size());
+        header.stepSize = state.stepSize;
+        writeBlock(file, &header, sizeof(CheckpointHeader));
+
+        writeVector(file, signature);
+        writeVector(file, state.completedIterations);
+        writeVector(file, state.parameters);
+        writeVector(file, state.optimiserState);
+
+        for (size_t i=0; i<state.transformations.size(); i++)
+        {
+            const nifti_image *image = state.transformations[i];
+            CheckpointImageRecord record;
+            memset(&record, 0, sizeof(CheckpointImageRecord));
+            record.geometry = getStoredGeometry(image);
+            copyMatrix(image->qto_xyz, record.xforms[0]);
+            copyMatrix(image->qto_ijk, record.xforms[1]);
+            copyMatrix(image->sto_xyz, record.xforms[2]);
+            copyMatrix(image->sto_ijk, record.xforms[3]);
+            writeBlock(file, &record, sizeof(CheckpointImageRecord));
+            writeBlock(file, image->data, image->nvox * image->nbyper);
+        }
+    }
+    catch (...)
+    {
+        fclose(file);
+        ::remove(temporaryFileName.c_str());
+        throw;
+    }
+
+    if (fclose(file) != 0)
+    {
+        ::remove(temporaryFileName.c_str());
+        throw std::runtime_error("Failed to write registration checkpoint");
+    }
+
+    // Renaming over an existing file fails on Windows, so the old file is
+    // removed first there, leaving a brief window with no checkpoint
+    if (rename(temporaryFileName.c_str(), fileName.c_str()) != 0)
+    {
+        ::remove(fileName.c_str());
+        if (rename(temporaryFileName.c_str(), fileName.c_str()) != 0)
+            throw std::runtime_error("Cannot replace registration checkpoint " + fileName);
+    }
+
+    const double elapsed = wallTime() - startTime;
+    writeTimes.push_back(elapsed);
+    if (verbose)
+        Rprintf("[NiftyReg F3D] Checkpoint at iteration %i of level %u written in %.3f s\n", int(state.iteration), state.level + 1, elapsed);
+}
+
+void RegistrationCheckpoint::remove () const
+{
+    ::remove(fileName.c_str());
+}
+
+void RegistrationCheckpoint::writeCallback (const reg_checkpointState &state, void *checkpoint)
+{
+    static_cast<RegistrationCheckpoint *>(checkpoint)->write(state);
+}
@@ -0,0 +1,52 @@
+#ifndef _CHECKPOINT_H_
+#define _CHECKPOINT_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "RNifti.h"
+#include "_reg_base.h"
+
+// The saved progress of a nonlinear registration, held in a binary file from
+// which it can be resumed at the same level and iteration. The file records
+// the optimiser state and the control point grids at the end of an iteration,
+// along with a signature of the registration settings and image sizes, which
+// must match when it is read back. Each write replaces the file atomically, by
+// writing to a temporary file in the same directory and renaming it
+class RegistrationCheckpoint
+{
+protected:
+    std::string fileName;
+    std::vector<double> signature;
+    bool verbose;
+
+    reg_checkpointState state;
+    std::vector<RNifti::NiftiImage> images;
+    std::vector<double> writeTimes;
+
+public:
+    RegistrationCheckpoint (const std::string &fileName, const std::vector<double> &signature, const bool verbose = false)
+        : fileName(fileName), signature(signature), verbose(verbose) {}
+
+    // Read the state from the checkpoint file, returning false if the file
+    // does not exist. An error is thrown if it belongs to another registration
+    bool read ();
+
+    // The state most recently read, valid while this object exists
+    const reg_checkpointState * getState () const { return &state; }
+
+    // Write a state to the checkpoint file, recording how long it took
+    void write (const reg_checkpointState &state);
+
+    // Wall-clock times, in seconds, taken by each write so far
+    const std::vector<double> & getWriteTimes () const { return writeTimes; }
+
+    // Delete the checkpoint file, once the registration has completed
+    void remove () const;
+
+    // Callback for reg_base<T>::SetCheckpointCallbackFunction(), taking a
+    // pointer to a checkpoint object as its parameter
+    static void writeCallback (const reg_checkpointState &state, void *checkpoint);
+};
+
+#endif
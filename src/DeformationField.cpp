@@ -6,13 +6,12 @@
 #include "_reg_resampling.h"
 
 #include "DeformationField.h"
+#include "helpers.h"
 
+// Create an identity deformation field matching the spatial geometry of a target image
 template <typename PrecisionType>
-void DeformationField<PrecisionType>::initImages (const RNifti::NiftiImage &targetImage)
+static nifti_image * createDeformationField (const nifti_image *targetImage)
 {
-    this->targetImage = targetImage;
-    
-    // Create a deformation field
     nifti_image *deformationField = nifti_copy_nim_info(targetImage);
     deformationField->dim[0] = deformationField->ndim = 5;
     deformationField->dim[1] = deformationField->nx = targetImage->nx;
@@ -32,14 +31,226 @@ void DeformationField<PrecisionType>::initImages (const RNifti::NiftiImage &targ
     // This is a little flakey, but we know only float or double will be used
     deformationField->datatype = (sizeof(PrecisionType)==4 ? NIFTI_TYPE_FLOAT32 : NIFTI_TYPE_FLOAT64);
     deformationField->nbyper = sizeof(PrecisionType);
-    deformationField->data = (void *) calloc(deformationField->nvox, deformationField->nbyper);
+    reg_tools_allocateImageData(deformationField);
 
     // Initialise the deformation field with an identity transformation
     reg_tools_multiplyValueToImage(deformationField, deformationField, 0.0f);
     reg_getDeformationFromDisplacement(deformationField);
     deformationField->intent_p1 = DEF_FIELD;
     
-    this->deformationFieldImage = RNifti::NiftiImage(deformationField);
+    return deformationField;
+}
+
+nifti_image * createResultImage (const nifti_image *targetImage, const nifti_image *sourceImage, const int datatype, const bool allocate)
+{
+    nifti_image *resultImage = nifti_copy_nim_info(targetImage);
+    resultImage->dim[0] = resultImage->ndim = sourceImage->dim[0];
+    resultImage->dim[4] = resultImage->nt = sourceImage->dim[4];
+    resultImage->cal_min = sourceImage->cal_min;
+    resultImage->cal_max = sourceImage->cal_max;
+    resultImage->scl_slope = sourceImage->scl_slope;
+    resultImage->scl_inter = sourceImage->scl_inter;
+    if (datatype == 0)
+    {
+        resultImage->datatype = sourceImage->datatype;
+        resultImage->nbyper = sourceImage->nbyper;
+    }
+    else
+    {
+        resultImage->datatype = datatype;
+        nifti_datatype_sizes(datatype, &resultImage->nbyper, NULL);
+    }
+    resultImage->nvox = size_t(resultImage->dim[1]) * size_t(resultImage->dim[2]) * size_t(resultImage->dim[3]) * size_t(resultImage->dim[4]);
+    if (allocate)
+        reg_tools_allocateImageData(resultImage);
+    return resultImage;
+}
+
+// Return a version of an image whose data type matches the working precision,
+// as needed by reg-lib functions which operate on two images together
+template <typename PrecisionType>
+static RNifti::NiftiImage matchPrecision (const RNifti::NiftiImage &image)
+{
+    const int datatype = (sizeof(PrecisionType)==4 ? NIFTI_TYPE_FLOAT32 : NIFTI_TYPE_FLOAT64);
+    if (image->datatype == datatype)
+        return image;
+    
+    RNifti::NiftiImage convertedImage(image, true);
+    reg_tools_changeDatatype<PrecisionType>(convertedImage);
+    return convertedImage;
+}
+
+// Allocate an image in target space to hold a Jacobian determinant map
+static nifti_image * createJacobianImage (const nifti_image *targetImage, const int datatype)
+{
+    nifti_image *jacobianImage = nifti_copy_nim_info(targetImage);
+    jacobianImage->cal_min = 0;
+    jacobianImage->cal_max = 0;
+    jacobianImage->scl_slope = 1.0;
+    jacobianImage->scl_inter = 0.0;
+    jacobianImage->datatype = datatype;
+    nifti_datatype_sizes(datatype, &jacobianImage->nbyper, NULL);
+    reg_tools_allocateImageData(jacobianImage);
+    return jacobianImage;
+}
+
+template <typename PrecisionType>
+void TransformChain<PrecisionType>::append (const AffineMatrix &affine)
+{
+    const Eigen::Matrix4d matrix = Rcpp::as<Eigen::MatrixXd>(affine);
+    
+    // Consecutive affines are collapsed into one, applying the new one last
+    if (!elements.empty() && elements.back().isAffine)
+        elements.back().matrix = matrix * elements.back().matrix;
+    else
+    {
+        Element element;
+        element.isAffine = true;
+        element.matrix = matrix;
+        elements.push_back(element);
+    }
+}
+
+template <typename PrecisionType>
+void TransformChain<PrecisionType>::append (const RNifti::NiftiImage &targetImage, const RNifti::NiftiImage &transformationImage)
+{
+    Element element;
+    element.isAffine = false;
+    RNifti::NiftiImage image = transformationImage;
+    
+    if (reg_round(image->intent_p1) == CUB_SPLINE_GRID)
+    {
+        // Grids are evaluated lazily, so only their metadata is checked here
+        reg_checkAndCorrectDimension(image);
+        element.transformationImage = matchPrecision<PrecisionType>(image);
+    }
+    else
+    {
+        // Other transformations are evaluated once over their own target, and
+        // the result is then interpolated wherever the chain is applied
+        DeformationField<PrecisionType> deformationField(targetImage, image);
+        element.transformationImage = matchPrecision<PrecisionType>(deformationField.getFieldImage());
+    }
+    
+    const int elementDims = (element.transformationImage->nz > 1 ? 3 : 2);
+    if (nDims == 0)
+        nDims = elementDims;
+    else if (elementDims != nDims)
+        throw std::runtime_error("Transformations in a chain must all have the same dimensionality");
+    
+    elements.push_back(element);
+}
+
+template <typename PrecisionType>
+void TransformChain<PrecisionType>::apply (nifti_image *deformationField, const bool compose) const
+{
+    if (nDims != 0 && deformationField->nu != nDims)
+        throw std::runtime_error("Dimensionality of transformation chain does not match the locations to be mapped");
+    
+    for (size_t i=0; i<elements.size(); i++)
+    {
+        const Element &element = elements[i];
+        const bool composeElement = (compose || i > 0);
+        if (element.isAffine)
+        {
+            mat44 affineMatrix;
+            for (int j=0; j<4; j++)
+            {
+                for (int k=0; k<4; k++)
+                    affineMatrix.m[j][k] = static_cast<float>(element.matrix(j,k));
+            }
+            reg_affine_getDeformationField(&affineMatrix, deformationField, composeElement, NULL);
+        }
+        else
+        {
+            // Nonlinear elements always operate by composition, so the field
+            // is reset to the identity if there is nothing to compose with yet
+            if (!composeElement)
+            {
+                reg_tools_multiplyValueToImage(deformationField, deformationField, 0.0f);
+                reg_getDeformationFromDisplacement(deformationField);
+            }
+            
+            nifti_image *transformationImage = element.transformationImage;
+            if (reg_round(transformationImage->intent_p1) == CUB_SPLINE_GRID)
+                reg_spline_getDeformationField(transformationImage, deformationField, NULL, true, true);
+            else
+                reg_defField_compose(transformationImage, deformationField, NULL);
+        }
+    }
+}
+
+template <typename PrecisionType>
+Eigen::MatrixXd TransformChain<PrecisionType>::mapPoints (const Eigen::MatrixXd &points) const
+{
+    const int pointDims = static_cast<int>(points.cols());
+    if (pointDims != 2 && pointDims != 3)
+        throw std::runtime_error("Points matrix should have 2 or 3 columns");
+    
+    const size_t nPoints = static_cast<size_t>(points.rows());
+    Eigen::MatrixXd result(points.rows(), points.cols());
+    if (nPoints == 0)
+        return result;
+    
+    // The points are laid out along the last spatial axis of a deformation
+    // field, over which reg-lib parallelises. A 3D field with a single slice
+    // would be treated as 2D, so a lone point is duplicated in that case
+    const size_t length = (pointDims == 3 ? std::max(nPoints, size_t(2)) : nPoints);
+    int dims[8] = { 5, 1, 1, 1, 1, pointDims, 1, 1 };
+    dims[pointDims == 3 ? 3 : 2] = static_cast<int>(length);
+    nifti_image *pointField = nifti_make_new_nim(dims, (sizeof(PrecisionType)==4 ? NIFTI_TYPE_FLOAT32 : NIFTI_TYPE_FLOAT64), 1);
+    pointField->intent_p1 = DEF_FIELD;
+    
+    PrecisionType *pointData = static_cast<PrecisionType *>(pointField->data);
+    for (size_t i=0; i<length; i++)
+    {
+        const size_t row = std::min(i, nPoints - 1);
+        for (int j=0; j<pointDims; j++)
+            pointData[i + j * length] = static_cast<PrecisionType>(points(row, j));
+    }
+    
+    // The field's own geometry is irrelevant, since every element composes
+    try
+    {
+        apply(pointField, true);
+    }
+    catch (...)
+    {
+        nifti_image_free(pointField);
+        throw;
+    }
+    
+    for (size_t i=0; i<nPoints; i++)
+    {
+        for (int j=0; j<pointDims; j++)
+            result(i, j) = static_cast<double>(pointData[i + j * length]);
+    }
+    
+    nifti_image_free(pointField);
+    return result;
+}
+
+template <typename PrecisionType>
+void DeformationField<PrecisionType>::initImages (const RNifti::NiftiImage &targetImage)
+{
+    this->targetImage = targetImage;
+    this->deformationFieldImage = RNifti::NiftiImage(createDeformationField<PrecisionType>(targetImage));
+}
+
+template <typename PrecisionType>
+void DeformationField<PrecisionType>::updateData ()
+{
+    // Point lookup reads the field buffer in place, so fields of any other
+    // type, or with scaling, are converted once to the working precision
+    const bool scaled = (deformationFieldImage->scl_slope != 0.0 && (deformationFieldImage->scl_slope != 1.0 || deformationFieldImage->scl_inter != 0.0));
+    if (scaled || (deformationFieldImage->datatype != NIFTI_TYPE_FLOAT32 && deformationFieldImage->datatype != NIFTI_TYPE_FLOAT64))
+    {
+        RNifti::NiftiImage convertedImage(deformationFieldImage, true);
+        if (scaled)
+            reg_tools_removeSCLInfo(convertedImage);
+        reg_tools_changeDatatype<PrecisionType>(convertedImage);
+        deformationFieldImage = convertedImage;
+    }
 }
 
 template <typename PrecisionType>
@@ -98,18 +309,19 @@ DeformationField<PrecisionType>::DeformationField (const RNifti::NiftiImage &tar
     updateData();
 }
 
+template <typename PrecisionType>
+DeformationField<PrecisionType>::DeformationField (const RNifti::NiftiImage &targetImage, const TransformChain<PrecisionType> &chain)
+{
+    initImages(targetImage);
+    chain.apply(deformationFieldImage);
+    updateData();
+}
+
 template <typename PrecisionType>
 RNifti::NiftiImage DeformationField<PrecisionType>::getJacobian ()
 {
     // Allocate Jacobian determinant image
-    nifti_image *jacobianImage = nifti_copy_nim_info(targetImage);
-    jacobianImage->cal_min = 0;
-    jacobianImage->cal_max = 0;
-    jacobianImage->scl_slope = 1.0;
-    jacobianImage->scl_inter = 0.0;
-    jacobianImage->datatype = NIFTI_TYPE_FLOAT64;
-    jacobianImage->nbyper = 8;
-    jacobianImage->data = (void *) calloc(jacobianImage->nvox, jacobianImage->nbyper);
+    nifti_image *jacobianImage = createJacobianImage(targetImage, NIFTI_TYPE_FLOAT64);
     
     // Calculate Jacobian determinant map
     reg_defField_getJacobianMap(deformationFieldImage, jacobianImage);
@@ -121,17 +333,7 @@ template <typename PrecisionType>
 RNifti::NiftiImage DeformationField<PrecisionType>::resampleImage (RNifti::NiftiImage &sourceImage, const int interpolation)
 {
     // Allocate result image
-    nifti_image *resultImage = nifti_copy_nim_info(targetImage);
-    resultImage->dim[0] = resultImage->ndim = sourceImage->dim[0];
-    resultImage->dim[4] = resultImage->nt = sourceImage->dim[4];
-    resultImage->cal_min = sourceImage->cal_min;
-    resultImage->cal_max = sourceImage->cal_max;
-    resultImage->scl_slope = sourceImage->scl_slope;
-    resultImage->scl_inter = sourceImage->scl_inter;
-    resultImage->datatype = sourceImage->datatype;
-    resultImage->nbyper = sourceImage->nbyper;
-    resultImage->nvox = size_t(resultImage->dim[1]) * size_t(resultImage->dim[2]) * size_t(resultImage->dim[3]) * size_t(resultImage->dim[4]);
-    resultImage->data = (void *) calloc(resultImage->nvox, resultImage->nbyper);
+    nifti_image *resultImage = createResultImage(targetImage, sourceImage);
 
     // Resample source image to target space
     reg_resampleImage(sourceImage, resultImage, deformationFieldImage, NULL, interpolation, 0);
@@ -141,7 +343,17 @@ RNifti::NiftiImage DeformationField<PrecisionType>::resampleImage (RNifti::Nifti
 
 template <typename PrecisionType>
 template <int Dim>
-Rcpp::NumericVector DeformationField<PrecisionType>::findPoint (const RNifti::NiftiImage &sourceImage, const Eigen::Matrix<double,Dim,1> &sourceLoc, const bool nearest, const Eigen::Matrix<double,Dim,1> &start) const
+Rcpp::NumericVector DeformationField<PrecisionType>::findPoint (const Eigen::Matrix<double,Dim,1> &sourceLoc, const bool nearest, const Eigen::Matrix<double,Dim,1> &start) const
+{
+    if (deformationFieldImage->datatype == NIFTI_TYPE_FLOAT32)
+        return findPoint<Dim,float>(DeformationFieldView<float>(deformationFieldImage), sourceLoc, nearest, start);
+    else
+        return findPoint<Dim,double>(DeformationFieldView<double>(deformationFieldImage), sourceLoc, nearest, start);
+}
+
+template <typename PrecisionType>
+template <int Dim, typename ElementType>
+Rcpp::NumericVector DeformationField<PrecisionType>::findPoint (const DeformationFieldView<ElementType> &field, const Eigen::Matrix<double,Dim,1> &sourceLoc, const bool nearest, const Eigen::Matrix<double,Dim,1> &start) const
 {
     typedef Eigen::Matrix<double,Dim,1> Point;
     Point closestLoc = Point::Zero();
@@ -191,8 +403,8 @@ Rcpp::NumericVector DeformationField<PrecisionType>::findPoint (const RNifti::Ni
                 if (Dim == 2)
                 {
                     Point currentLoc;
-                    currentLoc[0] = deformationData[v];
-                    currentLoc[1] = deformationData[v + nVoxels];
+                    currentLoc[0] = field(v, 0);
+                    currentLoc[1] = field(v, 1);
                     
                     const double currentDistance = (currentLoc - sourceLoc).norm();
                     if (currentDistance < currentClosestDistance)
@@ -214,9 +426,9 @@ Rcpp::NumericVector DeformationField<PrecisionType>::findPoint (const RNifti::Ni
                         const size_t w = v + z * strides[2];
                         
                         Point currentLoc;
-                        currentLoc[0] = deformationData[w];
-                        currentLoc[1] = deformationData[w + nVoxels];
-                        currentLoc[2] = deformationData[w + 2*nVoxels];
+                        currentLoc[0] = field(w, 0);
+                        currentLoc[1] = field(w, 1);
+                        currentLoc[2] = field(w, 2);
                         
                         const double currentDistance = (currentLoc - sourceLoc).norm();
                         if (currentDistance < currentClosestDistance)
@@ -253,63 +465,112 @@ Rcpp::NumericVector DeformationField<PrecisionType>::findPoint (const RNifti::Ni
         }
     }
     
-    if (nearest || closestDistance == 0.0)
+    Point location;
+    location[0] = static_cast<double>(closestVoxel % deformationFieldImage->dim[1]);
+    for (int i=1; i<Dim; i++)
+        location[i] = static_cast<double>((closestVoxel / strides[i]) % deformationFieldImage->dim[i+1]);
+    
+    if (!nearest && closestDistance > 0.0)
+        location = refinePoint<Dim,ElementType>(field, sourceLoc, location);
+    
+    // Convert to R's 1-based indexing
+    Rcpp::NumericVector result(Dim);
+    for (int i=0; i<Dim; i++)
+        result[i] = location[i] + 1.0;
+    return result;
+}
+
+template <typename PrecisionType>
+template <int Dim, typename ElementType>
+void DeformationField<PrecisionType>::interpolateField (const DeformationFieldView<ElementType> &field, const Eigen::Matrix<double,Dim,1> &location, Eigen::Matrix<double,Dim,1> &value, Eigen::Matrix<double,Dim,Dim> &jacobian) const
+{
+    int base[Dim];
+    size_t strides[Dim];
+    double fraction[Dim];
+    for (int i=0; i<Dim; i++)
     {
-        Rcpp::NumericVector result(Dim);
-        result[0] = closestVoxel % deformationFieldImage->dim[1] + 1.0;
-        for (int i=1; i<Dim; i++)
-            result[i] = (closestVoxel / strides[i]) % deformationFieldImage->dim[i+1] + 1.0;
-        
-        return result;
+        // The cell is clamped to the field, so locations beyond its edges are
+        // linearly extrapolated from the outermost cell
+        const int size = deformationFieldImage->dim[i+1];
+        base[i] = std::max(0, std::min(static_cast<int>(std::floor(location[i])), size - 2));
+        fraction[i] = location[i] - static_cast<double>(base[i]);
+        strides[i] = (i == 0 ? 1 : strides[i-1] * size_t(deformationFieldImage->dim[i]));
     }
-    else
+    
+    value.setZero();
+    jacobian.setZero();
+    for (int corner=0; corner<(1<<Dim); corner++)
     {
-        Rcpp::NumericVector result(int(R_pow_di(4.0,Dim)) * 2 * Dim);
-        const mat44 &xform = sourceImage.xform();
-        Point offset = sourceLoc - closestLoc;
-        
+        size_t voxel = 0;
+        double weight = 1.0;
+        Eigen::Matrix<double,Dim,1> weightGradient = Eigen::Matrix<double,Dim,1>::Ones();
         for (int i=0; i<Dim; i++)
-            offset[i] = (offset[i] * xform.m[i][i] >= 0.0 ? 0.0 : -1.0);
+        {
+            const int offset = (corner >> i) & 1;
+            voxel += size_t(std::min(base[i] + offset, deformationFieldImage->dim[i+1] - 1)) * strides[i];
+            const double axisWeight = (offset == 1 ? fraction[i] : 1.0 - fraction[i]);
+            weight *= axisWeight;
+            for (int j=0; j<Dim; j++)
+                weightGradient[j] *= (i == j ? (offset == 1 ? 1.0 : -1.0) : axisWeight);
+        }
         
-        for (int i=0; i<4; i++)
+        for (int k=0; k<Dim; k++)
         {
-            const int xShift = i + offset[0] - 1;
+            const double component = field(voxel, k);
+            value[k] += weight * component;
+            jacobian.row(k) += component * weightGradient.transpose();
+        }
+    }
+}
 
-            for (int j=0; j<4; j++)
+template <typename PrecisionType>
+template <int Dim, typename ElementType>
+Eigen::Matrix<double,Dim,1> DeformationField<PrecisionType>::refinePoint (const DeformationFieldView<ElementType> &field, const Eigen::Matrix<double,Dim,1> &sourceLoc, const Eigen::Matrix<double,Dim,1> &start) const
+{
+    typedef Eigen::Matrix<double,Dim,1> Point;
+    typedef Eigen::Matrix<double,Dim,Dim> Matrix;
+    
+    // Newton iterations on the (multi)linearly interpolated field, starting
+    // from the closest voxel, with the step halved whenever it fails to reduce
+    // the distance from the requested source location
+    Point location = start, value;
+    Matrix jacobian;
+    interpolateField<Dim,ElementType>(field, location, value, jacobian);
+    double distance = (value - sourceLoc).norm();
+    
+    for (int iteration=0; iteration<50 && distance > 0.0; iteration++)
+    {
+        const Eigen::FullPivLU<Matrix> decomposition(jacobian);
+        if (!decomposition.isInvertible())
+            break;
+        Point step = decomposition.solve(value - sourceLoc);
+        
+        bool improved = false;
+        for (int halvings=0; halvings<10 && !improved; halvings++)
+        {
+            const Point candidate = location - step;
+            Point candidateValue;
+            Matrix candidateJacobian;
+            interpolateField<Dim,ElementType>(field, candidate, candidateValue, candidateJacobian);
+            const double candidateDistance = (candidateValue - sourceLoc).norm();
+            if (candidateDistance < distance)
             {
-                const int yShift = j + offset[1] - 1;
-                
-                if (Dim == 2)
-                {
-                    const size_t v = closestVoxel + xShift + yShift * strides[1];
-                    const size_t w = size_t(i + j*4);
-                
-                    result[2*Dim*w] = deformationData[v];
-                    result[2*Dim*w + 1] = deformationData[v + nVoxels];
-                    result[2*Dim*w + 2] = v % deformationFieldImage->dim[1] + 1.0;
-                    result[2*Dim*w + 3] = (v / strides[1]) % deformationFieldImage->dim[2] + 1.0;
-                }
-                else
-                {
-                    for (int k=0; k<4; k++)
-                    {
-                        const int zShift = k + offset[2] - 1;
-                        const size_t v = closestVoxel + xShift + yShift * strides[1] + zShift * strides[2];
-                        const size_t w = size_t(i + j*4 + k*16);
-                        
-                        result[2*Dim*w] = deformationData[v];
-                        result[2*Dim*w + 1] = deformationData[v + nVoxels];
-                        result[2*Dim*w + 2] = deformationData[v + 2*nVoxels];
-                        result[2*Dim*w + 3] = v % deformationFieldImage->dim[1] + 1.0;
-                        result[2*Dim*w + 4] = (v / strides[1]) % deformationFieldImage->dim[2] + 1.0;
-                        result[2*Dim*w + 5] = (v / strides[2]) % deformationFieldImage->dim[3] + 1.0;
-                    }
-                }
+                location = candidate;
+                value = candidateValue;
+                jacobian = candidateJacobian;
+                distance = candidateDistance;
+                improved = true;
             }
+            else
+                step /= 2.0;
         }
         
-        return result;
+        // Stop once the location no longer changes appreciably
+        if (!improved || step.norm() < 1e-6)
+            break;
     }
+    
+    return location;
 }
 
 template <typename PrecisionType>
@@ -319,17 +580,837 @@ void DeformationField<PrecisionType>::compose (const DeformationField &otherFiel
     updateData();
 }
 
+// Read one of the affine matrices that NiftyReg may embed in the extensions of
+// a control point grid, which are applied to points before (index 0) and after
+// (index 1) the spline itself; the identity is returned if it is absent
+static bool getGridMatrix (const nifti_image *grid, const int index, mat44 &matrix)
+{
+    if (grid->num_ext > index && grid->ext_list[index].edata != NULL)
+    {
+        memcpy(&matrix, grid->ext_list[index].edata, sizeof(mat44));
+        return true;
+    }
+    else
+    {
+        reg_mat44_eye(&matrix);
+        return false;
+    }
+}
+
+static void setGridMatrix (nifti_image *grid, const int index, const mat44 &matrix)
+{
+    // Extensions are positional, so any missing earlier ones are filled with the identity
+    mat44 identity;
+    reg_mat44_eye(&identity);
+    while (grid->num_ext < index)
+        nifti_add_extension(grid, reinterpret_cast<const char *>(&identity), int(sizeof(mat44)), NIFTI_ECODE_IGNORE);
+
+    if (grid->num_ext > index)
+        memcpy(grid->ext_list[index].edata, &matrix, sizeof(mat44));
+    else
+        nifti_add_extension(grid, reinterpret_cast<const char *>(&matrix), int(sizeof(mat44)), NIFTI_ECODE_IGNORE);
+}
+
+// Discard any embedded matrices from the specified index onwards
+static void truncateGridMatrices (nifti_image *grid, const int index)
+{
+    while (grid->num_ext > index)
+    {
+        grid->num_ext--;
+        free(grid->ext_list[grid->num_ext].edata);
+        grid->ext_list[grid->num_ext].edata = NULL;
+    }
+}
+
+// Apply an affine matrix to the control point positions of a grid. Cubic
+// B-splines reproduce affine maps exactly, so this is equivalent to applying
+// the matrix after the spline transformation
+template <typename DataType>
+static void transformGridPositions (nifti_image *grid, const mat44 &matrix)
+{
+    const size_t nNodes = size_t(grid->nx) * size_t(grid->ny) * size_t(grid->nz);
+    DataType *xPtr = static_cast<DataType *>(grid->data);
+    DataType *yPtr = xPtr + nNodes;
+    DataType *zPtr = (grid->nu > 2 ? yPtr + nNodes : NULL);
+
+    for (size_t i=0; i<nNodes; i++)
+    {
+        const double position[3] = { double(xPtr[i]), double(yPtr[i]), (zPtr == NULL ? 0.0 : double(zPtr[i])) };
+        double newPosition[3];
+        reg_mat44_mul(&matrix, position, newPosition);
+        xPtr[i] = static_cast<DataType>(newPosition[0]);
+        yPtr[i] = static_cast<DataType>(newPosition[1]);
+        if (zPtr != NULL)
+            zPtr[i] = static_cast<DataType>(newPosition[2]);
+    }
+}
+
+// Add a layer of control points around a grid. reg-lib gives points beyond the
+// edge of a grid the displacement of the nearest control point, so new control
+// points are set the same way, and the transformation is unchanged
+template <typename DataType>
+static void padGrid (nifti_image *grid)
+{
+    const bool is3D = (grid->nz > 1);
+    const int oldDim[3] = { grid->nx, grid->ny, grid->nz };
+    const size_t oldNodes = size_t(grid->nx) * size_t(grid->ny) * size_t(grid->nz);
+    const mat44 *oldMatrix = (grid->sform_code > 0 ? &grid->sto_xyz : &grid->qto_xyz);
+    const DataType *oldData = static_cast<const DataType *>(grid->data);
+
+    grid->dim[1] = grid->nx = oldDim[0] + 2;
+    grid->dim[2] = grid->ny = oldDim[1] + 2;
+    grid->dim[3] = grid->nz = (is3D ? oldDim[2] + 2 : 1);
+    const size_t nNodes = size_t(grid->nx) * size_t(grid->ny) * size_t(grid->nz);
+    grid->nvox = nNodes * grid->nu;
+    DataType *data = static_cast<DataType *>(calloc(grid->nvox, sizeof(DataType)));
+
+    for (int k=0; k<grid->nz; k++)
+    {
+        for (int j=0; j<grid->ny; j++)
+        {
+            for (int i=0; i<grid->nx; i++)
+            {
+                // Old grid indices of this node and of the nearest old node
+                const float index[3] = { float(i - 1), float(j - 1), (is3D ? float(k - 1) : 0.0f) };
+                const int nearest[3] = { std::min(std::max(i - 1, 0), oldDim[0] - 1), std::min(std::max(j - 1, 0), oldDim[1] - 1), (is3D ? std::min(std::max(k - 1, 0), oldDim[2] - 1) : 0) };
+                const float nearestIndex[3] = { float(nearest[0]), float(nearest[1]), float(nearest[2]) };
+                float position[3], nearestPosition[3];
+                reg_mat44_mul(oldMatrix, index, position);
+                reg_mat44_mul(oldMatrix, nearestIndex, nearestPosition);
+
+                const size_t oldNode = (size_t(nearest[2]) * oldDim[1] + nearest[1]) * oldDim[0] + nearest[0];
+                const size_t node = (size_t(k) * grid->ny + j) * grid->nx + i;
+                for (int c=0; c<grid->nu; c++)
+                    data[node + c*nNodes] = oldData[oldNode + c*oldNodes] + static_cast<DataType>(position[c] - nearestPosition[c]);
+            }
+        }
+    }
+
+    free(grid->data);
+    grid->data = data;
+
+    // The origin moves back by one control point
+    const float origin[3] = { -1.0f, -1.0f, (is3D ? -1.0f : 0.0f) };
+    float qOrigin[3], sOrigin[3];
+    reg_mat44_mul(&grid->qto_xyz, origin, qOrigin);
+    reg_mat44_mul(&grid->sto_xyz, origin, sOrigin);
+    for (int i=0; i<3; i++)
+    {
+        grid->qto_xyz.m[i][3] = qOrigin[i];
+        grid->sto_xyz.m[i][3] = sOrigin[i];
+    }
+    grid->qoffset_x = qOrigin[0];
+    grid->qoffset_y = qOrigin[1];
+    grid->qoffset_z = qOrigin[2];
+    grid->qto_ijk = nifti_mat44_inverse(grid->qto_xyz);
+    grid->sto_ijk = nifti_mat44_inverse(grid->sto_xyz);
+}
+
+// Halve the control point spacing of a grid, without changing the transformation
+// it represents. Refinement loses half a control point spacing at each edge, so
+// the grid is padded first. reg-lib updates only the sform in this case, so the
+// qform is adjusted to match here
+template <typename DataType>
+static void refineGrid (nifti_image *grid)
+{
+    padGrid<DataType>(grid);
+
+    const bool is3D = (grid->nz > 1);
+    mat44 qform = grid->qto_xyz;
+    const float firstNode[3] = { 0.5f, 0.5f, (is3D ? 0.5f : 0.0f) };
+    float origin[3];
+    reg_mat44_mul(&qform, firstNode, origin);
+
+    reg_spline_refineControlPointGrid(grid, NULL);
+
+    for (int i=0; i<3; i++)
+    {
+        for (int j=0; j<(is3D ? 3 : 2); j++)
+            qform.m[i][j] /= 2.0f;
+        qform.m[i][3] = origin[i];
+    }
+    grid->qto_xyz = qform;
+    grid->qto_ijk = nifti_mat44_inverse(qform);
+    grid->qoffset_x = origin[0];
+    grid->qoffset_y = origin[1];
+    grid->qoffset_z = origin[2];
+}
+
+// Create an identity deformation field sampling the space of a target image
+// at half the control point spacing of a grid, so that points fall on the
+// control points and midway between them, where the error of an approximated
+// grid tends to be largest
+template <typename DataType>
+static nifti_image * createSampleField (const nifti_image *targetImage, const nifti_image *grid)
+{
+    const bool is3D = (targetImage->nz > 1);
+    const float step[3] = { fabsf(grid->dx) / (2.0f * fabsf(targetImage->dx)), fabsf(grid->dy) / (2.0f * fabsf(targetImage->dy)), (is3D ? fabsf(grid->dz) / (2.0f * fabsf(targetImage->dz)) : 1.0f) };
+
+    nifti_image *header = nifti_copy_nim_info(targetImage);
+    mat44 sampling;
+    reg_mat44_eye(&sampling);
+    for (int i=0; i<(is3D ? 3 : 2); i++)
+    {
+        header->dim[i+1] = std::max(1, int(floorf(float(targetImage->dim[i+1] - 1) / step[i])) + 1);
+        sampling.m[i][i] = step[i];
+    }
+    header->nx = header->dim[1];
+    header->ny = header->dim[2];
+    header->nz = header->dim[3];
+    header->qto_xyz = reg_mat44_mul(&targetImage->qto_xyz, &sampling);
+    header->qto_ijk = nifti_mat44_inverse(header->qto_xyz);
+    header->sto_xyz = reg_mat44_mul(&targetImage->sto_xyz, &sampling);
+    header->sto_ijk = nifti_mat44_inverse(header->sto_xyz);
+
+    nifti_image *field = createDeformationField<DataType>(header);
+    nifti_image_free(header);
+    return field;
+}
+
+template <typename DataType>
+static double maxFieldDistance (const nifti_image *field1, const nifti_image *field2)
+{
+    const size_t nVoxels = size_t(field1->nx) * size_t(field1->ny) * size_t(field1->nz);
+    const DataType *data1 = static_cast<const DataType *>(field1->data);
+    const DataType *data2 = static_cast<const DataType *>(field2->data);
+
+    double maxDistance = 0.0;
+    for (size_t i=0; i<nVoxels; i++)
+    {
+        double squaredDistance = 0.0;
+        for (int j=0; j<field1->nu; j++)
+        {
+            const double difference = double(data1[i + j*nVoxels]) - double(data2[i + j*nVoxels]);
+            squaredDistance += difference * difference;
+        }
+        // NaN distances, from points that cannot be mapped, are ignored
+        if (squaredDistance > maxDistance * maxDistance)
+            maxDistance = sqrt(squaredDistance);
+    }
+    return maxDistance;
+}
+
+template <typename DataType>
+static RNifti::NiftiImage composeControlPointGrids (const RNifti::NiftiImage &grid1, RNifti::NiftiImage &grid2, const RNifti::NiftiImage &targetImage, const double tolerance)
+{
+    // Points pass through the whole of the second transformation's spline and
+    // the first's, with any embedded affines between them applied to the
+    // second grid's control point positions. The result keeps the second
+    // grid's initial affine, while the first grid's final affine is folded into
+    // its control point positions
+    mat44 preMatrix1, postMatrix1, preMatrix2, postMatrix2;
+    getGridMatrix(grid1, 0, preMatrix1);
+    getGridMatrix(grid1, 1, postMatrix1);
+    getGridMatrix(grid2, 0, preMatrix2);
+    getGridMatrix(grid2, 1, postMatrix2);
+    const mat44 innerMatrix = reg_mat44_mul(&preMatrix1, &postMatrix2);
+
+    while (true)
+    {
+        RNifti::NiftiImage composedGrid(grid2, true);
+        truncateGridMatrices(composedGrid, 1);
+        transformGridPositions<DataType>(composedGrid, innerMatrix);
+        reg_spline_cppComposition(grid1, composedGrid, false, false, true);
+        transformGridPositions<DataType>(composedGrid, postMatrix1);
+
+        // The composed grid is only an approximation, so check it against the
+        // exact composition of the two transformations over the target image
+        nifti_image *exactField = createSampleField<DataType>(targetImage, grid2);
+        reg_spline_getDeformationField(grid2, exactField, NULL, true, true);
+        reg_spline_getDeformationField(grid1, exactField, NULL, true, true);
+
+        nifti_image *composedField = createSampleField<DataType>(targetImage, grid2);
+        reg_spline_getDeformationField(composedGrid, composedField, NULL, true, true);
+
+        const double error = maxFieldDistance<DataType>(exactField, composedField);
+        nifti_image_free(exactField);
+        nifti_image_free(composedField);
+
+        if (error <= tolerance)
+            return composedGrid;
+
+        // A grid finer than the target image would be no more compact than a
+        // deformation field, so give up at that point
+        if (fabs(grid2->dx) / 2.0 < fabs(targetImage->dx) || fabs(grid2->dy) / 2.0 < fabs(targetImage->dy) || (grid2->nz > 1 && fabs(grid2->dz) / 2.0 < fabs(targetImage->dz)))
+            return RNifti::NiftiImage();
+
+        // Refinement is exact, so the second transformation is unchanged, but
+        // its composition with the first can be represented more closely
+        refineGrid<DataType>(grid2);
+    }
+}
+
+RNifti::NiftiImage composeControlPointGrids (const RNifti::NiftiImage &grid1, const RNifti::NiftiImage &grid2, const RNifti::NiftiImage &targetImage, const double tolerance)
+{
+    RNifti::NiftiImage firstGrid(grid1, true);
+    RNifti::NiftiImage secondGrid(grid2, true);
+    reg_checkAndCorrectDimension(firstGrid);
+    reg_checkAndCorrectDimension(secondGrid);
+
+    if ((firstGrid->nz > 1) != (secondGrid->nz > 1))
+        return RNifti::NiftiImage();
+
+    // The result takes the precision of the second grid
+    if (secondGrid->datatype == NIFTI_TYPE_FLOAT32)
+    {
+        if (firstGrid->datatype != NIFTI_TYPE_FLOAT32)
+            reg_tools_changeDatatype<float>(firstGrid);
+        return composeControlPointGrids<float>(firstGrid, secondGrid, targetImage, tolerance);
+    }
+    else
+    {
+        if (firstGrid->datatype != NIFTI_TYPE_FLOAT64)
+            reg_tools_changeDatatype<double>(firstGrid);
+        if (secondGrid->datatype != NIFTI_TYPE_FLOAT64)
+            reg_tools_changeDatatype<double>(secondGrid);
+        return composeControlPointGrids<double>(firstGrid, secondGrid, targetImage, tolerance);
+    }
+}
+
+RNifti::NiftiImage composeControlPointGrids (const AffineMatrix &affine, const RNifti::NiftiImage &grid)
+{
+    RNifti::NiftiImage composedGrid(grid, true);
+    reg_checkAndCorrectDimension(composedGrid);
+
+    // The affine is applied last, so it can be combined with the grid's final
+    // embedded matrix if there is one, or otherwise with its control point positions
+    const mat44 matrix = affine;
+    mat44 postMatrix;
+    if (getGridMatrix(composedGrid, 1, postMatrix))
+        setGridMatrix(composedGrid, 1, reg_mat44_mul(&matrix, &postMatrix));
+    else if (composedGrid->datatype == NIFTI_TYPE_FLOAT32)
+        transformGridPositions<float>(composedGrid, matrix);
+    else
+    {
+        if (composedGrid->datatype != NIFTI_TYPE_FLOAT64)
+            reg_tools_changeDatatype<double>(composedGrid);
+        transformGridPositions<double>(composedGrid, matrix);
+    }
+
+    return composedGrid;
+}
+
+RNifti::NiftiImage composeControlPointGrids (const RNifti::NiftiImage &grid, const AffineMatrix &affine)
+{
+    RNifti::NiftiImage composedGrid(grid, true);
+    reg_checkAndCorrectDimension(composedGrid);
+
+    // The affine is applied first, so it is combined with the grid's initial embedded matrix
+    const mat44 matrix = affine;
+    mat44 preMatrix;
+    getGridMatrix(composedGrid, 0, preMatrix);
+    setGridMatrix(composedGrid, 0, reg_mat44_mul(&preMatrix, &matrix));
+
+    return composedGrid;
+}
+
+// Restrict an image header to a slab of "count" slices along the given axis,
+// starting at slice "start" of the reference image, and adjust its xforms to match
+static void setTileGeometry (nifti_image *tile, const nifti_image *referenceImage, const int axis, const int start, const int count)
+{
+    const size_t spatialVoxels = size_t(tile->nx) * size_t(tile->ny) * size_t(tile->nz);
+    const size_t nonSpatialCount = tile->nvox / spatialVoxels;
+    
+    tile->dim[axis] = count;
+    tile->nx = tile->dim[1];
+    tile->ny = tile->dim[2];
+    tile->nz = tile->dim[3];
+    tile->nvox = size_t(tile->nx) * size_t(tile->ny) * size_t(tile->nz) * nonSpatialCount;
+    
+    tile->qto_xyz = referenceImage->qto_xyz;
+    tile->sto_xyz = referenceImage->sto_xyz;
+    for (int i=0; i<3; i++)
+    {
+        tile->qto_xyz.m[i][3] += tile->qto_xyz.m[i][axis-1] * start;
+        tile->sto_xyz.m[i][3] += tile->sto_xyz.m[i][axis-1] * start;
+    }
+    tile->qoffset_x = tile->qto_xyz.m[0][3];
+    tile->qoffset_y = tile->qto_xyz.m[1][3];
+    tile->qoffset_z = tile->qto_xyz.m[2][3];
+    tile->qto_ijk = nifti_mat44_inverse(tile->qto_xyz);
+    tile->sto_ijk = nifti_mat44_inverse(tile->sto_xyz);
+}
+
+RNifti::NiftiImage getControlPointGridJacobian (const RNifti::NiftiImage &targetImage, const RNifti::NiftiImage &grid)
+{
+    // The grid coefficients are read with the precision of the map
+    RNifti::NiftiImage gridImage = grid;
+    reg_checkAndCorrectDimension(gridImage);
+    gridImage = matchPrecision<float>(gridImage);
+    
+    nifti_image *jacobianImage = createJacobianImage(targetImage, NIFTI_TYPE_FLOAT32);
+    const int axis = (targetImage->nz > 1 ? 3 : 2);
+    const int nSlices = targetImage->dim[axis];
+    const size_t sliceVoxels = (axis == 3 ? size_t(targetImage->nx) * size_t(targetImage->ny) : size_t(targetImage->nx));
+    
+    // reg-lib evaluates the spline derivatives for a grid that may not be
+    // aligned with the target serially, so the target is split into slices,
+    // each with its own header pointing into the map, which are processed
+    // in parallel. Slice headers are never freed, so a shallow copy suffices
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+    for (int i=0; i<nSlices; i++)
+    {
+        nifti_image slice = *jacobianImage;
+        setTileGeometry(&slice, jacobianImage, axis, i, 1);
+        slice.data = static_cast<float *>(jacobianImage->data) + sliceVoxels * size_t(i);
+        reg_spline_GetJacobianMap(gridImage, &slice);
+    }
+    
+    // The spline Jacobian is taken with respect to the locations at which the
+    // grid is evaluated, so any embedded affines contribute their determinants
+    double scale = 1.0;
+    mat44 matrix;
+    for (int i=0; i<2; i++)
+    {
+        if (getGridMatrix(gridImage, i, matrix))
+            scale *= (axis == 3 ? nifti_mat33_determ(reg_mat44_to_mat33(&matrix)) : matrix.m[0][0] * matrix.m[1][1] - matrix.m[0][1] * matrix.m[1][0]);
+    }
+    if (scale != 1.0)
+        reg_tools_multiplyValueToImage(jacobianImage, jacobianImage, scale);
+    
+    return RNifti::NiftiImage(jacobianImage);
+}
+
+template <typename PrecisionType>
+void DeformationFieldTiles<PrecisionType>::initTiles (const bool tiled)
+{
+    this->tiled = tiled;
+    
+    // Tiles are slabs along the last spatial dimension
+    axis = (targetImage->nz > 1 ? 3 : 2);
+    nSlices = targetImage->dim[axis];
+    sliceVoxels = (axis == 3 ? size_t(targetImage->nx) * size_t(targetImage->ny) : size_t(targetImage->nx));
+    if (tiled)
+    {
+        tileSlices = std::max(2, std::min(nSlices, int(DEFORMATION_TILE_VOXELS / sliceVoxels)));
+        
+        // A single field buffer, sized for the largest tile, is reused throughout
+        nifti_image *tileHeader = nifti_copy_nim_info(targetImage);
+        setTileGeometry(tileHeader, targetImage, axis, 0, maxSlices());
+        fieldImage = RNifti::NiftiImage(createDeformationField<PrecisionType>(tileHeader));
+        nifti_image_free(tileHeader);
+    }
+    else
+        tileSlices = nSlices;
+}
+
+template <typename PrecisionType>
+DeformationFieldTiles<PrecisionType>::DeformationFieldTiles (const RNifti::NiftiImage &targetImage, const AffineMatrix &affine)
+    : targetImage(targetImage)
+{
+    chain.append(affine);
+    initTiles(true);
+}
+
+template <typename PrecisionType>
+DeformationFieldTiles<PrecisionType>::DeformationFieldTiles (const RNifti::NiftiImage &targetImage, RNifti::NiftiImage &transformationImage)
+    : targetImage(targetImage)
+{
+    if (reg_round(transformationImage->intent_p1) == CUB_SPLINE_GRID)
+    {
+        chain.append(targetImage, transformationImage);
+        initTiles(true);
+    }
+    else
+    {
+        // Dense fields and velocity-based transformations are handled as a whole
+        DeformationField<PrecisionType> deformationField(targetImage, transformationImage);
+        fieldImage = deformationField.getFieldImage();
+        initTiles(false);
+    }
+}
+
+template <typename PrecisionType>
+DeformationFieldTiles<PrecisionType>::DeformationFieldTiles (const RNifti::NiftiImage &targetImage, const TransformChain<PrecisionType> &chain)
+    : targetImage(targetImage), chain(chain)
+{
+    initTiles(true);
+}
+
+template <typename PrecisionType>
+nifti_image * DeformationFieldTiles<PrecisionType>::evaluate (const int tile)
+{
+    if (!tiled)
+        return fieldImage;
+    
+    // The chain is evaluated at the world locations of the tile's voxels, so
+    // that it takes the tile's position within the target into account
+    nifti_image *deformationField = fieldImage;
+    setTileGeometry(deformationField, targetImage, axis, start(tile), slices(tile));
+    chain.apply(deformationField, false);
+    return deformationField;
+}
+
+// Resample a source image in target space, evaluating the transformation for
+// one tile of target voxels at a time and resampling it immediately
+template <typename PrecisionType>
+static RNifti::NiftiImage resampleTiles (DeformationFieldTiles<PrecisionType> &tiles, const RNifti::NiftiImage &targetImage, RNifti::NiftiImage &sourceImage, const int interpolation, const float paddingValue)
+{
+    nifti_image *resultImage = createResultImage(targetImage, sourceImage);
+    const size_t totalVoxels = tiles.getSliceVoxels() * size_t(targetImage->dim[tiles.getAxis()]);
+    
+    // The tile header for the result can point straight into the final image
+    // when it holds a single volume, but otherwise each volume is copied out
+    const bool contiguous = (resultImage->nvox == totalVoxels);
+    nifti_image *resultTile = nifti_copy_nim_info(resultImage);
+    setTileGeometry(resultTile, resultImage, tiles.getAxis(), 0, tiles.maxSlices());
+    if (!contiguous)
+        resultTile->data = calloc(resultTile->nvox, resultTile->nbyper);
+    
+    for (int i=0; i<tiles.count(); i++)
+    {
+        nifti_image *deformationField = tiles.evaluate(i);
+        setTileGeometry(resultTile, resultImage, tiles.getAxis(), tiles.start(i), tiles.slices(i));
+        
+        const size_t offset = tiles.offset(i);
+        const size_t tileVoxels = tiles.getSliceVoxels() * size_t(tiles.slices(i));
+        if (contiguous)
+            resultTile->data = static_cast<char *>(resultImage->data) + offset * resultImage->nbyper;
+        
+        reg_resampleImage(sourceImage, resultTile, deformationField, NULL, interpolation, paddingValue);
+        
+        if (!contiguous)
+        {
+            const size_t nVolumes = resultImage->nvox / totalVoxels;
+            for (size_t j=0; j<nVolumes; j++)
+            {
+                memcpy(static_cast<char *>(resultImage->data) + (j * totalVoxels + offset) * resultImage->nbyper,
+                       static_cast<char *>(resultTile->data) + j * tileVoxels * resultImage->nbyper,
+                       tileVoxels * resultImage->nbyper);
+            }
+        }
+    }
+    
+    if (contiguous)
+        resultTile->data = NULL;
+    nifti_image_free(resultTile);
+    
+    return RNifti::NiftiImage(resultImage);
+}
+
+template <typename PrecisionType>
+RNifti::NiftiImage resampleImageInTiles (const RNifti::NiftiImage &targetImage, const AffineMatrix &affine, RNifti::NiftiImage &sourceImage, const int interpolation, const float paddingValue)
+{
+    DeformationFieldTiles<PrecisionType> tiles(targetImage, affine);
+    return resampleTiles<PrecisionType>(tiles, targetImage, sourceImage, interpolation, paddingValue);
+}
+
+template <typename PrecisionType>
+RNifti::NiftiImage resampleImageInTiles (const RNifti::NiftiImage &targetImage, RNifti::NiftiImage &transformationImage, RNifti::NiftiImage &sourceImage, const int interpolation, const float paddingValue)
+{
+    DeformationFieldTiles<PrecisionType> tiles(targetImage, transformationImage);
+    return resampleTiles<PrecisionType>(tiles, targetImage, sourceImage, interpolation, paddingValue);
+}
+
+template <typename PrecisionType>
+RNifti::NiftiImage resampleImageInTiles (const RNifti::NiftiImage &targetImage, const TransformChain<PrecisionType> &chain, RNifti::NiftiImage &sourceImage, const int interpolation, const float paddingValue)
+{
+    DeformationFieldTiles<PrecisionType> tiles(targetImage, chain);
+    return resampleTiles<PrecisionType>(tiles, targetImage, sourceImage, interpolation, paddingValue);
+}
+
+static bool isCompressedFile (const char *fileName)
+{
+    const size_t length = (fileName == NULL ? 0 : strlen(fileName));
+    return (length >= 3 && strcmp(fileName + length - 3, ".gz") == 0);
+}
+
+static void swapBytes (void *data, const size_t count, const int size)
+{
+    char *bytes = static_cast<char *>(data);
+    for (size_t i=0; i<count; i++, bytes+=size)
+        std::reverse(bytes, bytes + size);
+}
+
+// Find the box of source voxels needed to resample one tile of the target,
+// including the support of the interpolation kernel. Returns false if no
+// location in the tile falls within the source image
+template <typename FieldType>
+static bool getSourceRegion (const nifti_image *deformationField, const nifti_image *sourceImage, const int interpolation, int *origin, int *size)
+{
+    const mat44 *sourceMatrix = (sourceImage->sform_code > 0 ? &sourceImage->sto_ijk : &sourceImage->qto_ijk);
+    const FieldType *fieldData = static_cast<const FieldType *>(deformationField->data);
+    const size_t tileVoxels = size_t(deformationField->nx) * size_t(deformationField->ny) * size_t(deformationField->nz);
+    const int nDims = deformationField->nu;
+    
+    float lower[3] = { FLT_MAX, FLT_MAX, FLT_MAX };
+    float upper[3] = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+    for (size_t v=0; v<tileVoxels; v++)
+    {
+        float world[3] = { 0.0f, 0.0f, 0.0f };
+        float position[3];
+        for (int d=0; d<nDims; d++)
+            world[d] = static_cast<float>(fieldData[v + d*tileVoxels]);
+        reg_mat44_mul(sourceMatrix, world, position);
+        if (position[0] != position[0] || position[1] != position[1] || position[2] != position[2])
+            continue;
+        for (int d=0; d<3; d++)
+        {
+            lower[d] = std::min(lower[d], position[d]);
+            upper[d] = std::max(upper[d], position[d]);
+        }
+    }
+    
+    // Cubic spline kernels reach one voxel below and two above the
+    // location, and linear and nearest neighbour kernels one above
+    const int below = (interpolation == 3 ? 1 : 0);
+    const int above = (interpolation == 3 ? 2 : 1);
+    for (int d=0; d<3; d++)
+    {
+        const int extent = sourceImage->dim[d+1];
+        if (d >= nDims)
+        {
+            origin[d] = 0;
+            size[d] = extent;
+            continue;
+        }
+        else if (lower[d] > upper[d])
+            return false;
+        
+        const double first = std::max(0.0, std::floor(double(lower[d])) - below);
+        const double last = std::min(double(extent - 1), std::floor(double(upper[d])) + above);
+        if (first > last)
+            return false;
+        origin[d] = static_cast<int>(first);
+        size[d] = static_cast<int>(last - first) + 1;
+    }
+    return true;
+}
+
+// Read a box-shaped region of every volume of an image stored uncompressed
+// on disk, into an image header whose geometry is updated to match the region
+static void readSourceRegion (FILE *file, const nifti_image *sourceImage, const int *origin, const int *size, nifti_image *regionImage)
+{
+    const size_t nVolumes = regionImage->nvox / (size_t(regionImage->nx) * size_t(regionImage->ny) * size_t(regionImage->nz));
+    for (int d=0; d<3; d++)
+        regionImage->dim[d+1] = size[d];
+    regionImage->nx = size[0];
+    regionImage->ny = size[1];
+    regionImage->nz = size[2];
+    regionImage->nvox = size_t(size[0]) * size_t(size[1]) * size_t(size[2]) * nVolumes;
+    
+    // The region's first voxel is the source voxel at its origin
+    regionImage->qto_xyz = sourceImage->qto_xyz;
+    regionImage->sto_xyz = sourceImage->sto_xyz;
+    for (int i=0; i<3; i++)
+    {
+        for (int d=0; d<3; d++)
+        {
+            regionImage->qto_xyz.m[i][3] += sourceImage->qto_xyz.m[i][d] * origin[d];
+            regionImage->sto_xyz.m[i][3] += sourceImage->sto_xyz.m[i][d] * origin[d];
+        }
+    }
+    regionImage->qoffset_x = regionImage->qto_xyz.m[0][3];
+    regionImage->qoffset_y = regionImage->qto_xyz.m[1][3];
+    regionImage->qoffset_z = regionImage->qto_xyz.m[2][3];
+    regionImage->qto_ijk = nifti_mat44_inverse(regionImage->qto_xyz);
+    regionImage->sto_ijk = nifti_mat44_inverse(regionImage->sto_xyz);
+    
+    free(regionImage->data);
+    regionImage->data = malloc(regionImage->nvox * regionImage->nbyper);
+    if (regionImage->data == NULL)
+        throw std::runtime_error("Cannot allocate memory for source image region");
+    
+    // Rows are read whole, or whole slices at a time when the region spans the x-axis
+    const size_t nbyper = size_t(sourceImage->nbyper);
+    const bool fullRows = (size[0] == sourceImage->nx);
+    const size_t readVoxels = (fullRows ? size_t(size[0]) * size_t(size[1]) : size_t(size[0]));
+    char *regionData = static_cast<char *>(regionImage->data);
+    for (size_t t=0; t<nVolumes; t++)
+    {
+        for (int z=origin[2]; z<origin[2]+size[2]; z++)
+        {
+            for (int y=origin[1]; y<origin[1]+size[1]; y+=(fullRows ? size[1] : 1))
+            {
+                const size_t voxel = ((t * size_t(sourceImage->nz) + size_t(z)) * size_t(sourceImage->ny) + size_t(y)) * size_t(sourceImage->nx) + size_t(origin[0]);
+                seekFile(file, int64_t(sourceImage->iname_offset) + int64_t(voxel * nbyper));
+                if (fread(regionData, nbyper, readVoxels, file) != readVoxels)
+                    throw std::runtime_error("Source image file is truncated or unreadable");
+                regionData += readVoxels * nbyper;
+            }
+        }
+    }
+    
+    // Data are stored in the byte order of the platform that wrote the file
+    const int one = 1;
+    const int hostByteOrder = (*reinterpret_cast<const char *>(&one) == 1 ? LSB_FIRST : MSB_FIRST);
+    if (sourceImage->byteorder != hostByteOrder && nbyper > 1)
+        swapBytes(regionImage->data, regionImage->nvox, int(nbyper));
+}
+
+// Write a single-file NIfTI-1 header, with data to follow at byte 352
+static void writeNiftiHeader (FILE *file, const nifti_image *image)
+{
+    nifti_1_header header;
+    memset(&header, 0, sizeof(nifti_1_header));
+    header.sizeof_hdr = 348;
+    header.regular = 'r';
+    for (int i=0; i<8; i++)
+    {
+        header.dim[i] = static_cast<short>(image->dim[i]);
+        header.pixdim[i] = static_cast<float>(image->pixdim[i]);
+    }
+    header.pixdim[0] = (image->qfac < 0.0 ? -1.0f : 1.0f);
+    header.intent_p1 = static_cast<float>(image->intent_p1);
+    header.intent_p2 = static_cast<float>(image->intent_p2);
+    header.intent_p3 = static_cast<float>(image->intent_p3);
+    header.intent_code = static_cast<short>(image->intent_code);
+    memcpy(header.intent_name, image->intent_name, 16);
+    header.datatype = static_cast<short>(image->datatype);
+    header.bitpix = static_cast<short>(8 * image->nbyper);
+    header.vox_offset = 352.0f;
+    header.scl_slope = static_cast<float>(image->scl_slope);
+    header.scl_inter = static_cast<float>(image->scl_inter);
+    header.cal_min = static_cast<float>(image->cal_min);
+    header.cal_max = static_cast<float>(image->cal_max);
+    header.xyzt_units = static_cast<char>((image->xyz_units & 0x07) | (image->time_units & 0x38));
+    memcpy(header.descrip, image->descrip, 80);
+    header.qform_code = static_cast<short>(image->qform_code);
+    header.sform_code = static_cast<short>(image->sform_code);
+    header.quatern_b = static_cast<float>(image->quatern_b);
+    header.quatern_c = static_cast<float>(image->quatern_c);
+    header.quatern_d = static_cast<float>(image->quatern_d);
+    header.qoffset_x = static_cast<float>(image->qoffset_x);
+    header.qoffset_y = static_cast<float>(image->qoffset_y);
+    header.qoffset_z = static_cast<float>(image->qoffset_z);
+    for (int j=0; j<4; j++)
+    {
+        header.srow_x[j] = static_cast<float>(image->sto_xyz.m[0][j]);
+        header.srow_y[j] = static_cast<float>(image->sto_xyz.m[1][j]);
+        header.srow_z[j] = static_cast<float>(image->sto_xyz.m[2][j]);
+    }
+    memcpy(header.magic, "n+1", 4);
+    
+    const char extender[4] = { 0, 0, 0, 0 };
+    if (fwrite(&header, sizeof(nifti_1_header), 1, file) != 1 || fwrite(extender, 1, 4, file) != 4)
+        throw std::runtime_error("Failed to write to result image file");
+}
+
+template <typename PrecisionType>
+void resampleImageFile (const RNifti::NiftiImage &targetImage, const TransformChain<PrecisionType> &chain, const RNifti::NiftiImage &sourceHeader, const std::string &resultFileName, const int interpolation)
+{
+    if (sourceHeader->iname == NULL || isCompressedFile(sourceHeader->iname))
+        throw std::runtime_error("The source image must be stored in an uncompressed file");
+    if (isCompressedFile(resultFileName.c_str()))
+        throw std::runtime_error("The result image cannot be written to a compressed file");
+    if (sourceHeader->nu > 1 || sourceHeader->nv > 1 || sourceHeader->nw > 1)
+        throw std::runtime_error("Multichannel images cannot be resampled from file");
+    
+    DeformationFieldTiles<PrecisionType> tiles(targetImage, chain);
+    const int axis = tiles.getAxis();
+    const size_t totalVoxels = tiles.getSliceVoxels() * size_t(targetImage->dim[axis]);
+    
+    // Only headers are held for the full images; interpolated values are
+    // calculated and stored in double precision
+    RNifti::NiftiImage resultHeader(createResultImage(targetImage, sourceHeader, interpolation == 0 ? 0 : NIFTI_TYPE_FLOAT64, false));
+    RNifti::NiftiImage resultTile(nifti_copy_nim_info(resultHeader));
+    setTileGeometry(resultTile, resultHeader, axis, 0, tiles.maxSlices());
+    resultTile->data = calloc(resultTile->nvox, resultTile->nbyper);
+    if (resultTile->data == NULL)
+        throw std::runtime_error("Cannot allocate memory for result tile");
+    const size_t nVolumes = resultHeader->nvox / totalVoxels;
+    const size_t nbyper = size_t(resultHeader->nbyper);
+    
+    FILE *sourceFile = fopen(sourceHeader->iname, "rb");
+    if (sourceFile == NULL)
+        throw std::runtime_error("Cannot open source image file " + std::string(sourceHeader->iname));
+    FILE *resultFile = fopen(resultFileName.c_str(), "wb");
+    if (resultFile == NULL)
+    {
+        fclose(sourceFile);
+        throw std::runtime_error("Cannot open file " + resultFileName + " for writing");
+    }
+    
+    try
+    {
+        writeNiftiHeader(resultFile, resultHeader);
+        RNifti::NiftiImage regionImage(nifti_copy_nim_info(sourceHeader));
+        
+        for (int i=0; i<tiles.count(); i++)
+        {
+            nifti_image *deformationField = tiles.evaluate(i);
+            setTileGeometry(resultTile, resultHeader, axis, tiles.start(i), tiles.slices(i));
+            
+            int origin[3], size[3];
+            const bool overlaps = (deformationField->datatype == NIFTI_TYPE_FLOAT32 ? getSourceRegion<float>(deformationField, sourceHeader, interpolation, origin, size) : getSourceRegion<double>(deformationField, sourceHeader, interpolation, origin, size));
+            if (overlaps)
+            {
+                // The region header is reset to the source's type before each read
+                regionImage->datatype = sourceHeader->datatype;
+                regionImage->nbyper = sourceHeader->nbyper;
+                readSourceRegion(sourceFile, sourceHeader, origin, size, regionImage);
+                if (interpolation != 0)
+                    reg_tools_changeDatatype<double>(regionImage);
+                reg_resampleImage(regionImage, resultTile, deformationField, NULL, interpolation, 0);
+            }
+            else
+                memset(resultTile->data, 0, resultTile->nvox * nbyper);
+            
+            // Each volume of the tile is written at its position in the result
+            const size_t tileVoxels = tiles.getSliceVoxels() * size_t(tiles.slices(i));
+            for (size_t j=0; j<nVolumes; j++)
+            {
+                seekFile(resultFile, int64_t(352) + int64_t((j * totalVoxels + tiles.offset(i)) * nbyper));
+                if (fwrite(static_cast<char *>(resultTile->data) + j * tileVoxels * nbyper, nbyper, tileVoxels, resultFile) != tileVoxels)
+                    throw std::runtime_error("Failed to write to result image file");
+            }
+        }
+    }
+    catch (...)
+    {
+        fclose(sourceFile);
+        fclose(resultFile);
+        throw;
+    }
+    
+    fclose(sourceFile);
+    if (fclose(resultFile) != 0)
+        throw std::runtime_error("Failed to write to result image file");
+}
+
+template class TransformChain<float>;
+template class TransformChain<double>;
+
 template class DeformationField<float>;
 template class DeformationField<double>;
 
+template class DeformationFieldTiles<float>;
+template class DeformationFieldTiles<double>;
+
+template
+Rcpp::NumericVector DeformationField<float>::findPoint (const Eigen::Matrix<double,2,1> &sourceLoc, const bool nearest, const Eigen::Matrix<double,2,1> &start) const;
+
+template
+Rcpp::NumericVector DeformationField<float>::findPoint (const Eigen::Matrix<double,3,1> &sourceLoc, const bool nearest, const Eigen::Matrix<double,3,1> &start) const;
+
+template
+Rcpp::NumericVector DeformationField<double>::findPoint (const Eigen::Matrix<double,2,1> &sourceLoc, const bool nearest, const Eigen::Matrix<double,2,1> &start) const;
+
+template
+Rcpp::NumericVector DeformationField<double>::findPoint (const Eigen::Matrix<double,3,1> &sourceLoc, const bool nearest, const Eigen::Matrix<double,3,1> &start) const;
+
+template
+RNifti::NiftiImage resampleImageInTiles<float> (const RNifti::NiftiImage &targetImage, const AffineMatrix &affine, RNifti::NiftiImage &sourceImage, const int interpolation, const float paddingValue);
+
+template
+RNifti::NiftiImage resampleImageInTiles<double> (const RNifti::NiftiImage &targetImage, const AffineMatrix &affine, RNifti::NiftiImage &sourceImage, const int interpolation, const float paddingValue);
+
+template
+RNifti::NiftiImage resampleImageInTiles<float> (const RNifti::NiftiImage &targetImage, RNifti::NiftiImage &transformationImage, RNifti::NiftiImage &sourceImage, const int interpolation, const float paddingValue);
+
+template
+RNifti::NiftiImage resampleImageInTiles<double> (const RNifti::NiftiImage &targetImage, RNifti::NiftiImage &transformationImage, RNifti::NiftiImage &sourceImage, const int interpolation, const float paddingValue);
+
 template
-Rcpp::NumericVector DeformationField<float>::findPoint (const RNifti::NiftiImage &sourceImage, const Eigen::Matrix<double,2,1> &sourceLoc, const bool nearest, const Eigen::Matrix<double,2,1> &start) const;
+RNifti::NiftiImage resampleImageInTiles<float> (const RNifti::NiftiImage &targetImage, const TransformChain<float> &chain, RNifti::NiftiImage &sourceImage, const int interpolation, const float paddingValue);
 
 template
-Rcpp::NumericVector DeformationField<float>::findPoint (const RNifti::NiftiImage &sourceImage, const Eigen::Matrix<double,3,1> &sourceLoc, const bool nearest, const Eigen::Matrix<double,3,1> &start) const;
+RNifti::NiftiImage resampleImageInTiles<double> (const RNifti::NiftiImage &targetImage, const TransformChain<double> &chain, RNifti::NiftiImage &sourceImage, const int interpolation, const float paddingValue);
 
 template
-Rcpp::NumericVector DeformationField<double>::findPoint (const RNifti::NiftiImage &sourceImage, const Eigen::Matrix<double,2,1> &sourceLoc, const bool nearest, const Eigen::Matrix<double,2,1> &start) const;
+void resampleImageFile<float> (const RNifti::NiftiImage &targetImage, const TransformChain<float> &chain, const RNifti::NiftiImage &sourceHeader, const std::string &resultFileName, const int interpolation);
 
 template
-Rcpp::NumericVector DeformationField<double>::findPoint (const RNifti::NiftiImage &sourceImage, const Eigen::Matrix<double,3,1> &sourceLoc, const bool nearest, const Eigen::Matrix<double,3,1> &start) const;
+void resampleImageFile<double> (const RNifti::NiftiImage &targetImage, const TransformChain<double> &chain, const RNifti::NiftiImage &sourceHeader, const std::string &resultFileName, const int interpolation);
@@ -9,26 +9,97 @@
 #include "_reg_resampling.h"
 #include "AffineMatrix.h"
 
+// Number of target voxels for which a transformation is evaluated at once when resampling in tiles
+#define DEFORMATION_TILE_VOXELS 262144
+
+// A typed, non-owning view of a deformation field buffer, in which the
+// components of each vector are separated by a fixed stride
+template <typename ElementType>
+class DeformationFieldView
+{
+protected:
+    const ElementType *data;
+    size_t stride;
+    
+public:
+    DeformationFieldView ()
+        : data(NULL), stride(0) {}
+    
+    DeformationFieldView (const nifti_image *image)
+        : data(static_cast<const ElementType *>(image->data)), stride(size_t(image->nx) * size_t(image->ny) * size_t(image->nz)) {}
+    
+    double operator() (const size_t voxel, const int component) const { return static_cast<double>(data[voxel + component * stride]); }
+};
+
+// A sequence of transformations, recorded without being evaluated, which
+// together map target points to source points. Elements are held in the order
+// in which they are applied to target locations, and consecutive affines are
+// collapsed into a single matrix as they are appended. The composed mapping is
+// only evaluated when applied to a set of locations, such as one tile of a
+// deformation field. Nonlinear transformations other than control point grids
+// are converted to a deformation field over their own target when appended
+template <typename PrecisionType>
+class TransformChain
+{
+protected:
+    struct Element
+    {
+        bool isAffine;
+        Eigen::Matrix4d matrix;
+        RNifti::NiftiImage transformationImage;
+    };
+    
+    std::vector<Element> elements;
+    int nDims;
+    
+public:
+    TransformChain ()
+        : nDims(0) {}
+    
+    // Append a transformation, to be applied after those already in the chain
+    void append (const AffineMatrix &affine);
+    void append (const RNifti::NiftiImage &targetImage, const RNifti::NiftiImage &transformationImage);
+    
+    size_t length () const { return elements.size(); }
+    
+    // Map the locations stored in a deformation field through the chain, in
+    // place; if "compose" is false the field's own voxel locations are used
+    void apply (nifti_image *deformationField, const bool compose = true) const;
+    
+    // Map a batch of points, given in world coordinates with one per row,
+    // through the chain. Only the points themselves are evaluated, so the cost
+    // depends on their number rather than on the size of any image
+    Eigen::MatrixXd mapPoints (const Eigen::MatrixXd &points) const;
+};
+
 template <typename PrecisionType>
 class DeformationField
 {
 protected:
     RNifti::NiftiImage deformationFieldImage;
     RNifti::NiftiImage targetImage;
-    std::vector<double> deformationData;
-    size_t nVoxels;
     
     void initImages (const RNifti::NiftiImage &targetImage);
-    void updateData ()
-    {
-        deformationData = deformationFieldImage.getData<double>();
-        nVoxels = deformationFieldImage->nx * deformationFieldImage->ny * deformationFieldImage->nz;
-    }
+    void updateData ();
+    
+    template <int Dim, typename ElementType>
+    Rcpp::NumericVector findPoint (const DeformationFieldView<ElementType> &field, const Eigen::Matrix<double,Dim,1> &sourceLoc, const bool nearest, const Eigen::Matrix<double,Dim,1> &start) const;
+    
+    // Interpolate the field at a continuous voxel location, also giving the
+    // derivatives of the interpolated value with respect to that location
+    template <int Dim, typename ElementType>
+    void interpolateField (const DeformationFieldView<ElementType> &field, const Eigen::Matrix<double,Dim,1> &location, Eigen::Matrix<double,Dim,1> &value, Eigen::Matrix<double,Dim,Dim> &jacobian) const;
+    
+    // Find the sub-voxel location at which the interpolated field matches a
+    // source location, starting from a nearby voxel
+    template <int Dim, typename ElementType>
+    Eigen::Matrix<double,Dim,1> refinePoint (const DeformationFieldView<ElementType> &field, const Eigen::Matrix<double,Dim,1> &sourceLoc, const Eigen::Matrix<double,Dim,1> &start) const;
     
 public:
     DeformationField () {}
     DeformationField (const RNifti::NiftiImage &targetImage, const AffineMatrix &affine, const bool compose = false);
     DeformationField (const RNifti::NiftiImage &targetImage, RNifti::NiftiImage &transformationImage, const bool compose = false);
+    DeformationField (const RNifti::NiftiImage &targetImage, const TransformChain<PrecisionType> &chain);
     
     RNifti::NiftiImage getFieldImage () const { return deformationFieldImage; }
     
@@ -37,9 +108,89 @@ public:
     RNifti::NiftiImage resampleImage (RNifti::NiftiImage &sourceImage, const int interpolation);
     
     template <int Dim>
-    Rcpp::NumericVector findPoint (const RNifti::NiftiImage &sourceImage, const Eigen::Matrix<double,Dim,1> &sourceLoc, const bool nearest, const Eigen::Matrix<double,Dim,1> &start) const;
+    Rcpp::NumericVector findPoint (const Eigen::Matrix<double,Dim,1> &sourceLoc, const bool nearest, const Eigen::Matrix<double,Dim,1> &start) const;
     
     void compose (const DeformationField &otherField);
 };
 
+// Compose two transformations, at least one of which is a cubic B-spline
+// control point grid and the other an affine or another grid, giving a control
+// point grid. As with DeformationField::compose(), target points are mapped
+// through the second transformation and then the first. Composition with an
+// affine is exact. Two grids are composed approximately on the lattice of the
+// second, which is refined until the error is within the tolerance (in mm); a
+// null image is returned if this would need a grid finer than the target image
+RNifti::NiftiImage composeControlPointGrids (const RNifti::NiftiImage &grid1, const RNifti::NiftiImage &grid2, const RNifti::NiftiImage &targetImage, const double tolerance);
+RNifti::NiftiImage composeControlPointGrids (const AffineMatrix &affine, const RNifti::NiftiImage &grid);
+RNifti::NiftiImage composeControlPointGrids (const RNifti::NiftiImage &grid, const AffineMatrix &affine);
+
+// Calculate the Jacobian determinant map of a cubic B-spline control point
+// grid over a target image, analytically from the spline coefficients. The
+// map is single precision, and no deformation field is created
+RNifti::NiftiImage getControlPointGridJacobian (const RNifti::NiftiImage &targetImage, const RNifti::NiftiImage &grid);
+
+// Allocate an image in target space to hold a resampled version of the source
+// image, with the source data type unless another one is specified. If
+// "allocate" is false only the header is created
+nifti_image * createResultImage (const nifti_image *targetImage, const nifti_image *sourceImage, const int datatype = 0, const bool allocate = true);
+
+// Evaluates a transformation over successive slabs of a target image, so that
+// only one tile of the deformation field is held in memory at a time. Dense
+// and velocity-based transformations form a single tile covering the target,
+// unless they are part of a chain
+template <typename PrecisionType>
+class DeformationFieldTiles
+{
+protected:
+    RNifti::NiftiImage targetImage;
+    RNifti::NiftiImage fieldImage;
+    TransformChain<PrecisionType> chain;
+    bool tiled;
+    int axis, nSlices, tileSlices;
+    size_t sliceVoxels;
+    
+    void initTiles (const bool tiled);
+    
+public:
+    DeformationFieldTiles (const RNifti::NiftiImage &targetImage, const AffineMatrix &affine);
+    DeformationFieldTiles (const RNifti::NiftiImage &targetImage, RNifti::NiftiImage &transformationImage);
+    DeformationFieldTiles (const RNifti::NiftiImage &targetImage, const TransformChain<PrecisionType> &chain);
+    
+    int getAxis () const { return axis; }
+    size_t getSliceVoxels () const { return sliceVoxels; }
+    // The last tile absorbs any remainder, so that a 3D target is never
+    // split into single-slice tiles, which would be treated as 2D
+    int count () const { return std::max(1, nSlices / tileSlices); }
+    int start (const int tile) const { return tile * tileSlices; }
+    int slices (const int tile) const { return (tile == count() - 1 ? nSlices - start(tile) : tileSlices); }
+    int maxSlices () const { return slices(count() - 1); }
+    size_t offset (const int tile) const { return sliceVoxels * size_t(start(tile)); }
+    
+    // Calculate the deformation field over one tile; the returned image is
+    // owned by this object and only remains valid until the next call
+    nifti_image * evaluate (const int tile);
+};
+
+// Resample a source image in the space of a target image, evaluating the
+// transformation one slab of the target at a time, so that the full
+// deformation field is never held in memory. Target voxels that map outside
+// the source are set to the padding value
+template <typename PrecisionType>
+RNifti::NiftiImage resampleImageInTiles (const RNifti::NiftiImage &targetImage, const AffineMatrix &affine, RNifti::NiftiImage &sourceImage, const int interpolation, const float paddingValue = 0.0f);
+
+template <typename PrecisionType>
+RNifti::NiftiImage resampleImageInTiles (const RNifti::NiftiImage &targetImage, RNifti::NiftiImage &transformationImage, RNifti::NiftiImage &sourceImage, const int interpolation, const float paddingValue = 0.0f);
+
+template <typename PrecisionType>
+RNifti::NiftiImage resampleImageInTiles (const RNifti::NiftiImage &targetImage, const TransformChain<PrecisionType> &chain, RNifti::NiftiImage &sourceImage, const int interpolation, const float paddingValue = 0.0f);
+
+// Resample a source image stored in an uncompressed NIfTI file, writing the
+// result to another uncompressed NIfTI file. Each slab of the target is
+// resampled from only the region of the source that it maps into, which is
+// read from disk as needed, and then written out, so neither image is ever
+// held in memory as a whole. Interpolated values are written in double
+// precision, as from resampleImageInTiles()
+template <typename PrecisionType>
+void resampleImageFile (const RNifti::NiftiImage &targetImage, const TransformChain<PrecisionType> &chain, const RNifti::NiftiImage &sourceHeader, const std::string &resultFileName, const int interpolation);
+
 #endif
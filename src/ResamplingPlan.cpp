@@ -0,0 +1,225 @@
+#include <RcppEigen.h>
+
+#include "_reg_maths.h"
+#include "_reg_resampling.h"
+
+#include "ResamplingPlan.h"
+
+#ifdef _OPENMP
+#include "omp.h"
+#endif
+
+ResamplingPlan::ResamplingPlan (const RNifti::NiftiImage &sourceImage, const RNifti::NiftiImage &targetImage, const AffineMatrix &affine, const int interpolation)
+    : targetImage(targetImage), interpolation(interpolation)
+{
+    DeformationFieldTiles<double> tiles(targetImage, affine);
+    build(tiles, sourceImage);
+}
+
+ResamplingPlan::ResamplingPlan (const RNifti::NiftiImage &sourceImage, const RNifti::NiftiImage &targetImage, RNifti::NiftiImage &transformationImage, const int interpolation)
+    : targetImage(targetImage), interpolation(interpolation)
+{
+    DeformationFieldTiles<double> tiles(targetImage, transformationImage);
+    build(tiles, sourceImage);
+}
+
+ResamplingPlan::ResamplingPlan (const RNifti::NiftiImage &sourceImage, const RNifti::NiftiImage &targetImage, const TransformChain<double> &chain, const int interpolation)
+    : targetImage(targetImage), interpolation(interpolation)
+{
+    DeformationFieldTiles<double> tiles(targetImage, chain);
+    build(tiles, sourceImage);
+}
+
+template <typename PrecisionType>
+void ResamplingPlan::build (DeformationFieldTiles<PrecisionType> &tiles, const RNifti::NiftiImage &sourceImage)
+{
+    if (interpolation != 0 && interpolation != 1 && interpolation != 3)
+        throw std::runtime_error("Interpolation type should be 0, 1 or 3");
+
+    // NiftyReg resamples in 3D whenever the target (and hence the deformation field) is 3D
+    nDims = (targetImage->nz > 1 ? 3 : 2);
+    kernelSize = (interpolation == 3 ? 4 : (interpolation == 1 ? 2 : 1));
+    nVoxels = size_t(targetImage->nx) * size_t(targetImage->ny) * size_t(targetImage->nz);
+
+    sourceDims.resize(3);
+    sourceDims[0] = sourceImage->nx;
+    sourceDims[1] = sourceImage->ny;
+    sourceDims[2] = sourceImage->nz;
+
+    offsets.assign(nVoxels * nDims * kernelSize, 0);
+    weights.assign(nVoxels * nDims * kernelSize, 0.0f);
+
+    for (int i=0; i<tiles.count(); i++)
+    {
+        const nifti_image *deformationField = tiles.evaluate(i);
+        if (deformationField->datatype == NIFTI_TYPE_FLOAT32)
+            buildTile<float>(deformationField, tiles.offset(i), sourceImage);
+        else
+            buildTile<double>(deformationField, tiles.offset(i), sourceImage);
+    }
+}
+
+template <typename FieldType>
+void ResamplingPlan::buildTile (const nifti_image *deformationField, const size_t offset, const RNifti::NiftiImage &sourceImage)
+{
+    const mat44 *sourceMatrix = (sourceImage->sform_code > 0 ? &sourceImage->sto_ijk : &sourceImage->qto_ijk);
+    const FieldType *fieldData = static_cast<const FieldType *>(deformationField->data);
+    const size_t tileVoxels = size_t(deformationField->nx) * size_t(deformationField->ny) * size_t(deformationField->nz);
+
+    // Kernel functions and offsets match those used by reg_resampleImage()
+    void (*kernelFunction)(double,double*) = (interpolation == 3 ? &interpCubicSplineKernel : (interpolation == 1 ? &interpLinearKernel : &interpNearestNeighKernel));
+    const int kernelOffset = (interpolation == 3 ? 1 : 0);
+    const size_t strides[3] = { 1, size_t(sourceDims[0]), size_t(sourceDims[0]) * size_t(sourceDims[1]) };
+    const size_t width = nDims * kernelSize;
+
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+    for (long v=0; v<long(tileVoxels); v++)
+    {
+        float world[3] = { 0.0f, 0.0f, 0.0f };
+        float position[3];
+        for (int d=0; d<nDims; d++)
+            world[d] = static_cast<float>(fieldData[v + d*tileVoxels]);
+        reg_mat44_mul(sourceMatrix, world, position);
+
+        int *voxelOffsets = &offsets[(offset + v) * width];
+        float *voxelWeights = &weights[(offset + v) * width];
+
+        // Locations that cannot be mapped keep zero weights, and hence resample to zero
+        if (position[0] != position[0] || position[1] != position[1] || position[2] != position[2])
+            continue;
+
+        for (int d=0; d<nDims; d++)
+        {
+            double basis[4];
+            const int previous = static_cast<int>(reg_floor(position[d]));
+            kernelFunction(static_cast<double>(position[d]) - static_cast<double>(previous), basis);
+
+            for (int k=0; k<kernelSize; k++)
+            {
+                // Nearest neighbour interpolation needs only the tap with unit weight
+                const int coordinate = (kernelSize == 1 ? previous + (basis[1] > 0.0 ? 1 : 0) : previous - kernelOffset + k);
+                const double weight = (kernelSize == 1 ? 1.0 : basis[k]);
+
+                // Taps outside the source image take the padding value, which is zero
+                if (coordinate >= 0 && coordinate < sourceDims[d])
+                {
+                    voxelOffsets[d*kernelSize + k] = static_cast<int>(coordinate * strides[d]);
+                    voxelWeights[d*kernelSize + k] = static_cast<float>(weight);
+                }
+            }
+        }
+    }
+}
+
+template <typename SourceType, typename ResultType>
+void ResamplingPlan::apply (const SourceType *sourceData, ResultType *resultData, const size_t nVolumes) const
+{
+    const size_t sourceVoxels = size_t(sourceDims[0]) * size_t(sourceDims[1]) * size_t(sourceDims[2]);
+    const size_t width = nDims * kernelSize;
+    const int *offsetData = &offsets.front();
+    const float *weightData = &weights.front();
+
+    for (size_t t=0; t<nVolumes; t++)
+    {
+        const SourceType *source = sourceData + t * sourceVoxels;
+        ResultType *result = resultData + t * nVoxels;
+
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+        for (long v=0; v<long(nVoxels); v++)
+        {
+            const int *voxelOffsets = offsetData + v * width;
+            const float *voxelWeights = weightData + v * width;
+            // Offsets and weights along the slowest-varying axis
+            const int *lastOffsets = voxelOffsets + (nDims - 1) * kernelSize;
+            const float *lastWeights = voxelWeights + (nDims - 1) * kernelSize;
+
+            double value = 0.0;
+            if (nDims == 3)
+            {
+                for (int c=0; c<kernelSize; c++)
+                {
+                    if (lastWeights[c] == 0.0f)
+                        continue;
+                    for (int b=0; b<kernelSize; b++)
+                    {
+                        const float yzWeight = voxelWeights[kernelSize + b] * lastWeights[c];
+                        if (yzWeight == 0.0f)
+                            continue;
+                        const SourceType *row = source + voxelOffsets[kernelSize + b] + lastOffsets[c];
+                        double rowValue = 0.0;
+                        for (int a=0; a<kernelSize; a++)
+                        {
+                            // Taps outside the source point at the start of the row, so are skipped
+                            if (voxelWeights[a] != 0.0f)
+                                rowValue += static_cast<double>(voxelWeights[a]) * static_cast<double>(row[voxelOffsets[a]]);
+                        }
+                        value += rowValue * static_cast<double>(yzWeight);
+                    }
+                }
+            }
+            else
+            {
+                for (int b=0; b<kernelSize; b++)
+                {
+                    if (lastWeights[b] == 0.0f)
+                        continue;
+                    const SourceType *row = source + lastOffsets[b];
+                    double rowValue = 0.0;
+                    for (int a=0; a<kernelSize; a++)
+                    {
+                        if (voxelWeights[a] != 0.0f)
+                            rowValue += static_cast<double>(voxelWeights[a]) * static_cast<double>(row[voxelOffsets[a]]);
+                    }
+                    value += rowValue * static_cast<double>(lastWeights[b]);
+                }
+            }
+            result[v] = static_cast<ResultType>(value);
+        }
+    }
+}
+
+template <typename SourceType>
+RNifti::NiftiImage ResamplingPlan::apply (const RNifti::NiftiImage &sourceImage) const
+{
+    // Interpolated values are returned in double precision, as from applyTransform()
+    nifti_image *resultImage = createResultImage(targetImage, sourceImage, interpolation == 0 ? 0 : NIFTI_TYPE_FLOAT64);
+    const size_t nVolumes = resultImage->nvox / nVoxels;
+
+    if (interpolation == 0)
+        apply<SourceType,SourceType>(static_cast<const SourceType *>(sourceImage->data), static_cast<SourceType *>(resultImage->data), nVolumes);
+    else
+        apply<SourceType,double>(static_cast<const SourceType *>(sourceImage->data), static_cast<double *>(resultImage->data), nVolumes);
+
+    return RNifti::NiftiImage(resultImage);
+}
+
+RNifti::NiftiImage ResamplingPlan::resampleImage (const RNifti::NiftiImage &sourceImage) const
+{
+    if (sourceImage->nx != sourceDims[0] || sourceImage->ny != sourceDims[1] || sourceImage->nz != sourceDims[2])
+        throw std::runtime_error("Image dimensions do not match the source image of the resampling plan");
+
+    // Stored values are resampled, and any scaling is carried over to the result
+    const RNifti::NiftiImage &image = sourceImage;
+    switch (image->datatype)
+    {
+        case NIFTI_TYPE_UINT8:      return apply<unsigned char>(image);
+        case NIFTI_TYPE_INT8:       return apply<signed char>(image);
+        case NIFTI_TYPE_UINT16:     return apply<unsigned short>(image);
+        case NIFTI_TYPE_INT16:      return apply<short>(image);
+        case NIFTI_TYPE_UINT32:     return apply<unsigned int>(image);
+        case NIFTI_TYPE_INT32:      return apply<int>(image);
+        case NIFTI_TYPE_FLOAT32:    return apply<float>(image);
+        case NIFTI_TYPE_FLOAT64:    return apply<double>(image);
+
+        default:
+        {
+            RNifti::NiftiImage convertedImage(image, true);
+            reg_tools_changeDatatype<double>(convertedImage);
+            return apply<double>(convertedImage);
+        }
+    }
+}
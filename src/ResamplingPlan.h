@@ -0,0 +1,50 @@
+#ifndef _RESAMPLING_PLAN_H_
+#define _RESAMPLING_PLAN_H_
+
+#include "RNifti.h"
+#include "AffineMatrix.h"
+#include "DeformationField.h"
+
+// A precomputed sparse operator that resamples images in the space of a source
+// image into the space of a target image. Interpolation is separable, so for
+// each target voxel and axis the plan stores the source offsets and weights of
+// the kernel taps, in int32 and float respectively. Any number of images or
+// volumes with the source geometry can then be resampled without evaluating
+// the transformation again
+class ResamplingPlan
+{
+protected:
+    RNifti::NiftiImage targetImage;
+    std::vector<int> sourceDims;
+    int interpolation;
+    int nDims;
+    int kernelSize;
+    size_t nVoxels;
+    std::vector<int> offsets;
+    std::vector<float> weights;
+
+    template <typename FieldType>
+    void buildTile (const nifti_image *deformationField, const size_t offset, const RNifti::NiftiImage &sourceImage);
+
+    template <typename PrecisionType>
+    void build (DeformationFieldTiles<PrecisionType> &tiles, const RNifti::NiftiImage &sourceImage);
+
+    template <typename SourceType, typename ResultType>
+    void apply (const SourceType *sourceData, ResultType *resultData, const size_t nVolumes) const;
+
+    template <typename SourceType>
+    RNifti::NiftiImage apply (const RNifti::NiftiImage &sourceImage) const;
+
+public:
+    ResamplingPlan (const RNifti::NiftiImage &sourceImage, const RNifti::NiftiImage &targetImage, const AffineMatrix &affine, const int interpolation);
+    ResamplingPlan (const RNifti::NiftiImage &sourceImage, const RNifti::NiftiImage &targetImage, RNifti::NiftiImage &transformationImage, const int interpolation);
+    ResamplingPlan (const RNifti::NiftiImage &sourceImage, const RNifti::NiftiImage &targetImage, const TransformChain<double> &chain, const int interpolation);
+
+    int getInterpolation () const { return interpolation; }
+
+    // Resample an image, which must have the spatial dimensions of the source
+    // image the plan was created for, but may contain several volumes
+    RNifti::NiftiImage resampleImage (const RNifti::NiftiImage &sourceImage) const;
+};
+
+#endif
@@ -0,0 +1,99 @@
+#include <stdexcept>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "_reg_tools.h"
+
+#include "ThreadContext.h"
+
+#ifdef THREAD_CONTEXT_AFFINITY
+// Set the affinity of every thread in a team of the given size, including the
+// calling thread. Threads created later for nested regions inherit the mask of
+// the thread that creates them, so they stay within the same set of CPUs
+static bool applyAffinity (const cpu_set_t &affinity, const int threads)
+{
+    int failures = 0;
+#pragma omp parallel num_threads(threads) reduction(+:failures)
+    {
+        if (sched_setaffinity(0, sizeof(cpu_set_t), &affinity) != 0)
+            failures++;
+    }
+    return (failures == 0);
+}
+#endif
+
+ThreadContext::ThreadContext (const int threads, const std::vector<int> &cpus, const int allocation)
+    : previousThreads(1), nThreads(1), pinned(false), previousFirstTouch(reg_tools_getFirstTouchAllocation()), previousHugePages(reg_tools_getHugePageAllocation())
+{
+#ifdef _OPENMP
+    previousThreads = omp_get_max_threads();
+    nThreads = (threads > 0 ? threads : previousThreads);
+
+#ifdef THREAD_CONTEXT_AFFINITY
+    if (!cpus.empty())
+        setAffinity(cpus, threads);
+#endif
+
+    omp_set_num_threads(nThreads);
+#endif
+
+    reg_tools_setFirstTouchAllocation(allocation > 0);
+    reg_tools_setHugePageAllocation(allocation > 1);
+}
+
+ThreadContext::~ThreadContext ()
+{
+#ifdef _OPENMP
+    restoreAffinity();
+    omp_set_num_threads(previousThreads);
+#endif
+    reg_tools_setFirstTouchAllocation(previousFirstTouch);
+    reg_tools_setHugePageAllocation(previousHugePages);
+}
+
+void ThreadContext::setAffinity (const std::vector<int> &cpus, const int threads)
+{
+#ifdef THREAD_CONTEXT_AFFINITY
+    if (sched_getaffinity(0, sizeof(cpu_set_t), &previousAffinity) != 0)
+        throw std::runtime_error("Cannot determine the CPU affinity of the current process");
+
+    cpu_set_t affinity;
+    CPU_ZERO(&affinity);
+    for (size_t i=0; i<cpus.size(); i++)
+    {
+        if (cpus[i] < 0 || cpus[i] >= CPU_SETSIZE)
+            throw std::runtime_error("CPU indices must be between 0 and the number of CPUs minus one");
+        CPU_SET(cpus[i], &affinity);
+    }
+
+    // Only CPUs that the process may already use are kept
+    CPU_AND(&affinity, &affinity, &previousAffinity);
+    const int nCpus = CPU_COUNT(&affinity);
+    if (nCpus == 0)
+        throw std::runtime_error("None of the requested CPUs is available to this process");
+
+    // Without an explicit budget, one thread is used per CPU
+    if (threads <= 0)
+        nThreads = nCpus;
+
+    if (!applyAffinity(affinity, nThreads))
+    {
+        applyAffinity(previousAffinity, nThreads);
+        throw std::runtime_error("Failed to set the CPU affinity of worker threads");
+    }
+    pinned = true;
+#endif
+}
+
+void ThreadContext::restoreAffinity ()
+{
+#ifdef THREAD_CONTEXT_AFFINITY
+    if (pinned)
+    {
+        applyAffinity(previousAffinity, nThreads);
+        pinned = false;
+    }
+#endif
+}
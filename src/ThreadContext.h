@@ -0,0 +1,51 @@
+#ifndef _THREAD_CONTEXT_H_
+#define _THREAD_CONTEXT_H_
+
+#include <vector>
+
+#if defined(_OPENMP) && defined(__linux__)
+#include <sched.h>
+#define THREAD_CONTEXT_AFFINITY
+#endif
+
+// The OpenMP settings for one call into the registration code. While the
+// object exists, parallel regions started from the calling thread use at most
+// the given number of threads, and those threads may be restricted to a set
+// of CPUs (on Linux only). Large image buffers may also be backed by huge
+// pages. The caller's settings are restored when the object is destroyed,
+// including when an exception is thrown, so calls with different budgets do
+// not leak their thread counts into one another
+class ThreadContext
+{
+protected:
+    int previousThreads;
+    int nThreads;
+    bool pinned;
+    bool previousFirstTouch;
+    bool previousHugePages;
+#ifdef THREAD_CONTEXT_AFFINITY
+    cpu_set_t previousAffinity;
+#endif
+
+    void setAffinity (const std::vector<int> &cpus, const int threads);
+    void restoreAffinity ();
+
+private:
+    // Copying would restore the caller's state twice
+    ThreadContext (const ThreadContext &);
+    ThreadContext & operator= (const ThreadContext &);
+
+public:
+    // A thread count of zero or less keeps the caller's setting, unless CPUs
+    // are given, in which case one thread per available CPU is used. CPU
+    // indices are zero-based, and an empty vector leaves affinity unchanged
+    // The allocation mode is 0 for plain allocation of image buffers, 1 to
+    // initialise large buffers in parallel, and 2 to also use huge pages
+    ThreadContext (const int threads, const std::vector<int> &cpus = std::vector<int>(), const int allocation = 0);
+    ~ThreadContext ();
+
+    // The number of threads available to parallel regions in this context
+    int threads () const { return nThreads; }
+};
+
+#endif
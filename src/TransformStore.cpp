@@ -0,0 +1,490 @@
+#include <RcppEigen.h>
+
+#include "_reg_tools.h"
+#include "_reg_localTrans.h"
+
+#include "TransformStore.h"
+#include "helpers.h"
+
+// Records and data blocks start on multiples of this many bytes
+#define TRANSFORM_STORE_ALIGNMENT 64
+
+// Number of values converted at a time when reading or writing image data
+#define TRANSFORM_STORE_CHUNK 65536
+
+// Quantised value standing for NaN, such as at points that cannot be mapped;
+// other values are clamped to +/-32767
+#define TRANSFORM_STORE_MISSING (-32768)
+
+static const char storeMagic[8] = { 'N', 'R', 'X', 'F', 'M', 'S', 'T', 'R' };
+static const uint32_t storeByteOrder = 0x01020304;
+static const int32_t storeVersion = 1;
+
+struct StoreHeader
+{
+    char magic[8];
+    uint32_t byteOrder;
+    int32_t version;
+    int32_t count;
+    int32_t storage;
+};
+
+struct StoredRecord
+{
+    double matrix[16];
+    int32_t isAffine, isDisplacement, nComponents, nExtensions;
+    float scales[3];
+    int32_t reserved;
+    StoredGeometry source;
+    StoredGeometry image;
+};
+
+static void writeBlock (FILE *file, const void *data, const size_t size)
+{
+    if (size > 0 && fwrite(data, 1, size, file) != size)
+        throw std::runtime_error("Failed to write to transform store");
+}
+
+static void readBlock (FILE *file, void *data, const size_t size)
+{
+    if (size > 0 && fread(data, 1, size, file) != size)
+        throw std::runtime_error("Transform store is truncated or unreadable");
+}
+
+// Zero-pad the file up to the next aligned position
+static void writePadding (FILE *file, const int64_t alignment = TRANSFORM_STORE_ALIGNMENT)
+{
+    static const char zeros[TRANSFORM_STORE_ALIGNMENT] = { 0 };
+    const int64_t padding = (alignment - tellFile(file) % alignment) % alignment;
+    writeBlock(file, zeros, size_t(padding));
+}
+
+static void skipPadding (FILE *file, const int64_t alignment = TRANSFORM_STORE_ALIGNMENT)
+{
+    const int64_t position = tellFile(file);
+    seekFile(file, position + (alignment - position % alignment) % alignment);
+}
+
+StoredGeometry getStoredGeometry (const nifti_image *image)
+{
+    StoredGeometry geometry;
+    memset(&geometry, 0, sizeof(StoredGeometry));
+    for (int i=0; i<8; i++)
+    {
+        geometry.dim[i] = image->dim[i];
+        geometry.pixdim[i] = image->pixdim[i];
+    }
+    geometry.datatype = image->datatype;
+    geometry.intentCode = image->intent_code;
+    geometry.qformCode = image->qform_code;
+    geometry.sformCode = image->sform_code;
+    geometry.xyzUnits = image->xyz_units;
+    geometry.timeUnits = image->time_units;
+    geometry.intentParams[0] = image->intent_p1;
+    geometry.intentParams[1] = image->intent_p2;
+    geometry.intentParams[2] = image->intent_p3;
+    geometry.quatern[0] = image->quatern_b;
+    geometry.quatern[1] = image->quatern_c;
+    geometry.quatern[2] = image->quatern_d;
+    geometry.qoffset[0] = image->qoffset_x;
+    geometry.qoffset[1] = image->qoffset_y;
+    geometry.qoffset[2] = image->qoffset_z;
+    geometry.qfac = image->qfac;
+    for (int i=0; i<3; i++)
+    {
+        for (int j=0; j<4; j++)
+            geometry.srow[i*4 + j] = image->sto_xyz.m[i][j];
+    }
+    memcpy(geometry.intentName, image->intent_name, 16);
+    return geometry;
+}
+
+nifti_image * createImageFromGeometry (const StoredGeometry &geometry)
+{
+    int dim[8];
+    for (int i=0; i<8; i++)
+        dim[i] = geometry.dim[i];
+    nifti_image *image = nifti_make_new_nim(dim, geometry.datatype == DT_UNKNOWN ? NIFTI_TYPE_FLOAT64 : geometry.datatype, 0);
+
+    for (int i=0; i<8; i++)
+        image->pixdim[i] = geometry.pixdim[i];
+    image->dx = image->pixdim[1];
+    image->dy = image->pixdim[2];
+    image->dz = image->pixdim[3];
+    image->dt = image->pixdim[4];
+    image->du = image->pixdim[5];
+    image->dv = image->pixdim[6];
+    image->dw = image->pixdim[7];
+
+    image->intent_code = geometry.intentCode;
+    image->intent_p1 = geometry.intentParams[0];
+    image->intent_p2 = geometry.intentParams[1];
+    image->intent_p3 = geometry.intentParams[2];
+    memcpy(image->intent_name, geometry.intentName, 16);
+    image->intent_name[15] = '\0';
+    image->xyz_units = geometry.xyzUnits;
+    image->time_units = geometry.timeUnits;
+
+    image->qform_code = geometry.qformCode;
+    image->quatern_b = geometry.quatern[0];
+    image->quatern_c = geometry.quatern[1];
+    image->quatern_d = geometry.quatern[2];
+    image->qoffset_x = geometry.qoffset[0];
+    image->qoffset_y = geometry.qoffset[1];
+    image->qoffset_z = geometry.qoffset[2];
+    image->qfac = geometry.qfac;
+    image->qto_xyz = nifti_quatern_to_mat44(image->quatern_b, image->quatern_c, image->quatern_d, image->qoffset_x, image->qoffset_y, image->qoffset_z, image->dx, image->dy, image->dz, image->qfac);
+    image->qto_ijk = nifti_mat44_inverse(image->qto_xyz);
+
+    image->sform_code = geometry.sformCode;
+    if (image->sform_code > 0)
+    {
+        for (int i=0; i<3; i++)
+        {
+            for (int j=0; j<4; j++)
+                image->sto_xyz.m[i][j] = geometry.srow[i*4 + j];
+        }
+        image->sto_xyz.m[3][0] = image->sto_xyz.m[3][1] = image->sto_xyz.m[3][2] = 0.0f;
+        image->sto_xyz.m[3][3] = 1.0f;
+        image->sto_ijk = nifti_mat44_inverse(image->sto_xyz);
+    }
+
+    return image;
+}
+
+static bool sameGeometry (const RNifti::NiftiImage &image1, const RNifti::NiftiImage &image2)
+{
+    for (int i=1; i<4; i++)
+    {
+        if (image1->dim[i] != image2->dim[i])
+            return false;
+    }
+
+    const mat44 &xform1 = image1.xform();
+    const mat44 &xform2 = image2.xform();
+    for (int i=0; i<3; i++)
+    {
+        for (int j=0; j<4; j++)
+        {
+            if (fabs(xform1.m[i][j] - xform2.m[i][j]) > 1e-4)
+                return false;
+        }
+    }
+    return true;
+}
+
+// Write image data, one component at a time, converting to the storage type
+template <typename DataType>
+static void writeData (FILE *file, const DataType *data, const size_t componentVoxels, const int nComponents, const TransformStore::Storage storage, const float *scales)
+{
+    std::vector<float> floatBuffer;
+    std::vector<int16_t> shortBuffer;
+    for (int c=0; c<nComponents; c++)
+    {
+        const DataType *componentData = data + size_t(c) * componentVoxels;
+        for (size_t start=0; start<componentVoxels; start+=TRANSFORM_STORE_CHUNK)
+        {
+            const size_t length = std::min(size_t(TRANSFORM_STORE_CHUNK), componentVoxels - start);
+            if (storage == TransformStore::QuantisedStorage)
+            {
+                shortBuffer.resize(length);
+                for (size_t i=0; i<length; i++)
+                {
+                    const double value = static_cast<double>(componentData[start + i]) / scales[c];
+                    if (value != value)
+                        shortBuffer[i] = TRANSFORM_STORE_MISSING;
+                    else
+                        shortBuffer[i] = static_cast<int16_t>(std::max(-32767.0, std::min(32767.0, floor(value + 0.5))));
+                }
+                writeBlock(file, &shortBuffer.front(), length * sizeof(int16_t));
+            }
+            else
+            {
+                floatBuffer.resize(length);
+                for (size_t i=0; i<length; i++)
+                    floatBuffer[i] = static_cast<float>(componentData[start + i]);
+                writeBlock(file, &floatBuffer.front(), length * sizeof(float));
+            }
+        }
+    }
+}
+
+// Read image data, one component at a time, converting from the storage type
+template <typename DataType>
+static void readData (FILE *file, DataType *data, const size_t componentVoxels, const int nComponents, const TransformStore::Storage storage, const float *scales)
+{
+    std::vector<float> floatBuffer;
+    std::vector<int16_t> shortBuffer;
+    for (int c=0; c<nComponents; c++)
+    {
+        DataType *componentData = data + size_t(c) * componentVoxels;
+        for (size_t start=0; start<componentVoxels; start+=TRANSFORM_STORE_CHUNK)
+        {
+            const size_t length = std::min(size_t(TRANSFORM_STORE_CHUNK), componentVoxels - start);
+            if (storage == TransformStore::QuantisedStorage)
+            {
+                shortBuffer.resize(length);
+                readBlock(file, &shortBuffer.front(), length * sizeof(int16_t));
+                for (size_t i=0; i<length; i++)
+                {
+                    if (shortBuffer[i] == TRANSFORM_STORE_MISSING)
+                        componentData[start + i] = std::numeric_limits<DataType>::quiet_NaN();
+                    else
+                        componentData[start + i] = static_cast<DataType>(static_cast<double>(shortBuffer[i]) * scales[c]);
+                }
+            }
+            else
+            {
+                floatBuffer.resize(length);
+                readBlock(file, &floatBuffer.front(), length * sizeof(float));
+                for (size_t i=0; i<length; i++)
+                    componentData[start + i] = static_cast<DataType>(floatBuffer[i]);
+            }
+        }
+    }
+}
+
+template <typename DataType>
+static void getScales (const DataType *data, const size_t componentVoxels, const int nComponents, float *scales)
+{
+    for (int c=0; c<nComponents; c++)
+    {
+        double maxMagnitude = 0.0;
+        const DataType *componentData = data + size_t(c) * componentVoxels;
+        for (size_t i=0; i<componentVoxels; i++)
+        {
+            const double magnitude = fabs(static_cast<double>(componentData[i]));
+            if (magnitude == magnitude)
+                maxMagnitude = std::max(maxMagnitude, magnitude);
+        }
+        scales[c] = (maxMagnitude > 0.0 ? static_cast<float>(maxMagnitude / 32767.0) : 1.0f);
+    }
+}
+
+static void writeEntry (FILE *file, const TransformStore::Entry &entry, const TransformStore::Storage storage)
+{
+    StoredRecord record;
+    memset(&record, 0, sizeof(StoredRecord));
+    record.source = getStoredGeometry(entry.sourceImage);
+
+    if (entry.isAffine)
+    {
+        record.isAffine = 1;
+        for (int i=0; i<4; i++)
+        {
+            for (int j=0; j<4; j++)
+                record.matrix[i*4 + j] = entry.matrix(i,j);
+        }
+        writeBlock(file, &record, sizeof(StoredRecord));
+        writePadding(file);
+        return;
+    }
+
+    RNifti::NiftiImage image = entry.transformationImage;
+    const int nComponents = std::max(1, image->nu);
+    if (storage == TransformStore::QuantisedStorage && nComponents > 3)
+        throw std::runtime_error("Only transformation images with up to three components can be quantised");
+
+    // Positions are quantised as displacements from the voxel or control point locations
+    const int type = reg_round(image->intent_p1);
+    const bool toDisplacement = (storage == TransformStore::QuantisedStorage && (type == CUB_SPLINE_GRID || type == DEF_FIELD || type == SPLINE_VEL_GRID || type == DEF_VEL_FIELD));
+    if (toDisplacement || (image->datatype != NIFTI_TYPE_FLOAT32 && image->datatype != NIFTI_TYPE_FLOAT64))
+    {
+        image = RNifti::NiftiImage(entry.transformationImage, true);
+        if (image->datatype != NIFTI_TYPE_FLOAT32 && image->datatype != NIFTI_TYPE_FLOAT64)
+            reg_tools_changeDatatype<double>(image);
+        if (toDisplacement)
+            reg_getDisplacementFromDeformation(image);
+    }
+
+    const size_t componentVoxels = image->nvox / size_t(nComponents);
+    record.isDisplacement = (toDisplacement ? 1 : 0);
+    record.nComponents = nComponents;
+    record.nExtensions = image->num_ext;
+    record.image = getStoredGeometry(image);
+    if (storage == TransformStore::QuantisedStorage)
+    {
+        if (image->datatype == NIFTI_TYPE_FLOAT32)
+            getScales(static_cast<const float *>(image->data), componentVoxels, nComponents, record.scales);
+        else
+            getScales(static_cast<const double *>(image->data), componentVoxels, nComponents, record.scales);
+    }
+    writeBlock(file, &record, sizeof(StoredRecord));
+
+    // Extensions hold the affine components of control point grids
+    for (int i=0; i<image->num_ext; i++)
+    {
+        const int32_t extension[2] = { image->ext_list[i].ecode, image->ext_list[i].esize - 8 };
+        writeBlock(file, extension, sizeof(extension));
+        writeBlock(file, image->ext_list[i].edata, size_t(extension[1]));
+        writePadding(file, 8);
+    }
+    writePadding(file);
+
+    if (storage == TransformStore::SingleStorage && image->datatype == NIFTI_TYPE_FLOAT32)
+        writeBlock(file, image->data, image->nvox * sizeof(float));
+    else if (image->datatype == NIFTI_TYPE_FLOAT32)
+        writeData(file, static_cast<const float *>(image->data), componentVoxels, nComponents, storage, record.scales);
+    else
+        writeData(file, static_cast<const double *>(image->data), componentVoxels, nComponents, storage, record.scales);
+    writePadding(file);
+}
+
+void TransformStore::write (const std::string &fileName, const std::vector<Entry> &entries, const Storage storage)
+{
+    if (entries.empty())
+        throw std::runtime_error("At least one transform must be given");
+
+    const RNifti::NiftiImage &targetImage = entries[0].targetImage;
+    for (size_t i=1; i<entries.size(); i++)
+    {
+        if (!sameGeometry(targetImage, entries[i].targetImage))
+            throw std::runtime_error("All transforms in a store must have the same target image geometry");
+    }
+
+    FILE *file = fopen(fileName.c_str(), "wb");
+    if (file == NULL)
+        throw std::runtime_error("Cannot open file " + fileName + " for writing");
+
+    try
+    {
+        StoreHeader header;
+        memset(&header, 0, sizeof(StoreHeader));
+        memcpy(header.magic, storeMagic, 8);
+        header.byteOrder = storeByteOrder;
+        header.version = storeVersion;
+        header.count = static_cast<int32_t>(entries.size());
+        header.storage = storage;
+        writeBlock(file, &header, sizeof(StoreHeader));
+        writePadding(file);
+
+        const StoredGeometry targetGeometry = getStoredGeometry(targetImage);
+        writeBlock(file, &targetGeometry, sizeof(StoredGeometry));
+        writePadding(file);
+
+        // The index is filled in once the location of each record is known
+        const int64_t indexOffset = tellFile(file);
+        std::vector<int64_t> offsets(entries.size(), 0);
+        writeBlock(file, &offsets.front(), offsets.size() * sizeof(int64_t));
+        writePadding(file);
+
+        for (size_t i=0; i<entries.size(); i++)
+        {
+            offsets[i] = tellFile(file);
+            writeEntry(file, entries[i], storage);
+        }
+
+        seekFile(file, indexOffset);
+        writeBlock(file, &offsets.front(), offsets.size() * sizeof(int64_t));
+    }
+    catch (...)
+    {
+        fclose(file);
+        throw;
+    }
+
+    if (fclose(file) != 0)
+        throw std::runtime_error("Failed to write to transform store");
+}
+
+TransformStore::TransformStore (const std::string &fileName)
+{
+    file = fopen(fileName.c_str(), "rb");
+    if (file == NULL)
+        throw std::runtime_error("Cannot open file " + fileName);
+
+    try
+    {
+        StoreHeader header;
+        readBlock(file, &header, sizeof(StoreHeader));
+        if (memcmp(header.magic, storeMagic, 8) != 0)
+            throw std::runtime_error("The specified file is not a transform store");
+        if (header.byteOrder != storeByteOrder)
+            throw std::runtime_error("The transform store was written on a platform with a different byte order");
+        if (header.version != storeVersion)
+            throw std::runtime_error("The transform store was written by an incompatible version of this package");
+        storage = static_cast<Storage>(header.storage);
+        skipPadding(file);
+
+        StoredGeometry targetGeometry;
+        readBlock(file, &targetGeometry, sizeof(StoredGeometry));
+        targetImage = RNifti::NiftiImage(createImageFromGeometry(targetGeometry));
+        skipPadding(file);
+
+        offsets.resize(size_t(header.count));
+        if (header.count > 0)
+            readBlock(file, &offsets.front(), offsets.size() * sizeof(int64_t));
+    }
+    catch (...)
+    {
+        fclose(file);
+        throw;
+    }
+}
+
+TransformStore::~TransformStore ()
+{
+    if (file != NULL)
+        fclose(file);
+}
+
+TransformStore::Entry TransformStore::read (const size_t index) const
+{
+    if (index >= offsets.size())
+        throw std::runtime_error("Transform index is out of bounds");
+
+    seekFile(file, offsets[index]);
+    StoredRecord record;
+    readBlock(file, &record, sizeof(StoredRecord));
+
+    Entry entry;
+    entry.isAffine = (record.isAffine != 0);
+    entry.sourceImage = RNifti::NiftiImage(createImageFromGeometry(record.source));
+    entry.targetImage = targetImage;
+
+    if (entry.isAffine)
+    {
+        for (int i=0; i<4; i++)
+        {
+            for (int j=0; j<4; j++)
+                entry.matrix(i,j) = record.matrix[i*4 + j];
+        }
+        return entry;
+    }
+
+    entry.matrix.setIdentity();
+    nifti_image *image = createImageFromGeometry(record.image);
+    entry.transformationImage = RNifti::NiftiImage(image);
+
+    std::vector<char> extensionData;
+    for (int i=0; i<record.nExtensions; i++)
+    {
+        int32_t extension[2];
+        readBlock(file, extension, sizeof(extension));
+        extensionData.resize(size_t(std::max(extension[1], 1)));
+        readBlock(file, &extensionData.front(), size_t(extension[1]));
+        nifti_add_extension(image, &extensionData.front(), extension[1], extension[0]);
+        skipPadding(file, 8);
+    }
+    skipPadding(file);
+
+    // Data are read straight into the image buffer, without any intermediate copy
+    // unless they need converting
+    image->data = malloc(image->nvox * size_t(image->nbyper));
+    if (image->data == NULL)
+        throw std::runtime_error("Cannot allocate memory for transformation image");
+
+    const int nComponents = std::max(1, record.nComponents);
+    const size_t componentVoxels = image->nvox / size_t(nComponents);
+    if (storage == SingleStorage && image->datatype == NIFTI_TYPE_FLOAT32)
+        readBlock(file, image->data, image->nvox * sizeof(float));
+    else if (image->datatype == NIFTI_TYPE_FLOAT32)
+        readData(file, static_cast<float *>(image->data), componentVoxels, nComponents, storage, record.scales);
+    else
+        readData(file, static_cast<double *>(image->data), componentVoxels, nComponents, storage, record.scales);
+
+    if (record.isDisplacement != 0)
+        reg_getDeformationFromDisplacement(image);
+
+    return entry;
+}
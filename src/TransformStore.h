@@ -0,0 +1,77 @@
+#ifndef _TRANSFORM_STORE_H_
+#define _TRANSFORM_STORE_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include <RcppEigen.h>
+
+#include "RNifti.h"
+
+// Spatial metadata needed to reconstruct a NIfTI header, in a fixed binary layout
+struct StoredGeometry
+{
+    int32_t dim[8];
+    float pixdim[8];
+    int32_t datatype, intentCode, qformCode, sformCode, xyzUnits, timeUnits;
+    float intentParams[3];
+    float quatern[3], qoffset[3], qfac;
+    float srow[12];
+    char intentName[16];
+};
+
+// Capture the spatial metadata of an image, and create an image header,
+// without data, from the metadata
+StoredGeometry getStoredGeometry (const nifti_image *image);
+nifti_image * createImageFromGeometry (const StoredGeometry &geometry);
+
+// A compact binary container for a set of transformations sharing a target
+// image. The target geometry is stored once, followed by an index of record
+// offsets, and then one record per transformation holding its source
+// geometry and either an affine matrix or a transformation image with its
+// extensions. Image data are stored uncompressed, as float32 or as int16 with
+// a scale factor per component and -32768 standing for NaN, with every record
+// and data block aligned to 64 bytes. Quantised position images are stored as displacements, which are far
+// smaller than the positions themselves, to retain sub-micron precision
+class TransformStore
+{
+public:
+    enum Storage { SingleStorage = 0, QuantisedStorage = 1 };
+
+    struct Entry
+    {
+        bool isAffine;
+        Eigen::Matrix4d matrix;
+        RNifti::NiftiImage sourceImage;
+        RNifti::NiftiImage targetImage;
+        RNifti::NiftiImage transformationImage;
+    };
+
+protected:
+    FILE *file;
+    Storage storage;
+    RNifti::NiftiImage targetImage;
+    std::vector<int64_t> offsets;
+
+    // Stores hold an open file, so they are not copied
+    TransformStore (const TransformStore &);
+    TransformStore & operator= (const TransformStore &);
+
+public:
+    // Open a store for reading, loading its header and index
+    TransformStore (const std::string &fileName);
+    ~TransformStore ();
+
+    size_t count () const { return offsets.size(); }
+
+    // The target image header, without data, which is shared by all entries
+    RNifti::NiftiImage getTargetImage () const { return targetImage; }
+
+    // Read one transformation, with images restored to their original data type
+    Entry read (const size_t index) const;
+
+    // Write a set of transformations, which must all have the same target geometry
+    static void write (const std::string &fileName, const std::vector<Entry> &entries, const Storage storage);
+};
+
+#endif
@@ -32,8 +32,7 @@ AladinResult regAladin (const NiftiImage &sourceImage, const NiftiImage &targetI
     
     if (nLevels == 0)
     {
-        DeformationField<PrecisionType> deformationField(result.target, initAffine);
-        result.image = deformationField.resampleImage(result.source, interpolation);
+        result.image = resampleImageInTiles<PrecisionType>(result.target, initAffine, result.source, interpolation);
         result.forwardTransform = initAffine;
     }
     else
@@ -8,11 +8,22 @@
 #include "f3d.h"
 #include "AffineMatrix.h"
 #include "DeformationField.h"
+#include "Checkpoint.h"
 
 using namespace RNifti;
 
+// Append a hash of the data of an image, or zero for a null image, to a
+// checkpoint signature. The hash is split into two 32-bit halves, which are
+// held exactly as doubles
+static void appendImageHash (std::vector<double> &signature, const NiftiImage &image)
+{
+    const uint64_t hash = image.isNull() ? 0 : reg_tools_getImageDataHash(image);
+    signature.push_back(double(hash >> 32));
+    signature.push_back(double(hash & 0xffffffffULL));
+}
+
 template <typename PrecisionType>
-F3dResult regF3d (const NiftiImage &sourceImage, const NiftiImage &targetImage, const int nLevels, const int maxIterations, const int interpolation, const NiftiImage &sourceMaskImage, const NiftiImage &targetMaskImage, const NiftiImage &initControlPoints, const AffineMatrix &initAffine, const int nBins, const std::vector<float> &spacing, const float bendingEnergyWeight, const float linearEnergyWeight, const float jacobianWeight, const bool symmetric, const bool verbose, const bool estimateOnly)
+F3dResult regF3d (const NiftiImage &sourceImage, const NiftiImage &targetImage, const int nLevels, const int maxIterations, const int interpolation, const NiftiImage &sourceMaskImage, const NiftiImage &targetMaskImage, const NiftiImage &initControlPoints, const AffineMatrix &initAffine, const int nBins, const std::vector<float> &spacing, const float bendingEnergyWeight, const float linearEnergyWeight, const float jacobianWeight, const bool symmetric, const bool verbose, const bool estimateOnly, const bool halfPrecisionGradient, const int approximateGradient, const std::string &checkpointFile, const double checkpointInterval)
 {
     F3dResult result;
     result.source = normaliseImage(isMultichannel(sourceImage) ? collapseChannels(sourceImage) : sourceImage);
@@ -40,8 +51,7 @@ F3dResult regF3d (const NiftiImage &sourceImage, const NiftiImage &targetImage,
         if (!controlPoints.isNull())
         {
             result.forwardTransform = controlPoints;
-            DeformationField<PrecisionType> deformationField(result.target, controlPoints);
-            result.image = deformationField.resampleImage(result.source, interpolation);
+            result.image = resampleImageInTiles<PrecisionType>(result.target, controlPoints, result.source, interpolation);
         }
         else
         {
@@ -52,6 +62,44 @@ F3dResult regF3d (const NiftiImage &sourceImage, const NiftiImage &targetImage,
     }
     else
     {
+        // Progress is saved periodically to the checkpoint file, if one is
+        // given, and resumed from it if it exists. The signature ties the
+        // file to these images and settings, including the voxel values of
+        // the images, masks and initial transformation
+        std::vector<double> signature;
+        signature.push_back(double(sizeof(PrecisionType)));
+        signature.push_back(double(symmetric));
+        signature.push_back(double(interpolation));
+        signature.push_back(double(halfPrecisionGradient));
+        signature.push_back(double(approximateGradient));
+        signature.push_back(double(nLevels));
+        signature.push_back(double(maxIterations));
+        signature.push_back(double(nBins));
+        for (int i = 0; i < 3; i++)
+            signature.push_back(double(spacing[i]));
+        signature.push_back(double(bendingEnergyWeight));
+        signature.push_back(double(linearEnergyWeight));
+        signature.push_back(double(jacobianWeight));
+        for (int i = 1; i < 8; i++)
+        {
+            signature.push_back(double(result.source->dim[i]));
+            signature.push_back(double(result.target->dim[i]));
+        }
+        if (!checkpointFile.empty())
+        {
+            // Hashing reads every voxel, so it is only done when needed
+            appendImageHash(signature, result.source);
+            appendImageHash(signature, result.target);
+            appendImageHash(signature, sourceMask);
+            appendImageHash(signature, targetMask);
+            if (!controlPoints.isNull())
+                appendImageHash(signature, controlPoints);
+            else
+                signature.insert(signature.end(), initAffine.begin(), initAffine.end());
+        }
+        RegistrationCheckpoint checkpoint(checkpointFile, signature, verbose);
+        const bool resume = (!checkpointFile.empty() && checkpoint.read());
+        
         reg_f3d<PrecisionType> *reg = NULL;
 
         // Create the reg_f3d object
@@ -94,7 +142,19 @@ F3dResult regF3d (const NiftiImage &sourceImage, const NiftiImage &targetImage,
         reg->SetJacobianLogWeight(jacobianWeight);
         
         reg->SetMaximalIterationNumber(maxIterations);
+
+        // The warped image gradients are only read by NMI, which tolerates
+        // their being rounded to half precision
+        if (halfPrecisionGradient)
+            reg->UseHalfPrecisionGradient();
         
+        // The gradient may be approximated by finite differences, evaluated
+        // locally where possible (1) or always over the whole image (2)
+        if (approximateGradient > 0)
+            reg->UseApproximatedGradient();
+        if (approximateGradient > 1)
+            reg->DoNotUseLocalApproximatedGradient();
+
         for (int i = 0; i < 3; i++)
             reg->SetSpacing(unsigned(i), PrecisionType(spacing[i]));
         
@@ -114,25 +174,57 @@ F3dResult regF3d (const NiftiImage &sourceImage, const NiftiImage &targetImage,
         else
             reg->UseNeareatNeighborInterpolation();
         
+        if (!checkpointFile.empty())
+        {
+            if (resume)
+                reg->SetResumeState(checkpoint.getState());
+            reg->SetCheckpointCallbackFunction(&RegistrationCheckpoint::writeCallback, &checkpoint, checkpointInterval);
+        }
+        
         // Run the registration
         reg->Run();
         
-        if (!estimateOnly)
-            result.image = NiftiImage(reg->GetWarpedImage()[0]);
+        // The checkpoint is no longer needed once the registration completes
+        if (!checkpointFile.empty())
+        {
+            result.checkpointTimes = checkpoint.getWriteTimes();
+            checkpoint.remove();
+        }
+        
         result.forwardTransform = NiftiImage(reg->GetControlPointPositionImage());
         if (symmetric)
             result.reverseTransform = NiftiImage(reg->GetBackwardControlPointPositionImage());
         result.iterations = reg->GetCompletedIterations();
+        result.peakMemory = double(reg->GetPeakMemoryUsage()) / 1048576.0;
         
         // Erase the registration object
         delete reg;
+        
+        // The final image is resampled through the control point grid with
+        // the requested interpolation, one slab at a time, straight into the
+        // image that is returned. Unlike reg_f3d<T>::GetWarpedImage(), this
+        // needs no full-size deformation field or copy of the warped data,
+        // and the backward image of a symmetric registration is not warped
+        if (!estimateOnly)
+        {
+            // The source keeps its own data type for nearest-neighbour
+            // interpolation, so a floating-point copy is resampled instead,
+            // in which points outside the source can be marked as NaN
+            NiftiImage finalSource = result.source;
+            if (finalSource->datatype != NIFTI_TYPE_FLOAT64)
+            {
+                finalSource = NiftiImage(result.source, true);
+                reg_tools_changeDatatype<double>(finalSource);
+            }
+            result.image = resampleImageInTiles<PrecisionType>(result.target, result.forwardTransform, finalSource, interpolation, std::numeric_limits<float>::quiet_NaN());
+        }
     }
     
     return result;
 }
 
 template
-F3dResult regF3d<float> (const NiftiImage &sourceImage, const NiftiImage &targetImage, const int nLevels, const int maxIterations, const int interpolation, const NiftiImage &sourceMaskImage, const NiftiImage &targetMaskImage, const NiftiImage &initControlPoints, const AffineMatrix &initAffine, const int nBins, const std::vector<float> &spacing, const float bendingEnergyWeight, const float linearEnergyWeight, const float jacobianWeight, const bool symmetric, const bool verbose, const bool estimateOnly);
+F3dResult regF3d<float> (const NiftiImage &sourceImage, const NiftiImage &targetImage, const int nLevels, const int maxIterations, const int interpolation, const NiftiImage &sourceMaskImage, const NiftiImage &targetMaskImage, const NiftiImage &initControlPoints, const AffineMatrix &initAffine, const int nBins, const std::vector<float> &spacing, const float bendingEnergyWeight, const float linearEnergyWeight, const float jacobianWeight, const bool symmetric, const bool verbose, const bool estimateOnly, const bool halfPrecisionGradient, const int approximateGradient, const std::string &checkpointFile, const double checkpointInterval);
 
 template
-F3dResult regF3d<double> (const NiftiImage &sourceImage, const NiftiImage &targetImage, const int nLevels, const int maxIterations, const int interpolation, const NiftiImage &sourceMaskImage, const NiftiImage &targetMaskImage, const NiftiImage &initControlPoints, const AffineMatrix &initAffine, const int nBins, const std::vector<float> &spacing, const float bendingEnergyWeight, const float linearEnergyWeight, const float jacobianWeight, const bool symmetric, const bool verbose, const bool estimateOnly);
+F3dResult regF3d<double> (const NiftiImage &sourceImage, const NiftiImage &targetImage, const int nLevels, const int maxIterations, const int interpolation, const NiftiImage &sourceMaskImage, const NiftiImage &targetMaskImage, const NiftiImage &initControlPoints, const AffineMatrix &initAffine, const int nBins, const std::vector<float> &spacing, const float bendingEnergyWeight, const float linearEnergyWeight, const float jacobianWeight, const bool symmetric, const bool verbose, const bool estimateOnly, const bool halfPrecisionGradient, const int approximateGradient, const std::string &checkpointFile, const double checkpointInterval);
@@ -50,6 +50,30 @@ NiftiImage collapseChannels (const NiftiImage &image)
         return image;
 }
 
+void channelsToVolumes (NiftiImage &image)
+{
+    if (isMultichannel(image))
+    {
+        image->dim[0] = 4;
+        image->dim[4] = image->dim[3];
+        image->pixdim[4] = 1.0;
+        image->dim[3] = 1;
+        nifti_update_dims_from_array(image);
+    }
+}
+
+void volumesToChannels (NiftiImage &image)
+{
+    if (image.nDims() == 4 && image->nz == 1 && (image->nt == 3 || image->nt == 4))
+    {
+        image->dim[0] = 3;
+        image->dim[3] = image->dim[4];
+        image->pixdim[3] = 1.0;
+        image->dim[4] = 1;
+        nifti_update_dims_from_array(image);
+    }
+}
+
 void checkImages (const NiftiImage &sourceImage, const NiftiImage &targetImage)
 {
     if (sourceImage.isNull())
@@ -133,3 +157,26 @@ NiftiImage allocateMultiregResult (const NiftiImage &source, const NiftiImage &t
     
     return NiftiImage(newStruct);
 }
+
+void seekFile (FILE *file, const int64_t offset)
+{
+#ifdef _WIN32
+    const int status = _fseeki64(file, offset, SEEK_SET);
+#else
+    const int status = fseeko(file, off_t(offset), SEEK_SET);
+#endif
+    if (status != 0)
+        throw std::runtime_error("Failed to seek within file");
+}
+
+int64_t tellFile (FILE *file)
+{
+#ifdef _WIN32
+    const int64_t position = _ftelli64(file);
+#else
+    const int64_t position = int64_t(ftello(file));
+#endif
+    if (position < 0)
+        throw std::runtime_error("Failed to find the position within file");
+    return position;
+}
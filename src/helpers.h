@@ -1,6 +1,9 @@
 #ifndef _HELPERS_H_
 #define _HELPERS_H_
 
+#include <stdio.h>
+#include <stdint.h>
+
 #include "RNifti.h"
 
 int nonunitaryDims (const RNifti::NiftiImage &image);
@@ -9,10 +12,20 @@ bool isMultichannel (const RNifti::NiftiImage &image);
 
 RNifti::NiftiImage collapseChannels (const RNifti::NiftiImage &image);
 
+// Reinterpret the channels of a multichannel image as volumes along the fourth
+// dimension, or vice versa, by changing only the image header
+void channelsToVolumes (RNifti::NiftiImage &image);
+void volumesToChannels (RNifti::NiftiImage &image);
+
 void checkImages (const RNifti::NiftiImage &sourceImage, const RNifti::NiftiImage &targetImage);
 
 RNifti::NiftiImage normaliseImage (const RNifti::NiftiImage &image);
 
 RNifti::NiftiImage allocateMultiregResult (const RNifti::NiftiImage &source, const RNifti::NiftiImage &target, const bool forceDouble);
 
+// Seek within a file, or find the current position, using 64-bit offsets,
+// since streamed images and transform stores may be very large
+void seekFile (FILE *file, const int64_t offset);
+int64_t tellFile (FILE *file);
+
 #endif
@@ -4,6 +4,9 @@
 
 #include "helpers.h"
 #include "DeformationField.h"
+#include "ResamplingPlan.h"
+#include "TransformStore.h"
+#include "ThreadContext.h"
 #include "aladin.h"
 #include "f3d.h"
 #include "_reg_nmi.h"
@@ -13,17 +16,15 @@ using namespace RNifti;
 
 typedef std::vector<float> float_vector;
 
-RcppExport SEXP calculateMeasure (SEXP _source, SEXP _target, SEXP _targetMask, SEXP _interpolation, SEXP _threads)
+RcppExport SEXP calculateMeasure (SEXP _source, SEXP _target, SEXP _targetMask, SEXP _interpolation, SEXP _threads, SEXP _cpus, SEXP _allocation)
 {
 BEGIN_RCPP
     const NiftiImage sourceImage(_source);
     const NiftiImage targetImage(_target);
     const NiftiImage targetMask(_targetMask);
     
-#ifdef _OPENMP
-    if (!Rf_isNull(_threads) && as<int>(_threads) > 0)
-        omp_set_num_threads(as<int>(_threads));
-#endif
+    // Thread settings apply to this call only, and are restored on exit
+    const ThreadContext threadContext(Rf_isNull(_threads) ? 0 : as<int>(_threads), Rf_isNull(_cpus) ? std::vector<int>() : as< std::vector<int> >(_cpus), as<int>(_allocation));
     
     checkImages(sourceImage, targetImage);
     if (sourceImage.nDims() != targetImage.nDims())
@@ -49,8 +50,7 @@ BEGIN_RCPP
     reg_tools_changeDatatype<double>(normalisedTargetImage);
     
     AffineMatrix affine(normalisedSourceImage, normalisedTargetImage);
-    DeformationField<double> deformationField(normalisedTargetImage, affine);
-    NiftiImage resampledSourceImage = deformationField.resampleImage(normalisedSourceImage, as<int>(_interpolation));
+    NiftiImage resampledSourceImage = resampleImageInTiles<double>(normalisedTargetImage, affine, normalisedSourceImage, as<int>(_interpolation));
     
     reg_nmi nmi;
     for (int i=0; i<std::min(normalisedTargetImage->nt,resampledSourceImage->nt); i++)
@@ -64,7 +64,30 @@ BEGIN_RCPP
 END_RCPP
 }
 
-RcppExport SEXP regLinear (SEXP _source, SEXP _target, SEXP _type, SEXP _symmetric, SEXP _nLevels, SEXP _maxIterations, SEXP _useBlockPercentage, SEXP _interpolation, SEXP _sourceMask, SEXP _targetMask, SEXP _init, SEXP _verbose, SEXP _estimateOnly, SEXP _sequentialInit, SEXP _internal, SEXP _precision, SEXP _threads)
+// Resample a normalised source image through a transformation. The channels of
+// a multichannel image are treated as volumes, so that they are all resampled
+// in a single pass, with the transformation and the interpolation weights at
+// each target location calculated only once
+template <typename PrecisionType, class TransformType>
+static NiftiImage resampleSourceImage (const NiftiImage &targetImage, TransformType &transform, const NiftiImage &sourceImage, const int interpolation)
+{
+    const bool multichannel = isMultichannel(sourceImage);
+    NiftiImage source = sourceImage;
+    if (multichannel || interpolation != 0)
+        source = NiftiImage(sourceImage, true);
+    channelsToVolumes(source);
+    
+    // Interpolated values are calculated in double precision
+    if (interpolation != 0)
+        reg_tools_changeDatatype<double>(source);
+    
+    NiftiImage result = resampleImageInTiles<PrecisionType>(targetImage, transform, source, interpolation);
+    if (multichannel)
+        volumesToChannels(result);
+    return result;
+}
+
+RcppExport SEXP regLinear (SEXP _source, SEXP _target, SEXP _type, SEXP _symmetric, SEXP _nLevels, SEXP _maxIterations, SEXP _useBlockPercentage, SEXP _interpolation, SEXP _sourceMask, SEXP _targetMask, SEXP _init, SEXP _verbose, SEXP _estimateOnly, SEXP _sequentialInit, SEXP _internal, SEXP _precision, SEXP _threads, SEXP _cpus, SEXP _allocation)
 {
 BEGIN_RCPP
     const NiftiImage sourceImage(_source);
@@ -72,10 +95,8 @@ BEGIN_RCPP
     const NiftiImage sourceMask(_sourceMask);
     const NiftiImage targetMask(_targetMask);
     
-#ifdef _OPENMP
-    if (!Rf_isNull(_threads) && as<int>(_threads) > 0)
-        omp_set_num_threads(as<int>(_threads));
-#endif
+    // Thread settings apply to this call only, and are restored on exit
+    const ThreadContext threadContext(Rf_isNull(_threads) ? 0 : as<int>(_threads), Rf_isNull(_cpus) ? std::vector<int>() : as< std::vector<int> >(_cpus), as<int>(_allocation));
     
     checkImages(sourceImage, targetImage);
     
@@ -128,18 +149,20 @@ BEGIN_RCPP
         else
             result = regAladin<float>(collapsedSource, targetImage, scope, symmetric, as<int>(_nLevels), as<int>(_maxIterations), as<int>(_useBlockPercentage), as<int>(_interpolation), sourceMask, targetMask, initAffine, as<bool>(_verbose), estimateOnly);
         
-        const int nReps = (estimateOnly ? 0 : sourceImage.nBlocks());
-        for (int i=0; i<nReps; i++)
+        // All channels are resampled together, through the final transform
+        if (!estimateOnly)
         {
-            NiftiImage currentSource = sourceImage.block(i);
-            AladinResult currentResult;
-            
+            NiftiImage resampledImage;
             if (doublePrecision)
-                currentResult = regAladin<double>(currentSource, targetImage, scope, symmetric, 0, as<int>(_maxIterations), as<int>(_useBlockPercentage), as<int>(_interpolation), sourceMask, targetMask, result.forwardTransform, as<bool>(_verbose), estimateOnly);
+                resampledImage = resampleSourceImage<double>(result.target, result.forwardTransform, normaliseImage(sourceImage), interpolation);
             else
-                currentResult = regAladin<float>(currentSource, targetImage, scope, symmetric, 0, as<int>(_maxIterations), as<int>(_useBlockPercentage), as<int>(_interpolation), sourceMask, targetMask, result.forwardTransform, as<bool>(_verbose), estimateOnly);
+                resampledImage = resampleSourceImage<float>(result.target, result.forwardTransform, normaliseImage(sourceImage), interpolation);
             
-            finalImage.block(i) = currentResult.image;
+            for (int i=0; i<sourceImage.nBlocks(); i++)
+            {
+                NiftiImage channel = resampledImage.block(i);
+                finalImage.block(i) = channel;
+            }
         }
         
         // The remaining fields are set in the drop-through block below
@@ -208,7 +231,7 @@ BEGIN_RCPP
 END_RCPP
 }
 
-RcppExport SEXP regNonlinear (SEXP _source, SEXP _target, SEXP _symmetric, SEXP _nLevels, SEXP _maxIterations, SEXP _interpolation, SEXP _sourceMask, SEXP _targetMask, SEXP _init, SEXP _nBins, SEXP _spacing, SEXP _bendingEnergyWeight, SEXP _linearEnergyWeight, SEXP _jacobianWeight, SEXP _verbose, SEXP _estimateOnly, SEXP _sequentialInit, SEXP _internal, SEXP _precision, SEXP _threads)
+RcppExport SEXP regNonlinear (SEXP _source, SEXP _target, SEXP _symmetric, SEXP _nLevels, SEXP _maxIterations, SEXP _interpolation, SEXP _sourceMask, SEXP _targetMask, SEXP _init, SEXP _nBins, SEXP _spacing, SEXP _bendingEnergyWeight, SEXP _linearEnergyWeight, SEXP _jacobianWeight, SEXP _verbose, SEXP _estimateOnly, SEXP _sequentialInit, SEXP _internal, SEXP _precision, SEXP _halfPrecisionGradient, SEXP _approximateGradient, SEXP _threads, SEXP _cpus, SEXP _allocation, SEXP _checkpoint, SEXP _checkpointInterval)
 {
 BEGIN_RCPP
     const NiftiImage sourceImage(_source);
@@ -216,10 +239,8 @@ BEGIN_RCPP
     const NiftiImage sourceMask(_sourceMask);
     const NiftiImage targetMask(_targetMask);
     
-#ifdef _OPENMP
-    if (!Rf_isNull(_threads) && as<int>(_threads) > 0)
-        omp_set_num_threads(as<int>(_threads));
-#endif
+    // Thread settings apply to this call only, and are restored on exit
+    const ThreadContext threadContext(Rf_isNull(_threads) ? 0 : as<int>(_threads), Rf_isNull(_cpus) ? std::vector<int>() : as< std::vector<int> >(_cpus), as<int>(_allocation));
     
     checkImages(sourceImage, targetImage);
     
@@ -231,6 +252,10 @@ BEGIN_RCPP
     const bool estimateOnly = as<bool>(_estimateOnly);
     const bool sequentialInit = as<bool>(_sequentialInit);
     const bool doublePrecision = (as<std::string>(_precision) == "double");
+    const bool halfPrecisionGradient = as<bool>(_halfPrecisionGradient);
+    const int approximateGradient = as<int>(_approximateGradient);
+    const std::string checkpointFile = (Rf_isNull(_checkpoint) ? std::string() : as<std::string>(_checkpoint));
+    const double checkpointInterval = as<double>(_checkpointInterval);
     
     const int internal = as<int>(_internal);
     const bool internalOutput = (internal == TRUE);
@@ -257,9 +282,9 @@ BEGIN_RCPP
             initAffine = AffineMatrix(sourceImage, targetImage);
         
         if (doublePrecision)
-            result = regF3d<double>(sourceImage, targetImage, as<int>(_nLevels), as<int>(_maxIterations), interpolation, sourceMask, targetMask, initControl, initAffine, as<int>(_nBins), as<float_vector>(_spacing), as<float>(_bendingEnergyWeight), as<float>(_linearEnergyWeight), as<float>(_jacobianWeight), symmetric, as<bool>(_verbose), estimateOnly);
+            result = regF3d<double>(sourceImage, targetImage, as<int>(_nLevels), as<int>(_maxIterations), interpolation, sourceMask, targetMask, initControl, initAffine, as<int>(_nBins), as<float_vector>(_spacing), as<float>(_bendingEnergyWeight), as<float>(_linearEnergyWeight), as<float>(_jacobianWeight), symmetric, as<bool>(_verbose), estimateOnly, halfPrecisionGradient, approximateGradient, checkpointFile, checkpointInterval);
         else
-            result = regF3d<float>(sourceImage, targetImage, as<int>(_nLevels), as<int>(_maxIterations), interpolation, sourceMask, targetMask, initControl, initAffine, as<int>(_nBins), as<float_vector>(_spacing), as<float>(_bendingEnergyWeight), as<float>(_linearEnergyWeight), as<float>(_jacobianWeight), symmetric, as<bool>(_verbose), estimateOnly);
+            result = regF3d<float>(sourceImage, targetImage, as<int>(_nLevels), as<int>(_maxIterations), interpolation, sourceMask, targetMask, initControl, initAffine, as<int>(_nBins), as<float_vector>(_spacing), as<float>(_bendingEnergyWeight), as<float>(_linearEnergyWeight), as<float>(_jacobianWeight), symmetric, as<bool>(_verbose), estimateOnly, halfPrecisionGradient, approximateGradient, checkpointFile, checkpointInterval);
         
         returnValue["image"] = result.image.toArrayOrPointer(internalOutput, "Result image");
     }
@@ -281,23 +306,26 @@ BEGIN_RCPP
         else
             initAffine = AffineMatrix(collapsedSource, targetImage);
         
+        // Only the transformation is needed, as all channels are resampled below
         if (doublePrecision)
-            result = regF3d<double>(collapsedSource, targetImage, as<int>(_nLevels), as<int>(_maxIterations), interpolation, sourceMask, targetMask, initControl, initAffine, as<int>(_nBins), as<float_vector>(_spacing), as<float>(_bendingEnergyWeight), as<float>(_linearEnergyWeight), as<float>(_jacobianWeight), symmetric, as<bool>(_verbose), estimateOnly);
+            result = regF3d<double>(collapsedSource, targetImage, as<int>(_nLevels), as<int>(_maxIterations), interpolation, sourceMask, targetMask, initControl, initAffine, as<int>(_nBins), as<float_vector>(_spacing), as<float>(_bendingEnergyWeight), as<float>(_linearEnergyWeight), as<float>(_jacobianWeight), symmetric, as<bool>(_verbose), true, halfPrecisionGradient, approximateGradient, checkpointFile, checkpointInterval);
         else
-            result = regF3d<float>(collapsedSource, targetImage, as<int>(_nLevels), as<int>(_maxIterations), interpolation, sourceMask, targetMask, initControl, initAffine, as<int>(_nBins), as<float_vector>(_spacing), as<float>(_bendingEnergyWeight), as<float>(_linearEnergyWeight), as<float>(_jacobianWeight), symmetric, as<bool>(_verbose), estimateOnly);
+            result = regF3d<float>(collapsedSource, targetImage, as<int>(_nLevels), as<int>(_maxIterations), interpolation, sourceMask, targetMask, initControl, initAffine, as<int>(_nBins), as<float_vector>(_spacing), as<float>(_bendingEnergyWeight), as<float>(_linearEnergyWeight), as<float>(_jacobianWeight), symmetric, as<bool>(_verbose), true, halfPrecisionGradient, approximateGradient, checkpointFile, checkpointInterval);
         
-        const int nReps = (estimateOnly ? 0 : sourceImage.nBlocks());
-        for (int i=0; i<nReps; i++)
+        // All channels are resampled together, through the final transform
+        if (!estimateOnly)
         {
-            NiftiImage currentSource = sourceImage.block(i);
-            F3dResult currentResult;
-            
+            NiftiImage resampledImage;
             if (doublePrecision)
-                currentResult = regF3d<double>(currentSource, targetImage, 0, as<int>(_maxIterations), interpolation, sourceMask, targetMask, result.forwardTransform, AffineMatrix(), as<int>(_nBins), as<float_vector>(_spacing), as<float>(_bendingEnergyWeight), as<float>(_linearEnergyWeight), as<float>(_jacobianWeight), symmetric, as<bool>(_verbose), estimateOnly);
+                resampledImage = resampleSourceImage<double>(result.target, result.forwardTransform, normaliseImage(sourceImage), interpolation);
             else
-                currentResult = regF3d<float>(currentSource, targetImage, 0, as<int>(_maxIterations), interpolation, sourceMask, targetMask, result.forwardTransform, AffineMatrix(), as<int>(_nBins), as<float_vector>(_spacing), as<float>(_bendingEnergyWeight), as<float>(_linearEnergyWeight), as<float>(_jacobianWeight), symmetric, as<bool>(_verbose), estimateOnly);
+                resampledImage = resampleSourceImage<float>(result.target, result.forwardTransform, normaliseImage(sourceImage), interpolation);
             
-            finalImage.block(i) = currentResult.image;
+            for (int i=0; i<sourceImage.nBlocks(); i++)
+            {
+                NiftiImage channel = resampledImage.block(i);
+                finalImage.block(i) = channel;
+            }
         }
         
         returnValue["image"] = finalImage.toArrayOrPointer(internalOutput, "Result image");
@@ -307,6 +335,7 @@ BEGIN_RCPP
         const int nReps = sourceImage.nBlocks();
         List forwardTransforms(nReps), reverseTransforms(nReps), iterations(nReps), sourceImages(nReps);
         NiftiImage finalImage = allocateMultiregResult(sourceImage, targetImage, interpolation != 0);
+        double peakMemory = 0.0;
         for (int i=0; i<nReps; i++)
         {
             NiftiImage currentSource = sourceImage.block(i);
@@ -328,9 +357,9 @@ BEGIN_RCPP
                 initAffine = AffineMatrix(currentSource, targetImage);
             
             if (doublePrecision)
-                result = regF3d<double>(currentSource, targetImage, as<int>(_nLevels), as<int>(_maxIterations), interpolation, sourceMask, targetMask, initControl, initAffine, as<int>(_nBins), as<float_vector>(_spacing), as<float>(_bendingEnergyWeight), as<float>(_linearEnergyWeight), as<float>(_jacobianWeight), symmetric, as<bool>(_verbose), estimateOnly);
+                result = regF3d<double>(currentSource, targetImage, as<int>(_nLevels), as<int>(_maxIterations), interpolation, sourceMask, targetMask, initControl, initAffine, as<int>(_nBins), as<float_vector>(_spacing), as<float>(_bendingEnergyWeight), as<float>(_linearEnergyWeight), as<float>(_jacobianWeight), symmetric, as<bool>(_verbose), estimateOnly, halfPrecisionGradient, approximateGradient);
             else
-                result = regF3d<float>(currentSource, targetImage, as<int>(_nLevels), as<int>(_maxIterations), interpolation, sourceMask, targetMask, initControl, initAffine, as<int>(_nBins), as<float_vector>(_spacing), as<float>(_bendingEnergyWeight), as<float>(_linearEnergyWeight), as<float>(_jacobianWeight), symmetric, as<bool>(_verbose), estimateOnly);
+                result = regF3d<float>(currentSource, targetImage, as<int>(_nLevels), as<int>(_maxIterations), interpolation, sourceMask, targetMask, initControl, initAffine, as<int>(_nBins), as<float_vector>(_spacing), as<float>(_bendingEnergyWeight), as<float>(_linearEnergyWeight), as<float>(_jacobianWeight), symmetric, as<bool>(_verbose), estimateOnly, halfPrecisionGradient, approximateGradient);
             
             finalImage.block(i) = result.image;
             
@@ -339,6 +368,7 @@ BEGIN_RCPP
                 reverseTransforms[i] = result.reverseTransform.toArrayOrPointer(internalInput, "F3D control points");
             iterations[i] = result.iterations;
             sourceImages[i] = result.source.toArrayOrPointer(internalInput, "Source image");
+            peakMemory = std::max(peakMemory, result.peakMemory);
         }
         
         returnValue["image"] = finalImage.toArrayOrPointer(internalOutput, "Result image");
@@ -350,6 +380,7 @@ BEGIN_RCPP
         returnValue["iterations"] = iterations;
         returnValue["source"] = sourceImages;
         returnValue["target"] = result.target.toArrayOrPointer(internalInput, "Target image");
+        returnValue["peakMemory"] = peakMemory;
         
         return returnValue;
     }
@@ -368,11 +399,45 @@ BEGIN_RCPP
     returnValue["iterations"] = List::create(result.iterations);
     returnValue["source"] = List::create(result.source.toArrayOrPointer(internalInput, "Source image"));
     returnValue["target"] = result.target.toArrayOrPointer(internalInput, "Target image");
+    returnValue["peakMemory"] = result.peakMemory;
+    if (!checkpointFile.empty())
+        returnValue["checkpointTimes"] = result.checkpointTimes;
     
     return returnValue;
 END_RCPP
 }
 
+// Check whether a transform object is a cubic B-spline control point grid
+static bool isControlPointGrid (const RObject &transform)
+{
+    if (transform.inherits("affine") || transform.inherits("transformChain"))
+        return false;
+    const NiftiImage transformationImage(SEXP(transform), false);
+    return (reg_round(transformationImage->intent_p1) == CUB_SPLINE_GRID);
+}
+
+// Build a lazily evaluated chain from a list of transforms. Images are mapped
+// through the first transform and then each subsequent one, so target points
+// pass through the transforms in reverse order. A single transform gives a
+// chain of length one
+static TransformChain<double> createTransformChain (const RObject &object)
+{
+    TransformChain<double> chain;
+    const List transforms = (object.inherits("transformChain") ? List(SEXP(object)) : List::create(object));
+    for (R_xlen_t i=transforms.length()-1; i>=0; i--)
+    {
+        RObject transform(transforms[i]);
+        if (transform.inherits("affine"))
+            chain.append(AffineMatrix(SEXP(transform)));
+        else
+        {
+            NiftiImage targetImage(SEXP(transform.attr("target")), false);
+            chain.append(targetImage, NiftiImage(SEXP(transform)));
+        }
+    }
+    return chain;
+}
+
 RcppExport SEXP getDeformationField (SEXP _transform, SEXP _jacobian)
 {
 BEGIN_RCPP
@@ -386,6 +451,8 @@ BEGIN_RCPP
         AffineMatrix affine = AffineMatrix(SEXP(transform));
         field = DeformationField<double>(targetImage, affine);
     }
+    else if (transform.inherits("transformChain"))
+        field = DeformationField<double>(targetImage, createTransformChain(transform));
     else
     {
         NiftiImage transformationImage(_transform);
@@ -396,23 +463,63 @@ BEGIN_RCPP
     result.attr("source") = transform.attr("source");
     result.attr("target") = transform.attr("target");
     
-    if (as<bool>(_jacobian))
+    // Jacobian maps for control point grids are calculated analytically
+    if (as<bool>(_jacobian) && isControlPointGrid(transform))
+        result.attr("jacobian") = getControlPointGridJacobian(targetImage, NiftiImage(_transform)).toPointer("Jacobian of deformation field");
+    else if (as<bool>(_jacobian))
         result.attr("jacobian") = field.getJacobian().toPointer("Jacobian of deformation field");
     
     return result;
 END_RCPP
 }
 
+RcppExport SEXP getJacobianMap (SEXP _transform)
+{
+BEGIN_RCPP
+    RObject transform(_transform);
+    NiftiImage targetImage(SEXP(transform.attr("target")));
+    
+    // The deformation field is only needed if there is no analytic alternative
+    if (isControlPointGrid(transform))
+        return getControlPointGridJacobian(targetImage, NiftiImage(_transform)).toPointer("Jacobian of deformation field");
+    
+    DeformationField<double> field;
+    if (transform.inherits("affine"))
+        field = DeformationField<double>(targetImage, AffineMatrix(SEXP(transform)));
+    else if (transform.inherits("transformChain"))
+        field = DeformationField<double>(targetImage, createTransformChain(transform));
+    else
+    {
+        NiftiImage transformationImage(_transform);
+        field = DeformationField<double>(targetImage, transformationImage);
+    }
+    return field.getJacobian().toPointer("Jacobian of deformation field");
+END_RCPP
+}
+
+RcppExport SEXP deformPoints (SEXP _transform, SEXP _points)
+{
+BEGIN_RCPP
+    const TransformChain<double> chain = createTransformChain(RObject(_transform));
+    return wrap(chain.mapPoints(as<Eigen::MatrixXd>(_points)));
+END_RCPP
+}
+
 RcppExport SEXP transformPoints (SEXP _transform, SEXP _points, SEXP _nearest)
 {
 BEGIN_RCPP
-    NiftiImage transformationImage(_transform);
     RObject transform(_transform);
-    NiftiImage sourceImage(SEXP(transform.attr("source")), false);
     NiftiImage targetImage(SEXP(transform.attr("target")), false);
-    DeformationField<double> deformationField(targetImage, transformationImage);
+    DeformationField<double> deformationField;
+    if (transform.inherits("transformChain"))
+        deformationField = DeformationField<double>(targetImage, createTransformChain(transform));
+    else
+    {
+        NiftiImage transformationImage(_transform);
+        deformationField = DeformationField<double>(targetImage, transformationImage);
+    }
     NumericMatrix points(_points);
-    List result(points.nrow());
+    NumericMatrix result(points.nrow(), points.ncol());
     const bool nearest = as<bool>(_nearest);
     
     if (points.ncol() == 2)
@@ -425,14 +532,13 @@ BEGIN_RCPP
             point[0] = points(i, 0);
             point[1] = points(i, 1);
             
-            // This result will have two elements if it is exact; otherwise it is much larger
-            const NumericVector resultVector = deformationField.findPoint(sourceImage, point, nearest, start);
-            const bool isExact = (resultVector.length() == 2);
-            result[i] = resultVector;
+            const NumericVector resultVector = deformationField.findPoint(point, nearest, start);
+            result(i, 0) = resultVector[0];
+            result(i, 1) = resultVector[1];
             
-            // Begin subsequent searches near the previous solution
-            start[0] = resultVector[isExact ? 0 : 2];
-            start[1] = resultVector[isExact ? 1 : 3];
+            // Begin subsequent searches near the previous solution (results are 1-based)
+            start[0] = resultVector[0] - 1.0;
+            start[1] = resultVector[1] - 1.0;
         }
     }
     else if (points.ncol() == 3)
@@ -446,15 +552,15 @@ BEGIN_RCPP
             point[1] = points(i, 1);
             point[2] = points(i, 2);
             
-            // This result will have three elements if it is exact; otherwise it is much larger
-            const NumericVector resultVector = deformationField.findPoint(sourceImage, point, nearest, start);
-            const bool isExact = (resultVector.length() == 3);
-            result[i] = resultVector;
+            const NumericVector resultVector = deformationField.findPoint(point, nearest, start);
+            result(i, 0) = resultVector[0];
+            result(i, 1) = resultVector[1];
+            result(i, 2) = resultVector[2];
             
-            // Begin subsequent searches near the previous solution
-            start[0] = resultVector[isExact ? 0 : 3];
-            start[1] = resultVector[isExact ? 1 : 4];
-            start[2] = resultVector[isExact ? 2 : 5];
+            // Begin subsequent searches near the previous solution (results are 1-based)
+            start[0] = resultVector[0] - 1.0;
+            start[1] = resultVector[1] - 1.0;
+            start[2] = resultVector[2] - 1.0;
         }
     }
     else
@@ -464,6 +570,73 @@ BEGIN_RCPP
 END_RCPP
 }
 
+RcppExport SEXP createResamplingPlan (SEXP _transform, SEXP _interpolation)
+{
+BEGIN_RCPP
+    RObject transform(_transform);
+    const NiftiImage sourceImage = normaliseImage(NiftiImage(SEXP(transform.attr("source")), false));
+    const NiftiImage targetImage = normaliseImage(NiftiImage(SEXP(transform.attr("target")), false));
+    const int interpolation = as<int>(_interpolation);
+    ResamplingPlan *plan;
+    
+    if (transform.inherits("affine"))
+        plan = new ResamplingPlan(sourceImage, targetImage, AffineMatrix(SEXP(transform)), interpolation);
+    else if (transform.inherits("transformChain"))
+        plan = new ResamplingPlan(sourceImage, targetImage, createTransformChain(transform), interpolation);
+    else
+    {
+        NiftiImage transformationImage(_transform);
+        plan = new ResamplingPlan(sourceImage, targetImage, transformationImage, interpolation);
+    }
+    
+    RObject result = XPtr<ResamplingPlan>(plan);
+    result.attr("source") = transform.attr("source");
+    result.attr("target") = transform.attr("target");
+    result.attr("interpolation") = interpolation;
+    result.attr("class") = "resamplingPlan";
+    
+    return result;
+END_RCPP
+}
+
+RcppExport SEXP applyResamplingPlan (SEXP _plan, SEXP _image, SEXP _internal)
+{
+BEGIN_RCPP
+    XPtr<ResamplingPlan> plan(_plan);
+    const NiftiImage image = normaliseImage(NiftiImage(_image));
+    NiftiImage result = plan->resampleImage(image);
+    return result.toArrayOrPointer(as<bool>(_internal), "Result image");
+END_RCPP
+}
+
+RcppExport SEXP applyTransformChain (SEXP _chain, SEXP _image, SEXP _interpolation, SEXP _internal)
+{
+BEGIN_RCPP
+    RObject chain(_chain);
+    const NiftiImage targetImage = normaliseImage(NiftiImage(SEXP(chain.attr("target")), false));
+    const NiftiImage sourceImage = normaliseImage(NiftiImage(_image));
+    
+    // The chain is evaluated one tile of the target at a time, so no
+    // intermediate deformation field is ever held in full
+    const TransformChain<double> transformChain = createTransformChain(chain);
+    NiftiImage result = resampleSourceImage<double>(targetImage, transformChain, sourceImage, as<int>(_interpolation));
+    return result.toArrayOrPointer(as<bool>(_internal), "Result image");
+END_RCPP
+}
+
+RcppExport SEXP applyTransformToFile (SEXP _transform, SEXP _sourceFile, SEXP _resultFile, SEXP _interpolation)
+{
+BEGIN_RCPP
+    RObject transform(_transform);
+    const NiftiImage targetImage = normaliseImage(NiftiImage(SEXP(transform.attr("target")), false));
+    
+    // Only the source header is read here; its data are read one region at a time
+    const NiftiImage sourceHeader = normaliseImage(NiftiImage(as<std::string>(_sourceFile), false));
+    resampleImageFile<double>(targetImage, createTransformChain(transform), sourceHeader, as<std::string>(_resultFile), as<int>(_interpolation));
+    return R_NilValue;
+END_RCPP
+}
+
 RcppExport SEXP halfTransform (SEXP _transform)
 {
 BEGIN_RCPP
@@ -550,7 +723,7 @@ BEGIN_RCPP
 END_RCPP
 }
 
-RcppExport SEXP composeTransforms (SEXP _transform1, SEXP _transform2)
+RcppExport SEXP composeTransforms (SEXP _transform1, SEXP _transform2, SEXP _tolerance)
 {
 BEGIN_RCPP
     RObject transform1(_transform1);
@@ -568,36 +741,52 @@ BEGIN_RCPP
     }
     else
     {
-        DeformationField<double> field1, field2;
-        
         NiftiImage targetImage1(SEXP(transform1.attr("target")));
         NiftiImage targetImage2(SEXP(transform2.attr("target")));
         
-        if (transform1.inherits("affine"))
-        {
-            AffineMatrix transformMatrix(_transform1);
-            field1 = DeformationField<double>(targetImage1, transformMatrix, true);
-        }
-        else
-        {
-            NiftiImage transformImage(_transform1);
-            field1 = DeformationField<double>(targetImage1, transformImage, true);
-        }
+        // Control point grids are composed in control point space where
+        // possible, since the result is far more compact than a deformation field
+        NiftiImage composedGrid;
+        const double tolerance = as<double>(_tolerance);
+        if (transform1.inherits("affine") && isControlPointGrid(transform2))
+            composedGrid = composeControlPointGrids(AffineMatrix(_transform1), NiftiImage(_transform2));
+        else if (isControlPointGrid(transform1) && transform2.inherits("affine"))
+            composedGrid = composeControlPointGrids(NiftiImage(_transform1), AffineMatrix(_transform2));
+        else if (tolerance > 0.0 && isControlPointGrid(transform1) && isControlPointGrid(transform2))
+            composedGrid = composeControlPointGrids(NiftiImage(_transform1), NiftiImage(_transform2), targetImage2, tolerance);
         
-        if (transform2.inherits("affine"))
-        {
-            AffineMatrix transformMatrix(_transform2);
-            field2 = DeformationField<double>(targetImage2, transformMatrix, true);
-        }
+        if (!composedGrid.isNull())
+            result = composedGrid.toPointer("F3D transformation");
         else
         {
-            NiftiImage transformImage(_transform2);
-            field2 = DeformationField<double>(targetImage2, transformImage, true);
+            DeformationField<double> field1, field2;
+            
+            if (transform1.inherits("affine"))
+            {
+                AffineMatrix transformMatrix(_transform1);
+                field1 = DeformationField<double>(targetImage1, transformMatrix, true);
+            }
+            else
+            {
+                NiftiImage transformImage(_transform1);
+                field1 = DeformationField<double>(targetImage1, transformImage, true);
+            }
+            
+            if (transform2.inherits("affine"))
+            {
+                AffineMatrix transformMatrix(_transform2);
+                field2 = DeformationField<double>(targetImage2, transformMatrix, true);
+            }
+            else
+            {
+                NiftiImage transformImage(_transform2);
+                field2 = DeformationField<double>(targetImage2, transformImage, true);
+            }
+            
+            // Order of composition is possibly not as expected
+            field2.compose(field1);
+            result = field2.getFieldImage().toPointer("Deformation field");
         }
-        
-        // Order of composition is possibly not as expected
-        field2.compose(field1);
-        result = field2.getFieldImage().toPointer("Deformation field");
     }
     
     result.attr("source") = transform1.attr("source");
@@ -607,6 +796,67 @@ BEGIN_RCPP
 END_RCPP
 }
 
+RcppExport SEXP saveTransformStore (SEXP _transforms, SEXP _fileName, SEXP _quantise)
+{
+BEGIN_RCPP
+    const List transforms(_transforms);
+    std::vector<TransformStore::Entry> entries(transforms.length());
+    for (R_xlen_t i=0; i<transforms.length(); i++)
+    {
+        RObject transform(transforms[i]);
+        TransformStore::Entry &entry = entries[i];
+        entry.sourceImage = NiftiImage(SEXP(transform.attr("source")), false);
+        entry.targetImage = NiftiImage(SEXP(transform.attr("target")), false);
+        entry.isAffine = transform.inherits("affine");
+        if (entry.isAffine)
+            entry.matrix = as<Eigen::MatrixXd>(SEXP(transform));
+        else
+            entry.transformationImage = NiftiImage(SEXP(transform));
+    }
+    
+    TransformStore::write(as<std::string>(_fileName), entries, (as<bool>(_quantise) ? TransformStore::QuantisedStorage : TransformStore::SingleStorage));
+    return R_NilValue;
+END_RCPP
+}
+
+RcppExport SEXP loadTransformStore (SEXP _fileName, SEXP _indices)
+{
+BEGIN_RCPP
+    const TransformStore store(as<std::string>(_fileName));
+    
+    // Indices are 1-based; by default every transform is read
+    std::vector<int> indices;
+    if (Rf_isNull(_indices))
+    {
+        for (size_t i=0; i<store.count(); i++)
+            indices.push_back(int(i) + 1);
+    }
+    else
+        indices = as< std::vector<int> >(_indices);
+    
+    // Transforms all share a single target image object
+    const RObject target = store.getTargetImage().toPointer("Target image");
+    List result(indices.size());
+    for (size_t i=0; i<indices.size(); i++)
+    {
+        if (indices[i] < 1)
+            throw std::runtime_error("Transform indices should be positive");
+        
+        const TransformStore::Entry entry = store.read(size_t(indices[i] - 1));
+        RObject transform;
+        if (entry.isAffine)
+            transform = AffineMatrix(Eigen::MatrixXd(entry.matrix));
+        else
+            transform = entry.transformationImage.toPointer("F3D transformation");
+        transform.attr("source") = entry.sourceImage.toPointer("Source image");
+        transform.attr("target") = target;
+        result[i] = transform;
+    }
+    
+    return result;
+END_RCPP
+}
+
 RcppExport SEXP RNifti_version ()
 {
 BEGIN_RCPP
@@ -620,13 +870,21 @@ END_RCPP
 }
 
 static R_CallMethodDef callMethods[] = {
-    { "calculateMeasure",       (DL_FUNC) &calculateMeasure,    5 },
-    { "regLinear",              (DL_FUNC) &regLinear,           17 },
-    { "regNonlinear",           (DL_FUNC) &regNonlinear,        20 },
+    { "calculateMeasure",       (DL_FUNC) &calculateMeasure,    7 },
+    { "regLinear",              (DL_FUNC) &regLinear,           19 },
+    { "regNonlinear",           (DL_FUNC) &regNonlinear,        26 },
     { "getDeformationField",    (DL_FUNC) &getDeformationField, 2 },
+    { "getJacobianMap",         (DL_FUNC) &getJacobianMap,      1 },
+    { "deformPoints",           (DL_FUNC) &deformPoints,        2 },
     { "transformPoints",        (DL_FUNC) &transformPoints,     3 },
+    { "createResamplingPlan",   (DL_FUNC) &createResamplingPlan, 2 },
+    { "applyResamplingPlan",    (DL_FUNC) &applyResamplingPlan, 3 },
+    { "applyTransformChain",    (DL_FUNC) &applyTransformChain, 4 },
+    { "applyTransformToFile",   (DL_FUNC) &applyTransformToFile, 4 },
     { "halfTransform",          (DL_FUNC) &halfTransform,       1 },
-    { "composeTransforms",      (DL_FUNC) &composeTransforms,   2 },
+    { "composeTransforms",      (DL_FUNC) &composeTransforms,   3 },
+    { "saveTransformStore",     (DL_FUNC) &saveTransformStore,  3 },
+    { "loadTransformStore",     (DL_FUNC) &loadTransformStore,  2 },
     { "RNifti_version",         (DL_FUNC) &RNifti_version,      0 },
     { NULL, NULL, 0 }
 };
@@ -257,70 +257,12 @@ void reg_aladin<T>::InitialiseRegistration()
   this->Print();
 
   // CREATE THE PYRAMID IMAGES
-  this->ReferencePyramid = (nifti_image **) malloc(this->LevelsToPerform * sizeof(nifti_image *));
-  this->FloatingPyramid = (nifti_image **) malloc(this->LevelsToPerform * sizeof(nifti_image *));
-  this->ReferenceMaskPyramid = (int **) malloc(this->LevelsToPerform * sizeof(int *));
-  this->activeVoxelNumber = (int *) malloc(this->LevelsToPerform * sizeof(int));
-
-  // FINEST LEVEL OF REGISTRATION
-  reg_createImagePyramid<T>(this->InputReference,
-                            this->ReferencePyramid,
-                            this->NumberOfLevels,
-                            this->LevelsToPerform);
-  reg_createImagePyramid<T>(this->InputFloating,
-                            this->FloatingPyramid,
-                            this->NumberOfLevels,
-                            this->LevelsToPerform);
-
-  if (this->InputReferenceMask != NULL)
-    reg_createMaskPyramid<T>(this->InputReferenceMask,
-                             this->ReferenceMaskPyramid,
-                             this->NumberOfLevels,
-                             this->LevelsToPerform,
-                             this->activeVoxelNumber);
-  else {
-    for (unsigned int l = 0; l < this->LevelsToPerform; ++l) {
-      this->activeVoxelNumber[l] = this->ReferencePyramid[l]->nx * this->ReferencePyramid[l]->ny * this->ReferencePyramid[l]->nz;
-      this->ReferenceMaskPyramid[l] = (int *) calloc(activeVoxelNumber[l], sizeof(int));
-    }
-  }
-
-  Kernel *convolutionKernel = this->platform->createKernel(ConvolutionKernel::getName(), NULL);
-  // SMOOTH THE INPUT IMAGES IF REQUIRED
-  for (unsigned int l = 0; l < this->LevelsToPerform; l++) {
-    if (this->ReferenceSigma != 0.0) {
-      // Only the first image is smoothed
-      bool *active = new bool[this->ReferencePyramid[l]->nt];
-      float *sigma = new float[this->ReferencePyramid[l]->nt];
-      active[0] = true;
-      for (int i = 1; i < this->ReferencePyramid[l]->nt; ++i)
-        active[i] = false;
-      sigma[0] = this->ReferenceSigma;
-      convolutionKernel->castTo<ConvolutionKernel>()->calculate(this->ReferencePyramid[l], sigma, 0, NULL, active);
-      delete[] active;
-      delete[] sigma;
-    }
-    if (this->FloatingSigma != 0.0) {
-      // Only the first image is smoothed
-      bool *active = new bool[this->FloatingPyramid[l]->nt];
-      float *sigma = new float[this->FloatingPyramid[l]->nt];
-      active[0] = true;
-      for (int i = 1; i < this->FloatingPyramid[l]->nt; ++i)
-        active[i] = false;
-      sigma[0] = this->FloatingSigma;
-      convolutionKernel->castTo<ConvolutionKernel>()->calculate(this->FloatingPyramid[l], sigma, 0, NULL, active);
-      delete[] active;
-      delete[] sigma;
-    }
-  }
-  delete convolutionKernel;
-
-  // THRESHOLD THE INPUT IMAGES IF REQUIRED
-  for(unsigned int l=0; l<this->LevelsToPerform; l++)
-  {
-    reg_thresholdImage<T>(this->ReferencePyramid[l],this->ReferenceLowerThreshold, this->ReferenceUpperThreshold);
-    reg_thresholdImage<T>(this->FloatingPyramid[l],this->FloatingLowerThreshold, this->FloatingUpperThreshold);
-  }
+  // Only the arrays are allocated here. Each level is created at the start of
+  // its registration and released once it has been performed
+  this->ReferencePyramid = (nifti_image **) calloc(this->LevelsToPerform, sizeof(nifti_image *));
+  this->FloatingPyramid = (nifti_image **) calloc(this->LevelsToPerform, sizeof(nifti_image *));
+  this->ReferenceMaskPyramid = (int **) calloc(this->LevelsToPerform, sizeof(int *));
+  this->activeVoxelNumber = (int *) calloc(this->LevelsToPerform, sizeof(int));
 
   // Initialise the transformation - for R this is guaranteed to have been done
 #ifndef HAVE_R
@@ -375,6 +317,70 @@ void reg_aladin<T>::InitialiseRegistration()
 }
 /* *************************************************************** */
 template<class T>
+void reg_aladin<T>::AllocatePyramidLevel(unsigned int l)
+{
+  if (this->ReferencePyramid[l] != NULL)
+    return;
+
+  reg_createImagePyramidLevel<T>(this->InputReference,
+                                 this->ReferencePyramid,
+                                 this->NumberOfLevels,
+                                 this->LevelsToPerform,
+                                 l);
+  reg_createImagePyramidLevel<T>(this->InputFloating,
+                                 this->FloatingPyramid,
+                                 this->NumberOfLevels,
+                                 this->LevelsToPerform,
+                                 l);
+
+  if (this->InputReferenceMask != NULL)
+    reg_createMaskPyramidLevel<T>(this->InputReferenceMask,
+                                  this->ReferenceMaskPyramid,
+                                  this->NumberOfLevels,
+                                  this->LevelsToPerform,
+                                  l,
+                                  this->activeVoxelNumber);
+  else {
+    this->activeVoxelNumber[l] = this->ReferencePyramid[l]->nx * this->ReferencePyramid[l]->ny * this->ReferencePyramid[l]->nz;
+    this->ReferenceMaskPyramid[l] = (int *) calloc(activeVoxelNumber[l], sizeof(int));
+  }
+
+  // SMOOTH THE INPUT IMAGES IF REQUIRED
+  if (this->ReferenceSigma != 0.0 || this->FloatingSigma != 0.0) {
+    Kernel *convolutionKernel = this->platform->createKernel(ConvolutionKernel::getName(), NULL);
+    if (this->ReferenceSigma != 0.0) {
+      // Only the first image is smoothed
+      bool *active = new bool[this->ReferencePyramid[l]->nt];
+      float *sigma = new float[this->ReferencePyramid[l]->nt];
+      active[0] = true;
+      for (int i = 1; i < this->ReferencePyramid[l]->nt; ++i)
+        active[i] = false;
+      sigma[0] = this->ReferenceSigma;
+      convolutionKernel->castTo<ConvolutionKernel>()->calculate(this->ReferencePyramid[l], sigma, 0, NULL, active);
+      delete[] active;
+      delete[] sigma;
+    }
+    if (this->FloatingSigma != 0.0) {
+      // Only the first image is smoothed
+      bool *active = new bool[this->FloatingPyramid[l]->nt];
+      float *sigma = new float[this->FloatingPyramid[l]->nt];
+      active[0] = true;
+      for (int i = 1; i < this->FloatingPyramid[l]->nt; ++i)
+        active[i] = false;
+      sigma[0] = this->FloatingSigma;
+      convolutionKernel->castTo<ConvolutionKernel>()->calculate(this->FloatingPyramid[l], sigma, 0, NULL, active);
+      delete[] active;
+      delete[] sigma;
+    }
+    delete convolutionKernel;
+  }
+
+  // THRESHOLD THE INPUT IMAGES IF REQUIRED
+  reg_thresholdImage<T>(this->ReferencePyramid[l],this->ReferenceLowerThreshold, this->ReferenceUpperThreshold);
+  reg_thresholdImage<T>(this->FloatingPyramid[l],this->FloatingLowerThreshold, this->FloatingUpperThreshold);
+}
+/* *************************************************************** */
+template<class T>
 void reg_aladin<T>::ClearCurrentInputImage()
 {
   nifti_image_free(this->ReferencePyramid[this->CurrentLevel]);
@@ -523,6 +529,9 @@ void reg_aladin<T>::Run()
   //Main loop over the levels:
   for (this->CurrentLevel = 0; this->CurrentLevel < this->LevelsToPerform; this->CurrentLevel++)
   {
+    // Create the current level of the pyramid
+    this->AllocatePyramidLevel(this->CurrentLevel);
+
     this->initAladinContent(this->ReferencePyramid[CurrentLevel], this->FloatingPyramid[CurrentLevel],
                             this->ReferenceMaskPyramid[CurrentLevel], this->TransformationMatrix, sizeof(T), this->BlockPercentage,
                             this->InlierLts, this->BlockStepSize);
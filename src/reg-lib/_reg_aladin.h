@@ -114,6 +114,7 @@ class reg_aladin
 
         virtual void InitialiseRegistration();
         virtual void ClearCurrentInputImage();
+        virtual void AllocatePyramidLevel(unsigned int);
 
         virtual void GetDeformationField();
         virtual void GetWarpedImage(int);
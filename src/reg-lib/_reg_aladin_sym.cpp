@@ -77,72 +77,8 @@ void reg_aladin_sym<T>::InitialiseRegistration()
 #endif
 
    reg_aladin<T>::InitialiseRegistration();
-   this->FloatingMaskPyramid = (int **) malloc(this->LevelsToPerform*sizeof(int *));
-   this->BackwardActiveVoxelNumber= (int *)malloc(this->LevelsToPerform*sizeof(int));
-   if (this->InputFloatingMask!=NULL)
-   {
-      reg_createMaskPyramid<T>(this->InputFloatingMask,
-                               this->FloatingMaskPyramid,
-                               this->NumberOfLevels,
-                               this->LevelsToPerform,
-                               this->BackwardActiveVoxelNumber);
-   }
-   else
-   {
-      for(unsigned int l=0; l<this->LevelsToPerform; ++l)
-      {
-         this->BackwardActiveVoxelNumber[l]=this->FloatingPyramid[l]->nx*this->FloatingPyramid[l]->ny*this->FloatingPyramid[l]->nz;
-         this->FloatingMaskPyramid[l]=(int *)calloc(this->BackwardActiveVoxelNumber[l],sizeof(int));
-      }
-   }
-
-   // CHECK THE THRESHOLD VALUES TO UPDATE THE MASK
-   if(this->FloatingUpperThreshold!=std::numeric_limits<T>::max())
-   {
-      for(unsigned int l=0; l<this->LevelsToPerform; ++l)
-      {
-         T *refPtr = static_cast<T *>(this->FloatingPyramid[l]->data);
-         int *mskPtr = this->FloatingMaskPyramid[l];
-         size_t removedVoxel=0;
-         for(size_t i=0;
-               i<(size_t)this->FloatingPyramid[l]->nx*this->FloatingPyramid[l]->ny*this->FloatingPyramid[l]->nz;
-               ++i)
-         {
-            if(mskPtr[i]>-1)
-            {
-               if(refPtr[i]>this->FloatingUpperThreshold)
-               {
-                  ++removedVoxel;
-                  mskPtr[i]=-1;
-               }
-            }
-         }
-         this->BackwardActiveVoxelNumber[l] -= removedVoxel;
-      }
-   }
-   if(this->FloatingLowerThreshold!=-std::numeric_limits<T>::max())
-   {
-      for(unsigned int l=0; l<this->LevelsToPerform; ++l)
-      {
-         T *refPtr = static_cast<T *>(this->FloatingPyramid[l]->data);
-         int *mskPtr = this->FloatingMaskPyramid[l];
-         size_t removedVoxel=0;
-         for(size_t i=0;
-               i<(size_t)this->FloatingPyramid[l]->nx*this->FloatingPyramid[l]->ny*this->FloatingPyramid[l]->nz;
-               ++i)
-         {
-            if(mskPtr[i]>-1)
-            {
-               if(refPtr[i]<this->FloatingLowerThreshold)
-               {
-                  ++removedVoxel;
-                  mskPtr[i]=-1;
-               }
-            }
-         }
-         this->BackwardActiveVoxelNumber[l] -= removedVoxel;
-      }
-   }
+   this->FloatingMaskPyramid = (int **) calloc(this->LevelsToPerform,sizeof(int *));
+   this->BackwardActiveVoxelNumber= (int *)calloc(this->LevelsToPerform,sizeof(int));
 
    if(this->AlignCentreGravity && this->InputTransformName==NULL)
    {
@@ -315,6 +251,70 @@ void reg_aladin_sym<T>::initAladinContent(nifti_image *ref,
 }
 /* *************************************************************** */
 template <class T>
+void reg_aladin_sym<T>::AllocatePyramidLevel(unsigned int l)
+{
+   reg_aladin<T>::AllocatePyramidLevel(l);
+
+   if(this->FloatingMaskPyramid[l]!=NULL)
+      return;
+
+   if (this->InputFloatingMask!=NULL)
+   {
+      reg_createMaskPyramidLevel<T>(this->InputFloatingMask,
+                                    this->FloatingMaskPyramid,
+                                    this->NumberOfLevels,
+                                    this->LevelsToPerform,
+                                    l,
+                                    this->BackwardActiveVoxelNumber);
+   }
+   else
+   {
+      this->BackwardActiveVoxelNumber[l]=this->FloatingPyramid[l]->nx*this->FloatingPyramid[l]->ny*this->FloatingPyramid[l]->nz;
+      this->FloatingMaskPyramid[l]=(int *)calloc(this->BackwardActiveVoxelNumber[l],sizeof(int));
+   }
+
+   // CHECK THE THRESHOLD VALUES TO UPDATE THE MASK
+   const size_t voxelNumber = (size_t)this->FloatingPyramid[l]->nx *
+         this->FloatingPyramid[l]->ny * this->FloatingPyramid[l]->nz;
+   if(this->FloatingUpperThreshold!=std::numeric_limits<T>::max())
+   {
+      T *refPtr = static_cast<T *>(this->FloatingPyramid[l]->data);
+      int *mskPtr = this->FloatingMaskPyramid[l];
+      size_t removedVoxel=0;
+      for(size_t i=0; i<voxelNumber; ++i)
+      {
+         if(mskPtr[i]>-1)
+         {
+            if(refPtr[i]>this->FloatingUpperThreshold)
+            {
+               ++removedVoxel;
+               mskPtr[i]=-1;
+            }
+         }
+      }
+      this->BackwardActiveVoxelNumber[l] -= removedVoxel;
+   }
+   if(this->FloatingLowerThreshold!=-std::numeric_limits<T>::max())
+   {
+      T *refPtr = static_cast<T *>(this->FloatingPyramid[l]->data);
+      int *mskPtr = this->FloatingMaskPyramid[l];
+      size_t removedVoxel=0;
+      for(size_t i=0; i<voxelNumber; ++i)
+      {
+         if(mskPtr[i]>-1)
+         {
+            if(refPtr[i]<this->FloatingLowerThreshold)
+            {
+               ++removedVoxel;
+               mskPtr[i]=-1;
+            }
+         }
+      }
+      this->BackwardActiveVoxelNumber[l] -= removedVoxel;
+   }
+}
+/* *************************************************************** */
+template <class T>
 void reg_aladin_sym<T>::ClearCurrentInputImage()
 {
    reg_aladin<T>::ClearCurrentInputImage();
@@ -49,6 +49,7 @@ protected:
   mat44 *BackwardTransformationMatrix;
 
   virtual void ClearCurrentInputImage();
+  virtual void AllocatePyramidLevel(unsigned int);
   virtual void GetBackwardDeformationField();
   virtual void UpdateTransformationMatrix(int);
 
@@ -32,6 +32,7 @@ reg_base<T>::reg_base(int refTimePoint,int floTimePoint)
    this->perturbationNumber=0;
    this->useConjGradient=true;
    this->useApproxGradient=false;
+   this->halfPrecisionGradient=false;
 
 #ifndef HAVE_R
    this->measure_ssd=NULL;
@@ -89,13 +90,21 @@ reg_base<T>::reg_base(int refTimePoint,int floTimePoint)
    this->currentReference=NULL;
    this->currentFloating=NULL;
    this->currentMask=NULL;
+   this->currentActiveVoxels=NULL;
    this->warped=NULL;
    this->deformationFieldImage=NULL;
    this->warImgGradient=NULL;
    this->voxelBasedMeasureGradient=NULL;
+   this->peakMemoryUsage=0;
 
    this->interpolation=1;
 
+   this->funcCheckpointCallback=NULL;
+   this->paramsCheckpointCallback=NULL;
+   this->checkpointInterval=0.;
+   this->lastCheckpointTime=0;
+   this->resumeState=NULL;
+
 #ifdef BUILD_DEV
    this->discrete_init=false;
 #endif
@@ -215,6 +224,11 @@ reg_base<T>::~reg_base()
       delete []this->activeVoxelNumber;
       this->activeVoxelNumber=NULL;
    }
+   if(this->currentActiveVoxels!=NULL)
+   {
+      delete this->currentActiveVoxels;
+      this->currentActiveVoxels=NULL;
+   }
    if(this->optimiser!=NULL)
    {
       delete this->optimiser;
@@ -459,6 +473,24 @@ void reg_base<T>::DoNotUseApproximatedGradient()
 }
 /* *************************************************************** */
 template<class T>
+void reg_base<T>::UseHalfPrecisionGradient()
+{
+   this->halfPrecisionGradient = true;
+#ifndef NDEBUG
+   reg_print_fct_debug("reg_base<T>::UseHalfPrecisionGradient");
+#endif
+}
+/* *************************************************************** */
+template<class T>
+void reg_base<T>::DoNotUseHalfPrecisionGradient()
+{
+   this->halfPrecisionGradient = false;
+#ifndef NDEBUG
+   reg_print_fct_debug("reg_base<T>::DoNotUseHalfPrecisionGradient");
+#endif
+}
+/* *************************************************************** */
+template<class T>
 void reg_base<T>::PrintOutInformation()
 {
    this->verbose = true;
@@ -534,12 +566,130 @@ void reg_base<T>::ClearCurrentInputImage()
 {
    this->currentReference=NULL;
    this->currentMask=NULL;
+   if(this->currentActiveVoxels!=NULL)
+      delete this->currentActiveVoxels;
+   this->currentActiveVoxels=NULL;
    this->currentFloating=NULL;
 #ifndef NDEBUG
    reg_print_fct_debug("reg_base<T>::ClearCurrentInputImage");
 #endif
 }
 /* *************************************************************** */
+template <class T>
+void reg_base<T>::AllocatePyramidLevel(unsigned int l)
+{
+   // The level is only created once, when it is first required
+   if(this->referencePyramid[l]!=NULL)
+      return;
+
+   // Without pyramidal approach, the single level is at full resolution
+   unsigned int levelNumber=this->usePyramid?this->levelNumber:1;
+   unsigned int levelToPerform=this->usePyramid?this->levelToPerform:1;
+
+   reg_createImagePyramidLevel<T>(this->inputReference, this->referencePyramid, levelNumber, levelToPerform, l);
+   reg_createImagePyramidLevel<T>(this->inputFloating, this->floatingPyramid, levelNumber, levelToPerform, l);
+   if (this->maskImage!=NULL)
+      reg_createMaskPyramidLevel<T>(this->maskImage, this->maskPyramid, levelNumber, levelToPerform, l, this->activeVoxelNumber);
+   else
+   {
+      this->activeVoxelNumber[l]=this->referencePyramid[l]->nx*this->referencePyramid[l]->ny*this->referencePyramid[l]->nz;
+      this->maskPyramid[l]=(int *)calloc(activeVoxelNumber[l],sizeof(int));
+   }
+
+   // SMOOTH THE INPUT IMAGES IF REQUIRED
+   if(this->referenceSmoothingSigma!=0.0)
+   {
+      bool *active = new bool[this->referencePyramid[l]->nt];
+      float *sigma = new float[this->referencePyramid[l]->nt];
+      active[0]=true;
+      for(int i=1; i<this->referencePyramid[l]->nt; ++i)
+         active[i]=false;
+      sigma[0]=this->referenceSmoothingSigma;
+      reg_tools_kernelConvolution(this->referencePyramid[l], sigma, GAUSSIAN_KERNEL, NULL, active);
+      delete []active;
+      delete []sigma;
+   }
+   if(this->floatingSmoothingSigma!=0.0)
+   {
+      // Only the first image is smoothed
+      bool *active = new bool[this->floatingPyramid[l]->nt];
+      float *sigma = new float[this->floatingPyramid[l]->nt];
+      active[0]=true;
+      for(int i=1; i<this->floatingPyramid[l]->nt; ++i)
+         active[i]=false;
+      sigma[0]=this->floatingSmoothingSigma;
+      reg_tools_kernelConvolution(this->floatingPyramid[l], sigma, GAUSSIAN_KERNEL, NULL, active);
+      delete []active;
+      delete []sigma;
+   }
+
+   // THRESHOLD THE INPUT IMAGES IF REQUIRED
+   reg_thresholdImage<T>(this->referencePyramid[l],this->referenceThresholdLow[0], this->referenceThresholdUp[0]);
+   reg_thresholdImage<T>(this->floatingPyramid[l],this->referenceThresholdLow[0], this->referenceThresholdUp[0]);
+
+   this->UpdatePeakMemoryUsage();
+#ifndef NDEBUG
+   char text[255];
+   snprintf(text, 255, "reg_base<T>::AllocatePyramidLevel - level %u", l);
+   reg_print_fct_debug(text);
+#endif
+}
+/* *************************************************************** */
+template <class T>
+void reg_base<T>::ClearPyramidLevel(unsigned int l)
+{
+   if(this->referencePyramid[l]!=NULL)
+      nifti_image_free(this->referencePyramid[l]);
+   this->referencePyramid[l]=NULL;
+   if(this->floatingPyramid[l]!=NULL)
+      nifti_image_free(this->floatingPyramid[l]);
+   this->floatingPyramid[l]=NULL;
+   if(this->maskPyramid[l]!=NULL)
+      free(this->maskPyramid[l]);
+   this->maskPyramid[l]=NULL;
+#ifndef NDEBUG
+   reg_print_fct_debug("reg_base<T>::ClearPyramidLevel");
+#endif
+}
+/* *************************************************************** */
+template <class T>
+size_t reg_base<T>::GetCurrentMemoryUsage()
+{
+   // The input images are held by the caller for the whole registration
+   size_t memory=reg_tools_getImageMemory(this->inputReference);
+   memory += reg_tools_getImageMemory(this->inputFloating);
+   memory += reg_tools_getImageMemory(this->maskImage);
+   unsigned int pyramidalLevelNumber=this->usePyramid?this->levelToPerform:1;
+   for(unsigned int l=0; l<pyramidalLevelNumber; ++l)
+   {
+      if(this->referencePyramid!=NULL && this->referencePyramid[l]!=NULL)
+      {
+         memory += reg_tools_getImageMemory(this->referencePyramid[l]);
+         if(this->maskPyramid[l]!=NULL)
+            memory += (size_t)this->referencePyramid[l]->nx *
+                  this->referencePyramid[l]->ny *
+                  this->referencePyramid[l]->nz * sizeof(int);
+      }
+      if(this->floatingPyramid!=NULL)
+         memory += reg_tools_getImageMemory(this->floatingPyramid[l]);
+   }
+   if(this->currentActiveVoxels!=NULL)
+      memory += this->currentActiveVoxels->number * sizeof(int);
+   memory += reg_tools_getImageMemory(this->warped);
+   memory += reg_tools_getImageMemory(this->deformationFieldImage);
+   memory += reg_tools_getImageMemory(this->warImgGradient);
+   memory += reg_tools_getImageMemory(this->voxelBasedMeasureGradient);
+   return memory;
+}
+/* *************************************************************** */
+template <class T>
+void reg_base<T>::UpdatePeakMemoryUsage()
+{
+   size_t memory=this->GetCurrentMemoryUsage();
+   if(memory>this->peakMemoryUsage)
+      this->peakMemoryUsage=memory;
+}
+/* *************************************************************** */
 /* *************************************************************** */
 template <class T>
 void reg_base<T>::AllocateWarped()
@@ -564,7 +714,7 @@ void reg_base<T>::AllocateWarped()
    this->warped->scl_inter=0.f;
    this->warped->datatype = this->currentFloating->datatype;
    this->warped->nbyper = this->currentFloating->nbyper;
-   this->warped->data = (void *)calloc(this->warped->nvox, this->warped->nbyper);
+   reg_tools_allocateImageData(this->warped);
 #ifndef NDEBUG
    reg_print_fct_debug("reg_base<T>::AllocateWarped");
 #endif
@@ -617,8 +767,7 @@ void reg_base<T>::AllocateDeformationField()
    if(sizeof(T)==sizeof(float))
       this->deformationFieldImage->datatype = NIFTI_TYPE_FLOAT32;
    else this->deformationFieldImage->datatype = NIFTI_TYPE_FLOAT64;
-   this->deformationFieldImage->data = (void *)calloc(this->deformationFieldImage->nvox,
-                                       this->deformationFieldImage->nbyper);
+   reg_tools_allocateImageData(this->deformationFieldImage);
    this->deformationFieldImage->intent_code=NIFTI_INTENT_VECTOR;
    memset(this->deformationFieldImage->intent_name, 0, 16);
    strcpy(this->deformationFieldImage->intent_name,"NREG_TRANS");
@@ -666,8 +815,12 @@ void reg_base<T>::AllocateWarpedGradient()
    }
    reg_base<T>::ClearWarpedGradient();
    this->warImgGradient = nifti_copy_nim_info(this->deformationFieldImage);
-   this->warImgGradient->data = (void *)calloc(this->warImgGradient->nvox,
-                                     this->warImgGradient->nbyper);
+   if(this->halfPrecisionGradient)
+   {
+      this->warImgGradient->datatype = REG_TYPE_FLOAT16;
+      this->warImgGradient->nbyper = sizeof(reg_half);
+   }
+   reg_tools_allocateImageData(this->warImgGradient);
 #ifndef NDEBUG
    reg_print_fct_debug("reg_base<T>::AllocateWarpedGradient");
 #endif
@@ -697,8 +850,7 @@ void reg_base<T>::AllocateVoxelBasedMeasureGradient()
    }
    reg_base<T>::ClearVoxelBasedMeasureGradient();
    this->voxelBasedMeasureGradient = nifti_copy_nim_info(this->deformationFieldImage);
-   this->voxelBasedMeasureGradient->data = (void *)calloc(this->voxelBasedMeasureGradient->nvox,
-         this->voxelBasedMeasureGradient->nbyper);
+   reg_tools_allocateImageData(this->voxelBasedMeasureGradient);
 #ifndef NDEBUG
    reg_print_fct_debug("reg_base<T>::AllocateVoxelBasedMeasureGradient");
 #endif
@@ -756,6 +908,19 @@ void reg_base<T>::CheckParameters()
    if(this->levelToPerform==0 || this->levelToPerform>this->levelNumber)
       this->levelToPerform=this->levelNumber;
 
+#ifndef HAVE_R
+   // CHECK THAT HALF-PRECISION GRADIENTS ARE ONLY USED WITH NMI
+   if(this->halfPrecisionGradient &&
+         (this->measure_ssd!=NULL || this->measure_kld!=NULL ||
+          this->measure_dti!=NULL || this->measure_lncc!=NULL ||
+          this->measure_mind!=NULL || this->measure_mindssc!=NULL))
+   {
+      reg_print_fct_error("reg_base::CheckParameters()");
+      reg_print_msg_error("Half-precision image gradients are only supported with NMI");
+      reg_exit();
+   }
+#endif
+
 #ifndef NDEBUG
    reg_print_fct_debug("reg_base<T>::CheckParameters");
 #endif
@@ -790,6 +955,8 @@ void reg_base<T>::InitialiseSimilarity()
                                            this->warImgGradient,
                                            this->voxelBasedMeasureGradient
                                           );
+   if(this->measure_nmi!=NULL)
+      this->measure_nmi->SetActiveVoxelLists(this->currentActiveVoxels);
 
 #ifndef HAVE_R
    if(this->measure_ssd!=NULL)
@@ -865,20 +1032,15 @@ void reg_base<T>::Initialise()
 //   this->platform->setGpuIdx(this->gpuIdx);
 
    // CREATE THE PYRAMIDE IMAGES
-   if(this->usePyramid)
-   {
-      this->referencePyramid = (nifti_image **)malloc(this->levelToPerform*sizeof(nifti_image *));
-      this->floatingPyramid = (nifti_image **)malloc(this->levelToPerform*sizeof(nifti_image *));
-      this->maskPyramid = (int **)malloc(this->levelToPerform*sizeof(int *));
-      this->activeVoxelNumber= (int *)malloc(this->levelToPerform*sizeof(int));
-   }
-   else
-   {
-      this->referencePyramid = (nifti_image **)malloc(sizeof(nifti_image *));
-      this->floatingPyramid = (nifti_image **)malloc(sizeof(nifti_image *));
-      this->maskPyramid = (int **)malloc(sizeof(int *));
-      this->activeVoxelNumber= (int *)malloc(sizeof(int));
-   }
+   // Only the arrays are allocated here. Each level is created when it is
+   // first required and released once it has been performed, so that the
+   // levels are never all resident at once
+   unsigned int pyramidalLevelNumber=1;
+   if(this->usePyramid) pyramidalLevelNumber=this->levelToPerform;
+   this->referencePyramid = (nifti_image **)calloc(pyramidalLevelNumber,sizeof(nifti_image *));
+   this->floatingPyramid = (nifti_image **)calloc(pyramidalLevelNumber,sizeof(nifti_image *));
+   this->maskPyramid = (int **)calloc(pyramidalLevelNumber,sizeof(int *));
+   this->activeVoxelNumber= (int *)calloc(pyramidalLevelNumber,sizeof(int));
 
    // Update the input images threshold if required
    if(this->robustRange==true){
@@ -915,74 +1077,9 @@ void reg_base<T>::Initialise()
       nifti_image_free(temp_floating);
    }
 
-   // FINEST LEVEL OF REGISTRATION
-   if(this->usePyramid)
-   {
-      reg_createImagePyramid<T>(this->inputReference, this->referencePyramid, this->levelNumber, this->levelToPerform);
-      reg_createImagePyramid<T>(this->inputFloating, this->floatingPyramid, this->levelNumber, this->levelToPerform);
-      if (this->maskImage!=NULL)
-         reg_createMaskPyramid<T>(this->maskImage, this->maskPyramid, this->levelNumber, this->levelToPerform, this->activeVoxelNumber);
-      else
-      {
-         for(unsigned int l=0; l<this->levelToPerform; ++l)
-         {
-            this->activeVoxelNumber[l]=this->referencePyramid[l]->nx*this->referencePyramid[l]->ny*this->referencePyramid[l]->nz;
-            this->maskPyramid[l]=(int *)calloc(activeVoxelNumber[l],sizeof(int));
-         }
-      }
-   }
-   else
-   {
-      reg_createImagePyramid<T>(this->inputReference, this->referencePyramid, 1, 1);
-      reg_createImagePyramid<T>(this->inputFloating, this->floatingPyramid, 1, 1);
-      if (this->maskImage!=NULL)
-         reg_createMaskPyramid<T>(this->maskImage, this->maskPyramid, 1, 1, this->activeVoxelNumber);
-      else
-      {
-         this->activeVoxelNumber[0]=this->referencePyramid[0]->nx*this->referencePyramid[0]->ny*this->referencePyramid[0]->nz;
-         this->maskPyramid[0]=(int *)calloc(activeVoxelNumber[0],sizeof(int));
-      }
-   }
-
-   unsigned int pyramidalLevelNumber=1;
-   if(this->usePyramid) pyramidalLevelNumber=this->levelToPerform;
-
-   // SMOOTH THE INPUT IMAGES IF REQUIRED
-   for(unsigned int l=0; l<this->levelToPerform; l++)
-   {
-      if(this->referenceSmoothingSigma!=0.0)
-      {
-         bool *active = new bool[this->referencePyramid[l]->nt];
-         float *sigma = new float[this->referencePyramid[l]->nt];
-         active[0]=true;
-         for(int i=1; i<this->referencePyramid[l]->nt; ++i)
-            active[i]=false;
-         sigma[0]=this->referenceSmoothingSigma;
-         reg_tools_kernelConvolution(this->referencePyramid[l], sigma, GAUSSIAN_KERNEL, NULL, active);
-         delete []active;
-         delete []sigma;
-      }
-      if(this->floatingSmoothingSigma!=0.0)
-      {
-         // Only the first image is smoothed
-         bool *active = new bool[this->floatingPyramid[l]->nt];
-         float *sigma = new float[this->floatingPyramid[l]->nt];
-         active[0]=true;
-         for(int i=1; i<this->floatingPyramid[l]->nt; ++i)
-            active[i]=false;
-         sigma[0]=this->floatingSmoothingSigma;
-         reg_tools_kernelConvolution(this->floatingPyramid[l], sigma, GAUSSIAN_KERNEL, NULL, active);
-         delete []active;
-         delete []sigma;
-      }
-   }
-
-   // THRESHOLD THE INPUT IMAGES IF REQUIRED
-   for(unsigned int l=0; l<pyramidalLevelNumber; l++)
-   {
-      reg_thresholdImage<T>(this->referencePyramid[l],this->referenceThresholdLow[0], this->referenceThresholdUp[0]);
-      reg_thresholdImage<T>(this->floatingPyramid[l],this->referenceThresholdLow[0], this->referenceThresholdUp[0]);
-   }
+   // The first level is created straight away as it is used to
+   // initialise the transformation
+   this->AllocatePyramidLevel(0);
 
    this->initialised=true;
 #ifndef NDEBUG
@@ -1075,7 +1172,11 @@ void reg_base<T>::GetVoxelBasedGradient()
                            this->currentMask,
                            this->interpolation,
                            this->warpedPaddingValue,
-                           t);
+                           t,
+                           NULL,
+                           NULL,
+                           NULL,
+                           this->currentActiveVoxels);
 
       // The gradient of the various measures of similarity are computed
       if(this->measure_nmi!=NULL)
@@ -1263,7 +1364,10 @@ void reg_base<T>::WarpFloatingImage(int inter)
                         this->deformationFieldImage,
                         this->currentMask,
                         inter,
-                        this->warpedPaddingValue);
+                        this->warpedPaddingValue,
+                        NULL,
+                        NULL,
+                        this->currentActiveVoxels);
    }
 #ifndef HAVE_R
    else
@@ -1287,6 +1391,31 @@ void reg_base<T>::WarpFloatingImage(int inter)
 /* *************************************************************** */
 /* *************************************************************** */
 template <class T>
+void reg_base<T>::WriteCheckpoint(size_t perturbation, T stepSize)
+{
+   // The current position is the best one at the end of an iteration
+   reg_checkpointState state;
+   state.levelNumber=this->levelToPerform;
+   state.level=this->currentLevel;
+   state.perturbation=perturbation;
+   state.iteration=this->optimiser->GetCurrentIterationNumber();
+   state.stepSize=stepSize;
+#ifdef HAVE_R
+   state.completedIterations=this->completedIterations;
+   state.completedIterations[this->currentLevel]=static_cast<int>(state.iteration);
+#endif
+   this->optimiser->GetState(state.optimiserState);
+   this->GetCheckpointState(state);
+
+   (*this->funcCheckpointCallback)(state, this->paramsCheckpointCallback);
+   this->lastCheckpointTime=time(NULL);
+#ifndef NDEBUG
+   reg_print_fct_debug("reg_base<T>::WriteCheckpoint");
+#endif
+}
+/* *************************************************************** */
+/* *************************************************************** */
+template <class T>
 void reg_base<T>::Run()
 {
 #ifndef NDEBUG
@@ -1309,6 +1438,25 @@ void reg_base<T>::Run()
    this->completedIterations.resize(this->levelToPerform, 0);
 #endif
 
+   // Levels before that of the checkpoint being resumed are skipped
+   unsigned int firstLevel=0;
+   if(this->resumeState!=NULL)
+   {
+      if(this->resumeState->levelNumber!=this->levelToPerform ||
+            this->resumeState->level>=this->levelToPerform)
+      {
+         reg_print_fct_error("reg_base<T>::Run()");
+         reg_print_msg_error("The checkpoint does not match the number of levels to perform");
+         reg_exit();
+      }
+      firstLevel=this->resumeState->level;
+#ifdef HAVE_R
+      this->completedIterations=this->resumeState->completedIterations;
+      this->completedIterations.resize(this->levelToPerform, 0);
+#endif
+   }
+   this->lastCheckpointTime=time(NULL);
+
    // Update the maximal number of iteration to perform per level
    this->maxiterationNumber = this->maxiterationNumber * static_cast<int>(powf(2.0, this->levelToPerform-1));
 
@@ -1317,6 +1465,17 @@ void reg_base<T>::Run()
          this->currentLevel<this->levelToPerform;
          this->currentLevel++)
    {
+      if(this->currentLevel<firstLevel)
+      {
+         // Only the first level has been created, by Initialise()
+         if(this->usePyramid)
+            this->ClearPyramidLevel(this->currentLevel);
+         this->maxiterationNumber /= 2;
+         continue;
+      }
+
+      // Create the current level of the pyramid if required
+      this->AllocatePyramidLevel(this->usePyramid?this->currentLevel:0);
 
       // Set the current input images
       if(this->usePyramid)
@@ -1331,6 +1490,12 @@ void reg_base<T>::Run()
          this->currentFloating = this->floatingPyramid[0];
          this->currentMask = this->maskPyramid[0];
       }
+      // The compact list of active voxels is used by the masked kernels
+      this->currentActiveVoxels =
+            reg_tools_getActiveVoxelList(this->currentMask,
+                                         (size_t)this->currentReference->nx *
+                                         this->currentReference->ny *
+                                         this->currentReference->nz);
 
       // Allocate image that depends on the reference image
       this->AllocateWarped();
@@ -1342,6 +1507,16 @@ void reg_base<T>::Run()
       T currentSize = maxStepSize;
       T smallestSize = maxStepSize / (T)100.0;
 
+      // The transformation is replaced by the checkpointed one, if any
+      const reg_checkpointState *levelResumeState=NULL;
+      if(this->resumeState!=NULL && this->currentLevel==firstLevel)
+      {
+         levelResumeState=this->resumeState;
+         this->resumeState=NULL;
+         this->SetCheckpointState(*levelResumeState);
+         currentSize=static_cast<T>(levelResumeState->stepSize);
+      }
+
       this->DisplayCurrentLevelParameters();
 
 #ifdef BUILD_DEV
@@ -1356,12 +1531,32 @@ void reg_base<T>::Run()
 
       // Initialise the measures of similarity
       this->InitialiseSimilarity();
+      this->UpdatePeakMemoryUsage();
 
       // initialise the optimiser
       this->SetOptimiser();
 
+      size_t firstPerturbation=0;
+      if(levelResumeState!=NULL)
+      {
+         this->optimiser->SetCurrentIterationNumber(levelResumeState->iteration);
+         this->optimiser->SetState(levelResumeState->optimiserState);
+         firstPerturbation=levelResumeState->perturbation;
+#ifdef NDEBUG
+         if(this->verbose)
+         {
+#endif
+            char text[255];
+            snprintf(text, 255, "Resuming from iteration %i of level %i",
+                     (int)levelResumeState->iteration, (int)this->currentLevel+1);
+            reg_print_info(this->executableName, text);
+#ifdef NDEBUG
+         }
+#endif
+      }
+
       // Loop over the number of perturbation to do
-      for(size_t perturbation=0;
+      for(size_t perturbation=firstPerturbation;
             perturbation<=this->perturbationNumber;
             ++perturbation)
       {
@@ -1400,6 +1595,11 @@ void reg_base<T>::Run()
 #ifdef HAVE_R
             Rcpp::checkUserInterrupt();
 #endif
+
+            // Save the state of the registration if it is due
+            if(this->funcCheckpointCallback!=NULL &&
+                  difftime(time(NULL),this->lastCheckpointTime)>=this->checkpointInterval)
+               this->WriteCheckpoint(perturbation,currentSize);
          } // while
          
 #ifdef HAVE_R
@@ -1439,23 +1639,9 @@ void reg_base<T>::Run()
       this->ClearVoxelBasedMeasureGradient();
       this->ClearTransformationGradient();
       if(this->usePyramid)
-      {
-         nifti_image_free(this->referencePyramid[this->currentLevel]);
-         this->referencePyramid[this->currentLevel]=NULL;
-         nifti_image_free(this->floatingPyramid[this->currentLevel]);
-         this->floatingPyramid[this->currentLevel]=NULL;
-         free(this->maskPyramid[this->currentLevel]);
-         this->maskPyramid[this->currentLevel]=NULL;
-      }
+         this->ClearPyramidLevel(this->currentLevel);
       else if(this->currentLevel==this->levelToPerform-1)
-      {
-         nifti_image_free(this->referencePyramid[0]);
-         this->referencePyramid[0]=NULL;
-         nifti_image_free(this->floatingPyramid[0]);
-         this->floatingPyramid[0]=NULL;
-         free(this->maskPyramid[0]);
-         this->maskPyramid[0]=NULL;
-      }
+         this->ClearPyramidLevel(0);
       this->ClearCurrentInputImage();
 
 #ifdef NDEBUG
@@ -1471,6 +1657,18 @@ void reg_base<T>::Run()
       this->maxiterationNumber /= 2;
    } // level this->levelToPerform
 
+#ifdef NDEBUG
+   if(this->verbose)
+   {
+#endif
+      char memoryText[255];
+      snprintf(memoryText, 255, "Peak memory used by the images: %.1f MB",
+               (double)this->peakMemoryUsage/1048576.0);
+      reg_print_info(this->executableName, memoryText);
+#ifdef NDEBUG
+   }
+#endif
+
 #ifndef NDEBUG
    reg_print_fct_debug("reg_base<T>::Run");
 #endif
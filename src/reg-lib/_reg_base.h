@@ -31,12 +31,30 @@
 #endif
 #include "_reg_optimiser.h"
 #include "float.h"
+#include <time.h>
+#include <vector>
 //#include "Platform.h"
 #ifdef BUILD_DEV
 #include "_reg_discrete_init.h"
 #include "_reg_mrf.h"
 #endif
  
+/// @brief Progress of a registration at the end of an iteration, from which
+/// it can be resumed at the same level and iteration. The transformation
+/// images are not owned by this structure
+struct reg_checkpointState
+{
+   unsigned int levelNumber;
+   unsigned int level;
+   size_t perturbation;
+   size_t iteration;
+   double stepSize;
+   std::vector<int> completedIterations;
+   std::vector<double> parameters;
+   std::vector<double> optimiserState;
+   std::vector<nifti_image *> transformations;
+};
+
 /// @brief Base registration class
 template <class T>
 class reg_base : public InterfaceOptimiser
@@ -94,6 +112,7 @@ protected:
    bool additive_mc_nmi;
    bool useConjGradient;
    bool useApproxGradient;
+   bool halfPrecisionGradient;
    bool verbose;
    bool usePyramid;
    int interpolation;
@@ -106,11 +125,13 @@ protected:
    nifti_image *currentReference;
    nifti_image *currentFloating;
    int *currentMask;
+   _reg_activeVoxelList *currentActiveVoxels;
    nifti_image *warped;
    nifti_image *deformationFieldImage;
    nifti_image *warImgGradient;
    nifti_image *voxelBasedMeasureGradient;
    unsigned int currentLevel;
+   size_t peakMemoryUsage;
 
    mat33 *forwardJacobianMatrix;
 
@@ -138,6 +159,10 @@ protected:
       return 0.;
    }
    virtual void ClearCurrentInputImage();
+   virtual void AllocatePyramidLevel(unsigned int);
+   virtual void ClearPyramidLevel(unsigned int);
+   virtual size_t GetCurrentMemoryUsage();
+   void UpdatePeakMemoryUsage();
 
    virtual void WarpFloatingImage(int);
    virtual double ComputeSimilarityMeasure();
@@ -219,6 +244,27 @@ protected:
    void (*funcProgressCallback)(float pcntProgress, void *params);
    void *paramsProgressCallback;
 
+   // Checkpointing related variables and functions
+   void (*funcCheckpointCallback)(const reg_checkpointState &state, void *params);
+   void *paramsCheckpointCallback;
+   double checkpointInterval;
+   time_t lastCheckpointTime;
+   const reg_checkpointState *resumeState;
+
+   void WriteCheckpoint(size_t perturbation, T stepSize);
+   /// @brief Adds the transformation images and level-dependent parameters
+   /// to a checkpoint
+   virtual void GetCheckpointState(reg_checkpointState &)
+   {
+      return;  // Need to be filled
+   }
+   /// @brief Restores the transformation images and parameters from a
+   /// checkpoint, once the level at which it was taken has been initialised
+   virtual void SetCheckpointState(const reg_checkpointState &)
+   {
+      return;  // Need to be filled
+   }
+
 public:
    reg_base(int refTimePoint,int floTimePoint);
    virtual ~reg_base();
@@ -251,6 +297,10 @@ public:
    void DoNotUseConjugateGradient();
    void UseApproximatedGradient();
    void DoNotUseApproximatedGradient();
+   /// @brief Stores the spatial gradients of the warped images in half
+   /// precision, which is only supported by the NMI measure
+   void UseHalfPrecisionGradient();
+   void DoNotUseHalfPrecisionGradient();
    // Measure of similarity related functions
 //    void ApproximateParzenWindow();
 //    void DoNotApproximateParzenWindow();
@@ -294,6 +344,13 @@ public:
    void DoNotUseDiscreteInit();
 #endif
 
+   /// @brief Returns the largest number of bytes held at once by the input
+   /// images and the images allocated during the registration
+   size_t GetPeakMemoryUsage()
+   {
+      return this->peakMemoryUsage;
+   }
+
 #ifdef HAVE_R
    std::vector<int> GetCompletedIterations()
    {
@@ -326,6 +383,26 @@ public:
       paramsProgressCallback = paramsProgCallback;
    }
 
+   /// @brief Sets a function to be called with the state of the registration
+   /// at the end of an iteration, when at least "interval" seconds have
+   /// passed since the last call
+   void SetCheckpointCallbackFunction(void (*funcCheckpointCallback)(const reg_checkpointState &state,
+                                      void *params),
+                                      void *paramsCheckpointCallback,
+                                      double interval)
+   {
+      this->funcCheckpointCallback = funcCheckpointCallback;
+      this->paramsCheckpointCallback = paramsCheckpointCallback;
+      this->checkpointInterval = interval;
+   }
+   /// @brief Resumes the registration from a checkpoint when it is run. The
+   /// state must remain valid until the first resumed level is initialised,
+   /// and the other settings must match those of the checkpointed registration
+   void SetResumeState(const reg_checkpointState *state)
+   {
+      this->resumeState = state;
+   }
+
    // Function used for testing
    virtual void reg_test_setOptimiser(reg_optimiser<T> *opt)
    {
@@ -28,6 +28,7 @@ reg_f3d<T>::reg_f3d(int refTimePoint,int floTimePoint)
    this->linearEnergyWeight=0.01;
    this->jacobianLogWeight=0.;
    this->jacobianLogApproximation=true;
+   this->jacobianCache=new reg_jacobianCache();
    this->spacing[0]=-5;
    this->spacing[1]=std::numeric_limits<T>::quiet_NaN();
    this->spacing[2]=std::numeric_limits<T>::quiet_NaN();
@@ -39,6 +40,7 @@ reg_f3d<T>::reg_f3d(int refTimePoint,int floTimePoint)
    this->transformationGradient=NULL;
 
    this->gridRefinement=true;
+   this->localApproxGradient=true;
 
 #ifdef BUILD_DEV
    pairwiseEnergyWeight=0;
@@ -60,6 +62,11 @@ reg_f3d<T>::~reg_f3d()
       nifti_image_free(this->controlPointGrid);
       this->controlPointGrid=NULL;
    }
+   if(this->jacobianCache!=NULL)
+   {
+      delete this->jacobianCache;
+      this->jacobianCache=NULL;
+   }
 #ifndef NDEBUG
    reg_print_fct_debug("reg_f3d<T>::~reg_f3d");
 #endif
@@ -177,6 +184,17 @@ T reg_f3d<T>::InitialiseCurrentLevel()
 }
 /* *************************************************************** */
 template <class T>
+void reg_f3d<T>::ClearCurrentInputImage()
+{
+   reg_base<T>::ClearCurrentInputImage();
+   // The cached Jacobian matrices are only valid for the current level
+   this->jacobianCache->Clear();
+#ifndef NDEBUG
+   reg_print_fct_debug("reg_f3d<T>::ClearCurrentInputImage");
+#endif
+}
+/* *************************************************************** */
+template <class T>
 void reg_f3d<T>::AllocateTransformationGradient()
 {
    if(this->controlPointGrid==NULL)
@@ -498,13 +516,17 @@ double reg_f3d<T>::ComputeJacobianBasedPenaltyTerm(int type)
    {
       value = reg_spline_getJacobianPenaltyTerm(this->controlPointGrid,
                                                 this->currentReference,
-                                                false);
+                                                false,
+                                                false,
+                                                this->jacobianCache);
    }
    else
    {
       value = reg_spline_getJacobianPenaltyTerm(this->controlPointGrid,
                                                 this->currentReference,
-                                                this->jacobianLogApproximation);
+                                                this->jacobianLogApproximation,
+                                                false,
+                                                this->jacobianCache);
    }
    unsigned int maxit=5;
    if(type>0) maxit=20;
@@ -515,13 +537,15 @@ double reg_f3d<T>::ComputeJacobianBasedPenaltyTerm(int type)
       {
          value = reg_spline_correctFolding(this->controlPointGrid,
                                            this->currentReference,
-                                           false);
+                                           false,
+                                           this->jacobianCache);
       }
       else
       {
          value = reg_spline_correctFolding(this->controlPointGrid,
                                            this->currentReference,
-                                           this->jacobianLogApproximation);
+                                           this->jacobianLogApproximation,
+                                           this->jacobianCache);
       }
 #ifndef NDEBUG
       reg_print_msg_debug("Folding correction");
@@ -582,6 +606,43 @@ double reg_f3d<T>::ComputeLinearEnergyPenaltyTerm()
 }
 /* *************************************************************** */
 /* *************************************************************** */
+template <class T>
+double reg_f3d<T>::ComputeLocalPenaltyTerm(nifti_image *localGrid)
+{
+   // The penalty terms of a block of control points cut from the current
+   // grid. Each term is a sum over the nodes with a full stencil, so the
+   // sums are rescaled to the normalisation used over the whole grid. Only
+   // the values are computed, without folding correction or caching
+   nifti_image *grid = this->controlPointGrid;
+   double value=0.;
+   if(this->bendingEnergyWeight>0)
+      value += this->bendingEnergyWeight *
+            reg_spline_approxBendingEnergy(localGrid) *
+            (double)localGrid->nvox / (double)grid->nvox;
+   if(this->linearEnergyWeight>0)
+      value += this->linearEnergyWeight *
+            reg_spline_approxLinearEnergy(localGrid) *
+            (double)localGrid->nvox / (double)grid->nvox;
+   if(this->jacobianLogWeight>0)
+   {
+      double localNumber = (double)(localGrid->nx-2) * (localGrid->ny-2);
+      double gridNumber = (double)(grid->nx-2) * (grid->ny-2);
+      if(grid->nz>1)
+      {
+         localNumber *= (double)(localGrid->nz-2);
+         gridNumber *= (double)(grid->nz-2);
+      }
+      if(localNumber>0)
+         value += this->jacobianLogWeight *
+               reg_spline_getJacobianPenaltyTerm(localGrid,
+                                                 this->currentReference,
+                                                 true) *
+               localNumber / gridNumber;
+   }
+   return value;
+}
+/* *************************************************************** */
+/* *************************************************************** */
 #ifdef BUILD_DEV
 template <class T>
 double reg_f3d<T>::ComputePairwiseEnergyPenaltyTerm()
@@ -604,60 +665,18 @@ void reg_f3d<T>::GetSimilarityMeasureGradient()
 {
    this->GetVoxelBasedGradient();
 
-   int kernel_type=CUBIC_SPLINE_KERNEL;
-#ifdef BUILD_DEV
-   if(this->linearSpline)
-      kernel_type=LINEAR_KERNEL;
-#endif
-   // The voxel based NMI gradient is convolved with a spline kernel
-   // Convolution along the x axis
-   float currentNodeSpacing[3];
-   currentNodeSpacing[0]=currentNodeSpacing[1]=currentNodeSpacing[2]=this->controlPointGrid->dx;
-   bool activeAxis[3]= {1,0,0};
-   reg_tools_kernelConvolution(this->voxelBasedMeasureGradient,
-                               currentNodeSpacing,
-                               kernel_type,
-                               NULL, // mask
-                               NULL, // all volumes are considered as active
-                               activeAxis
-                               );
-   // Convolution along the y axis
-   currentNodeSpacing[0]=currentNodeSpacing[1]=currentNodeSpacing[2]=this->controlPointGrid->dy;
-   activeAxis[0]=0;
-   activeAxis[1]=1;
-   reg_tools_kernelConvolution(this->voxelBasedMeasureGradient,
-                               currentNodeSpacing,
-                               kernel_type,
-                               NULL, // mask
-                               NULL, // all volumes are considered as active
-                               activeAxis
-                               );
-   // Convolution along the z axis if required
-   if(this->voxelBasedMeasureGradient->nz>1)
-   {
-      currentNodeSpacing[0]=currentNodeSpacing[1]=currentNodeSpacing[2]=this->controlPointGrid->dz;
-      activeAxis[1]=0;
-      activeAxis[2]=1;
-      reg_tools_kernelConvolution(this->voxelBasedMeasureGradient,
-                                  currentNodeSpacing,
-                                  kernel_type,
-                                  NULL, // mask
-                                  NULL, // all volumes are considered as active
-                                  activeAxis
-                                  );
-   }
-
-   // The node based NMI gradient is extracted
+   // The voxel based gradient is projected onto the control points, as the
+   // adjoint of the B-spline interpolation of the deformation field
    mat44 reorientation;
    if(this->currentFloating->sform_code>0)
       reorientation = this->currentFloating->sto_ijk;
    else reorientation = this->currentFloating->qto_ijk;
-   reg_voxelCentric2NodeCentric(this->transformationGradient,
-                                this->voxelBasedMeasureGradient,
-                                this->similarityWeight,
-                                false, // no update
-                                &reorientation
-                                );
+   reg_spline_projectVoxelGradient(this->transformationGradient,
+                                   this->voxelBasedMeasureGradient,
+                                   this->similarityWeight,
+                                   false, // no update
+                                   &reorientation
+                                   );
 #ifndef NDEBUG
    reg_print_fct_debug("reg_f3d<T>::GetSimilarityMeasureGradient");
 #endif
@@ -702,7 +721,9 @@ void reg_f3d<T>::GetJacobianBasedGradient()
                                              this->currentReference,
                                              this->transformationGradient,
                                              this->jacobianLogWeight,
-                                             this->jacobianLogApproximation);
+                                             this->jacobianLogApproximation,
+                                             false,
+                                             this->jacobianCache);
 #ifndef NDEBUG
    reg_print_fct_debug("reg_f3d<T>::GetJacobianBasedGradient");
 #endif
@@ -1055,6 +1076,35 @@ void reg_f3d<T>::SmoothGradient()
 /* *************************************************************** */
 template <class T>
 void reg_f3d<T>::GetApproximatedGradient()
+{
+   // When NMI is the only measure of similarity and the deformation is a sum
+   // of B-spline terms, a perturbed control point only alters the field over
+   // its own support. As long as the penalty terms are approximated at the
+   // control points, the objective function can then be updated locally
+   bool localUpdate = this->localApproxGradient &&
+         this->similarityWeight>0 &&
+         this->measure_nmi!=NULL &&
+         this->controlPointGrid->intent_p1!=LIN_SPLINE_GRID &&
+         (this->jacobianLogWeight<=0 || this->jacobianLogApproximation) &&
+         (this->controlPointGrid->num_ext==0 ||
+          this->controlPointGrid->ext_list[0].edata==NULL);
+#ifndef HAVE_R
+   if(this->measure_ssd!=NULL || this->measure_kld!=NULL ||
+         this->measure_dti!=NULL || this->measure_lncc!=NULL ||
+         this->measure_mind!=NULL || this->measure_mindssc!=NULL)
+      localUpdate=false;
+#endif
+   if(localUpdate)
+      this->GetLocalApproximatedGradient();
+   else this->GetFullApproximatedGradient();
+#ifndef NDEBUG
+   reg_print_fct_debug("reg_f3d<T>::GetApproximatedGradient");
+#endif
+}
+/* *************************************************************** */
+/* *************************************************************** */
+template <class T>
+void reg_f3d<T>::GetFullApproximatedGradient()
 {
    // Loop over every control point
    T *gridPtr = static_cast<T *>(this->controlPointGrid->data);
@@ -1071,7 +1121,250 @@ void reg_f3d<T>::GetApproximatedGradient()
       gradPtr[i] = -(T)((valPlus - valMinus ) / (2.0*eps));
    }
 #ifndef NDEBUG
-   reg_print_fct_debug("reg_f3d<T>::GetApproximatedGradient");
+   reg_print_fct_debug("reg_f3d<T>::GetFullApproximatedGradient");
+#endif
+}
+/* *************************************************************** */
+/* *************************************************************** */
+template <class T>
+void reg_f3d<T>::GetLocalApproximatedGradient()
+{
+   // The current transformation is evaluated once over the whole image, and
+   // its joint histogram kept as the state from which each perturbation starts
+   this->WarpFloatingImage(this->interpolation);
+   double currentMeasure = this->ComputeSimilarityMeasure();
+   this->measure_nmi->StoreJointHistogram();
+
+   nifti_image *field = this->deformationFieldImage;
+   nifti_image *grid = this->controlPointGrid;
+   int fieldDim[3] = {field->nx, field->ny, field->nz};
+   int gridDim[3] = {grid->nx, grid->ny, grid->nz};
+   size_t voxelNumber = (size_t)fieldDim[0] * fieldDim[1] * fieldDim[2];
+   size_t gridVoxelNumber = (size_t)gridDim[0] * gridDim[1] * gridDim[2];
+   T gridVoxelSpacing[3];
+   gridVoxelSpacing[0] = grid->dx / field->dx;
+   gridVoxelSpacing[1] = grid->dy / field->dy;
+   gridVoxelSpacing[2] = grid->dz / field->dz;
+
+   // The basis values along each axis are computed as in
+   // reg_spline_getDeformationField(), along with the range of voxels over
+   // which each control point has some weight. In 2D the single plane is
+   // attached to the first control point along z with unit weight
+   std::vector<int> preIndex[3], firstVoxel[3], lastVoxel[3];
+   std::vector<T> basisValues[3];
+   int boxDim[3];
+   for(int a=0; a<3; ++a)
+   {
+      preIndex[a].resize(fieldDim[a]);
+      basisValues[a].assign(4*fieldDim[a], 0);
+      firstVoxel[a].assign(gridDim[a], fieldDim[a]);
+      lastVoxel[a].assign(gridDim[a], -1);
+      bool planar = (a==2 && field->nz==1);
+      for(int v=0; v<fieldDim[a]; ++v)
+      {
+         if(planar)
+         {
+            preIndex[a][v]=0;
+            basisValues[a][4*v]=1;
+         }
+         else
+         {
+            preIndex[a][v]=static_cast<int>(static_cast<T>(v)/gridVoxelSpacing[a]);
+            T basis=static_cast<T>(v)/gridVoxelSpacing[a]-static_cast<T>(preIndex[a][v]);
+            if(basis<0.0) basis=0.0; //rounding error
+            get_BSplineBasisValues<T>(basis, &basisValues[a][4*v]);
+         }
+         for(int k=0; k<(planar?1:4); ++k)
+         {
+            int cp=preIndex[a][v]+k;
+            if(cp<gridDim[a])
+            {
+               firstVoxel[a][cp]=std::min(firstVoxel[a][cp],v);
+               lastVoxel[a][cp]=std::max(lastVoxel[a][cp],v);
+            }
+         }
+      }
+      boxDim[a]=1;
+      for(int cp=0; cp<gridDim[a]; ++cp)
+         boxDim[a]=std::max(boxDim[a],lastVoxel[a][cp]-firstVoxel[a][cp]+1);
+   }
+   size_t localVoxelNumber = (size_t)boxDim[0] * boxDim[1] * boxDim[2];
+
+   // Small images hold the field and the warped values over one support
+   // region, with the voxels outside the region or the mask excluded
+   nifti_image *localField = nifti_copy_nim_info(field);
+   localField->dim[1]=localField->nx=boxDim[0];
+   localField->dim[2]=localField->ny=boxDim[1];
+   localField->dim[3]=localField->nz=boxDim[2];
+   localField->nvox=localVoxelNumber*(field->nvox/voxelNumber);
+   localField->data=(void *)calloc(localField->nvox,localField->nbyper);
+   nifti_image *localWarped = nifti_copy_nim_info(this->warped);
+   localWarped->dim[1]=localWarped->nx=boxDim[0];
+   localWarped->dim[2]=localWarped->ny=boxDim[1];
+   localWarped->dim[3]=localWarped->nz=boxDim[2];
+   localWarped->nvox=localVoxelNumber*(this->warped->nvox/voxelNumber);
+   localWarped->data=(void *)calloc(localWarped->nvox,localWarped->nbyper);
+   // The penalty terms are evaluated over the control points whose stencil
+   // includes the perturbed one, which are held in a block of at most five
+   // control points along each axis
+   nifti_image *localGrid = nifti_copy_nim_info(grid);
+   int localGridDim[3] = {std::min(gridDim[0],5), std::min(gridDim[1],5), std::min(gridDim[2],5)};
+   size_t localGridNumber = (size_t)localGridDim[0] * localGridDim[1] * localGridDim[2];
+   localGrid->data=(void *)malloc(localGridNumber*(grid->nvox/gridVoxelNumber)*grid->nbyper);
+   int *localMask=(int *)malloc(localVoxelNumber*sizeof(int));
+   int *referenceIndex=(int *)malloc(localVoxelNumber*sizeof(int));
+   T *localWeight=(T *)malloc(localVoxelNumber*sizeof(T));
+
+   T *gridPtr = static_cast<T *>(grid->data);
+   T *gradPtr = static_cast<T *>(this->transformationGradient->data);
+   T *fieldPtr = static_cast<T *>(field->data);
+   T *localFieldPtr = static_cast<T *>(localField->data);
+   T *localGridPtr = static_cast<T *>(localGrid->data);
+   int componentNumber = static_cast<int>(grid->nvox/gridVoxelNumber);
+   T eps = grid->dx / 100.f;
+
+   for(int z=0; z<gridDim[2]; ++z)
+   {
+      for(int y=0; y<gridDim[1]; ++y)
+      {
+         for(int x=0; x<gridDim[0]; ++x)
+         {
+            size_t cpIndex = ((size_t)z*gridDim[1]+y)*gridDim[0]+x;
+            int cpCoord[3] = {x, y, z};
+            // Gather the supported voxels, their weights and current positions
+            size_t activeNumber=0;
+            size_t n=0;
+            for(int lz=0; lz<boxDim[2]; ++lz)
+            {
+               for(int ly=0; ly<boxDim[1]; ++ly)
+               {
+                  for(int lx=0; lx<boxDim[0]; ++lx, ++n)
+                  {
+                     int local[3] = {lx, ly, lz};
+                     int voxel[3];
+                     bool inside=true;
+                     T weight=1;
+                     for(int a=0; a<3; ++a)
+                     {
+                        voxel[a]=firstVoxel[a][cpCoord[a]]+local[a];
+                        if(voxel[a]>lastVoxel[a][cpCoord[a]])
+                        {
+                           inside=false;
+                           break;
+                        }
+                        weight*=basisValues[a][4*voxel[a]+cpCoord[a]-preIndex[a][voxel[a]]];
+                     }
+                     size_t index = inside ? ((size_t)voxel[2]*fieldDim[1]+voxel[1])*fieldDim[0]+voxel[0] : 0;
+                     if(inside && (this->currentMask==NULL || this->currentMask[index]>-1))
+                     {
+                        referenceIndex[n]=static_cast<int>(index);
+                        localMask[n]=0;
+                        localWeight[n]=weight;
+                        for(int c=0; c<componentNumber; ++c)
+                           localFieldPtr[c*localVoxelNumber+n]=fieldPtr[c*voxelNumber+index];
+                        ++activeNumber;
+                     }
+                     else
+                     {
+                        referenceIndex[n]=-1;
+                        localMask[n]=-1;
+                        localWeight[n]=0;
+                     }
+                  }
+               }
+            }
+
+            // Cut the block of control points around the current one
+            int blockStart[3], blockDim[3];
+            for(int a=0; a<3; ++a)
+            {
+               blockStart[a]=std::max(cpCoord[a]-2,0);
+               blockDim[a]=std::min(cpCoord[a]+2,gridDim[a]-1)-blockStart[a]+1;
+            }
+            localGrid->dim[1]=localGrid->nx=blockDim[0];
+            localGrid->dim[2]=localGrid->ny=blockDim[1];
+            localGrid->dim[3]=localGrid->nz=blockDim[2];
+            size_t blockNumber = (size_t)blockDim[0] * blockDim[1] * blockDim[2];
+            localGrid->nvox=blockNumber*componentNumber;
+            size_t blockIndex=0;
+            for(int c=0; c<componentNumber; ++c)
+            {
+               for(int bz=0; bz<blockDim[2]; ++bz)
+               {
+                  for(int by=0; by<blockDim[1]; ++by)
+                  {
+                     size_t index = c*gridVoxelNumber +
+                           ((size_t)(blockStart[2]+bz)*gridDim[1]+blockStart[1]+by)*gridDim[0]+blockStart[0];
+                     for(int bx=0; bx<blockDim[0]; ++bx)
+                        localGridPtr[blockIndex++]=gridPtr[index+bx];
+                  }
+               }
+            }
+            size_t localCpIndex = ((size_t)(cpCoord[2]-blockStart[2])*blockDim[1] +
+                  cpCoord[1]-blockStart[1])*blockDim[0]+cpCoord[0]-blockStart[0];
+
+            for(int c=0; c<componentNumber; ++c)
+            {
+               size_t i = c*gridVoxelNumber+cpIndex;
+               size_t localIndex = c*blockNumber+localCpIndex;
+               T currentValue = localGridPtr[localIndex];
+               T *localFieldComp = &localFieldPtr[c*localVoxelNumber];
+               T *fieldComp = &fieldPtr[c*voxelNumber];
+               double value[2];
+               for(int s=0; s<2; ++s)
+               {
+                  T delta = (s==0) ? eps : -eps;
+                  // Only the copied block is altered, leaving the grid and the
+                  // deformation field as they are
+                  localGridPtr[localIndex] = currentValue + delta;
+                  double penalty = this->ComputeLocalPenaltyTerm(localGrid);
+                  double measure = currentMeasure;
+                  if(activeNumber>0)
+                  {
+                     // The field is linear in each coefficient, so the new
+                     // positions follow from the current ones and the weights
+                     for(n=0; n<localVoxelNumber; ++n)
+                     {
+                        if(referenceIndex[n]>-1)
+                           localFieldComp[n]=fieldComp[referenceIndex[n]]+delta*localWeight[n];
+                     }
+                     reg_resampleImage(this->currentFloating,
+                                       localWarped,
+                                       localField,
+                                       localMask,
+                                       this->interpolation,
+                                       this->warpedPaddingValue);
+                     measure = double(this->similarityWeight) *
+                           this->measure_nmi->GetLocalSimilarityMeasureValue(localWarped,
+                                                                             referenceIndex);
+                  }
+                  value[s] = measure - penalty;
+               }
+               for(n=0; n<localVoxelNumber; ++n)
+               {
+                  if(referenceIndex[n]>-1)
+                     localFieldComp[n]=fieldComp[referenceIndex[n]];
+               }
+               localGridPtr[localIndex] = currentValue;
+               // A perturbation that folds the transformation has no finite
+               // penalty, and is not used
+               double difference = value[0] - value[1];
+               if(difference!=difference || fabs(difference)>std::numeric_limits<double>::max())
+                  gradPtr[i] = 0;
+               else gradPtr[i] = -(T)(difference / (2.0*eps));
+            }
+         }
+      }
+   }
+
+   free(localWeight);
+   free(referenceIndex);
+   free(localMask);
+   nifti_image_free(localGrid);
+   nifti_image_free(localWarped);
+   nifti_image_free(localField);
+#ifndef NDEBUG
+   reg_print_fct_debug("reg_f3d<T>::GetLocalApproximatedGradient");
 #endif
 }
 /* *************************************************************** */
@@ -1141,6 +1434,9 @@ void reg_f3d<T>::UpdateBestObjFunctionValue()
 #ifdef BUILD_DEV
    this->bestWPE=this->currentWPE;
 #endif
+   // The Jacobian matrices of the best transformation are kept for the
+   // gradient computation that follows
+   this->jacobianCache->Retain();
 #ifndef NDEBUG
    reg_print_fct_debug("reg_f3d<T>::UpdateBestObjFunctionValue");
 #endif
@@ -1247,6 +1543,59 @@ void reg_f3d<T>::CorrectTransformation()
 }
 /* *************************************************************** */
 /* *************************************************************** */
+template<class T>
+void reg_f3d<T>::GetCheckpointState(reg_checkpointState &state)
+{
+   // The penalty weights are rescaled as the grid is refined
+   state.transformations.push_back(this->controlPointGrid);
+   state.parameters.push_back(static_cast<double>(this->bendingEnergyWeight));
+   state.parameters.push_back(static_cast<double>(this->linearEnergyWeight));
+#ifndef NDEBUG
+   reg_print_fct_debug("reg_f3d<T>::GetCheckpointState");
+#endif
+}
+/* *************************************************************** */
+/* *************************************************************** */
+template<class T>
+void reg_f3d<T>::SetCheckpointState(const reg_checkpointState &state)
+{
+   const size_t transformationNumber = this->GetSymmetricStatus()?2:1;
+   if(state.transformations.size()!=transformationNumber || state.parameters.size()!=2)
+   {
+      reg_print_fct_error("reg_f3d<T>::SetCheckpointState()");
+      reg_print_msg_error("The checkpoint does not match the type of registration");
+      reg_exit();
+   }
+   this->RestoreCheckpointImage(&this->controlPointGrid, state.transformations[0]);
+   this->bendingEnergyWeight = static_cast<T>(state.parameters[0]);
+   this->linearEnergyWeight = static_cast<T>(state.parameters[1]);
+#ifndef NDEBUG
+   reg_print_fct_debug("reg_f3d<T>::SetCheckpointState");
+#endif
+}
+/* *************************************************************** */
+/* *************************************************************** */
+template<class T>
+void reg_f3d<T>::RestoreCheckpointImage(nifti_image **image, const nifti_image *savedImage)
+{
+   // The saved grid replaces the current one, whose geometry may differ if
+   // intermediate levels have been skipped
+   if(savedImage==NULL || savedImage->data==NULL || savedImage->datatype!=(*image)->datatype)
+   {
+      reg_print_fct_error("reg_f3d<T>::RestoreCheckpointImage()");
+      reg_print_msg_error("The checkpointed control point grid is missing or has the wrong precision");
+      reg_exit();
+   }
+   nifti_image_free(*image);
+   *image = nifti_copy_nim_info(savedImage);
+   (*image)->data = (void *)malloc((*image)->nvox * (*image)->nbyper);
+   memcpy((*image)->data, savedImage->data, (*image)->nvox * (*image)->nbyper);
+#ifndef NDEBUG
+   reg_print_fct_debug("reg_f3d<T>::RestoreCheckpointImage");
+#endif
+}
+/* *************************************************************** */
+/* *************************************************************** */
 #ifdef BUILD_DEV
 template<class T>
 void reg_f3d<T>::DiscreteInitialisation()
@@ -25,10 +25,12 @@ protected:
    T linearEnergyWeight;
    T jacobianLogWeight;
    bool jacobianLogApproximation;
+   reg_jacobianCache *jacobianCache;
    T spacing[3];
 
    nifti_image *transformationGradient;
    bool gridRefinement;
+   bool localApproxGradient;
 
    double currentWJac;
    double currentWBE;
@@ -40,10 +42,12 @@ protected:
    virtual void AllocateTransformationGradient();
    virtual void ClearTransformationGradient();
    virtual T InitialiseCurrentLevel();
+   virtual void ClearCurrentInputImage();
 
    virtual double ComputeJacobianBasedPenaltyTerm(int);
    virtual double ComputeBendingEnergyPenaltyTerm();
    virtual double ComputeLinearEnergyPenaltyTerm();
+   double ComputeLocalPenaltyTerm(nifti_image *);
 
    virtual void GetBendingEnergyGradient();
    virtual void GetLinearEnergyGradient();
@@ -53,6 +57,8 @@ protected:
    virtual void SmoothGradient();
    virtual void GetObjectiveFunctionGradient();
    virtual void GetApproximatedGradient();
+   void GetFullApproximatedGradient();
+   void GetLocalApproximatedGradient();
    void GetSimilarityMeasureGradient();
 
    virtual void GetDeformationField();
@@ -68,6 +74,10 @@ protected:
 
    virtual void CorrectTransformation();
 
+   virtual void GetCheckpointState(reg_checkpointState &);
+   virtual void SetCheckpointState(const reg_checkpointState &);
+   void RestoreCheckpointImage(nifti_image **, const nifti_image *);
+
 #ifdef BUILD_DEV
    T pairwiseEnergyWeight;
    double bestWPE;
@@ -99,6 +109,12 @@ public:
    {
       this->gridRefinement=false;
    }
+   /// @brief Evaluate every perturbation of the approximated gradient over
+   /// the whole image, even where it could be updated locally
+   void DoNotUseLocalApproximatedGradient()
+   {
+      this->localApproxGradient=false;
+   }
 
 #ifdef BUILD_DEV
    void UseLinearSpline();
@@ -34,10 +34,12 @@ reg_f3d_sym<T>::reg_f3d_sym(int refTimePoint,int floTimePoint)
 
    this->floatingMaskImage=NULL;
    this->currentFloatingMask=NULL;
+   this->currentFloatingActiveVoxels=NULL;
    this->floatingMaskPyramid=NULL;
    this->backwardActiveVoxelNumber=NULL;
 
    this->backwardJacobianMatrix=NULL;
+   this->backwardJacobianCache=new reg_jacobianCache();
 
    this->inverseConsistencyWeight=0.1;
 
@@ -50,6 +52,12 @@ reg_f3d_sym<T>::reg_f3d_sym(int refTimePoint,int floTimePoint)
 template <class T>
 reg_f3d_sym<T>::~reg_f3d_sym()
 {
+   if(this->currentFloatingActiveVoxels!=NULL)
+   {
+      delete this->currentFloatingActiveVoxels;
+      this->currentFloatingActiveVoxels=NULL;
+   }
+
    if(this->backwardControlPointGrid!=NULL)
    {
       nifti_image_free(this->backwardControlPointGrid);
@@ -87,6 +95,12 @@ reg_f3d_sym<T>::~reg_f3d_sym()
       this->backwardActiveVoxelNumber=NULL;
    }
 
+   if(this->backwardJacobianCache!=NULL)
+   {
+      delete this->backwardJacobianCache;
+      this->backwardJacobianCache=NULL;
+   }
+
 #ifndef NDEBUG
    reg_print_fct_debug("reg_f3d_sym<T>::~reg_f3d_sym");
 #endif
@@ -145,6 +159,14 @@ T reg_f3d_sym<T>::InitialiseCurrentLevel()
       this->currentMask = this->maskPyramid[0];
       this->currentFloatingMask = this->floatingMaskPyramid[0];
    }
+   // The compact list of active voxels is used by the masked kernels
+   if(this->currentFloatingActiveVoxels!=NULL)
+      delete this->currentFloatingActiveVoxels;
+   this->currentFloatingActiveVoxels =
+         reg_tools_getActiveVoxelList(this->currentFloatingMask,
+                                      (size_t)this->currentFloating->nx *
+                                      this->currentFloating->ny *
+                                      this->currentFloating->nz);
 
    // Define the initial step size for the gradient ascent optimisation
    T maxStepSize = this->currentReference->dx;
@@ -166,12 +188,112 @@ template <class T>
 void reg_f3d_sym<T>::ClearCurrentInputImage()
 {
    reg_f3d<T>::ClearCurrentInputImage();
+   if(this->currentFloatingActiveVoxels!=NULL)
+      delete this->currentFloatingActiveVoxels;
+   this->currentFloatingActiveVoxels=NULL;
+   this->backwardJacobianCache->Clear();
 #ifndef NDEBUG
    reg_print_fct_debug("reg_f3d_sym<T>::ClearCurrentInputImage");
 #endif
    return;
 }
 /* *************************************************************** */
+template <class T>
+void reg_f3d_sym<T>::AllocatePyramidLevel(unsigned int l)
+{
+   reg_f3d<T>::AllocatePyramidLevel(l);
+
+   // The floating mask pyramid arrays are allocated with the first level
+   if(this->floatingMaskPyramid==NULL)
+   {
+      unsigned int pyramidalLevelNumber=this->usePyramid?this->levelToPerform:1;
+      this->floatingMaskPyramid = (int **)calloc(pyramidalLevelNumber,sizeof(int *));
+      this->backwardActiveVoxelNumber= (int *)calloc(pyramidalLevelNumber,sizeof(int));
+   }
+   if(this->floatingMaskPyramid[l]!=NULL)
+      return;
+
+   if (this->floatingMaskImage!=NULL)
+   {
+      reg_createMaskPyramidLevel<T>(this->floatingMaskImage,
+                                    this->floatingMaskPyramid,
+                                    this->usePyramid?this->levelNumber:1,
+                                    this->usePyramid?this->levelToPerform:1,
+                                    l,
+                                    this->backwardActiveVoxelNumber);
+   }
+   else
+   {
+      this->backwardActiveVoxelNumber[l]=this->floatingPyramid[l]->nx*this->floatingPyramid[l]->ny*this->floatingPyramid[l]->nz;
+      this->floatingMaskPyramid[l]=(int *)calloc(backwardActiveVoxelNumber[l],sizeof(int));
+   }
+   this->UpdatePeakMemoryUsage();
+#ifndef NDEBUG
+   reg_print_fct_debug("reg_f3d_sym<T>::AllocatePyramidLevel");
+#endif
+}
+/* *************************************************************** */
+template <class T>
+void reg_f3d_sym<T>::ClearPyramidLevel(unsigned int l)
+{
+   reg_f3d<T>::ClearPyramidLevel(l);
+   if(this->floatingMaskPyramid!=NULL)
+   {
+      if(this->floatingMaskPyramid[l]!=NULL)
+         free(this->floatingMaskPyramid[l]);
+      this->floatingMaskPyramid[l]=NULL;
+   }
+#ifndef NDEBUG
+   reg_print_fct_debug("reg_f3d_sym<T>::ClearPyramidLevel");
+#endif
+}
+/* *************************************************************** */
+template <class T>
+size_t reg_f3d_sym<T>::GetCurrentMemoryUsage()
+{
+   size_t memory=reg_f3d<T>::GetCurrentMemoryUsage();
+   memory += reg_tools_getImageMemory(this->floatingMaskImage);
+   if(this->floatingMaskPyramid!=NULL)
+   {
+      unsigned int pyramidalLevelNumber=this->usePyramid?this->levelToPerform:1;
+      for(unsigned int l=0; l<pyramidalLevelNumber; ++l)
+      {
+         if(this->floatingMaskPyramid[l]!=NULL && this->floatingPyramid[l]!=NULL)
+            memory += (size_t)this->floatingPyramid[l]->nx *
+                  this->floatingPyramid[l]->ny *
+                  this->floatingPyramid[l]->nz * sizeof(int);
+      }
+   }
+   if(this->currentFloatingActiveVoxels!=NULL)
+      memory += this->currentFloatingActiveVoxels->number * sizeof(int);
+   memory += reg_tools_getImageMemory(this->backwardWarped);
+   memory += reg_tools_getImageMemory(this->backwardDeformationFieldImage);
+   memory += reg_tools_getImageMemory(this->backwardWarpedGradientImage);
+   memory += reg_tools_getImageMemory(this->backwardVoxelBasedMeasureGradientImage);
+   return memory;
+}
+/* *************************************************************** */
+/* *************************************************************** */
+template <class T>
+void reg_f3d_sym<T>::GetCheckpointState(reg_checkpointState &state)
+{
+   reg_f3d<T>::GetCheckpointState(state);
+   state.transformations.push_back(this->backwardControlPointGrid);
+#ifndef NDEBUG
+   reg_print_fct_debug("reg_f3d_sym<T>::GetCheckpointState");
+#endif
+}
+/* *************************************************************** */
+template <class T>
+void reg_f3d_sym<T>::SetCheckpointState(const reg_checkpointState &state)
+{
+   reg_f3d<T>::SetCheckpointState(state);
+   this->RestoreCheckpointImage(&this->backwardControlPointGrid, state.transformations[1]);
+#ifndef NDEBUG
+   reg_print_fct_debug("reg_f3d_sym<T>::SetCheckpointState");
+#endif
+}
+/* *************************************************************** */
 /* *************************************************************** */
 template <class T>
 void reg_f3d_sym<T>::AllocateWarped()
@@ -196,7 +318,7 @@ void reg_f3d_sym<T>::AllocateWarped()
          (size_t)this->backwardWarped->nt;
    this->backwardWarped->datatype = this->currentReference->datatype;
    this->backwardWarped->nbyper = this->currentReference->nbyper;
-   this->backwardWarped->data = (void *)calloc(this->backwardWarped->nvox, this->backwardWarped->nbyper);
+   reg_tools_allocateImageData(this->backwardWarped);
 #ifndef NDEBUG
    reg_print_fct_debug("reg_f3d_sym<T>::AllocateWarped");
 #endif
@@ -260,8 +382,7 @@ void reg_f3d_sym<T>::AllocateDeformationField()
          (size_t)this->backwardDeformationFieldImage->nu;
    this->backwardDeformationFieldImage->nbyper = this->backwardControlPointGrid->nbyper;
    this->backwardDeformationFieldImage->datatype = this->backwardControlPointGrid->datatype;
-   this->backwardDeformationFieldImage->data = (void *)calloc(this->backwardDeformationFieldImage->nvox,
-                                                              this->backwardDeformationFieldImage->nbyper);
+   reg_tools_allocateImageData(this->backwardDeformationFieldImage);
    this->backwardDeformationFieldImage->intent_code=NIFTI_INTENT_VECTOR;
    memset(this->backwardDeformationFieldImage->intent_name, 0, 16);
    strcpy(this->backwardDeformationFieldImage->intent_name,"NREG_TRANS");
@@ -318,8 +439,12 @@ void reg_f3d_sym<T>::AllocateWarpedGradient()
       reg_exit();
    }
    this->backwardWarpedGradientImage = nifti_copy_nim_info(this->backwardDeformationFieldImage);
-   this->backwardWarpedGradientImage->data = (void *)calloc(this->backwardWarpedGradientImage->nvox,
-                                                            this->backwardWarpedGradientImage->nbyper);
+   if(this->halfPrecisionGradient)
+   {
+      this->backwardWarpedGradientImage->datatype = REG_TYPE_FLOAT16;
+      this->backwardWarpedGradientImage->nbyper = sizeof(reg_half);
+   }
+   reg_tools_allocateImageData(this->backwardWarpedGradientImage);
 #ifndef NDEBUG
    reg_print_fct_debug("reg_f3d_sym<T>::AllocateWarpedGradient");
 #endif
@@ -355,9 +480,7 @@ void reg_f3d_sym<T>::AllocateVoxelBasedMeasureGradient()
       reg_exit();
    }
    this->backwardVoxelBasedMeasureGradientImage = nifti_copy_nim_info(this->backwardDeformationFieldImage);
-   this->backwardVoxelBasedMeasureGradientImage->data =
-         (void *)calloc(this->backwardVoxelBasedMeasureGradientImage->nvox,
-                        this->backwardVoxelBasedMeasureGradientImage->nbyper);
+   reg_tools_allocateImageData(this->backwardVoxelBasedMeasureGradientImage);
 #ifndef NDEBUG
    reg_print_fct_debug("reg_f3d_sym<T>::AllocateVoxelBasedMeasureGradient");
 #endif
@@ -518,46 +641,6 @@ void reg_f3d_sym<T>::Initialise()
       }
    }
 
-   // Set the floating mask image pyramid
-   if(this->usePyramid)
-   {
-      this->floatingMaskPyramid = (int **)malloc(this->levelToPerform*sizeof(int *));
-      this->backwardActiveVoxelNumber= (int *)malloc(this->levelToPerform*sizeof(int));
-   }
-   else
-   {
-      this->floatingMaskPyramid = (int **)malloc(sizeof(int *));
-      this->backwardActiveVoxelNumber= (int *)malloc(sizeof(int));
-   }
-
-   if(this->usePyramid)
-   {
-      if (this->floatingMaskImage!=NULL)
-         reg_createMaskPyramid<T>(this->floatingMaskImage,
-                                  this->floatingMaskPyramid,
-                                  this->levelNumber,
-                                  this->levelToPerform,
-                                  this->backwardActiveVoxelNumber);
-      else
-      {
-         for(unsigned int l=0; l<this->levelToPerform; ++l)
-         {
-            this->backwardActiveVoxelNumber[l]=this->floatingPyramid[l]->nx*this->floatingPyramid[l]->ny*this->floatingPyramid[l]->nz;
-            this->floatingMaskPyramid[l]=(int *)calloc(backwardActiveVoxelNumber[l],sizeof(int));
-         }
-      }
-   }
-   else  // no pyramid
-   {
-      if (this->floatingMaskImage!=NULL)
-         reg_createMaskPyramid<T>(this->floatingMaskImage, this->floatingMaskPyramid, 1, 1, this->backwardActiveVoxelNumber);
-      else
-      {
-         this->backwardActiveVoxelNumber[0]=this->floatingPyramid[0]->nx*this->floatingPyramid[0]->ny*this->floatingPyramid[0]->nz;
-         this->floatingMaskPyramid[0]=(int *)calloc(backwardActiveVoxelNumber[0],sizeof(int));
-      }
-   }
-
 #ifdef NDEBUG
    if(this->verbose)
    {
@@ -582,18 +665,48 @@ void reg_f3d_sym<T>::Initialise()
 template <class T>
 void reg_f3d_sym<T>::GetDeformationField()
 {
-   reg_spline_getDeformationField(this->controlPointGrid,
-                                  this->deformationFieldImage,
-                                  this->currentMask,
-                                  false, //composition
-                                  true // bspline
-                                  );
-   reg_spline_getDeformationField(this->backwardControlPointGrid,
-                                  this->backwardDeformationFieldImage,
-                                  this->currentFloatingMask,
-                                  false, //composition
-                                  true // bspline
-                                  );
+   // The two directions are independent and are run concurrently, each on
+   // half of the threads, when enough threads are available
+   int previousLevels;
+   bool concurrent=reg_beginConcurrentSections(&previousLevels);
+#pragma omp parallel sections num_threads(2) if(concurrent)
+   {
+#pragma omp section
+      {
+         try
+         {
+            reg_setSectionThreadNumber(concurrent, 0);
+            reg_spline_getDeformationField(this->controlPointGrid,
+                                           this->deformationFieldImage,
+                                           this->currentMask,
+                                           false, //composition
+                                           true // bspline
+                                           );
+         }
+         catch(...)
+         {
+            reg_failSection();
+         }
+      }
+#pragma omp section
+      {
+         try
+         {
+            reg_setSectionThreadNumber(concurrent, 1);
+            reg_spline_getDeformationField(this->backwardControlPointGrid,
+                                           this->backwardDeformationFieldImage,
+                                           this->currentFloatingMask,
+                                           false, //composition
+                                           true // bspline
+                                           );
+         }
+         catch(...)
+         {
+            reg_failSection();
+         }
+      }
+   }
+   reg_endConcurrentSections(concurrent, previousLevels);
 #ifndef NDEBUG
    reg_print_fct_debug("reg_f3d_sym<T>::GetDeformationField");
 #endif
@@ -607,61 +720,94 @@ void reg_f3d_sym<T>::WarpFloatingImage(int inter)
    // Compute the deformation fields
    this->GetDeformationField();
 
-   // Resample the floating image
-#ifndef HAVE_R
-   if(this->measure_dti==NULL)
-#endif
-   {
-      reg_resampleImage(this->currentFloating,
-                        this->warped,
-                        this->deformationFieldImage,
-                        this->currentMask,
-                        inter,
-                        this->warpedPaddingValue);
-   }
-#ifndef HAVE_R
-   else
-   {
-      reg_defField_getJacobianMatrix(this->deformationFieldImage,
-                                     this->forwardJacobianMatrix);
-      reg_resampleImage(this->currentFloating,
-                        this->warped,
-                        this->deformationFieldImage,
-                        this->currentMask,
-                        inter,
-                        this->warpedPaddingValue,
-                        this->measure_dti->GetActiveTimepoints(),
-                        this->forwardJacobianMatrix);
-   }
-#endif
-
-   // Resample the reference image
-#ifndef HAVE_R
-   if(this->measure_dti==NULL)
-#endif
-   {
-      reg_resampleImage(this->currentReference, // input image
-                        this->backwardWarped, // warped input image
-                        this->backwardDeformationFieldImage, // deformation field
-                        this->currentFloatingMask, // mask
-                        inter, // interpolation type
-                        this->warpedPaddingValue); // padding value
-   }
-#ifndef HAVE_R
-   else
+   int previousLevels;
+   bool concurrent=reg_beginConcurrentSections(&previousLevels);
+#pragma omp parallel sections num_threads(2) if(concurrent)
    {
-      reg_defField_getJacobianMatrix(this->backwardDeformationFieldImage,
-                                     this->backwardJacobianMatrix);
-      reg_resampleImage(this->currentReference, // input image
-                        this->backwardWarped, // warped input image
-                        this->backwardDeformationFieldImage, // deformation field
-                        this->currentFloatingMask, // mask
-                        inter, // interpolation type
-                        this->warpedPaddingValue, // padding value
-                        this->measure_dti->GetActiveTimepoints(),
-                        this->backwardJacobianMatrix);
+#pragma omp section
+      {
+         try
+         {
+            reg_setSectionThreadNumber(concurrent, 0);
+            // Resample the floating image
+   #ifndef HAVE_R
+            if(this->measure_dti==NULL)
+   #endif
+            {
+               reg_resampleImage(this->currentFloating,
+                                 this->warped,
+                                 this->deformationFieldImage,
+                                 this->currentMask,
+                                 inter,
+                                 this->warpedPaddingValue,
+                                 NULL,
+                                 NULL,
+                                 this->currentActiveVoxels);
+            }
+   #ifndef HAVE_R
+            else
+            {
+               reg_defField_getJacobianMatrix(this->deformationFieldImage,
+                                              this->forwardJacobianMatrix);
+               reg_resampleImage(this->currentFloating,
+                                 this->warped,
+                                 this->deformationFieldImage,
+                                 this->currentMask,
+                                 inter,
+                                 this->warpedPaddingValue,
+                                 this->measure_dti->GetActiveTimepoints(),
+                                 this->forwardJacobianMatrix);
+            }
+   #endif
+         }
+         catch(...)
+         {
+            reg_failSection();
+         }
+      }
+#pragma omp section
+      {
+         try
+         {
+            reg_setSectionThreadNumber(concurrent, 1);
+            // Resample the reference image
+   #ifndef HAVE_R
+            if(this->measure_dti==NULL)
+   #endif
+            {
+               reg_resampleImage(this->currentReference, // input image
+                                 this->backwardWarped, // warped input image
+                                 this->backwardDeformationFieldImage, // deformation field
+                                 this->currentFloatingMask, // mask
+                                 inter, // interpolation type
+                                 this->warpedPaddingValue, // padding value
+                                 NULL,
+                                 NULL,
+                                 this->currentFloatingActiveVoxels); // active voxel list
+            }
+   #ifndef HAVE_R
+            else
+            {
+               reg_defField_getJacobianMatrix(this->backwardDeformationFieldImage,
+                                              this->backwardJacobianMatrix);
+               reg_resampleImage(this->currentReference, // input image
+                                 this->backwardWarped, // warped input image
+                                 this->backwardDeformationFieldImage, // deformation field
+                                 this->currentFloatingMask, // mask
+                                 inter, // interpolation type
+                                 this->warpedPaddingValue, // padding value
+                                 this->measure_dti->GetActiveTimepoints(),
+                                 this->backwardJacobianMatrix);
+            }
+   #endif
+         }
+         catch(...)
+         {
+            reg_failSection();
+         }
+      }
    }
-#endif
+   reg_endConcurrentSections(concurrent, previousLevels);
 #ifndef NDEBUG
    reg_print_fct_debug("reg_f3d_sym<T>::WarpFloatingImage");
 #endif
@@ -682,13 +828,17 @@ double reg_f3d_sym<T>::ComputeJacobianBasedPenaltyTerm(int type)
    {
       backwardPenaltyTerm = reg_spline_getJacobianPenaltyTerm(this->backwardControlPointGrid,
                                                               this->currentFloating,
-                                                              false);
+                                                              false,
+                                                              false,
+                                                              this->backwardJacobianCache);
    }
    else
    {
       backwardPenaltyTerm = reg_spline_getJacobianPenaltyTerm(this->backwardControlPointGrid,
                                                               this->currentFloating,
-                                                              this->jacobianLogApproximation);
+                                                              this->jacobianLogApproximation,
+                                                              false,
+                                                              this->backwardJacobianCache);
    }
    unsigned int maxit=5;
    if(type>0) maxit=20;
@@ -699,13 +849,15 @@ double reg_f3d_sym<T>::ComputeJacobianBasedPenaltyTerm(int type)
       {
          backwardPenaltyTerm = reg_spline_correctFolding(this->backwardControlPointGrid,
                                                          this->currentFloating,
-                                                         false);
+                                                         false,
+                                                         this->backwardJacobianCache);
       }
       else
       {
          backwardPenaltyTerm = reg_spline_correctFolding(this->backwardControlPointGrid,
                                                          this->currentFloating,
-                                                         this->jacobianLogApproximation);
+                                                         this->jacobianLogApproximation,
+                                                         this->backwardJacobianCache);
       }
 #ifndef NDEBUG
       reg_print_msg_debug("Folding correction - Backward transformation");
@@ -750,9 +902,37 @@ double reg_f3d_sym<T>::ComputeBendingEnergyPenaltyTerm()
 {
    if (this->bendingEnergyWeight<=0) return 0.;
 
-   double forwardPenaltyTerm=reg_f3d<T>::ComputeBendingEnergyPenaltyTerm();
-
-   double value = reg_spline_approxBendingEnergy(this->backwardControlPointGrid);
+   double forwardPenaltyTerm=0., value=0.;
+   int previousLevels;
+   bool concurrent=reg_beginConcurrentSections(&previousLevels);
+#pragma omp parallel sections num_threads(2) if(concurrent)
+   {
+#pragma omp section
+      {
+         try
+         {
+            reg_setSectionThreadNumber(concurrent, 0);
+            forwardPenaltyTerm=reg_f3d<T>::ComputeBendingEnergyPenaltyTerm();
+         }
+         catch(...)
+         {
+            reg_failSection();
+         }
+      }
+#pragma omp section
+      {
+         try
+         {
+            reg_setSectionThreadNumber(concurrent, 1);
+            value = reg_spline_approxBendingEnergy(this->backwardControlPointGrid);
+         }
+         catch(...)
+         {
+            reg_failSection();
+         }
+      }
+   }
+   reg_endConcurrentSections(concurrent, previousLevels);
 #ifndef NDEBUG
    reg_print_fct_debug("reg_f3d_sym<T>::ComputeBendingEnergyPenaltyTerm");
 #endif
@@ -765,9 +945,37 @@ double reg_f3d_sym<T>::ComputeLinearEnergyPenaltyTerm()
 {
    if(this->linearEnergyWeight<=0) return 0.;
 
-   double forwardPenaltyTerm=reg_f3d<T>::ComputeLinearEnergyPenaltyTerm();
-
-   double backwardPenaltyTerm = this->linearEnergyWeight*reg_spline_approxLinearEnergy(this->backwardControlPointGrid);
+   double forwardPenaltyTerm=0., backwardPenaltyTerm=0.;
+   int previousLevels;
+   bool concurrent=reg_beginConcurrentSections(&previousLevels);
+#pragma omp parallel sections num_threads(2) if(concurrent)
+   {
+#pragma omp section
+      {
+         try
+         {
+            reg_setSectionThreadNumber(concurrent, 0);
+            forwardPenaltyTerm=reg_f3d<T>::ComputeLinearEnergyPenaltyTerm();
+         }
+         catch(...)
+         {
+            reg_failSection();
+         }
+      }
+#pragma omp section
+      {
+         try
+         {
+            reg_setSectionThreadNumber(concurrent, 1);
+            backwardPenaltyTerm = this->linearEnergyWeight*reg_spline_approxLinearEnergy(this->backwardControlPointGrid);
+         }
+         catch(...)
+         {
+            reg_failSection();
+         }
+      }
+   }
+   reg_endConcurrentSections(concurrent, previousLevels);
 
 #ifndef NDEBUG
    reg_print_fct_debug("reg_f3d_sym<T>::ComputeLinearEnergyPenaltyTerm");
@@ -815,21 +1023,56 @@ void reg_f3d_sym<T>::GetVoxelBasedGradient()
 
 
    for(int t=0; t<this->currentReference->nt; ++t){
-      reg_getImageGradient(this->currentFloating,
-                           this->warImgGradient,
-                           this->deformationFieldImage,
-                           this->currentMask,
-                           this->interpolation,
-                           this->warpedPaddingValue,
-                           t);
-
-      reg_getImageGradient(this->currentReference,
-                           this->backwardWarpedGradientImage,
-                           this->backwardDeformationFieldImage,
-                           this->currentFloatingMask,
-                           this->interpolation,
-                           this->warpedPaddingValue,
-                           t);
+      int previousLevels;
+      bool concurrent=reg_beginConcurrentSections(&previousLevels);
+#pragma omp parallel sections num_threads(2) if(concurrent)
+      {
+#pragma omp section
+         {
+            try
+            {
+               reg_setSectionThreadNumber(concurrent, 0);
+               reg_getImageGradient(this->currentFloating,
+                                    this->warImgGradient,
+                                    this->deformationFieldImage,
+                                    this->currentMask,
+                                    this->interpolation,
+                                    this->warpedPaddingValue,
+                                    t,
+                                    NULL,
+                                    NULL,
+                                    NULL,
+                                    this->currentActiveVoxels);
+            }
+            catch(...)
+            {
+               reg_failSection();
+            }
+         }
+#pragma omp section
+         {
+            try
+            {
+               reg_setSectionThreadNumber(concurrent, 1);
+               reg_getImageGradient(this->currentReference,
+                                    this->backwardWarpedGradientImage,
+                                    this->backwardDeformationFieldImage,
+                                    this->currentFloatingMask,
+                                    this->interpolation,
+                                    this->warpedPaddingValue,
+                                    t,
+                                    NULL,
+                                    NULL,
+                                    NULL,
+                                    this->currentFloatingActiveVoxels);
+            }
+            catch(...)
+            {
+               reg_failSection();
+            }
+         }
+      }
+      reg_endConcurrentSections(concurrent, previousLevels);
 
       // The gradient of the various measures of similarity are computed
       if(this->measure_nmi!=NULL)
@@ -863,56 +1106,56 @@ void reg_f3d_sym<T>::GetVoxelBasedGradient()
 template <class T>
 void reg_f3d_sym<T>::GetSimilarityMeasureGradient()
 {
-   reg_f3d<T>::GetSimilarityMeasureGradient();
+   this->GetVoxelBasedGradient();
 
-   // The voxel based sim measure gradient is convolved with a spline kernel
-   // Convolution along the x axis
-   float currentNodeSpacing[3];
-   currentNodeSpacing[0]=currentNodeSpacing[1]=currentNodeSpacing[2]=this->backwardControlPointGrid->dx;
-   bool activeAxis[3]= {1,0,0};
-   reg_tools_kernelConvolution(this->backwardVoxelBasedMeasureGradientImage,
-                               currentNodeSpacing,
-                               CUBIC_SPLINE_KERNEL, // cubic spline kernel
-                               NULL, // mask
-                               NULL, // all volumes are active
-                               activeAxis
-                               );
-   // Convolution along the y axis
-   currentNodeSpacing[0]=currentNodeSpacing[1]=currentNodeSpacing[2]=this->backwardControlPointGrid->dy;
-   activeAxis[0]=0;
-   activeAxis[1]=1;
-   reg_tools_kernelConvolution(this->backwardVoxelBasedMeasureGradientImage,
-                               currentNodeSpacing,
-                               CUBIC_SPLINE_KERNEL, // cubic spline kernel
-                               NULL, // mask
-                               NULL, // all volumes are active
-                               activeAxis
-                               );
-   // Convolution along the z axis if required
-   if(this->voxelBasedMeasureGradient->nz>1)
+   // Each voxel based gradient is projected onto its own grid
+   mat44 forwardReorientation, backwardReorientation;
+   if(this->currentFloating->sform_code>0)
+      forwardReorientation = this->currentFloating->sto_ijk;
+   else forwardReorientation = this->currentFloating->qto_ijk;
+   if(this->currentReference->sform_code>0)
+      backwardReorientation = this->currentReference->sto_ijk;
+   else backwardReorientation = this->currentReference->qto_ijk;
+   int previousLevels;
+   bool concurrent=reg_beginConcurrentSections(&previousLevels);
+#pragma omp parallel sections num_threads(2) if(concurrent)
    {
-      currentNodeSpacing[0]=currentNodeSpacing[1]=currentNodeSpacing[2]=this->backwardControlPointGrid->dz;
-      activeAxis[1]=0;
-      activeAxis[2]=1;
-      reg_tools_kernelConvolution(this->backwardVoxelBasedMeasureGradientImage,
-                                  currentNodeSpacing,
-                                  CUBIC_SPLINE_KERNEL, // cubic spline kernel
-                                  NULL, // mask
-                                  NULL, // all volumes are active
-                                  activeAxis
-                                  );
+#pragma omp section
+      {
+         try
+         {
+            reg_setSectionThreadNumber(concurrent, 0);
+            reg_spline_projectVoxelGradient(this->transformationGradient,
+                                            this->voxelBasedMeasureGradient,
+                                            this->similarityWeight,
+                                            false, // no update
+                                            &forwardReorientation // voxel to mm conversion
+                                            );
+         }
+         catch(...)
+         {
+            reg_failSection();
+         }
+      }
+#pragma omp section
+      {
+         try
+         {
+            reg_setSectionThreadNumber(concurrent, 1);
+            reg_spline_projectVoxelGradient(this->backwardTransformationGradient,
+                                            this->backwardVoxelBasedMeasureGradientImage,
+                                            this->similarityWeight,
+                                            false, // no update
+                                            &backwardReorientation // voxel to mm conversion
+                                            );
+         }
+         catch(...)
+         {
+            reg_failSection();
+         }
+      }
    }
-   // The backward node based sim measure gradient is extracted
-   mat44 reorientation;
-   if(this->currentReference->sform_code>0)
-      reorientation = this->currentReference->sto_ijk;
-   else reorientation = this->currentReference->qto_ijk;
-   reg_voxelCentric2NodeCentric(this->backwardTransformationGradient,
-                                this->backwardVoxelBasedMeasureGradientImage,
-                                this->similarityWeight,
-                                false, // no update
-                                &reorientation // voxel to mm conversion
-                                );
+   reg_endConcurrentSections(concurrent, previousLevels);
 #ifndef NDEBUG
    reg_print_fct_debug("reg_f3d_sym<T>::GetSimilarityMeasureGradient");
 #endif
@@ -925,13 +1168,42 @@ void reg_f3d_sym<T>::GetJacobianBasedGradient()
 {
    if(this->jacobianLogWeight<=0) return;
 
-   reg_f3d<T>::GetJacobianBasedGradient();
-
-   reg_spline_getJacobianPenaltyTermGradient(this->backwardControlPointGrid,
-                                             this->currentFloating,
-                                             this->backwardTransformationGradient,
-                                             this->jacobianLogWeight,
-                                             this->jacobianLogApproximation);
+   int previousLevels;
+   bool concurrent=reg_beginConcurrentSections(&previousLevels);
+#pragma omp parallel sections num_threads(2) if(concurrent)
+   {
+#pragma omp section
+      {
+         try
+         {
+            reg_setSectionThreadNumber(concurrent, 0);
+            reg_f3d<T>::GetJacobianBasedGradient();
+         }
+         catch(...)
+         {
+            reg_failSection();
+         }
+      }
+#pragma omp section
+      {
+         try
+         {
+            reg_setSectionThreadNumber(concurrent, 1);
+            reg_spline_getJacobianPenaltyTermGradient(this->backwardControlPointGrid,
+                                                      this->currentFloating,
+                                                      this->backwardTransformationGradient,
+                                                      this->jacobianLogWeight,
+                                                      this->jacobianLogApproximation,
+                                                      false,
+                                                      this->backwardJacobianCache);
+         }
+         catch(...)
+         {
+            reg_failSection();
+         }
+      }
+   }
+   reg_endConcurrentSections(concurrent, previousLevels);
 #ifndef NDEBUG
    reg_print_fct_debug("reg_f3d_sym<T>::GetJacobianBasedGradient");
 #endif
@@ -944,10 +1216,38 @@ void reg_f3d_sym<T>::GetBendingEnergyGradient()
 {
    if(this->bendingEnergyWeight<=0) return;
 
-   reg_f3d<T>::GetBendingEnergyGradient();
-   reg_spline_approxBendingEnergyGradient(this->backwardControlPointGrid,
-                                          this->backwardTransformationGradient,
-                                          this->bendingEnergyWeight);
+   int previousLevels;
+   bool concurrent=reg_beginConcurrentSections(&previousLevels);
+#pragma omp parallel sections num_threads(2) if(concurrent)
+   {
+#pragma omp section
+      {
+         try
+         {
+            reg_setSectionThreadNumber(concurrent, 0);
+            reg_f3d<T>::GetBendingEnergyGradient();
+         }
+         catch(...)
+         {
+            reg_failSection();
+         }
+      }
+#pragma omp section
+      {
+         try
+         {
+            reg_setSectionThreadNumber(concurrent, 1);
+            reg_spline_approxBendingEnergyGradient(this->backwardControlPointGrid,
+                                                   this->backwardTransformationGradient,
+                                                   this->bendingEnergyWeight);
+         }
+         catch(...)
+         {
+            reg_failSection();
+         }
+      }
+   }
+   reg_endConcurrentSections(concurrent, previousLevels);
 #ifndef NDEBUG
    reg_print_fct_debug("reg_f3d_sym<T>::GetBendingEnergyGradient");
 #endif
@@ -960,11 +1260,38 @@ void reg_f3d_sym<T>::GetLinearEnergyGradient()
 {
    if(this->linearEnergyWeight<=0) return;
 
-   reg_f3d<T>::GetLinearEnergyGradient();
-
-   reg_spline_approxLinearEnergyGradient(this->backwardControlPointGrid,
-                                         this->transformationGradient,
-                                         this->linearEnergyWeight);
+   int previousLevels;
+   bool concurrent=reg_beginConcurrentSections(&previousLevels);
+#pragma omp parallel sections num_threads(2) if(concurrent)
+   {
+#pragma omp section
+      {
+         try
+         {
+            reg_setSectionThreadNumber(concurrent, 0);
+            reg_f3d<T>::GetLinearEnergyGradient();
+         }
+         catch(...)
+         {
+            reg_failSection();
+         }
+      }
+#pragma omp section
+      {
+         try
+         {
+            reg_setSectionThreadNumber(concurrent, 1);
+            reg_spline_approxLinearEnergyGradient(this->backwardControlPointGrid,
+                                                  this->backwardTransformationGradient,
+                                                  this->linearEnergyWeight);
+         }
+         catch(...)
+         {
+            reg_failSection();
+         }
+      }
+   }
+   reg_endConcurrentSections(concurrent, previousLevels);
 #ifndef NDEBUG
    reg_print_fct_debug("reg_f3d_sym<T>::GetLinearEnergyGradient");
 #endif
@@ -1008,7 +1335,9 @@ void reg_f3d_sym<T>::SmoothGradient()
 template <class T>
 void reg_f3d_sym<T>::GetApproximatedGradient()
 {
-   reg_f3d<T>::GetApproximatedGradient();
+   // Both grids enter the symmetric objective, through the backward measure
+   // and the inverse consistency, so every perturbation is evaluated in full
+   reg_f3d<T>::GetFullApproximatedGradient();
 
    // Loop over every control points
    T *gridPtr = static_cast<T *>(this->backwardControlPointGrid->data);
@@ -1184,21 +1513,49 @@ void reg_f3d_sym<T>::GetInverseConsistencyErrorField(bool forceAll)
       this->GetDeformationField();
    }
    // Compose the obtained deformation fields by the inverse transformations
-   reg_spline_getDeformationField(this->backwardControlPointGrid,
-                                  this->deformationFieldImage,
-                                  this->currentMask,
-                                  true, // composition
-                                  true // use B-Spline
-                                  );
-   reg_spline_getDeformationField(this->controlPointGrid,
-                                  this->backwardDeformationFieldImage,
-                                  this->currentFloatingMask,
-                                  true, // composition
-                                  true // use B-Spline
-                                  );
-   // Convert the deformation fields into displacement
-   reg_getDisplacementFromDeformation(this->deformationFieldImage);
-   reg_getDisplacementFromDeformation(this->backwardDeformationFieldImage);
+   int previousLevels;
+   bool concurrent=reg_beginConcurrentSections(&previousLevels);
+#pragma omp parallel sections num_threads(2) if(concurrent)
+   {
+#pragma omp section
+      {
+         try
+         {
+            reg_setSectionThreadNumber(concurrent, 0);
+            reg_spline_getDeformationField(this->backwardControlPointGrid,
+                                           this->deformationFieldImage,
+                                           this->currentMask,
+                                           true, // composition
+                                           true // use B-Spline
+                                           );
+            // Convert the deformation field into displacement
+            reg_getDisplacementFromDeformation(this->deformationFieldImage);
+         }
+         catch(...)
+         {
+            reg_failSection();
+         }
+      }
+#pragma omp section
+      {
+         try
+         {
+            reg_setSectionThreadNumber(concurrent, 1);
+            reg_spline_getDeformationField(this->controlPointGrid,
+                                           this->backwardDeformationFieldImage,
+                                           this->currentFloatingMask,
+                                           true, // composition
+                                           true // use B-Spline
+                                           );
+            reg_getDisplacementFromDeformation(this->backwardDeformationFieldImage);
+         }
+         catch(...)
+         {
+            reg_failSection();
+         }
+      }
+   }
+   reg_endConcurrentSections(concurrent, previousLevels);
 
 #ifndef NDEBUG
    reg_print_fct_debug("reg_f3d_sym<T>::GetInverseConsistencyErrorField");
@@ -1539,6 +1896,7 @@ void reg_f3d_sym<T>::UpdateBestObjFunctionValue()
 {
    reg_f3d<T>::UpdateBestObjFunctionValue();
    this->bestIC=this->currentIC;
+   this->backwardJacobianCache->Retain();
 #ifndef NDEBUG
    reg_print_fct_debug("reg_f3d_sym<T>::UpdateBestObjFunctionValue");
 #endif
@@ -1628,6 +1986,9 @@ void reg_f3d_sym<T>::InitialiseSimilarity()
                                            this->backwardWarpedGradientImage,
                                            this->backwardVoxelBasedMeasureGradientImage
                                            );
+   if(this->measure_nmi!=NULL)
+      this->measure_nmi->SetActiveVoxelLists(this->currentActiveVoxels,
+                                             this->currentFloatingActiveVoxels);
 
 #ifndef HAVE_R
    if(this->measure_ssd!=NULL)
@@ -14,7 +14,9 @@
 
 #include "_reg_f3d.h"
 
-/// @brief Symmetric Fast Free Form Deformation registration class
+/// @brief Symmetric Fast Free Form Deformation registration class. The forward
+/// and backward halves of each stage are independent, and are run concurrently
+/// on split thread teams when enough threads are available
 template <class T>
 class reg_f3d_sym : public reg_f3d<T>
 {
@@ -25,7 +27,9 @@ protected:
    nifti_image *floatingMaskImage;
    int **floatingMaskPyramid;
    int *currentFloatingMask;
+   _reg_activeVoxelList *currentFloatingActiveVoxels;
    int *backwardActiveVoxelNumber;
+   reg_jacobianCache *backwardJacobianCache;
 
    nifti_image *backwardControlPointGrid;
    nifti_image *backwardDeformationFieldImage;
@@ -56,6 +60,11 @@ protected:
    virtual void ClearTransformationGradient();
    virtual T InitialiseCurrentLevel();
    virtual void ClearCurrentInputImage();
+   virtual void AllocatePyramidLevel(unsigned int);
+   virtual void ClearPyramidLevel(unsigned int);
+   virtual size_t GetCurrentMemoryUsage();
+   virtual void GetCheckpointState(reg_checkpointState &);
+   virtual void SetCheckpointState(const reg_checkpointState &);
 
    virtual double ComputeJacobianBasedPenaltyTerm(int);
    virtual double ComputeBendingEnergyPenaltyTerm();
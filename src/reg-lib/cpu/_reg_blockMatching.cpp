@@ -469,9 +469,11 @@ void block_matching_method3D(nifti_image * reference,
    size_t referenceIndex, warpedIndex, blockIndex, tid = 0;
 
 #if defined (_OPENMP)
+   // The per-thread buffers limit the team to 16 threads, which is requested
+   // for this region alone rather than by changing the caller's setting
    int threadNumber = omp_get_max_threads();
    if (threadNumber > 16)
-      omp_set_num_threads(16);
+      threadNumber = 16;
    DTYPE referenceValues[16][BLOCK_3D_SIZE];
    DTYPE warpedValues[16][BLOCK_3D_SIZE];
    bool referenceOverlap[16][BLOCK_3D_SIZE];
@@ -486,7 +488,7 @@ void block_matching_method3D(nifti_image * reference,
    params->definedActiveBlockNumber = 0;
 
 #if defined (_OPENMP)
-#pragma omp parallel for default(none) \
+#pragma omp parallel for default(none) num_threads(threadNumber) \
    shared(params, reference, warped, referencePtr, warpedPtr, mask, referenceMatrix_xyz, \
    referenceOverlap, warpedOverlap, referenceValues, warpedValues) \
    private(i, j, k, l, m, n, x, y, z, blockIndex, referenceIndex, \
@@ -661,10 +663,6 @@ void block_matching_method3D(nifti_image * reference,
          }
       }
    }
-
-#if defined (_OPENMP)
-   omp_set_num_threads(threadNumber);
-#endif
 }
 /* *************************************************************** */
 // Block matching interface function
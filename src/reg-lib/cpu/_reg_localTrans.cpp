@@ -10,6 +10,7 @@
  */
 
 #include <cmath>
+#include <vector>
 #include "_reg_localTrans.h"
 #include "_reg_maths_eigen.h"
 
@@ -1731,6 +1732,280 @@ void reg_voxelCentric2NodeCentric(nifti_image *nodeImage,
 }
 /* *************************************************************** */
 /* *************************************************************** */
+template<class DTYPE>
+void reg_spline_projectVoxelGradient_core(nifti_image *nodeImage,
+                                          nifti_image *voxelImage,
+                                          float weight,
+                                          bool update,
+                                          mat33 reorientation
+                                          )
+{
+   int nodeDim[3] = {nodeImage->nx, nodeImage->ny, nodeImage->nz};
+   int voxelDim[3] = {voxelImage->nx, voxelImage->ny, voxelImage->nz};
+   size_t nodeNumber = (size_t)nodeDim[0]*nodeDim[1]*nodeDim[2];
+   size_t voxelNumber = (size_t)voxelDim[0]*voxelDim[1]*voxelDim[2];
+   int componentNumber = voxelImage->nz>1?3:2;
+   DTYPE *nodePtr = static_cast<DTYPE *>(nodeImage->data);
+   DTYPE *voxelPtr = static_cast<DTYPE *>(voxelImage->data);
+
+   // The basis values along each axis are computed as in the deformation
+   // field kernel: voxel v depends on nodes preIndex[v] to preIndex[v]+3. In
+   // 2D the single plane is attached to the first node along z
+   DTYPE gridVoxelSpacing[3];
+   gridVoxelSpacing[0] = nodeImage->dx / voxelImage->dx;
+   gridVoxelSpacing[1] = nodeImage->dy / voxelImage->dy;
+   gridVoxelSpacing[2] = nodeImage->dz / voxelImage->dz;
+   std::vector<int> preIndex[3];
+   std::vector<DTYPE> basisValues[3];
+   for(int a=0; a<3; ++a)
+   {
+      preIndex[a].resize(voxelDim[a]);
+      basisValues[a].assign(4*voxelDim[a], 0);
+      for(int v=0; v<voxelDim[a]; ++v)
+      {
+         if(a==2 && voxelImage->nz==1)
+         {
+            preIndex[a][v]=0;
+            basisValues[a][4*v]=1;
+         }
+         else
+         {
+            preIndex[a][v]=static_cast<int>(static_cast<DTYPE>(v)/gridVoxelSpacing[a]);
+            DTYPE basis=static_cast<DTYPE>(v)/gridVoxelSpacing[a]-static_cast<DTYPE>(preIndex[a][v]);
+            if(basis<0.0) basis=0.0; //rounding error
+            get_BSplineBasisValues<DTYPE>(basis, &basisValues[a][4*v]);
+         }
+      }
+   }
+   int *preX = &preIndex[0][0], *preY = &preIndex[1][0], *preZ = &preIndex[2][0];
+   DTYPE *basisX = &basisValues[0][0], *basisY = &basisValues[1][0], *basisZ = &basisValues[2][0];
+
+   // The weights are separable, so the sums are formed one axis at a time,
+   // each pass reducing that axis from voxel to node resolution. Every voxel
+   // is then visited once, for the four nodes it depends on, rather than
+   // once per node of its support
+   size_t planeX = (size_t)nodeDim[0]*voxelDim[1];
+   size_t planeY = (size_t)nodeDim[0]*nodeDim[1];
+   std::vector<DTYPE> bufferX((size_t)componentNumber*planeX*voxelDim[2], 0);
+   std::vector<DTYPE> bufferY((size_t)componentNumber*planeY*voxelDim[2], 0);
+   std::vector<DTYPE> bufferZ((size_t)componentNumber*nodeNumber, 0);
+   DTYPE *bufferXPtr = &bufferX[0], *bufferYPtr = &bufferY[0], *bufferZPtr = &bufferZ[0];
+
+   // Along x, one row of voxels at a time
+   int rowNumber = componentNumber*voxelDim[1]*voxelDim[2];
+   int row, plane, x, y, z, k;
+#if defined (_OPENMP)
+#pragma omp parallel for default(none) \
+   shared(rowNumber, voxelDim, nodeDim, voxelNumber, voxelPtr, bufferXPtr, preX, basisX) \
+   private(row, x, k)
+#endif
+   for(row=0; row<rowNumber; ++row)
+   {
+      int c = row / (voxelDim[1]*voxelDim[2]);
+      size_t rowIndex = (size_t)(row % (voxelDim[1]*voxelDim[2]));
+      DTYPE *in = &voxelPtr[c*voxelNumber+rowIndex*voxelDim[0]];
+      DTYPE *out = &bufferXPtr[(size_t)row*nodeDim[0]];
+      for(x=0; x<voxelDim[0]; ++x)
+      {
+         DTYPE value = in[x];
+         // Undefined gradient values do not contribute
+         if(value!=value) continue;
+         for(k=0; k<4; ++k)
+         {
+            if(preX[x]+k<nodeDim[0])
+               out[preX[x]+k] += basisX[4*x+k] * value;
+         }
+      }
+   }
+   // Along y, one plane at a time, in which rows of nodes are contiguous
+   int planeNumber = componentNumber*voxelDim[2];
+#if defined (_OPENMP)
+#pragma omp parallel for default(none) \
+   shared(planeNumber, voxelDim, nodeDim, planeX, planeY, bufferXPtr, bufferYPtr, preY, basisY) \
+   private(plane, x, y, k)
+#endif
+   for(plane=0; plane<planeNumber; ++plane)
+   {
+      DTYPE *in = &bufferXPtr[(size_t)plane*planeX];
+      DTYPE *out = &bufferYPtr[(size_t)plane*planeY];
+      for(y=0; y<voxelDim[1]; ++y)
+      {
+         for(k=0; k<4; ++k)
+         {
+            if(preY[y]+k<nodeDim[1])
+            {
+               DTYPE basis = basisY[4*y+k];
+               DTYPE *outRow = &out[(size_t)(preY[y]+k)*nodeDim[0]];
+               DTYPE *inRow = &in[(size_t)y*nodeDim[0]];
+               for(x=0; x<nodeDim[0]; ++x)
+                  outRow[x] += basis * inRow[x];
+            }
+         }
+      }
+   }
+   // Along z, one plane of nodes at a time
+   planeNumber = componentNumber*nodeDim[2];
+#if defined (_OPENMP)
+#pragma omp parallel for default(none) \
+   shared(planeNumber, voxelDim, nodeDim, planeY, bufferYPtr, bufferZPtr, preZ, basisZ) \
+   private(plane, x, z, k)
+#endif
+   for(plane=0; plane<planeNumber; ++plane)
+   {
+      int c = plane / nodeDim[2];
+      int nodeZ = plane % nodeDim[2];
+      DTYPE *out = &bufferZPtr[(size_t)plane*planeY];
+      for(z=0; z<voxelDim[2]; ++z)
+      {
+         k = nodeZ - preZ[z];
+         if(k<0 || k>3) continue;
+         DTYPE basis = basisZ[4*z+k];
+         DTYPE *in = &bufferYPtr[((size_t)c*voxelDim[2]+z)*planeY];
+         for(x=0; x<(int)planeY; ++x)
+            out[x] += basis * in[x];
+      }
+   }
+
+   // The node values are reoriented and weighted
+#ifdef WIN32
+   long node;
+   long nodeNumberLoop = (long)nodeNumber;
+#else
+   size_t node;
+   size_t nodeNumberLoop = nodeNumber;
+#endif
+#if defined (_OPENMP)
+#pragma omp parallel for default(none) \
+   shared(nodeNumberLoop, nodeNumber, componentNumber, nodePtr, bufferZPtr, \
+   weight, update, reorientation) \
+   private(node)
+#endif
+   for(node=0; node<nodeNumberLoop; ++node)
+   {
+      DTYPE sum[3] = {0,0,0};
+      for(int c=0; c<componentNumber; ++c)
+         sum[c] = bufferZPtr[c*nodeNumber+node];
+      DTYPE reorientedValue[3]={0,0,0};
+      reorientedValue[0] =
+            reorientation.m[0][0] * sum[0] +
+            reorientation.m[1][0] * sum[1] +
+            reorientation.m[2][0] * sum[2] ;
+      reorientedValue[1] =
+            reorientation.m[0][1] * sum[0] +
+            reorientation.m[1][1] * sum[1] +
+            reorientation.m[2][1] * sum[2] ;
+      if(componentNumber>2)
+         reorientedValue[2] =
+               reorientation.m[0][2] * sum[0] +
+               reorientation.m[1][2] * sum[1] +
+               reorientation.m[2][2] * sum[2] ;
+      for(int c=0; c<componentNumber; ++c)
+      {
+         if(update)
+            nodePtr[c*nodeNumber+node] += reorientedValue[c]*static_cast<DTYPE>(weight);
+         else nodePtr[c*nodeNumber+node] = reorientedValue[c]*static_cast<DTYPE>(weight);
+      }
+   }
+}
+/* *************************************************************** */
+extern "C++"
+void reg_spline_projectVoxelGradient(nifti_image *nodeImage,
+                                     nifti_image *voxelImage,
+                                     float weight,
+                                     bool update,
+                                     mat44 *voxelToMillimeter
+                                     )
+{
+   if(nodeImage->datatype!=voxelImage->datatype)
+   {
+      reg_print_fct_error("reg_spline_projectVoxelGradient");
+      reg_print_msg_error("Both input images do not have the same type");
+      reg_exit();
+   }
+
+   // The direct projection assumes the layout used to compute a deformation
+   // field without composition, in which the first node lies one spacing
+   // before the first voxel and the axes of the grid and image coincide
+   bool aligned = nodeImage->intent_p1!=LIN_SPLINE_GRID;
+   if(nodeImage->num_ext>0 && nodeImage->ext_list[0].edata!=NULL)
+      aligned=false;
+   if(aligned)
+   {
+      mat44 transformation = nodeImage->sform_code>0 ? nodeImage->sto_xyz : nodeImage->qto_xyz;
+      if(voxelImage->sform_code>0)
+         transformation = reg_mat44_mul(&voxelImage->sto_ijk,&transformation);
+      else transformation = reg_mat44_mul(&voxelImage->qto_ijk,&transformation);
+      float gridVoxelSpacing[3] = {nodeImage->dx / voxelImage->dx,
+                                   nodeImage->dy / voxelImage->dy,
+                                   nodeImage->dz / voxelImage->dz};
+      for(int i=0; i<(voxelImage->nz>1?3:2); ++i)
+      {
+         for(int j=0; j<(voxelImage->nz>1?3:2); ++j)
+         {
+            float expected = (i==j) ? gridVoxelSpacing[i] : 0.f;
+            if(fabs(transformation.m[i][j]-expected) > 1.e-4f*gridVoxelSpacing[i])
+               aligned=false;
+         }
+         if(fabs(transformation.m[i][3]+gridVoxelSpacing[i]) > 1.e-3f*gridVoxelSpacing[i])
+            aligned=false;
+      }
+   }
+
+   if(!aligned)
+   {
+      // Otherwise the gradient is convolved with the spline kernel at full
+      // resolution, and then sampled at the node positions
+      int kernelType = nodeImage->intent_p1==LIN_SPLINE_GRID ? LINEAR_KERNEL : CUBIC_SPLINE_KERNEL;
+      float currentNodeSpacing[3];
+      bool activeAxis[3]= {0,0,0};
+      for(int i=0; i<(voxelImage->nz>1?3:2); ++i)
+      {
+         currentNodeSpacing[0]=currentNodeSpacing[1]=currentNodeSpacing[2]=nodeImage->pixdim[i+1];
+         activeAxis[0]=activeAxis[1]=activeAxis[2]=false;
+         activeAxis[i]=true;
+         reg_tools_kernelConvolution(voxelImage,
+                                     currentNodeSpacing,
+                                     kernelType,
+                                     NULL, // mask
+                                     NULL, // all volumes are considered as active
+                                     activeAxis
+                                     );
+      }
+      reg_voxelCentric2NodeCentric(nodeImage,
+                                   voxelImage,
+                                   weight,
+                                   update,
+                                   voxelToMillimeter
+                                   );
+      return;
+   }
+
+   mat33 reorientation;
+   if(voxelToMillimeter!=NULL)
+      reorientation=reg_mat44_to_mat33(voxelToMillimeter);
+   else reg_mat33_eye(&reorientation);
+
+   switch(nodeImage->datatype)
+   {
+   case NIFTI_TYPE_FLOAT32:
+      reg_spline_projectVoxelGradient_core<float>
+            (nodeImage, voxelImage, weight, update, reorientation);
+      break;
+   case NIFTI_TYPE_FLOAT64:
+      reg_spline_projectVoxelGradient_core<double>
+            (nodeImage, voxelImage, weight, update, reorientation);
+      break;
+   default:
+      reg_print_fct_error("reg_spline_projectVoxelGradient");
+      reg_print_msg_error("Data type not supported");
+      reg_exit();
+   }
+#ifndef NDEBUG
+   reg_print_fct_debug("reg_spline_projectVoxelGradient");
+#endif
+}
+/* *************************************************************** */
+/* *************************************************************** */
 template<class SplineTYPE>
 SplineTYPE GetValue(SplineTYPE *array, int *dim, int x, int y, int z)
 {
@@ -2355,12 +2630,12 @@ void reg_defField_compose2D(nifti_image *deformationField,
    mat44 *df_voxel2Real=NULL;
    if(deformationField->sform_code>0)
    {
-      df_real2Voxel=&(dfToUpdate->sto_ijk);
+      df_real2Voxel=&(deformationField->sto_ijk);
       df_voxel2Real=&(deformationField->sto_xyz);
    }
    else
    {
-      df_real2Voxel=&(dfToUpdate->qto_ijk);
+      df_real2Voxel=&(deformationField->qto_ijk);
       df_voxel2Real=&(deformationField->qto_xyz);
    }
 
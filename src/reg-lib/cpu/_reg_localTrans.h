@@ -94,6 +94,29 @@ void reg_voxelCentric2NodeCentric(nifti_image *nodeImage,
                                   mat44 *voxelToMillimeter = NULL
       );
 /* *************************************************************** */
+/** @brief Project a voxel-based gradient onto the nodes of a cubic
+ * B-spline grid, as the adjoint of reg_spline_getDeformationField().
+ * Each node sums the gradient over its own support, weighted by its
+ * contribution to the deformation of each voxel, so the cost depends on
+ * the number of nodes rather than on the full image resolution. Grids
+ * that are not aligned with the image fall back on a kernel convolution
+ * followed by reg_voxelCentric2NodeCentric(), which modifies voxelImage
+ * @param nodeImage Control point grid image that receives the gradient
+ * @param voxelImage Voxel-based gradient, in the space of the grid's
+ * reference image
+ * @param weight The projected values are multiplied by this weight
+ * @param update The values in node image are incremented if update is
+ * set to true; a blank node image is considered otherwise
+ * @param voxelToMillimeter Matrix used to reorient the gradient
+ */
+extern "C++"
+void reg_spline_projectVoxelGradient(nifti_image *nodeImage,
+                                     nifti_image *voxelImage,
+                                     float weight,
+                                     bool update,
+                                     mat44 *voxelToMillimeter = NULL
+      );
+/* *************************************************************** */
 /** @brief Refine a grid of control points
  * @param referenceImage Image that defined the space of the reference
  * image
@@ -1231,11 +1231,241 @@ void reg_cubic_spline_jacobian3D(nifti_image *splineControlPoint,
    return;
 }
 /* *************************************************************** */
+reg_jacobianCache::reg_jacobianCache()
+{
+   for(int i=0; i<2; ++i)
+   {
+      memset(&this->entries[i], 0, sizeof(reg_jacobianCacheEntry));
+   }
+}
+/* *************************************************************** */
+reg_jacobianCache::~reg_jacobianCache()
+{
+   this->Clear();
+}
+/* *************************************************************** */
+void reg_jacobianCache::ClearEntry(reg_jacobianCacheEntry &entry)
+{
+   if(entry.matrices!=NULL) free(entry.matrices);
+   if(entry.determinants!=NULL) free(entry.determinants);
+   memset(&entry, 0, sizeof(reg_jacobianCacheEntry));
+}
+/* *************************************************************** */
+void reg_jacobianCache::Clear()
+{
+   this->ClearEntry(this->entries[0]);
+   this->ClearEntry(this->entries[1]);
+}
+/* *************************************************************** */
+void reg_jacobianCache::Retain()
+{
+   if(this->entries[0].matrices==NULL)
+      return;
+   // The previously retained entry is released
+   this->ClearEntry(this->entries[1]);
+   this->entries[1]=this->entries[0];
+   memset(&this->entries[0], 0, sizeof(reg_jacobianCacheEntry));
+}
+/* *************************************************************** */
+/* Fill the key of an entry, which holds everything the Jacobian matrices
+ * depend on. The fields of an unused reference image are left to zero.
+ */
+void reg_jacobianCache::SetKey(reg_jacobianCacheEntry &entry,
+                               nifti_image *controlPointGridImage,
+                               nifti_image *referenceImage,
+                               bool approx,
+                               bool useHeaderInformation)
+{
+   entry.approx=approx;
+   entry.useHeaderInformation=useHeaderInformation;
+   entry.gridDim[0]=controlPointGridImage->nx;
+   entry.gridDim[1]=controlPointGridImage->ny;
+   entry.gridDim[2]=controlPointGridImage->nz;
+   entry.gridDim[3]=controlPointGridImage->datatype;
+   entry.gridPixDim[0]=controlPointGridImage->dx;
+   entry.gridPixDim[1]=controlPointGridImage->dy;
+   entry.gridPixDim[2]=controlPointGridImage->dz;
+   if(controlPointGridImage->sform_code>0)
+      entry.gridMatrix=controlPointGridImage->sto_xyz;
+   else entry.gridMatrix=controlPointGridImage->qto_xyz;
+   entry.gridSize=controlPointGridImage->nvox*controlPointGridImage->nbyper;
+   entry.gridHash=reg_tools_getImageDataHash(controlPointGridImage);
+   memset(entry.referenceDim, 0, sizeof(entry.referenceDim));
+   memset(entry.referencePixDim, 0, sizeof(entry.referencePixDim));
+   memset(&entry.referenceMatrix, 0, sizeof(mat44));
+   if(!approx && referenceImage!=NULL)
+   {
+      entry.referenceDim[0]=referenceImage->nx;
+      entry.referenceDim[1]=referenceImage->ny;
+      entry.referenceDim[2]=referenceImage->nz;
+      entry.referencePixDim[0]=referenceImage->dx;
+      entry.referencePixDim[1]=referenceImage->dy;
+      entry.referencePixDim[2]=referenceImage->dz;
+      if(referenceImage->sform_code>0)
+         entry.referenceMatrix=referenceImage->sto_xyz;
+      else entry.referenceMatrix=referenceImage->qto_xyz;
+   }
+}
+/* *************************************************************** */
+bool reg_jacobianCache::Match(reg_jacobianCacheEntry &entry,
+                              nifti_image *controlPointGridImage,
+                              nifti_image *referenceImage,
+                              bool approx,
+                              bool useHeaderInformation)
+{
+   if(entry.matrices==NULL)
+      return false;
+   // The key of the current grid is compared with the stored one. Both are
+   // built the same way, so that unused fields are equal
+   reg_jacobianCacheEntry key;
+   memset(&key, 0, sizeof(reg_jacobianCacheEntry));
+   this->SetKey(key, controlPointGridImage, referenceImage, approx, useHeaderInformation);
+   return key.approx==entry.approx &&
+         key.useHeaderInformation==entry.useHeaderInformation &&
+         memcmp(key.referenceDim, entry.referenceDim, sizeof(key.referenceDim))==0 &&
+         memcmp(key.referencePixDim, entry.referencePixDim, sizeof(key.referencePixDim))==0 &&
+         memcmp(&key.referenceMatrix, &entry.referenceMatrix, sizeof(mat44))==0 &&
+         memcmp(key.gridDim, entry.gridDim, sizeof(key.gridDim))==0 &&
+         memcmp(key.gridPixDim, entry.gridPixDim, sizeof(key.gridPixDim))==0 &&
+         memcmp(&key.gridMatrix, &entry.gridMatrix, sizeof(mat44))==0 &&
+         key.gridSize==entry.gridSize &&
+         key.gridHash==entry.gridHash;
+}
+/* *************************************************************** */
+template<class DTYPE>
+bool reg_jacobianCache::Get(nifti_image *controlPointGridImage,
+                            nifti_image *referenceImage,
+                            bool approx,
+                            bool useHeaderInformation,
+                            mat33 *jacobianMatrices,
+                            DTYPE *jacobianDeterminants)
+{
+   for(int i=0; i<2; ++i)
+   {
+      reg_jacobianCacheEntry &entry=this->entries[i];
+      if(this->Match(entry, controlPointGridImage, referenceImage, approx, useHeaderInformation))
+      {
+         if(jacobianMatrices!=NULL)
+            memcpy(jacobianMatrices, entry.matrices, entry.number*sizeof(mat33));
+         if(jacobianDeterminants!=NULL)
+         {
+            for(size_t j=0; j<entry.number; ++j)
+               jacobianDeterminants[j]=static_cast<DTYPE>(entry.determinants[j]);
+         }
+#ifndef NDEBUG
+         reg_print_msg_debug("The Jacobian matrices and determinants are extracted from the cache");
+#endif
+         return true;
+      }
+   }
+   return false;
+}
+template bool reg_jacobianCache::Get<float>(nifti_image *, nifti_image *, bool, bool, mat33 *, float *);
+template bool reg_jacobianCache::Get<double>(nifti_image *, nifti_image *, bool, bool, mat33 *, double *);
+/* *************************************************************** */
+template<class DTYPE>
+void reg_jacobianCache::Store(nifti_image *controlPointGridImage,
+                              nifti_image *referenceImage,
+                              bool approx,
+                              bool useHeaderInformation,
+                              mat33 *jacobianMatrices,
+                              DTYPE *jacobianDeterminants,
+                              size_t jacobianNumber)
+{
+   reg_jacobianCacheEntry &entry=this->entries[0];
+   // The arrays are only reallocated when their size changes
+   if(entry.number!=jacobianNumber)
+   {
+      this->ClearEntry(entry);
+      entry.matrices=(mat33 *)malloc(jacobianNumber*sizeof(mat33));
+      entry.determinants=(float *)malloc(jacobianNumber*sizeof(float));
+      entry.number=jacobianNumber;
+   }
+   this->SetKey(entry, controlPointGridImage, referenceImage, approx, useHeaderInformation);
+   memcpy(entry.matrices, jacobianMatrices, jacobianNumber*sizeof(mat33));
+   for(size_t j=0; j<jacobianNumber; ++j)
+      entry.determinants[j]=static_cast<float>(jacobianDeterminants[j]);
+}
+template void reg_jacobianCache::Store<float>(nifti_image *, nifti_image *, bool, bool, mat33 *, float *, size_t);
+template void reg_jacobianCache::Store<double>(nifti_image *, nifti_image *, bool, bool, mat33 *, double *, size_t);
+/* *************************************************************** */
+/* *************************************************************** */
+/* Compute the Jacobian matrices and determinants of a cubic B-spline
+ * parametrisation, or extract them from the cache when the grid has not
+ * been modified since they were last computed.
+ */
+template<class DTYPE>
+void reg_cubic_spline_jacobian(nifti_image *splineControlPoint,
+                               nifti_image *referenceImage,
+                               mat33 *JacobianMatrices,
+                               DTYPE *JacobianDeterminants,
+                               bool approximation,
+                               bool useHeaderInformation,
+                               reg_jacobianCache *cache)
+{
+   if(cache!=NULL && cache->Get<DTYPE>(splineControlPoint,
+                                       referenceImage,
+                                       approximation,
+                                       useHeaderInformation,
+                                       JacobianMatrices,
+                                       JacobianDeterminants))
+      return;
+
+   size_t jacobianNumber;
+   if(approximation)
+   {
+      jacobianNumber = (size_t)(splineControlPoint->nx-2) *
+            (splineControlPoint->ny-2);
+      if(splineControlPoint->nz>1)
+         jacobianNumber *= (size_t)(splineControlPoint->nz-2);
+   }
+   else jacobianNumber = (size_t)referenceImage->nx *
+         referenceImage->ny * referenceImage->nz;
+
+   // Both the matrices and determinants are required to fill the cache
+   mat33 *jacobianMatrices = JacobianMatrices;
+   DTYPE *jacobianDeterminants = JacobianDeterminants;
+   if(cache!=NULL && jacobianMatrices==NULL)
+      jacobianMatrices=(mat33 *)malloc(jacobianNumber*sizeof(mat33));
+   if(cache!=NULL && jacobianDeterminants==NULL)
+      jacobianDeterminants=(DTYPE *)malloc(jacobianNumber*sizeof(DTYPE));
+
+   if(splineControlPoint->nz==1)
+      reg_cubic_spline_jacobian2D<DTYPE>(splineControlPoint,
+                                         referenceImage,
+                                         jacobianMatrices,
+                                         jacobianDeterminants,
+                                         approximation,
+                                         useHeaderInformation);
+   else
+      reg_cubic_spline_jacobian3D<DTYPE>(splineControlPoint,
+                                         referenceImage,
+                                         jacobianMatrices,
+                                         jacobianDeterminants,
+                                         approximation,
+                                         useHeaderInformation);
+
+   if(cache!=NULL)
+      cache->Store<DTYPE>(splineControlPoint,
+                          referenceImage,
+                          approximation,
+                          useHeaderInformation,
+                          jacobianMatrices,
+                          jacobianDeterminants,
+                          jacobianNumber);
+
+   if(jacobianMatrices!=JacobianMatrices)
+      free(jacobianMatrices);
+   if(jacobianDeterminants!=JacobianDeterminants)
+      free(jacobianDeterminants);
+}
+/* *************************************************************** */
 extern "C++"
 double reg_spline_getJacobianPenaltyTerm(nifti_image *splineControlPoint,
                                          nifti_image *referenceImage,
                                          bool approximation,
-                                         bool useHeaderInformation
+                                         bool useHeaderInformation,
+                                         reg_jacobianCache *cache
                                          )
 {
    // An array to store the Jacobian determinant is created
@@ -1253,57 +1483,30 @@ double reg_spline_getJacobianPenaltyTerm(nifti_image *splineControlPoint,
    void *JacobianDetermiantArray=(void *)malloc(detNumber*splineControlPoint->nbyper);
 
    // The jacobian determinants are computed
-   if(splineControlPoint->nz==1)
-   {
-      switch(splineControlPoint->datatype)
-      {
-      case NIFTI_TYPE_FLOAT32:
-         reg_cubic_spline_jacobian2D<float>(splineControlPoint,
-                                      referenceImage,
-                                      NULL,
-                                      static_cast<float *>(JacobianDetermiantArray),
-                                      approximation,
-                                      useHeaderInformation);
-         break;
-      case NIFTI_TYPE_FLOAT64:
-         reg_cubic_spline_jacobian2D<double>(splineControlPoint,
-                                       referenceImage,
-                                       NULL,
-                                       static_cast<double *>(JacobianDetermiantArray),
-                                       approximation,
-                                       useHeaderInformation);
-         break;
-      default:
-         reg_print_fct_error("reg_spline_getJacobianPenaltyTerm");
-         reg_print_fct_error("Only single or double precision has been implemented");
-         reg_exit(1);
-      }
-   }
-   else
+   switch(splineControlPoint->datatype)
    {
-      switch(splineControlPoint->datatype)
-      {
-      case NIFTI_TYPE_FLOAT32:
-         reg_cubic_spline_jacobian3D<float>(splineControlPoint,
-                                      referenceImage,
-                                      NULL,
-                                      static_cast<float *>(JacobianDetermiantArray),
-                                      approximation,
-                                      useHeaderInformation);
-         break;
-      case NIFTI_TYPE_FLOAT64:
-         reg_cubic_spline_jacobian3D<double>(splineControlPoint,
+   case NIFTI_TYPE_FLOAT32:
+      reg_cubic_spline_jacobian<float>(splineControlPoint,
                                        referenceImage,
                                        NULL,
-                                       static_cast<double *>(JacobianDetermiantArray),
+                                       static_cast<float *>(JacobianDetermiantArray),
                                        approximation,
-                                       useHeaderInformation);
-         break;
-      default:
-         reg_print_fct_error("reg_spline_getJacobianPenaltyTerm");
-         reg_print_fct_error("Only single or double precision has been implemented");
-         reg_exit(1);
-      }
+                                       useHeaderInformation,
+                                       cache);
+      break;
+   case NIFTI_TYPE_FLOAT64:
+      reg_cubic_spline_jacobian<double>(splineControlPoint,
+                                        referenceImage,
+                                        NULL,
+                                        static_cast<double *>(JacobianDetermiantArray),
+                                        approximation,
+                                        useHeaderInformation,
+                                        cache);
+      break;
+   default:
+      reg_print_fct_error("reg_spline_getJacobianPenaltyTerm");
+      reg_print_fct_error("Only single or double precision has been implemented");
+      reg_exit(1);
    }
    // The jacobian determinant are averaged
    double penaltySum=0.;
@@ -1353,7 +1556,8 @@ void reg_spline_jacobianDetGradient2D(nifti_image *splineControlPoint,
                                       nifti_image *gradientImage,
                                       float weight,
                                       bool approximation,
-                                      bool useHeaderInformation)
+                                      bool useHeaderInformation,
+                                      reg_jacobianCache *cache)
 {
    size_t arraySize = 0;
    if(approximation)
@@ -1366,12 +1570,13 @@ void reg_spline_jacobianDetGradient2D(nifti_image *splineControlPoint,
    DTYPE *jacobianDeterminant=(DTYPE *)malloc(arraySize * sizeof(DTYPE));
 
    // Compute all the required Jacobian determinants and matrices
-   reg_cubic_spline_jacobian2D<DTYPE>(splineControlPoint,
-                                referenceImage,
-                                jacobianMatrices,
-                                jacobianDeterminant,
-                                approximation,
-                                useHeaderInformation);
+   reg_cubic_spline_jacobian<DTYPE>(splineControlPoint,
+                                    referenceImage,
+                                    jacobianMatrices,
+                                    jacobianDeterminant,
+                                    approximation,
+                                    useHeaderInformation,
+                                    cache);
 
    // The gradient are now computed for every control point
    DTYPE *gradientImagePtrX = static_cast<DTYPE *>(gradientImage->data);
@@ -1592,7 +1797,8 @@ void reg_spline_jacobianDetGradient3D(nifti_image *splineControlPoint,
                                       nifti_image *gradientImage,
                                       float weight,
                                       bool approximation,
-                                      bool useHeaderInformation)
+                                      bool useHeaderInformation,
+                                      reg_jacobianCache *cache)
 {
    size_t arraySize = 0;
    if(approximation)
@@ -1605,12 +1811,13 @@ void reg_spline_jacobianDetGradient3D(nifti_image *splineControlPoint,
    DTYPE *jacobianDeterminant=(DTYPE *)malloc(arraySize * sizeof(DTYPE));
 
    // Compute all the required Jacobian determinants and matrices
-   reg_cubic_spline_jacobian3D<DTYPE>(splineControlPoint,
-                                referenceImage,
-                                jacobianMatrices,
-                                jacobianDeterminant,
-                                approximation,
-                                useHeaderInformation);
+   reg_cubic_spline_jacobian<DTYPE>(splineControlPoint,
+                                    referenceImage,
+                                    jacobianMatrices,
+                                    jacobianDeterminant,
+                                    approximation,
+                                    useHeaderInformation,
+                                    cache);
 
    // The gradient are now computed for every control point
    DTYPE *gradientImagePtrX = static_cast<DTYPE *>(gradientImage->data);
@@ -1877,7 +2084,8 @@ void reg_spline_getJacobianPenaltyTermGradient(nifti_image *splineControlPoint,
                                                nifti_image *gradientImage,
                                                float weight,
                                                bool approximation,
-                                               bool useHeaderInformation)
+                                               bool useHeaderInformation,
+                                               reg_jacobianCache *cache)
 {
    if(splineControlPoint->datatype != gradientImage->datatype)
    {
@@ -1897,7 +2105,8 @@ void reg_spline_getJacobianPenaltyTermGradient(nifti_image *splineControlPoint,
                                                  gradientImage,
                                                  weight,
                                                  approximation,
-                                                 useHeaderInformation);
+                                                 useHeaderInformation,
+                                                 cache);
          break;
       case NIFTI_TYPE_FLOAT64:
          reg_spline_jacobianDetGradient2D<double>(splineControlPoint,
@@ -1905,7 +2114,8 @@ void reg_spline_getJacobianPenaltyTermGradient(nifti_image *splineControlPoint,
                                                   gradientImage,
                                                   weight,
                                                   approximation,
-                                                  useHeaderInformation);
+                                                  useHeaderInformation,
+                                                  cache);
          break;
       default:
          reg_print_fct_error("reg_spline_getJacobianPenaltyTermGradient");
@@ -1923,7 +2133,8 @@ void reg_spline_getJacobianPenaltyTermGradient(nifti_image *splineControlPoint,
                                                  gradientImage,
                                                  weight,
                                                  approximation,
-                                                 useHeaderInformation);
+                                                 useHeaderInformation,
+                                                 cache);
          break;
       case NIFTI_TYPE_FLOAT64:
          reg_spline_jacobianDetGradient3D<double>(splineControlPoint,
@@ -1931,7 +2142,8 @@ void reg_spline_getJacobianPenaltyTermGradient(nifti_image *splineControlPoint,
                                                   gradientImage,
                                                   weight,
                                                   approximation,
-                                                  useHeaderInformation);
+                                                  useHeaderInformation,
+                                                  cache);
          break;
       default:
          reg_print_fct_error("reg_spline_getJacobianPenaltyTermGradient");
@@ -1946,7 +2158,8 @@ template<class DTYPE>
 double reg_spline_correctFolding2D(nifti_image *splineControlPoint,
                                    nifti_image *referenceImage,
                                    bool approximation,
-                                   bool useHeaderInformation)
+                                   bool useHeaderInformation,
+                                   reg_jacobianCache *cache)
 {
 #ifdef WIN32
    long i;
@@ -1964,12 +2177,13 @@ double reg_spline_correctFolding2D(nifti_image *splineControlPoint,
    mat33 *jacobianMatrices=(mat33 *)malloc(jacobianNumber*sizeof(mat33));
    DTYPE *jacobianDeterminant=(DTYPE *)malloc(jacobianNumber*sizeof(DTYPE));
 
-   reg_cubic_spline_jacobian2D(splineControlPoint,
-                         referenceImage,
-                         jacobianMatrices,
-                         jacobianDeterminant,
-                         approximation,
-                         useHeaderInformation);
+   reg_cubic_spline_jacobian<DTYPE>(splineControlPoint,
+                                    referenceImage,
+                                    jacobianMatrices,
+                                    jacobianDeterminant,
+                                    approximation,
+                                    useHeaderInformation,
+                                    cache);
 
    /* The current Penalty term value is computed */
    double penaltyTerm =0., logDet;
@@ -2196,7 +2410,8 @@ template<class DTYPE>
 double reg_spline_correctFolding3D(nifti_image *splineControlPoint,
                                    nifti_image *referenceImage,
                                    bool approximation,
-                                   bool useHeaderInformation)
+                                   bool useHeaderInformation,
+                                   reg_jacobianCache *cache)
 {
 #ifdef WIN32
    long i;
@@ -2214,12 +2429,13 @@ double reg_spline_correctFolding3D(nifti_image *splineControlPoint,
    mat33 *jacobianMatrices=(mat33 *)malloc(jacobianNumber*sizeof(mat33));
    DTYPE *jacobianDeterminant=(DTYPE *)malloc(jacobianNumber*sizeof(DTYPE));
 
-   reg_cubic_spline_jacobian3D(splineControlPoint,
-                         referenceImage,
-                         jacobianMatrices,
-                         jacobianDeterminant,
-                         approximation,
-                         useHeaderInformation);
+   reg_cubic_spline_jacobian<DTYPE>(splineControlPoint,
+                                    referenceImage,
+                                    jacobianMatrices,
+                                    jacobianDeterminant,
+                                    approximation,
+                                    useHeaderInformation,
+                                    cache);
 
    /* The current Penalty term value is computed */
    double penaltyTerm =0., logDet;
@@ -2489,7 +2705,8 @@ double reg_spline_correctFolding3D(nifti_image *splineControlPoint,
 extern "C++"
 double reg_spline_correctFolding(nifti_image *splineControlPoint,
                                  nifti_image *referenceImage,
-                                 bool approx)
+                                 bool approx,
+                                 reg_jacobianCache *cache)
 {
    if(splineControlPoint->nz==1)
    {
@@ -2497,11 +2714,11 @@ double reg_spline_correctFolding(nifti_image *splineControlPoint,
       {
       case NIFTI_TYPE_FLOAT32:
          return reg_spline_correctFolding2D<float>
-               (splineControlPoint, referenceImage, approx, false);
+               (splineControlPoint, referenceImage, approx, false, cache);
          break;
       case NIFTI_TYPE_FLOAT64:
          return reg_spline_correctFolding2D<double>
-               (splineControlPoint, referenceImage, approx, false);
+               (splineControlPoint, referenceImage, approx, false, cache);
          break;
       default:
          reg_print_fct_error("reg_spline_correctFolding");
@@ -2515,11 +2732,11 @@ double reg_spline_correctFolding(nifti_image *splineControlPoint,
       {
       case NIFTI_TYPE_FLOAT32:
          return reg_spline_correctFolding3D<float>
-               (splineControlPoint, referenceImage, approx, false);
+               (splineControlPoint, referenceImage, approx, false, cache);
          break;
       case NIFTI_TYPE_FLOAT64:
          return reg_spline_correctFolding3D<double>
-               (splineControlPoint, referenceImage, approx, false);
+               (splineControlPoint, referenceImage, approx, false, cache);
          break;
       default:
          reg_print_fct_error("reg_spline_correctFolding");
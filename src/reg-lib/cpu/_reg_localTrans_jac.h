@@ -15,6 +15,79 @@
 
 #include "_reg_localTrans.h"
 
+/* *************************************************************** */
+/** @class reg_jacobianCache
+ * @brief Jacobian matrices and determinants of a cubic B-spline
+ * parametrisation, stored so that the penalty term value, its gradient and
+ * the folding correction share a single computation per control point grid.
+ * The values are kept in single precision, in which they are computed. Two
+ * entries are kept: the latest one and the one retained at the best position
+ * of the optimisation, where the gradient is later evaluated. An entry is
+ * keyed on a hash of the grid values, read in place, and on the grid and
+ * reference image geometries, so that the grid is never copied.
+ */
+class reg_jacobianCache
+{
+public:
+   reg_jacobianCache();
+   ~reg_jacobianCache();
+   /// @brief Release all the stored Jacobian matrices and determinants
+   void Clear();
+   /// @brief Retain the latest entry as the best position
+   void Retain();
+   /** @brief Copy the stored Jacobian matrices and determinants if they
+    * correspond to the current control point grid
+    * @return True if a stored entry has been used
+    */
+   template<class DTYPE>
+   bool Get(nifti_image *controlPointGridImage,
+            nifti_image *referenceImage,
+            bool approx,
+            bool useHeaderInformation,
+            mat33 *jacobianMatrices,
+            DTYPE *jacobianDeterminants);
+   /// @brief Store the Jacobian matrices and determinants of the current grid
+   template<class DTYPE>
+   void Store(nifti_image *controlPointGridImage,
+              nifti_image *referenceImage,
+              bool approx,
+              bool useHeaderInformation,
+              mat33 *jacobianMatrices,
+              DTYPE *jacobianDeterminants,
+              size_t jacobianNumber);
+
+private:
+   typedef struct
+   {
+      mat33 *matrices;
+      float *determinants;
+      size_t number;
+      bool approx;
+      bool useHeaderInformation;
+      int referenceDim[3];
+      float referencePixDim[3];
+      mat44 referenceMatrix;
+      int gridDim[4];
+      float gridPixDim[4];
+      mat44 gridMatrix;
+      uint64_t gridHash;
+      size_t gridSize;
+   } reg_jacobianCacheEntry;
+   reg_jacobianCacheEntry entries[2];
+
+   void ClearEntry(reg_jacobianCacheEntry &entry);
+   void SetKey(reg_jacobianCacheEntry &entry,
+               nifti_image *controlPointGridImage,
+               nifti_image *referenceImage,
+               bool approx,
+               bool useHeaderInformation);
+   bool Match(reg_jacobianCacheEntry &entry,
+              nifti_image *controlPointGridImage,
+              nifti_image *referenceImage,
+              bool approx,
+              bool useHeaderInformation);
+};
+/* *************************************************************** */
 /* *************************************************************** */
 /** @brief Compute the Jacobian determinant map using a cubic b-spline
  * @param controlPointGridImage Image that contains the transformation
@@ -35,12 +108,15 @@ void reg_spline_GetJacobianMap(nifti_image *controlPointGridImage,
  * @param approx Approximate the average Jacobian determinant by using
  * only the information from the control point if the value is set to true;
  * all voxels are considered if the value is set to false.
+ * @param cache Optional cache in which the Jacobian matrices and
+ * determinants are looked up and stored
  */
 extern "C++"
 double reg_spline_getJacobianPenaltyTerm(nifti_image *controlPointGridImage,
                                          nifti_image *referenceImage,
                                          bool approx,
-                                         bool useHeaderInformation=false
+                                         bool useHeaderInformation=false,
+                                         reg_jacobianCache *cache=NULL
       );
 /* *************************************************************** */
 /** @brief Compute the gradient at every control point position of the
@@ -58,6 +134,8 @@ double reg_spline_getJacobianPenaltyTerm(nifti_image *controlPointGridImage,
  * @param approx Approximate the gradient by using only the information
  * from the control point if the value is set to true; all voxels are
  * considered if the value is set to false.
+ * @param cache Optional cache in which the Jacobian matrices and
+ * determinants are looked up and stored
  */
 extern "C++"
 void reg_spline_getJacobianPenaltyTermGradient(nifti_image *controlPointGridImage,
@@ -65,7 +143,8 @@ void reg_spline_getJacobianPenaltyTermGradient(nifti_image *controlPointGridImag
                                                nifti_image *gradientImage,
                                                float weight,
                                                bool approx,
-                                               bool useHeaderInformation=false
+                                               bool useHeaderInformation=false,
+                                               reg_jacobianCache *cache=NULL
       );
 /* *************************************************************** */
 /** @brief Compute the Jacobian matrix at every voxel position
@@ -91,11 +170,14 @@ void reg_spline_GetJacobianMatrix(nifti_image *referenceImage,
  * @param referenceImage Image that defines the space of the transformation
  * @param approx The function can be run be considering only the control
  * point position (approx==false) or every voxel (approx==true)
+ * @param cache Optional cache in which the Jacobian matrices and
+ * determinants are looked up and stored
  */
 extern "C++"
 double reg_spline_correctFolding(nifti_image *controlPointGridImage,
                                  nifti_image *referenceImage,
-                                 bool approx
+                                 bool approx,
+                                 reg_jacobianCache *cache=NULL
                                  );
 /* *************************************************************** */
 /** @brief Compute the Jacobian determinant at every voxel position
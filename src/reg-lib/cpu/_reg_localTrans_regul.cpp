@@ -23,15 +23,16 @@ double reg_spline_approxBendingEnergyValue2D(nifti_image *splineControlPoint)
    DTYPE *splinePtrX = static_cast<DTYPE *>(splineControlPoint->data);
    DTYPE *splinePtrY = &splinePtrX[nodeNumber];
 
-   // get the constant basis values
-   DTYPE basisXX[9], basisYY[9], basisXY[9];
+   // get the constant basis values. The second order derivatives are
+   // accumulated in double precision, as the coefficients are positions
+   double basisXX[9], basisYY[9], basisXY[9];
    set_second_order_bspline_basis_values(basisXX, basisYY, basisXY);
 
    double constraintValue=0.0;
 
-   DTYPE splineCoeffX, splineCoeffY;
-   DTYPE XX_x, YY_x, XY_x;
-   DTYPE XX_y, YY_y, XY_y;
+   double splineCoeffX, splineCoeffY;
+   double XX_x, YY_x, XY_x;
+   double XX_y, YY_y, XY_y;
 
 #ifdef _OPENMP
 #pragma omp parallel for default(none) \
@@ -66,98 +67,190 @@ double reg_spline_approxBendingEnergyValue2D(nifti_image *splineControlPoint)
             }
          }
 
-         constraintValue += double(
-                  XX_x*XX_x + YY_x*YY_x + 2.0*XY_x*XY_x +
-                  XX_y*XX_y + YY_y*YY_y + 2.0*XY_y*XY_y );
+         constraintValue +=
+               XX_x*XX_x + YY_x*YY_x + 2.0*XY_x*XY_x +
+               XX_y*XX_y + YY_y*YY_y + 2.0*XY_y*XY_y;
       }
    }
    return constraintValue / (double)splineControlPoint->nvox;
 }
 /* *************************************************************** */
 template<class DTYPE>
-double reg_spline_approxBendingEnergyValue3D(nifti_image *splineControlPoint)
+double reg_spline_approxBendingEnergy3D(nifti_image *splineControlPoint,
+                                        nifti_image *gradientImage,
+                                        float weight)
 {
    size_t nodeNumber = (size_t)splineControlPoint->nx *
          splineControlPoint->ny * splineControlPoint->nz;
-   int a, b, c, x, y, z, index, i;
+   int a, b, c, d, x, y, z, X, Y, Z, index, i;
 
    // Create pointers to the spline coefficients
    DTYPE *splinePtrX = static_cast<DTYPE *>(splineControlPoint->data);
    DTYPE *splinePtrY = &splinePtrX[nodeNumber];
    DTYPE *splinePtrZ = &splinePtrY[nodeNumber];
 
-   // get the constant basis values
-   DTYPE basisXX[27], basisYY[27], basisZZ[27], basisXY[27], basisYZ[27], basisXZ[27];
+   // get the constant basis values. The second order derivatives are
+   // accumulated in double precision, as the coefficients are positions
+   double basisXX[27], basisYY[27], basisZZ[27], basisXY[27], basisYZ[27], basisXZ[27];
    set_second_order_bspline_basis_values(basisXX, basisYY, basisZZ, basisXY, basisYZ, basisXZ);
 
+   // The gradient is computed from the displacement. As the second order
+   // derivatives of the initial control point positions vanish over a full
+   // stencil, they only need to be removed at the boundary nodes
+   mat44 matrix;
+   if(splineControlPoint->sform_code>0)
+      matrix=splineControlPoint->sto_xyz;
+   else matrix=splineControlPoint->qto_xyz;
+
+   // The second order derivatives are only stored when the gradient is required
+   bool computeGradient = gradientImage!=NULL;
+   DTYPE *derivativeValues = NULL;
+   if(computeGradient)
+      derivativeValues = (DTYPE *)calloc(18*nodeNumber, sizeof(DTYPE));
+   // Without gradient, only the nodes with a full stencil are visited
+   int border = computeGradient?0:1;
+
    double constraintValue=0.0;
 
-   DTYPE splineCoeffX, splineCoeffY, splineCoeffZ;
-   DTYPE XX_x, YY_x, ZZ_x, XY_x, YZ_x, XZ_x;
-   DTYPE XX_y, YY_y, ZZ_y, XY_y, YZ_y, XZ_y;
-   DTYPE XX_z, YY_z, ZZ_z, XY_z, YZ_z, XZ_z;
+   double coeff[3], derivative[18];
+   bool interior;
 
+   // Evaluate the second order derivatives of the three components at once
 #ifdef _OPENMP
 #pragma omp parallel for default(none) \
-   shared(splineControlPoint, splinePtrX, splinePtrY, splinePtrZ, \
-   basisXX, basisYY, basisZZ, basisXY, basisYZ, basisXZ) \
-   private(XX_x, YY_x, ZZ_x, XY_x, YZ_x, XZ_x, XX_y, YY_y, ZZ_y, XY_y, YZ_y, XZ_y, \
-   XX_z, YY_z, ZZ_z, XY_z, YZ_z, XZ_z, x, y, z, a, b, c, index, i, \
-   splineCoeffX, splineCoeffY, splineCoeffZ) \
+   shared(splineControlPoint, splinePtrX, splinePtrY, splinePtrZ, derivativeValues, \
+   basisXX, basisYY, basisZZ, basisXY, basisYZ, basisXZ, matrix, computeGradient, border) \
+   private(x, y, z, a, b, c, d, index, i, coeff, derivative, interior) \
    reduction(+:constraintValue)
 #endif
-   for(z=1; z<splineControlPoint->nz-1; ++z)
+   for(z=border; z<splineControlPoint->nz-border; ++z)
    {
-      for(y=1; y<splineControlPoint->ny-1; ++y)
+      for(y=border; y<splineControlPoint->ny-border; ++y)
       {
-         for(x=1; x<splineControlPoint->nx-1; ++x)
+         for(x=border; x<splineControlPoint->nx-border; ++x)
          {
-            XX_x=0.0, YY_x=0.0, ZZ_x=0.0;
-            XY_x=0.0, YZ_x=0.0, XZ_x=0.0;
-            XX_y=0.0, YY_y=0.0, ZZ_y=0.0;
-            XY_y=0.0, YZ_y=0.0, XZ_y=0.0;
-            XX_z=0.0, YY_z=0.0, ZZ_z=0.0;
-            XY_z=0.0, YZ_z=0.0, XZ_z=0.0;
+            interior = x>0 && y>0 && z>0 &&
+                  x<splineControlPoint->nx-1 &&
+                  y<splineControlPoint->ny-1 &&
+                  z<splineControlPoint->nz-1;
+            for(d=0; d<18; ++d) derivative[d]=0;
 
             i=0;
             for(c=-1; c<2; c++){
                for(b=-1; b<2; b++){
                   for(a=-1; a<2; a++){
-                     index = ((z+c)*splineControlPoint->ny+y+b)*splineControlPoint->nx+x+a;
-                     splineCoeffX = splinePtrX[index];
-                     splineCoeffY = splinePtrY[index];
-                     splineCoeffZ = splinePtrZ[index];
-                     XX_x += basisXX[i]*splineCoeffX;
-                     YY_x += basisYY[i]*splineCoeffX;
-                     ZZ_x += basisZZ[i]*splineCoeffX;
-                     XY_x += basisXY[i]*splineCoeffX;
-                     YZ_x += basisYZ[i]*splineCoeffX;
-                     XZ_x += basisXZ[i]*splineCoeffX;
-
-                     XX_y += basisXX[i]*splineCoeffY;
-                     YY_y += basisYY[i]*splineCoeffY;
-                     ZZ_y += basisZZ[i]*splineCoeffY;
-                     XY_y += basisXY[i]*splineCoeffY;
-                     YZ_y += basisYZ[i]*splineCoeffY;
-                     XZ_y += basisXZ[i]*splineCoeffY;
-
-                     XX_z += basisXX[i]*splineCoeffZ;
-                     YY_z += basisYY[i]*splineCoeffZ;
-                     ZZ_z += basisZZ[i]*splineCoeffZ;
-                     XY_z += basisXY[i]*splineCoeffZ;
-                     YZ_z += basisYZ[i]*splineCoeffZ;
-                     XZ_z += basisXZ[i]*splineCoeffZ;
+                     if(-1<(x+a) && -1<(y+b) && -1<(z+c) && (x+a)<splineControlPoint->nx && (y+b)<splineControlPoint->ny && (z+c)<splineControlPoint->nz)
+                     {
+                        index = ((z+c)*splineControlPoint->ny+y+b)*splineControlPoint->nx+x+a;
+                        coeff[0] = splinePtrX[index];
+                        coeff[1] = splinePtrY[index];
+                        coeff[2] = splinePtrZ[index];
+                        if(!interior)
+                        {
+                           for(d=0; d<3; ++d)
+                              coeff[d] -=
+                                    matrix.m[d][0]*static_cast<double>(x+a) +
+                                    matrix.m[d][1]*static_cast<double>(y+b) +
+                                    matrix.m[d][2]*static_cast<double>(z+c) +
+                                    matrix.m[d][3];
+                        }
+                        for(d=0; d<3; ++d)
+                        {
+                           derivative[d]    += basisXX[i]*coeff[d];
+                           derivative[3+d]  += basisYY[i]*coeff[d];
+                           derivative[6+d]  += basisZZ[i]*coeff[d];
+                           derivative[9+d]  += basisXY[i]*coeff[d];
+                           derivative[12+d] += basisYZ[i]*coeff[d];
+                           derivative[15+d] += basisXZ[i]*coeff[d];
+                        }
+                     }
                      ++i;
                   }
                }
             }
 
-            constraintValue += double(
-                     XX_x*XX_x + YY_x*YY_x + ZZ_x*ZZ_x + 2.0*(XY_x*XY_x + YZ_x*YZ_x + XZ_x*XZ_x) +
-                     XX_y*XX_y + YY_y*YY_y + ZZ_y*ZZ_y + 2.0*(XY_y*XY_y + YZ_y*YZ_y + XZ_y*XZ_y) +
-                     XX_z*XX_z + YY_z*YY_z + ZZ_z*ZZ_z + 2.0*(XY_z*XY_z + YZ_z*YZ_z + XZ_z*XZ_z) );
+            if(interior)
+            {
+               for(d=0; d<3; ++d)
+               {
+                  constraintValue +=
+                        derivative[d]*derivative[d] +
+                        derivative[3+d]*derivative[3+d] +
+                        derivative[6+d]*derivative[6+d] +
+                        2.0*(derivative[9+d]*derivative[9+d] +
+                             derivative[12+d]*derivative[12+d] +
+                             derivative[15+d]*derivative[15+d]);
+               }
+            }
+            if(computeGradient)
+            {
+               index = (z*splineControlPoint->ny+y)*splineControlPoint->nx+x;
+               for(d=0; d<9; ++d)
+                  derivativeValues[18*index+d] = (DTYPE)derivative[d];
+               for(d=9; d<18; ++d)
+                  derivativeValues[18*index+d] = (DTYPE)(2.0*derivative[d]);
+            }
+         }
+      }
+   }
+
+   if(computeGradient)
+   {
+      DTYPE *gradientXPtr = static_cast<DTYPE *>(gradientImage->data);
+      DTYPE *gradientYPtr = &gradientXPtr[nodeNumber];
+      DTYPE *gradientZPtr = &gradientYPtr[nodeNumber];
+
+      double approxRatio = (double)weight / (double)nodeNumber;
+      double gradientValue[3];
+      DTYPE *derivativeValuesPtr;
+      // Each node gathers the contribution of its neighbours to avoid
+      // concurrent writes
+#ifdef _OPENMP
+#pragma omp parallel for default(none) \
+   shared(splineControlPoint, derivativeValues, gradientXPtr, gradientYPtr, gradientZPtr, \
+   basisXX, basisYY, basisZZ, basisXY, basisYZ, basisXZ, approxRatio) \
+   private(index, a, d, X, Y, Z, x, y, z, derivativeValuesPtr, gradientValue)
+#endif
+      for(z=0; z<splineControlPoint->nz; z++)
+      {
+         index=z*splineControlPoint->nx*splineControlPoint->ny;
+         for(y=0; y<splineControlPoint->ny; y++)
+         {
+            for(x=0; x<splineControlPoint->nx; x++)
+            {
+               gradientValue[0]=gradientValue[1]=gradientValue[2]=0.0;
+               a=0;
+               for(Z=z-1; Z<z+2; Z++)
+               {
+                  for(Y=y-1; Y<y+2; Y++)
+                  {
+                     for(X=x-1; X<x+2; X++)
+                     {
+                        if(-1<X && -1<Y && -1<Z && X<splineControlPoint->nx && Y<splineControlPoint->ny && Z<splineControlPoint->nz)
+                        {
+                           derivativeValuesPtr = &derivativeValues[18 * ((Z*splineControlPoint->ny + Y)*splineControlPoint->nx + X)];
+                           for(d=0; d<3; ++d)
+                           {
+                              gradientValue[d] += derivativeValuesPtr[d] * basisXX[a] +
+                                    derivativeValuesPtr[3+d] * basisYY[a] +
+                                    derivativeValuesPtr[6+d] * basisZZ[a] +
+                                    derivativeValuesPtr[9+d] * basisXY[a] +
+                                    derivativeValuesPtr[12+d] * basisYZ[a] +
+                                    derivativeValuesPtr[15+d] * basisXZ[a];
+                           }
+                        }
+                        a++;
+                     }
+                  }
+               }
+               gradientXPtr[index] += (DTYPE)(approxRatio*gradientValue[0]);
+               gradientYPtr[index] += (DTYPE)(approxRatio*gradientValue[1]);
+               gradientZPtr[index] += (DTYPE)(approxRatio*gradientValue[2]);
+               index++;
+            }
          }
       }
+      free(derivativeValues);
    }
    return constraintValue / (double)splineControlPoint->nvox;
 }
@@ -184,9 +277,9 @@ double reg_spline_approxBendingEnergy(nifti_image *splineControlPoint)
       switch(splineControlPoint->datatype)
       {
       case NIFTI_TYPE_FLOAT32:
-         return reg_spline_approxBendingEnergyValue3D<float>(splineControlPoint);
+         return reg_spline_approxBendingEnergy3D<float>(splineControlPoint, NULL, 0.f);
       case NIFTI_TYPE_FLOAT64:
-         return reg_spline_approxBendingEnergyValue3D<double>(splineControlPoint);
+         return reg_spline_approxBendingEnergy3D<double>(splineControlPoint, NULL, 0.f);
       default:
          reg_print_fct_error("reg_spline_approxBendingEnergy");
          reg_print_msg_error("Only implemented for single or double precision images");
@@ -209,13 +302,13 @@ void reg_spline_approxBendingEnergyGradient2D(nifti_image *splineControlPoint,
    DTYPE *splinePtrY = &splinePtrX[nodeNumber];
 
    // get the constant basis values
-   DTYPE basisXX[9], basisYY[9], basisXY[9];
+   double basisXX[9], basisYY[9], basisXY[9];
    set_second_order_bspline_basis_values(basisXX, basisYY, basisXY);
 
-   DTYPE splineCoeffX;
-   DTYPE splineCoeffY;
-   DTYPE XX_x, YY_x, XY_x;
-   DTYPE XX_y, YY_y, XY_y;
+   double splineCoeffX;
+   double splineCoeffY;
+   double XX_x, YY_x, XY_x;
+   double XX_y, YY_y, XY_y;
 
    DTYPE *derivativeValues = (DTYPE *)calloc(6*nodeNumber, sizeof(DTYPE));
    DTYPE *derivativeValuesPtr;
@@ -257,10 +350,10 @@ void reg_spline_approxBendingEnergyGradient2D(nifti_image *splineControlPoint,
                ++i;
             }
          }
-         *derivativeValuesPtr++ = XX_x;
-         *derivativeValuesPtr++ = XX_y;
-         *derivativeValuesPtr++ = YY_x;
-         *derivativeValuesPtr++ = YY_y;
+         *derivativeValuesPtr++ = (DTYPE)XX_x;
+         *derivativeValuesPtr++ = (DTYPE)XX_y;
+         *derivativeValuesPtr++ = (DTYPE)YY_x;
+         *derivativeValuesPtr++ = (DTYPE)YY_y;
          *derivativeValuesPtr++ = (DTYPE)(2.0*XY_x);
          *derivativeValuesPtr++ = (DTYPE)(2.0*XY_y);
       }
@@ -269,8 +362,8 @@ void reg_spline_approxBendingEnergyGradient2D(nifti_image *splineControlPoint,
    DTYPE *gradientXPtr = static_cast<DTYPE *>(gradientImage->data);
    DTYPE *gradientYPtr = &gradientXPtr[nodeNumber];
 
-   DTYPE approxRatio = (DTYPE)weight / (DTYPE)nodeNumber;
-   DTYPE gradientValue[2];
+   double approxRatio = (double)weight / (double)nodeNumber;
+   double gradientValue[2];
 #ifdef _OPENMP
 #pragma omp parallel for default(none) \
    shared(splineControlPoint, derivativeValues, gradientXPtr, gradientYPtr, \
@@ -303,8 +396,8 @@ void reg_spline_approxBendingEnergyGradient2D(nifti_image *splineControlPoint,
                a++;
             }
          }
-         gradientXPtr[index] += approxRatio*gradientValue[0];
-         gradientYPtr[index] += approxRatio*gradientValue[1];
+         gradientXPtr[index] += (DTYPE)(approxRatio*gradientValue[0]);
+         gradientYPtr[index] += (DTYPE)(approxRatio*gradientValue[1]);
          index++;
       }
    }
@@ -312,184 +405,6 @@ void reg_spline_approxBendingEnergyGradient2D(nifti_image *splineControlPoint,
    free(derivativeValues);
 }
 /* *************************************************************** */
-template<class DTYPE>
-void reg_spline_approxBendingEnergyGradient3D(nifti_image *splineControlPoint,
-                                              nifti_image *gradientImage,
-                                              float weight)
-{
-   size_t nodeNumber = (size_t)splineControlPoint->nx*splineControlPoint->ny*splineControlPoint->nz;
-   int a, b, c, x, y, z, X, Y, Z, index, i;
-
-   // Create pointers to the spline coefficients
-   DTYPE *splinePtrX = static_cast<DTYPE *>(splineControlPoint->data);
-   DTYPE *splinePtrY = &splinePtrX[nodeNumber];
-   DTYPE *splinePtrZ = &splinePtrY[nodeNumber];
-
-   // get the constant basis values
-   DTYPE basisXX[27], basisYY[27], basisZZ[27], basisXY[27], basisYZ[27], basisXZ[27];
-   set_second_order_bspline_basis_values(basisXX, basisYY, basisZZ, basisXY, basisYZ, basisXZ);
-
-   DTYPE splineCoeffX;
-   DTYPE splineCoeffY;
-   DTYPE splineCoeffZ;
-   DTYPE XX_x, YY_x, ZZ_x, XY_x, YZ_x, XZ_x;
-   DTYPE XX_y, YY_y, ZZ_y, XY_y, YZ_y, XZ_y;
-   DTYPE XX_z, YY_z, ZZ_z, XY_z, YZ_z, XZ_z;
-
-   DTYPE *derivativeValues = (DTYPE *)calloc(18*nodeNumber, sizeof(DTYPE));
-   DTYPE *derivativeValuesPtr;
-
-   reg_getDisplacementFromDeformation(splineControlPoint);
-
-   // Compute the bending energy values everywhere but at the boundary
-#ifdef _OPENMP
-#pragma omp parallel for default(none) \
-   shared(splineControlPoint,splinePtrX,splinePtrY,splinePtrZ, derivativeValues, \
-   basisXX, basisYY, basisZZ, basisXY, basisYZ, basisXZ) \
-   private(a, b, c, i, index, x, y, z, derivativeValuesPtr, splineCoeffX, splineCoeffY, \
-   splineCoeffZ, XX_x, YY_x, ZZ_x, XY_x, YZ_x, XZ_x, XX_y, YY_y, \
-   ZZ_y, XY_y, YZ_y, XZ_y, XX_z, YY_z, ZZ_z, XY_z, YZ_z, XZ_z)
-#endif
-   for(z=0; z<splineControlPoint->nz; z++)
-   {
-      derivativeValuesPtr = &derivativeValues[18*z*splineControlPoint->ny*splineControlPoint->nx];
-      for(y=0; y<splineControlPoint->ny; y++)
-      {
-         for(x=0; x<splineControlPoint->nx; x++)
-         {
-            XX_x=0.0, YY_x=0.0, ZZ_x=0.0;
-            XY_x=0.0, YZ_x=0.0, XZ_x=0.0;
-            XX_y=0.0, YY_y=0.0, ZZ_y=0.0;
-            XY_y=0.0, YZ_y=0.0, XZ_y=0.0;
-            XX_z=0.0, YY_z=0.0, ZZ_z=0.0;
-            XY_z=0.0, YZ_z=0.0, XZ_z=0.0;
-
-            i=0;
-            for(c=-1; c<2; c++){
-               for(b=-1; b<2; b++){
-                  for(a=-1; a<2; a++){
-                     if(-1<(x+a) && -1<(y+b) && -1<(z+c) && (x+a)<splineControlPoint->nx && (y+b)<splineControlPoint->ny && (z+c)<splineControlPoint->nz)
-                     {
-                        index = ((z+c)*splineControlPoint->ny+y+b)*splineControlPoint->nx+x+a;
-                        splineCoeffX = splinePtrX[index];
-                        splineCoeffY = splinePtrY[index];
-                        splineCoeffZ = splinePtrZ[index];
-                        XX_x += basisXX[i]*splineCoeffX;
-                        YY_x += basisYY[i]*splineCoeffX;
-                        ZZ_x += basisZZ[i]*splineCoeffX;
-                        XY_x += basisXY[i]*splineCoeffX;
-                        YZ_x += basisYZ[i]*splineCoeffX;
-                        XZ_x += basisXZ[i]*splineCoeffX;
-
-                        XX_y += basisXX[i]*splineCoeffY;
-                        YY_y += basisYY[i]*splineCoeffY;
-                        ZZ_y += basisZZ[i]*splineCoeffY;
-                        XY_y += basisXY[i]*splineCoeffY;
-                        YZ_y += basisYZ[i]*splineCoeffY;
-                        XZ_y += basisXZ[i]*splineCoeffY;
-
-                        XX_z += basisXX[i]*splineCoeffZ;
-                        YY_z += basisYY[i]*splineCoeffZ;
-                        ZZ_z += basisZZ[i]*splineCoeffZ;
-                        XY_z += basisXY[i]*splineCoeffZ;
-                        YZ_z += basisYZ[i]*splineCoeffZ;
-                        XZ_z += basisXZ[i]*splineCoeffZ;
-                     }
-                     ++i;
-                  }
-               }
-            }
-            *derivativeValuesPtr++ = XX_x;
-            *derivativeValuesPtr++ = XX_y;
-            *derivativeValuesPtr++ = XX_z;
-            *derivativeValuesPtr++ = YY_x;
-            *derivativeValuesPtr++ = YY_y;
-            *derivativeValuesPtr++ = YY_z;
-            *derivativeValuesPtr++ = ZZ_x;
-            *derivativeValuesPtr++ = ZZ_y;
-            *derivativeValuesPtr++ = ZZ_z;
-            *derivativeValuesPtr++ = (DTYPE)(2.0*XY_x);
-            *derivativeValuesPtr++ = (DTYPE)(2.0*XY_y);
-            *derivativeValuesPtr++ = (DTYPE)(2.0*XY_z);
-            *derivativeValuesPtr++ = (DTYPE)(2.0*YZ_x);
-            *derivativeValuesPtr++ = (DTYPE)(2.0*YZ_y);
-            *derivativeValuesPtr++ = (DTYPE)(2.0*YZ_z);
-            *derivativeValuesPtr++ = (DTYPE)(2.0*XZ_x);
-            *derivativeValuesPtr++ = (DTYPE)(2.0*XZ_y);
-            *derivativeValuesPtr++ = (DTYPE)(2.0*XZ_z);
-         }
-      }
-   }
-
-   DTYPE *gradientXPtr = static_cast<DTYPE *>(gradientImage->data);
-   DTYPE *gradientYPtr = &gradientXPtr[nodeNumber];
-   DTYPE *gradientZPtr = &gradientYPtr[nodeNumber];
-
-   DTYPE approxRatio = (DTYPE)weight / (DTYPE)nodeNumber;
-   DTYPE gradientValue[3];
-#ifdef _OPENMP
-#pragma omp parallel for default(none) \
-   shared(splineControlPoint, derivativeValues, gradientXPtr, gradientYPtr, gradientZPtr, \
-   basisXX, basisYY, basisZZ, basisXY, basisYZ, basisXZ, approxRatio) \
-   private(index, a, X, Y, Z, x, y, z, derivativeValuesPtr, gradientValue)
-#endif
-   for(z=0; z<splineControlPoint->nz; z++)
-   {
-      index=z*splineControlPoint->nx*splineControlPoint->ny;
-      for(y=0; y<splineControlPoint->ny; y++)
-      {
-         for(x=0; x<splineControlPoint->nx; x++)
-         {
-            gradientValue[0]=gradientValue[1]=gradientValue[2]=0.0;
-            a=0;
-            for(Z=z-1; Z<z+2; Z++)
-            {
-               for(Y=y-1; Y<y+2; Y++)
-               {
-                  for(X=x-1; X<x+2; X++)
-                  {
-                     if(-1<X && -1<Y && -1<Z && X<splineControlPoint->nx && Y<splineControlPoint->ny && Z<splineControlPoint->nz)
-                     {
-                        derivativeValuesPtr = &derivativeValues[18 * ((Z*splineControlPoint->ny + Y)*splineControlPoint->nx + X)];
-                        gradientValue[0] += (*derivativeValuesPtr++) * basisXX[a];
-                        gradientValue[1] += (*derivativeValuesPtr++) * basisXX[a];
-                        gradientValue[2] += (*derivativeValuesPtr++) * basisXX[a];
-
-                        gradientValue[0] += (*derivativeValuesPtr++) * basisYY[a];
-                        gradientValue[1] += (*derivativeValuesPtr++) * basisYY[a];
-                        gradientValue[2] += (*derivativeValuesPtr++) * basisYY[a];
-
-                        gradientValue[0] += (*derivativeValuesPtr++) * basisZZ[a];
-                        gradientValue[1] += (*derivativeValuesPtr++) * basisZZ[a];
-                        gradientValue[2] += (*derivativeValuesPtr++) * basisZZ[a];
-
-                        gradientValue[0] += (*derivativeValuesPtr++) * basisXY[a];
-                        gradientValue[1] += (*derivativeValuesPtr++) * basisXY[a];
-                        gradientValue[2] += (*derivativeValuesPtr++) * basisXY[a];
-
-                        gradientValue[0] += (*derivativeValuesPtr++) * basisYZ[a];
-                        gradientValue[1] += (*derivativeValuesPtr++) * basisYZ[a];
-                        gradientValue[2] += (*derivativeValuesPtr++) * basisYZ[a];
-
-                        gradientValue[0] += (*derivativeValuesPtr++) * basisXZ[a];
-                        gradientValue[1] += (*derivativeValuesPtr++) * basisXZ[a];
-                        gradientValue[2] += (*derivativeValuesPtr++) * basisXZ[a];
-                     }
-                     a++;
-                  }
-               }
-            }
-            gradientXPtr[index] += approxRatio*gradientValue[0];
-            gradientYPtr[index] += approxRatio*gradientValue[1];
-            gradientZPtr[index] += approxRatio*gradientValue[2];
-            index++;
-         }
-      }
-   }
-   free(derivativeValues);
-   reg_getDeformationFromDisplacement(splineControlPoint);
-}
-/* *************************************************************** */
 extern "C++"
 void reg_spline_approxBendingEnergyGradient(nifti_image *splineControlPoint,
                                             nifti_image *gradientImage,
@@ -524,11 +439,11 @@ void reg_spline_approxBendingEnergyGradient(nifti_image *splineControlPoint,
       switch(splineControlPoint->datatype)
       {
       case NIFTI_TYPE_FLOAT32:
-         reg_spline_approxBendingEnergyGradient3D<float>
+         reg_spline_approxBendingEnergy3D<float>
                (splineControlPoint, gradientImage, weight);
          break;
       case NIFTI_TYPE_FLOAT64:
-         reg_spline_approxBendingEnergyGradient3D<double>
+         reg_spline_approxBendingEnergy3D<double>
                (splineControlPoint, gradientImage, weight);
          break;
       default:
@@ -555,12 +470,14 @@ double reg_spline_approxLinearEnergyValue2D(nifti_image *splineControlPoint)
    DTYPE *splinePtrY = &splinePtrX[nodeNumber];
 
    // Store the basis values since they are constant as the value is approximated
-   // at the control point positions only
-   DTYPE basisX[9], basisY[9];
+   // at the control point positions only. The first order derivatives are
+   // accumulated in double precision, as the coefficients are positions
+   double basisX[9], basisY[9];
    set_first_order_basis_values(basisX, basisY);
 
-   DTYPE splineCoeffX;
-   DTYPE splineCoeffY;
+   double splineCoeffX;
+   double splineCoeffY;
+   double derivative[4];
 
    mat33 matrix, R;
 
@@ -575,14 +492,13 @@ double reg_spline_approxLinearEnergyValue2D(nifti_image *splineControlPoint)
    shared(splinePtrX, splinePtrY, splineControlPoint, \
    basisX, basisY, reorientation) \
    private(x, y, a, b, i, index, matrix, R, \
-   splineCoeffX, splineCoeffY, currentValue) \
+   splineCoeffX, splineCoeffY, derivative, currentValue) \
    reduction(+:constraintValue)
 #endif
    for(y=1; y<splineControlPoint->ny-1; ++y){
       for(x=1; x<splineControlPoint->nx-1; ++x){
 
-         memset(&matrix, 0, sizeof(mat33));
-         matrix.m[2][2] = 1.f;
+         derivative[0]=derivative[1]=derivative[2]=derivative[3]=0.0;
 
          i=0;
          for(b=-1; b<2; b++){
@@ -590,13 +506,19 @@ double reg_spline_approxLinearEnergyValue2D(nifti_image *splineControlPoint)
                index = (y+b)*splineControlPoint->nx+x+a;
                splineCoeffX = splinePtrX[index];
                splineCoeffY = splinePtrY[index];
-               matrix.m[0][0] += basisX[i]*splineCoeffX;
-               matrix.m[1][0] += basisY[i]*splineCoeffX;
-               matrix.m[0][1] += basisX[i]*splineCoeffY;
-               matrix.m[1][1] += basisY[i]*splineCoeffY;
+               derivative[0] += basisX[i]*splineCoeffX;
+               derivative[1] += basisY[i]*splineCoeffX;
+               derivative[2] += basisX[i]*splineCoeffY;
+               derivative[3] += basisY[i]*splineCoeffY;
                ++i;
             }
          }
+         memset(&matrix, 0, sizeof(mat33));
+         matrix.m[0][0] = derivative[0];
+         matrix.m[1][0] = derivative[1];
+         matrix.m[0][1] = derivative[2];
+         matrix.m[1][1] = derivative[3];
+         matrix.m[2][2] = 1.f;
          // Convert from mm to voxel
          matrix = nifti_mat33_mul(reorientation, matrix);
          // Removing the rotation component
@@ -619,11 +541,13 @@ double reg_spline_approxLinearEnergyValue2D(nifti_image *splineControlPoint)
 }
 /* *************************************************************** */
 template <class DTYPE>
-double reg_spline_approxLinearEnergyValue3D(nifti_image *splineControlPoint)
+double reg_spline_approxLinearEnergy3D(nifti_image *splineControlPoint,
+                                       nifti_image *gradientImage,
+                                       float weight)
 {
    size_t nodeNumber = (size_t)splineControlPoint->nx *
          splineControlPoint->ny * splineControlPoint->nz;
-   int a, b, c, x, y, z, i, index;
+   int a, b, c, d, x, y, z, X, Y, Z, i, index;
 
    double constraintValue = 0.;
    double currentValue;
@@ -634,13 +558,18 @@ double reg_spline_approxLinearEnergyValue3D(nifti_image *splineControlPoint)
    DTYPE *splinePtrZ = &splinePtrY[nodeNumber];
 
    // Store the basis values since they are constant as the value is approximated
-   // at the control point positions only
-   DTYPE basisX[27], basisY[27], basisZ[27];
+   // at the control point positions only. The first order derivatives are
+   // accumulated in double precision, as the coefficients are positions
+   double basisX[27], basisY[27], basisZ[27];
    set_first_order_basis_values(basisX, basisY, basisZ);
 
-   DTYPE splineCoeffX;
-   DTYPE splineCoeffY;
-   DTYPE splineCoeffZ;
+   // The displacement gradients are only stored when the gradient is required
+   bool computeGradient = gradientImage!=NULL;
+   DTYPE *derivativeValues = NULL;
+   if(computeGradient)
+      derivativeValues = (DTYPE *)calloc(9*nodeNumber, sizeof(DTYPE));
+
+   double coeff[3], derivative[9];
 
    mat33 matrix, R;
 
@@ -650,44 +579,41 @@ double reg_spline_approxLinearEnergyValue3D(nifti_image *splineControlPoint)
       reorientation = reg_mat44_to_mat33(&splineControlPoint->sto_ijk);
    else reorientation = reg_mat44_to_mat33(&splineControlPoint->qto_ijk);
 
+   // Evaluate the first order derivatives of the three components at once
 #ifdef _OPENMP
 #pragma omp parallel for default(none) \
-   shared(splinePtrX, splinePtrY, splinePtrZ, splineControlPoint, \
-   basisX, basisY, basisZ, reorientation) \
-   private(x, y, z, a, b, c, i, index, matrix, R, \
-   splineCoeffX, splineCoeffY, splineCoeffZ, currentValue) \
+   shared(splinePtrX, splinePtrY, splinePtrZ, splineControlPoint, derivativeValues, \
+   basisX, basisY, basisZ, reorientation, computeGradient) \
+   private(x, y, z, a, b, c, d, i, index, matrix, R, coeff, derivative, currentValue) \
    reduction(+:constraintValue)
 #endif
    for(z=1; z<splineControlPoint->nz-1; ++z){
       for(y=1; y<splineControlPoint->ny-1; ++y){
          for(x=1; x<splineControlPoint->nx-1; ++x){
 
-            memset(&matrix, 0, sizeof(mat33));
+            for(d=0; d<9; ++d) derivative[d]=0;
 
             i=0;
             for(c=-1; c<2; c++){
                for(b=-1; b<2; b++){
                   for(a=-1; a<2; a++){
                      index = ((z+c)*splineControlPoint->ny+y+b)*splineControlPoint->nx+x+a;
-                     splineCoeffX = splinePtrX[index];
-                     splineCoeffY = splinePtrY[index];
-                     splineCoeffZ = splinePtrZ[index];
-
-                     matrix.m[0][0] += basisX[i]*splineCoeffX;
-                     matrix.m[1][0] += basisY[i]*splineCoeffX;
-                     matrix.m[2][0] += basisZ[i]*splineCoeffX;
-
-                     matrix.m[0][1] += basisX[i]*splineCoeffY;
-                     matrix.m[1][1] += basisY[i]*splineCoeffY;
-                     matrix.m[2][1] += basisZ[i]*splineCoeffY;
-
-                     matrix.m[0][2] += basisX[i]*splineCoeffZ;
-                     matrix.m[1][2] += basisY[i]*splineCoeffZ;
-                     matrix.m[2][2] += basisZ[i]*splineCoeffZ;
+                     coeff[0] = splinePtrX[index];
+                     coeff[1] = splinePtrY[index];
+                     coeff[2] = splinePtrZ[index];
+                     for(d=0; d<3; ++d)
+                     {
+                        derivative[d]   += basisX[i]*coeff[d];
+                        derivative[3+d] += basisY[i]*coeff[d];
+                        derivative[6+d] += basisZ[i]*coeff[d];
+                     }
                      ++i;
                   }
                }
             }
+            for(b=0; b<3; b++)
+               for(a=0; a<3; a++)
+                  matrix.m[b][a] = derivative[3*b+a];
             // Convert from mm to voxel
             matrix = nifti_mat33_mul(reorientation, matrix);
             // Removing the rotation component
@@ -705,9 +631,92 @@ double reg_spline_approxLinearEnergyValue3D(nifti_image *splineControlPoint)
                }
             }
             constraintValue += currentValue;
+
+            if(computeGradient)
+            {
+               index = (z*splineControlPoint->ny+y)*splineControlPoint->nx+x;
+               for(b=0; b<3; b++)
+                  for(a=0; a<3; a++)
+                     derivativeValues[9*index+3*b+a] = matrix.m[b][a];
+            }
          }
       }
    }
+
+   if(computeGradient)
+   {
+      DTYPE *gradientXPtr = static_cast<DTYPE *>(gradientImage->data);
+      DTYPE *gradientYPtr = &gradientXPtr[nodeNumber];
+      DTYPE *gradientZPtr = &gradientYPtr[nodeNumber];
+
+      DTYPE approxRatio = (DTYPE)weight / (DTYPE)(nodeNumber);
+
+      // Matrices to be used to convert the gradient from voxel to mm
+      reorientation = nifti_mat33_inverse(reorientation);
+
+      double gradValues[3];
+      DTYPE *derivativeValuesPtr;
+
+      // Each node gathers the contribution of its neighbours to avoid
+      // concurrent writes
+#ifdef _OPENMP
+#pragma omp parallel for default(none) \
+   shared(splineControlPoint, derivativeValues, \
+   gradientXPtr, gradientYPtr, gradientZPtr, \
+   basisX, basisY, basisZ, approxRatio, reorientation) \
+   private(index, i, X, Y, Z, x, y, z, \
+   derivativeValuesPtr, gradValues)
+#endif
+      for(z=0; z<splineControlPoint->nz; z++)
+      {
+         index=z*splineControlPoint->nx*splineControlPoint->ny;
+         for(y=0; y<splineControlPoint->ny; y++)
+         {
+            for(x=0; x<splineControlPoint->nx; x++)
+            {
+               gradValues[0]=gradValues[1]=gradValues[2]=0.0;
+               i=0;
+               for(Z=z-1; Z<z+2; Z++)
+               {
+                  for(Y=y-1; Y<y+2; Y++)
+                  {
+                     for(X=x-1; X<x+2; X++)
+                     {
+                        if(-1<X && -1<Y && -1<Z &&
+                              X<splineControlPoint->nx &&
+                              Y<splineControlPoint->ny &&
+                              Z<splineControlPoint->nz)
+                        {
+                           derivativeValuesPtr = &derivativeValues[
+                                 9 * ((Z*splineControlPoint->ny + Y)*splineControlPoint->nx + X)
+                                 ];
+                           // Only the diagonal terms contribute
+                           gradValues[0] -= 2.0*derivativeValuesPtr[0]*basisX[i];
+                           gradValues[1] -= 2.0*derivativeValuesPtr[4]*basisY[i];
+                           gradValues[2] -= 2.0*derivativeValuesPtr[8]*basisZ[i];
+                        }
+                        ++i;
+                     } // X
+                  } // Y
+               } // Z
+               gradientXPtr[index] += approxRatio *
+                     ( reorientation.m[0][0]*gradValues[0]
+                     + reorientation.m[0][1]*gradValues[1]
+                     + reorientation.m[0][2]*gradValues[2]);
+               gradientYPtr[index] += approxRatio *
+                     ( reorientation.m[1][0]*gradValues[0]
+                     + reorientation.m[1][1]*gradValues[1]
+                     + reorientation.m[1][2]*gradValues[2]);
+               gradientZPtr[index] += approxRatio *
+                     ( reorientation.m[2][0]*gradValues[0]
+                     + reorientation.m[2][1]*gradValues[1]
+                     + reorientation.m[2][2]*gradValues[2]);
+               index++;
+            }
+         }
+      }
+      free(derivativeValues);
+   }
    return constraintValue / static_cast<double>(splineControlPoint->nvox);
 }
 /* *************************************************************** */
@@ -717,9 +726,9 @@ double reg_spline_approxLinearEnergy(nifti_image *splineControlPoint)
       switch(splineControlPoint->datatype)
       {
       case NIFTI_TYPE_FLOAT32:
-         return reg_spline_approxLinearEnergyValue3D<float>(splineControlPoint);
+         return reg_spline_approxLinearEnergy3D<float>(splineControlPoint, NULL, 0.f);
       case NIFTI_TYPE_FLOAT64:
-         return reg_spline_approxLinearEnergyValue3D<double>(splineControlPoint);
+         return reg_spline_approxLinearEnergy3D<double>(splineControlPoint, NULL, 0.f);
       default:
          reg_print_fct_error("reg_spline_approxLinearEnergyValue3D");
          reg_print_msg_error("Only implemented for single or double precision images");
@@ -758,8 +767,8 @@ void reg_spline_approxLinearEnergyGradient2D(nifti_image *splineControlPoint,
 
    // Store the basis values since they are constant as the value is approximated
    // at the control point positions only
-   DTYPE basisX[9];
-   DTYPE basisY[9];
+   double basisX[9];
+   double basisY[9];
    set_first_order_basis_values(basisX, basisY);
 
    DTYPE *derivativeValues = (DTYPE *)calloc(4*nodeNumber, sizeof(DTYPE));
@@ -771,8 +780,9 @@ void reg_spline_approxLinearEnergyGradient2D(nifti_image *splineControlPoint,
       reorientation = reg_mat44_to_mat33(&splineControlPoint->sto_ijk);
    else reorientation = reg_mat44_to_mat33(&splineControlPoint->qto_ijk);
 
-   DTYPE splineCoeffX;
-   DTYPE splineCoeffY;
+   double splineCoeffX;
+   double splineCoeffY;
+   double derivative[4];
 
    mat33 matrix, R;
 
@@ -781,7 +791,7 @@ void reg_spline_approxLinearEnergyGradient2D(nifti_image *splineControlPoint,
    shared(splineControlPoint, splinePtrX, splinePtrY, \
    derivativeValues, basisX, basisY, reorientation) \
    private(x, y, a, b, i, index, derivativeValuesPtr, \
-   splineCoeffX, splineCoeffY, matrix, R)
+   splineCoeffX, splineCoeffY, derivative, matrix, R)
 #endif
    for(y=1; y<splineControlPoint->ny-1; y++)
    {
@@ -790,8 +800,7 @@ void reg_spline_approxLinearEnergyGradient2D(nifti_image *splineControlPoint,
             ];
       for(x=1; x<splineControlPoint->nx-1; x++)
       {
-         memset(&matrix, 0, sizeof(mat33));
-         matrix.m[2][2]=1.f;
+         derivative[0]=derivative[1]=derivative[2]=derivative[3]=0.0;
 
          i=0;
          for(b=-1; b<2; b++){
@@ -800,14 +809,20 @@ void reg_spline_approxLinearEnergyGradient2D(nifti_image *splineControlPoint,
                splineCoeffX = splinePtrX[index];
                splineCoeffY = splinePtrY[index];
 
-               matrix.m[0][0] += basisX[i]*splineCoeffX;
-               matrix.m[1][0] += basisY[i]*splineCoeffX;
+               derivative[0] += basisX[i]*splineCoeffX;
+               derivative[1] += basisY[i]*splineCoeffX;
 
-               matrix.m[0][1] += basisX[i]*splineCoeffY;
-               matrix.m[1][1] += basisY[i]*splineCoeffY;
+               derivative[2] += basisX[i]*splineCoeffY;
+               derivative[3] += basisY[i]*splineCoeffY;
                ++i;
             }
          }
+         memset(&matrix, 0, sizeof(mat33));
+         matrix.m[0][0]=derivative[0];
+         matrix.m[1][0]=derivative[1];
+         matrix.m[0][1]=derivative[2];
+         matrix.m[1][1]=derivative[3];
+         matrix.m[2][2]=1.f;
          // Convert from mm to voxel
          matrix = nifti_mat33_mul(reorientation, matrix);
          // Removing the rotation component
@@ -885,198 +900,6 @@ void reg_spline_approxLinearEnergyGradient2D(nifti_image *splineControlPoint,
    free(derivativeValues);
 }
 /* *************************************************************** */
-template <class DTYPE>
-void reg_spline_approxLinearEnergyGradient3D(nifti_image *splineControlPoint,
-                                             nifti_image *gradientImage,
-                                             float weight
-                                             )
-{
-   size_t nodeNumber = (size_t)splineControlPoint->nx*
-         splineControlPoint->ny*splineControlPoint->nz;
-   int x, y, z, X, Y, Z, a, b, c, i, index;
-
-   // Create pointers to the spline coefficients
-   DTYPE * splinePtrX = static_cast<DTYPE *>(splineControlPoint->data);
-   DTYPE * splinePtrY = &splinePtrX[nodeNumber];
-   DTYPE * splinePtrZ = &splinePtrY[nodeNumber];
-
-   // Store the basis values since they are constant as the value is approximated
-   // at the control point positions only
-   DTYPE basisX[27];
-   DTYPE basisY[27];
-   DTYPE basisZ[27];
-   set_first_order_basis_values(basisX, basisY, basisZ);
-
-   DTYPE *derivativeValues = (DTYPE *)calloc(9*nodeNumber, sizeof(DTYPE));
-   DTYPE *derivativeValuesPtr;
-
-   // Matrix to use to convert the gradient from mm to voxel
-   mat33 reorientation;
-   if(splineControlPoint->sform_code>0)
-      reorientation = reg_mat44_to_mat33(&splineControlPoint->sto_ijk);
-   else reorientation = reg_mat44_to_mat33(&splineControlPoint->qto_ijk);
-
-   DTYPE splineCoeffX;
-   DTYPE splineCoeffY;
-   DTYPE splineCoeffZ;
-
-   mat33 matrix, R;
-
-#ifdef _OPENMP
-#pragma omp parallel for default(none) \
-   shared(splineControlPoint, splinePtrX, splinePtrY, splinePtrZ, \
-   derivativeValues, basisX, basisY, basisZ, reorientation) \
-   private(x, y, z, a, b, c, i, index, derivativeValuesPtr, \
-   splineCoeffX, splineCoeffY, splineCoeffZ, matrix, R)
-#endif
-   for(z=1; z<splineControlPoint->nz-1; z++)
-   {
-      for(y=1; y<splineControlPoint->ny-1; y++)
-      {
-         derivativeValuesPtr = &derivativeValues[
-               9*((z*splineControlPoint->ny+y)*splineControlPoint->nx+1)
-               ];
-         for(x=1; x<splineControlPoint->nx-1; x++)
-         {
-            memset(&matrix, 0, sizeof(mat33));
-
-            i=0;
-            for(c=-1; c<2; c++){
-               for(b=-1; b<2; b++){
-                  for(a=-1; a<2; a++){
-                     index = ((z+c)*splineControlPoint->ny+y+b)*splineControlPoint->nx+x+a;
-                     splineCoeffX = splinePtrX[index];
-                     splineCoeffY = splinePtrY[index];
-                     splineCoeffZ = splinePtrZ[index];
-
-                     matrix.m[0][0] += basisX[i]*splineCoeffX;
-                     matrix.m[1][0] += basisY[i]*splineCoeffX;
-                     matrix.m[2][0] += basisZ[i]*splineCoeffX;
-
-                     matrix.m[0][1] += basisX[i]*splineCoeffY;
-                     matrix.m[1][1] += basisY[i]*splineCoeffY;
-                     matrix.m[2][1] += basisZ[i]*splineCoeffY;
-
-                     matrix.m[0][2] += basisX[i]*splineCoeffZ;
-                     matrix.m[1][2] += basisY[i]*splineCoeffZ;
-                     matrix.m[2][2] += basisZ[i]*splineCoeffZ;
-                     ++i;
-                  }
-               }
-            }
-            // Convert from mm to voxel
-            matrix = nifti_mat33_mul(reorientation, matrix);
-            // Removing the rotation component
-            R = nifti_mat33_inverse(nifti_mat33_polar(matrix));
-            matrix = nifti_mat33_mul(R, matrix);
-            // Convert to displacement
-            --matrix.m[0][0];
-            --matrix.m[1][1];
-            --matrix.m[2][2];
-            *derivativeValuesPtr++ = matrix.m[0][0];
-            *derivativeValuesPtr++ = matrix.m[0][1];
-            *derivativeValuesPtr++ = matrix.m[0][2];
-            *derivativeValuesPtr++ = matrix.m[1][0];
-            *derivativeValuesPtr++ = matrix.m[1][1];
-            *derivativeValuesPtr++ = matrix.m[1][2];
-            *derivativeValuesPtr++ = matrix.m[2][0];
-            *derivativeValuesPtr++ = matrix.m[2][1];
-            *derivativeValuesPtr++ = matrix.m[2][2];
-         } // x
-      } // y
-   } // z
-
-   DTYPE *gradientXPtr = static_cast<DTYPE *>(gradientImage->data);
-   DTYPE *gradientYPtr = &gradientXPtr[nodeNumber];
-   DTYPE *gradientZPtr = &gradientYPtr[nodeNumber];
-
-   DTYPE approxRatio = (DTYPE)weight / (DTYPE)(nodeNumber);
-
-   // Matrices to be used to convert the gradient from voxel to mm
-   reorientation = nifti_mat33_inverse(reorientation);
-
-   double gradValues[3];
-
-#ifdef _OPENMP
-#pragma omp parallel for default(none) \
-   shared(splineControlPoint, derivativeValues, \
-   gradientXPtr, gradientYPtr, gradientZPtr, \
-   basisX, basisY, basisZ, approxRatio, reorientation) \
-   private(index, i, X, Y, Z, x, y, z, a, \
-   derivativeValuesPtr, gradValues, matrix)
-#endif
-   for(z=0; z<splineControlPoint->nz; z++)
-   {
-      index=z*splineControlPoint->nx*splineControlPoint->ny;
-      for(y=0; y<splineControlPoint->ny; y++)
-      {
-         for(x=0; x<splineControlPoint->nx; x++)
-         {
-            gradValues[0]=gradValues[1]=gradValues[2]=0.0;
-            i=0;
-            for(Z=z-1; Z<z+2; Z++)
-            {
-               for(Y=y-1; Y<y+2; Y++)
-               {
-                  for(X=x-1; X<x+2; X++)
-                  {
-                     if(-1<X && -1<Y && -1<Z &&
-                           X<splineControlPoint->nx &&
-                           Y<splineControlPoint->ny &&
-                           Z<splineControlPoint->nz)
-                     {
-                        derivativeValuesPtr = &derivativeValues[
-                              9 * ((Z*splineControlPoint->ny + Y)*splineControlPoint->nx + X)
-                              ];
-
-                        matrix.m[0][0] = (*derivativeValuesPtr++);
-                        matrix.m[0][1] = (*derivativeValuesPtr++);
-                        matrix.m[0][2] = (*derivativeValuesPtr++);
-
-                        matrix.m[1][0] = (*derivativeValuesPtr++);
-                        matrix.m[1][1] = (*derivativeValuesPtr++);
-                        matrix.m[1][2] = (*derivativeValuesPtr++);
-
-                        matrix.m[2][0] = (*derivativeValuesPtr++);
-                        matrix.m[2][1] = (*derivativeValuesPtr++);
-                        matrix.m[2][2] = (*derivativeValuesPtr++);
-
-                        gradValues[0] -= 2.0*matrix.m[0][0]*basisX[i];
-//                        gradValues[0] -= (matrix.m[0][1]+matrix.m[1][0])*basisY[i];
-//                        gradValues[0] -= (matrix.m[0][2]+matrix.m[2][0])*basisZ[i];
-
-                        gradValues[1] -= 2.0*matrix.m[1][1]*basisY[i];
-//                        gradValues[1] -= (matrix.m[1][0]+matrix.m[0][1])*basisX[i];
-//                        gradValues[1] -= (matrix.m[1][2]+matrix.m[2][1])*basisZ[i];
-
-                        gradValues[2] -= 2.0*matrix.m[2][2]*basisZ[i];
-//                        gradValues[2] -= (matrix.m[2][0]+matrix.m[0][2])*basisX[i];
-//                        gradValues[2] -= (matrix.m[2][1]+matrix.m[1][2])*basisY[i];
-                     }
-                     ++i;
-                  } // X
-               } // Y
-            } // Z
-            matrix = reorientation;
-            gradientXPtr[index] += approxRatio *
-                  ( matrix.m[0][0]*gradValues[0]
-                  + matrix.m[0][1]*gradValues[1]
-                  + matrix.m[0][2]*gradValues[2]);
-            gradientYPtr[index] += approxRatio *
-                  ( matrix.m[1][0]*gradValues[0]
-                  + matrix.m[1][1]*gradValues[1]
-                  + matrix.m[1][2]*gradValues[2]);
-            gradientZPtr[index] += approxRatio *
-                  ( matrix.m[2][0]*gradValues[0]
-                  + matrix.m[2][1]*gradValues[1]
-                  + matrix.m[2][2]*gradValues[2]);
-            index++;
-         }
-      }
-   }
-   free(derivativeValues);
-}
-/* *************************************************************** */
 void reg_spline_approxLinearEnergyGradient(nifti_image *splineControlPoint,
                                            nifti_image *gradientImage,
                                            float weight
@@ -1092,11 +915,11 @@ void reg_spline_approxLinearEnergyGradient(nifti_image *splineControlPoint,
       switch(splineControlPoint->datatype)
       {
       case NIFTI_TYPE_FLOAT32:
-         reg_spline_approxLinearEnergyGradient3D<float>
+         reg_spline_approxLinearEnergy3D<float>
                (splineControlPoint, gradientImage, weight);
          break;
       case NIFTI_TYPE_FLOAT64:
-         reg_spline_approxLinearEnergyGradient3D<double>
+         reg_spline_approxLinearEnergy3D<double>
                (splineControlPoint, gradientImage, weight);
          break;
       default:
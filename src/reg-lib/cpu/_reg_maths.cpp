@@ -5,6 +5,8 @@
 //STD
 #include <map>
 #include <vector>
+#include <string>
+#include <stdarg.h>
 
 #define mat(i,j,dim) mat[i*dim+j]
 
@@ -985,6 +987,134 @@ double get_square_distance2D(float * first_point2D, float * second_point2D) {
           reg_pow2(first_point2D[1] - second_point2D[1]));
 }
 /* *************************************************************** */
+// Number of nested concurrent section pairs currently running, and whether
+// one of their sections failed
+static int reg_sectionDepth=0;
+static bool reg_sectionFailed=false;
+#ifdef HAVE_R
+static std::vector< std::pair<bool,std::string> > reg_sectionMessages;
+#endif
+// Thrown to leave a section body, and caught by that body before the join
+struct reg_sectionAbort {};
+/* *************************************************************** */
+bool reg_beginConcurrentSections(int *previousLevels)
+{
+   *previousLevels=1;
+#pragma omp critical(reg_concurrentSections)
+   ++reg_sectionDepth;
+#if defined (_OPENMP)
+   if(omp_in_parallel() || omp_get_max_threads()<2)
+      return false;
+   *previousLevels=omp_get_max_active_levels();
+   if(*previousLevels<2)
+      omp_set_max_active_levels(2);
+   return true;
+#else
+   return false;
+#endif
+}
+/* *************************************************************** */
+void reg_setSectionThreadNumber(bool concurrent, int section)
+{
+#if defined (_OPENMP)
+   if(!concurrent) return;
+   // The first section takes any odd thread
+   int threadNumber=omp_get_max_threads();
+   if(section==0)
+      omp_set_num_threads((threadNumber+1)/2);
+   else omp_set_num_threads(threadNumber/2>0?threadNumber/2:1);
+#endif
+}
+/* *************************************************************** */
+void reg_failSection()
+{
+#pragma omp critical(reg_concurrentSections)
+   reg_sectionFailed=true;
+}
+/* *************************************************************** */
+void reg_endConcurrentSections(bool concurrent, int previousLevels)
+{
+#if defined (_OPENMP)
+   if(concurrent && previousLevels<2)
+      omp_set_max_active_levels(previousLevels);
+#endif
+   bool outermost, failed;
+#ifdef HAVE_R
+   std::vector< std::pair<bool,std::string> > messages;
+#endif
+#pragma omp critical(reg_concurrentSections)
+   {
+      outermost=(--reg_sectionDepth==0);
+      failed=reg_sectionFailed;
+      if(outermost)
+      {
+         reg_sectionFailed=false;
+#ifdef HAVE_R
+         messages.swap(reg_sectionMessages);
+#endif
+      }
+   }
+   // A nested pair passes the failure on to the section enclosing it
+   if(!outermost)
+   {
+      if(failed) throw reg_sectionAbort();
+      return;
+   }
+#ifdef HAVE_R
+   for(size_t i=0; i<messages.size(); ++i)
+   {
+      if(messages[i].first)
+         REprintf("%s", messages[i].second.c_str());
+      else Rprintf("%s", messages[i].second.c_str());
+   }
+#endif
+   if(failed)
+   {
+      reg_print_fct_error("reg_endConcurrentSections");
+      reg_print_msg_error("One of the concurrent sections failed");
+      reg_exit();
+   }
+}
+/* *************************************************************** */
+#ifdef HAVE_R
+void reg_printR(bool error, const char *format, ...)
+{
+   char text[1024];
+   va_list args;
+   va_start(args, format);
+   vsnprintf(text, sizeof(text), format, args);
+   va_end(args);
+   bool queued=false;
+#pragma omp critical(reg_concurrentSections)
+   {
+      if(reg_sectionDepth>0)
+      {
+         reg_sectionMessages.push_back(std::make_pair(error, std::string(text)));
+         queued=true;
+      }
+   }
+   if(queued) return;
+   if(error)
+      REprintf("%s", text);
+   else Rprintf("%s", text);
+}
+/* *************************************************************** */
+void reg_abortSection()
+{
+   bool active=false;
+#pragma omp critical(reg_concurrentSections)
+   {
+      if(reg_sectionDepth>0)
+      {
+         reg_sectionFailed=true;
+         active=true;
+      }
+   }
+   // Outside of any concurrent section the caller raises the R error itself
+   if(active) throw reg_sectionAbort();
+}
+#endif
+/* *************************************************************** */
 // Calculate pythagorean distance
 template<class T>
 T pythag(T a, T b)
@@ -25,6 +25,7 @@
 
 #include <limits>
 #include <stdio.h>
+#include <string.h>
 #include <math.h>
 #include <iostream>
 #include <vector>
@@ -75,14 +76,18 @@ typedef enum
 #endif
 /* *************************************************************** */
 #ifdef HAVE_R
-#define reg_exit(...)                   Rf_error("[NiftyReg] Fatal error")
-#define reg_print_info(executable,text) Rprintf("[%s] %s\n", executable, text)
-#define reg_print_fct_debug(text)       Rprintf("[NiftyReg DEBUG] Function: %s called\n", text)
-#define reg_print_msg_debug(text)       Rprintf("[NiftyReg DEBUG] %s\n", text)
-#define reg_print_fct_warn(text)        REprintf("[NiftyReg WARNING] Function: %s\n", text)
-#define reg_print_msg_warn(text)        REprintf("[NiftyReg WARNING] %s\n", text)
-#define reg_print_fct_error(text)       REprintf("[NiftyReg ERROR] Function: %s\n", text)
-#define reg_print_msg_error(text)       REprintf("[NiftyReg ERROR] %s\n", text)
+// The R API may only be called from the master thread, so within concurrent
+// sections messages are queued and errors are raised once the sections join
+void reg_printR(bool error, const char *format, ...);
+void reg_abortSection();
+#define reg_exit(...)                   { reg_abortSection(); Rf_error("[NiftyReg] Fatal error"); }
+#define reg_print_info(executable,text) reg_printR(false, "[%s] %s\n", executable, text)
+#define reg_print_fct_debug(text)       reg_printR(false, "[NiftyReg DEBUG] Function: %s called\n", text)
+#define reg_print_msg_debug(text)       reg_printR(false, "[NiftyReg DEBUG] %s\n", text)
+#define reg_print_fct_warn(text)        reg_printR(true, "[NiftyReg WARNING] Function: %s\n", text)
+#define reg_print_msg_warn(text)        reg_printR(true, "[NiftyReg WARNING] %s\n", text)
+#define reg_print_fct_error(text)       reg_printR(true, "[NiftyReg ERROR] Function: %s\n", text)
+#define reg_print_msg_error(text)       reg_printR(true, "[NiftyReg ERROR] %s\n", text)
 #else
 #define reg_exit(){ \
     fprintf(stderr,"[NiftyReg] Exit here. File: %s:%i\n",__FILE__, __LINE__); \
@@ -125,6 +130,83 @@ inline int fabs(int _x)
 }
 #endif // If on windows...
 /* *************************************************************** */
+/** Datatype code of images holding reg_half values. NIfTI defines no
+ * half-precision type, so such images are only used internally and are
+ * never written to file
+ */
+#define REG_TYPE_FLOAT16 8192
+/* *************************************************************** */
+/** @brief IEEE 754 half-precision (binary16) value, used to store large
+ * intermediate images in two bytes per element. Values are converted from
+ * float with rounding to the nearest even value and have about three
+ * significant decimal digits; arithmetic is done after conversion back to
+ * float
+ */
+class reg_half
+{
+public:
+   unsigned short bits;
+
+   reg_half() {}
+   reg_half(float value)
+   {
+      unsigned int u;
+      memcpy(&u, &value, sizeof(float));
+      const unsigned short sign = (unsigned short)((u >> 16) & 0x8000);
+      u &= 0x7fffffff;
+      if(u >= 0x7f800000) // Inf or NaN
+         this->bits = sign | 0x7c00 | (u > 0x7f800000 ? 0x200 : 0);
+      else if(u >= 0x47800000) // Overflows to Inf
+         this->bits = sign | 0x7c00;
+      else
+      {
+         // Normal values keep the top ten bits of the float mantissa, while
+         // values below 2^-14 become subnormal and keep fewer
+         const int exponent = (int)(u >> 23);
+         unsigned int mantissa = u & 0x7fffff;
+         int shift = 13;
+         unsigned int result;
+         if(exponent > 112)
+            result = ((unsigned int)(exponent - 112) << 10) | (mantissa >> 13);
+         else if(exponent >= 102)
+         {
+            mantissa |= 0x800000;
+            shift = 126 - exponent;
+            result = mantissa >> shift;
+         }
+         else
+         {
+            this->bits = sign;
+            return;
+         }
+         // The carry of a rounded-up mantissa moves into the exponent
+         const unsigned int remainder = mantissa & ((1u << shift) - 1);
+         const unsigned int halfway = 1u << (shift - 1);
+         if(remainder > halfway || (remainder == halfway && (result & 1)))
+            ++result;
+         this->bits = sign | (unsigned short)result;
+      }
+   }
+   operator float() const
+   {
+      const unsigned int sign = (unsigned int)(this->bits & 0x8000) << 16;
+      const unsigned int exponent = (this->bits >> 10) & 0x1f;
+      const unsigned int mantissa = this->bits & 0x3ff;
+      if(exponent == 0) // Zero or subnormal, in units of 2^-24
+      {
+         const float value = (float)mantissa * 5.9604644775390625e-8f;
+         return sign ? -value : value;
+      }
+      unsigned int u;
+      if(exponent == 0x1f)
+         u = sign | 0x7f800000 | (mantissa << 13);
+      else u = sign | ((exponent + 112) << 23) | (mantissa << 13);
+      float value;
+      memcpy(&value, &u, sizeof(float));
+      return value;
+   }
+};
+/* *************************************************************** */
 extern "C++" template <class T>
 void reg_LUdecomposition(T *inputMatrix,
                          size_t dim,
@@ -291,4 +373,30 @@ double get_square_distance3D(float * first_point3D, float * second_point3D);
 /* *************************************************************** */
 double get_square_distance2D(float * first_point2D, float * second_point2D);
 /* *************************************************************** */
+/** @brief Prepare two independent pieces of work, such as the forward and
+ * backward halves of a symmetric registration, to be run concurrently as a
+ * pair of OpenMP sections, by enabling one level of nested parallelism.
+ * Returns false, leaving the OpenMP state untouched, when fewer than two
+ * threads are available or when already inside a parallel region, in which
+ * case the sections should be run one after the other
+ * @param previousLevels Receives the current maximal number of active
+ * levels, to be restored by reg_endConcurrentSections()
+ */
+bool reg_beginConcurrentSections(int *previousLevels);
+/** @brief Restrict the parallel regions encountered within one of two
+ * concurrent sections to that section's half of the available threads.
+ * Nothing is done if the sections are not run concurrently
+ */
+void reg_setSectionThreadNumber(bool concurrent, int section);
+/** @brief Record that the enclosing concurrent section failed. Each section
+ * body catches any exception and calls this function, so that nothing is
+ * thrown across the OpenMP boundary
+ */
+void reg_failSection();
+/** @brief Restore the nesting state saved by reg_beginConcurrentSections().
+ * Messages queued by the sections are then printed and, if one of them
+ * failed, the error is raised from the calling thread
+ */
+void reg_endConcurrentSections(bool concurrent, int previousLevels);
+/* *************************************************************** */
 #endif // _REG_MATHS_H
@@ -33,6 +33,8 @@ public:
       this->referenceTimePoint=this->referenceImagePointer->nt;
       this->floatingImagePointer=floImgPtr;
       this->referenceMaskPointer=maskRefPtr;
+      this->referenceActiveVoxels=NULL;
+      this->floatingActiveVoxels=NULL;
       this->warpedFloatingImagePointer=warFloImgPtr;
       this->warpedFloatingGradientImagePointer=warFloGraPtr;
       this->forwardVoxelBasedGradientImagePointer=forVoxBasedGraPtr;
@@ -53,6 +55,14 @@ public:
       printf("[NiftyReg DEBUG] reg_measure::InitialiseMeasure()\n");
 #endif
    }
+   /// @brief Set the optional compact lists of active voxels matching the
+   /// reference and floating masks. The lists are owned by the caller.
+   void SetActiveVoxelLists(_reg_activeVoxelList *refActiveVoxels,
+                            _reg_activeVoxelList *floActiveVoxels = NULL)
+   {
+      this->referenceActiveVoxels=refActiveVoxels;
+      this->floatingActiveVoxels=this->isSymmetric?floActiveVoxels:NULL;
+   }
    /// @brief Returns the registration measure of similarity value
    virtual double GetSimilarityMeasureValue() = 0;
    /// @brief Compute the voxel based measure of similarity gradient
@@ -86,6 +96,7 @@ public:
 protected:
    nifti_image *referenceImagePointer;
    int *referenceMaskPointer;
+   _reg_activeVoxelList *referenceActiveVoxels;
    nifti_image *warpedFloatingImagePointer;
    nifti_image *warpedFloatingGradientImagePointer;
    nifti_image *forwardVoxelBasedGradientImagePointer;
@@ -93,6 +104,7 @@ protected:
    bool isSymmetric;
    nifti_image *floatingImagePointer;
    int *floatingMaskPointer;
+   _reg_activeVoxelList *floatingActiveVoxels;
    nifti_image *warpedReferenceImagePointer;
    nifti_image *warpedReferenceGradientImagePointer;
    nifti_image *backwardVoxelBasedGradientImagePointer;
@@ -103,6 +115,8 @@ protected:
    reg_measure()
    {
       memset(this->activeTimePoint,0,255*sizeof(bool) );
+      this->referenceActiveVoxels=NULL;
+      this->floatingActiveVoxels=NULL;
 #ifndef NDEBUG
       printf("[NiftyReg DEBUG] reg_measure constructor called\n");
 #endif
@@ -25,6 +25,7 @@ reg_nmi::reg_nmi()
    this->backwardJointHistogramPro=NULL;
    this->backwardJointHistogramLog=NULL;
    this->backwardEntropyValues=NULL;
+   this->storedJointHistogram=NULL;
 
    for(int i=0; i<255; ++i)
    {
@@ -117,6 +118,18 @@ void reg_nmi::ClearHistogram()
       free(this->backwardEntropyValues);
    }
    this->backwardEntropyValues=NULL;
+
+   if(this->storedJointHistogram!=NULL)
+   {
+      for(int i=0; i<timepoint; ++i)
+      {
+         if(this->storedJointHistogram[i]!=NULL)
+            free(this->storedJointHistogram[i]);
+         this->storedJointHistogram[i]=NULL;
+      }
+      free(this->storedJointHistogram);
+   }
+   this->storedJointHistogram=NULL;
 #ifndef NDEBUG
    reg_print_msg_debug("reg_nmi::ClearHistogram called");
 #endif
@@ -262,17 +275,16 @@ PrecisionTYPE GetBasisSplineDerivativeValue(PrecisionTYPE ori)
 /* *************************************************************** */
 /* *************************************************************** */
 template <class DTYPE>
-void reg_getNMIValue(nifti_image *referenceImage,
-                     nifti_image *warpedImage,
-                     bool *activeTimePoint,
-                     unsigned short *referenceBinNumber,
-                     unsigned short *floatingBinNumber,
-                     unsigned short *totalBinNumber,
-                     double **jointHistogramLog,
-                     double **jointhistogramPro,
-                     double **entropyValues,
-                     int *referenceMask
-                     )
+void reg_getNMIJointHistogram(nifti_image *referenceImage,
+                              nifti_image *warpedImage,
+                              bool *activeTimePoint,
+                              unsigned short *referenceBinNumber,
+                              unsigned short *floatingBinNumber,
+                              unsigned short *totalBinNumber,
+                              double **jointHistogram,
+                              int *referenceMask,
+                              _reg_activeVoxelList *activeVoxels
+                              )
 {
    // Create pointers to the image data arrays
    DTYPE *refImagePtr = static_cast<DTYPE *>(referenceImage->data);
@@ -281,26 +293,23 @@ void reg_getNMIValue(nifti_image *referenceImage,
    size_t voxelNumber = (size_t)referenceImage->nx *
          referenceImage->ny *
          referenceImage->nz;
+   // Only the listed voxels are visited when a compact mask is provided
+   int *activeIndex = activeVoxels!=NULL ? activeVoxels->index : NULL;
+   size_t loopNumber = activeVoxels!=NULL ? activeVoxels->number : voxelNumber;
    // Iterate over all active time points
    for(int t=0; t<referenceImage->nt; ++t)
    {
       if(activeTimePoint[t])
       {
-#ifndef NDEBUG
-         char text[255];
-         snprintf(text, 255, "Computing NMI for time point %i",t);
-         reg_print_msg_debug(text);
-#endif
-         // Define some pointers to the current histograms
-         double *jointHistoProPtr = jointhistogramPro[t];
-         double *jointHistoLogPtr = jointHistogramLog[t];
+         double *jointHistoPtr = jointHistogram[t];
          // Empty the joint histogram
-         memset(jointHistoProPtr,0,totalBinNumber[t]*sizeof(double));
+         memset(jointHistoPtr,0,totalBinNumber[t]*sizeof(double));
          // Fill the joint histograms using an approximation
          DTYPE *refPtr = &refImagePtr[t*voxelNumber];
          DTYPE *warPtr = &warImagePtr[t*voxelNumber];
-         for(size_t voxel=0; voxel<voxelNumber; ++voxel)
+         for(size_t n=0; n<loopNumber; ++n)
          {
+            size_t voxel = activeIndex!=NULL ? activeIndex[n] : n;
             if(referenceMask[voxel]>-1)
             {
                DTYPE refValue=refPtr[voxel];
@@ -310,11 +319,35 @@ void reg_getNMIValue(nifti_image *referenceImage,
                      refValue<referenceBinNumber[t] &&
                      warValue<floatingBinNumber[t])
                {
-                  ++jointHistoProPtr[static_cast<int>(refValue) +
+                  ++jointHistoPtr[static_cast<int>(refValue) +
                         static_cast<int>(warValue) * referenceBinNumber[t]];
                }
             }
          }
+      } // if active time point
+   } // iterate over all time point in the reference image
+}
+/* *************************************************************** */
+template void reg_getNMIJointHistogram<float>(nifti_image *,nifti_image *,bool *,unsigned short *,unsigned short *,unsigned short *,double **,int *,_reg_activeVoxelList *);
+template void reg_getNMIJointHistogram<double>(nifti_image *,nifti_image *,bool *,unsigned short *,unsigned short *,unsigned short *,double **,int *,_reg_activeVoxelList *);
+/* *************************************************************** */
+void reg_getNMIEntropies(int timePointNumber,
+                         bool *activeTimePoint,
+                         unsigned short *referenceBinNumber,
+                         unsigned short *floatingBinNumber,
+                         unsigned short *totalBinNumber,
+                         double **jointHistogramLog,
+                         double **jointhistogramPro,
+                         double **entropyValues
+                         )
+{
+   for(int t=0; t<timePointNumber; ++t)
+   {
+      if(activeTimePoint[t])
+      {
+         // Define some pointers to the current histograms
+         double *jointHistoProPtr = jointhistogramPro[t];
+         double *jointHistoLogPtr = jointHistogramLog[t];
          // Convolve the histogram with a cubic B-spline kernel
          double kernel[3];
          kernel[0]=kernel[2]=GetBasisSplineValue(-1.);
@@ -442,8 +475,45 @@ void reg_getNMIValue(nifti_image *referenceImage,
    } // iterate over all time point in the reference image
 }
 /* *************************************************************** */
-template void reg_getNMIValue<float>(nifti_image *,nifti_image *,bool *,unsigned short *,unsigned short *,unsigned short *,double **,double **,double **,int *);
-template void reg_getNMIValue<double>(nifti_image *,nifti_image *,bool *,unsigned short *,unsigned short *,unsigned short *,double **,double **,double **,int *);
+/* *************************************************************** */
+template <class DTYPE>
+void reg_getNMIValue(nifti_image *referenceImage,
+                     nifti_image *warpedImage,
+                     bool *activeTimePoint,
+                     unsigned short *referenceBinNumber,
+                     unsigned short *floatingBinNumber,
+                     unsigned short *totalBinNumber,
+                     double **jointHistogramLog,
+                     double **jointhistogramPro,
+                     double **entropyValues,
+                     int *referenceMask,
+                     _reg_activeVoxelList *activeVoxels
+                     )
+{
+#ifndef NDEBUG
+   reg_print_msg_debug("Computing NMI for the active time points");
+#endif
+   reg_getNMIJointHistogram<DTYPE>(referenceImage,
+                                   warpedImage,
+                                   activeTimePoint,
+                                   referenceBinNumber,
+                                   floatingBinNumber,
+                                   totalBinNumber,
+                                   jointhistogramPro,
+                                   referenceMask,
+                                   activeVoxels);
+   reg_getNMIEntropies(referenceImage->nt,
+                       activeTimePoint,
+                       referenceBinNumber,
+                       floatingBinNumber,
+                       totalBinNumber,
+                       jointHistogramLog,
+                       jointhistogramPro,
+                       entropyValues);
+}
+/* *************************************************************** */
+template void reg_getNMIValue<float>(nifti_image *,nifti_image *,bool *,unsigned short *,unsigned short *,unsigned short *,double **,double **,double **,int *,_reg_activeVoxelList *);
+template void reg_getNMIValue<double>(nifti_image *,nifti_image *,bool *,unsigned short *,unsigned short *,unsigned short *,double **,double **,double **,int *,_reg_activeVoxelList *);
 /* *************************************************************** */
 /* *************************************************************** */
 double reg_nmi::GetSimilarityMeasureValue()
@@ -455,121 +525,340 @@ double reg_nmi::GetSimilarityMeasureValue()
       reg_print_msg_error("Both input images are exepected to have the same type");
       reg_exit();
    }
+   if(this->isSymmetric)
+   {
+      // Check that all the specified image are of the same datatype
+      if(this->floatingImagePointer->datatype !=this->warpedReferenceImagePointer->datatype)
+      {
+         reg_print_fct_error("reg_nmi::GetSimilarityMeasureValue()");
+         reg_print_msg_error("Both input images are exepected to have the same type");
+         reg_exit();
+      }
+   }
+
+   // The forward and backward joint histograms are independent and are
+   // filled concurrently when enough threads are available
+   int previousLevels;
+   bool concurrent=this->isSymmetric && reg_beginConcurrentSections(&previousLevels);
+#pragma omp parallel sections num_threads(2) if(concurrent)
+   {
+#pragma omp section
+      {
+         reg_setSectionThreadNumber(concurrent, 0);
+         switch(this->referenceImagePointer->datatype)
+         {
+         case NIFTI_TYPE_FLOAT32:
+            reg_getNMIValue<float>
+                  (this->referenceImagePointer,
+                   this->warpedFloatingImagePointer,
+                   this->activeTimePoint,
+                   this->referenceBinNumber,
+                   this->floatingBinNumber,
+                   this->totalBinNumber,
+                   this->forwardJointHistogramLog,
+                   this->forwardJointHistogramPro,
+                   this->forwardEntropyValues,
+                   this->referenceMaskPointer,
+                   this->referenceActiveVoxels
+                   );
+            break;
+         case NIFTI_TYPE_FLOAT64:
+            reg_getNMIValue<double>
+                  (this->referenceImagePointer,
+                   this->warpedFloatingImagePointer,
+                   this->activeTimePoint,
+                   this->referenceBinNumber,
+                   this->floatingBinNumber,
+                   this->totalBinNumber,
+                   this->forwardJointHistogramLog,
+                   this->forwardJointHistogramPro,
+                   this->forwardEntropyValues,
+                   this->referenceMaskPointer,
+                   this->referenceActiveVoxels
+                   );
+            break;
+         default:
+            reg_print_fct_error("reg_nmi::GetSimilarityMeasureValue()");
+            reg_print_msg_error("Unsupported datatype");
+            reg_exit();
+         }
+      }
+#pragma omp section
+      {
+         if(this->isSymmetric)
+         {
+            reg_setSectionThreadNumber(concurrent, 1);
+            switch(this->floatingImagePointer->datatype)
+            {
+            case NIFTI_TYPE_FLOAT32:
+               reg_getNMIValue<float>
+                     (this->floatingImagePointer,
+                      this->warpedReferenceImagePointer,
+                      this->activeTimePoint,
+                      this->floatingBinNumber,
+                      this->referenceBinNumber,
+                      this->totalBinNumber,
+                      this->backwardJointHistogramLog,
+                      this->backwardJointHistogramPro,
+                      this->backwardEntropyValues,
+                      this->floatingMaskPointer,
+                      this->floatingActiveVoxels
+                      );
+               break;
+            case NIFTI_TYPE_FLOAT64:
+               reg_getNMIValue<double>
+                     (this->floatingImagePointer,
+                      this->warpedReferenceImagePointer,
+                      this->activeTimePoint,
+                      this->floatingBinNumber,
+                      this->referenceBinNumber,
+                      this->totalBinNumber,
+                      this->backwardJointHistogramLog,
+                      this->backwardJointHistogramPro,
+                      this->backwardEntropyValues,
+                      this->floatingMaskPointer,
+                      this->floatingActiveVoxels
+                      );
+               break;
+            default:
+               reg_print_fct_error("reg_nmi::GetSimilarityMeasureValue()");
+               reg_print_msg_error("Unsupported datatype");
+               reg_exit();
+            }
+         }
+      }
+   }
+   reg_endConcurrentSections(concurrent, previousLevels);
+
+   double nmi_value_forward=0.;
+   double nmi_value_backward=0.;
+   for(int t=0; t<this->referenceTimePoint; ++t)
+   {
+      if(this->activeTimePoint[t])
+      {
+         nmi_value_forward += (this->forwardEntropyValues[t][0] +
+               this->forwardEntropyValues[t][1] ) /
+               this->forwardEntropyValues[t][2];
+         if(this->isSymmetric)
+            nmi_value_backward += (this->backwardEntropyValues[t][0] +
+                  this->backwardEntropyValues[t][1] ) /
+                  this->backwardEntropyValues[t][2];
+      }
+   }
+#ifndef NDEBUG
+   reg_print_msg_debug("reg_nmi::GetSimilarityMeasureValue called");
+#endif
+   return nmi_value_forward+nmi_value_backward;
+}
+/* *************************************************************** */
+/* *************************************************************** */
+template <class DTYPE>
+void reg_updateNMIJointHistogram(nifti_image *referenceImage,
+                                 nifti_image *warpedImage,
+                                 nifti_image *localWarpedImage,
+                                 int *referenceIndex,
+                                 bool *activeTimePoint,
+                                 unsigned short *referenceBinNumber,
+                                 unsigned short *floatingBinNumber,
+                                 unsigned short *totalBinNumber,
+                                 double **storedJointHistogram,
+                                 double **jointHistogram
+                                 )
+{
+   DTYPE *refImagePtr = static_cast<DTYPE *>(referenceImage->data);
+   DTYPE *warImagePtr = static_cast<DTYPE *>(warpedImage->data);
+   DTYPE *locImagePtr = static_cast<DTYPE *>(localWarpedImage->data);
+   size_t voxelNumber = (size_t)referenceImage->nx *
+         referenceImage->ny *
+         referenceImage->nz;
+   size_t localVoxelNumber = (size_t)localWarpedImage->nx *
+         localWarpedImage->ny *
+         localWarpedImage->nz;
+   for(int t=0; t<referenceImage->nt; ++t)
+   {
+      if(activeTimePoint[t])
+      {
+         // Start from the stored counts, including the empty marginal bins
+         double *jointHistoPtr = jointHistogram[t];
+         memcpy(jointHistoPtr,storedJointHistogram[t],totalBinNumber[t]*sizeof(double));
+         DTYPE *refPtr = &refImagePtr[t*voxelNumber];
+         DTYPE *warPtr = &warImagePtr[t*voxelNumber];
+         DTYPE *locPtr = &locImagePtr[t*localVoxelNumber];
+         // Each listed voxel is moved from its current bin to its new one,
+         // using the same validity tests as when the histogram was filled
+         for(size_t n=0; n<localVoxelNumber; ++n)
+         {
+            int voxel = referenceIndex[n];
+            if(voxel<0) continue;
+            DTYPE refValue=refPtr[voxel];
+            if(refValue!=refValue || refValue<0 ||
+                  refValue>=referenceBinNumber[t])
+               continue;
+            DTYPE oldValue=warPtr[voxel];
+            DTYPE newValue=locPtr[n];
+            if(oldValue==oldValue && oldValue>=0 &&
+                  oldValue<floatingBinNumber[t])
+            {
+               --jointHistoPtr[static_cast<int>(refValue) +
+                     static_cast<int>(oldValue) * referenceBinNumber[t]];
+            }
+            if(newValue==newValue && newValue>=0 &&
+                  newValue<floatingBinNumber[t])
+            {
+               ++jointHistoPtr[static_cast<int>(refValue) +
+                     static_cast<int>(newValue) * referenceBinNumber[t]];
+            }
+         }
+      } // if active time point
+   } // iterate over all time point in the reference image
+}
+/* *************************************************************** */
+/* *************************************************************** */
+void reg_nmi::StoreJointHistogram()
+{
+   if(this->isSymmetric)
+   {
+      reg_print_fct_error("reg_nmi::StoreJointHistogram()");
+      reg_print_msg_error("Local updates are only implemented for the forward measure");
+      reg_exit();
+   }
+   if(this->storedJointHistogram==NULL)
+   {
+      this->storedJointHistogram=(double**)malloc(255*sizeof(double *));
+      for(int i=0; i<this->referenceTimePoint; ++i)
+      {
+         if(this->activeTimePoint[i])
+            this->storedJointHistogram[i]=(double *)
+                  calloc(this->totalBinNumber[i],sizeof(double));
+         else this->storedJointHistogram[i]=NULL;
+      }
+   }
    switch(this->referenceImagePointer->datatype)
    {
    case NIFTI_TYPE_FLOAT32:
-      reg_getNMIValue<float>
+      reg_getNMIJointHistogram<float>
             (this->referenceImagePointer,
              this->warpedFloatingImagePointer,
              this->activeTimePoint,
              this->referenceBinNumber,
              this->floatingBinNumber,
              this->totalBinNumber,
-             this->forwardJointHistogramLog,
-             this->forwardJointHistogramPro,
-             this->forwardEntropyValues,
-             this->referenceMaskPointer
+             this->storedJointHistogram,
+             this->referenceMaskPointer,
+             this->referenceActiveVoxels
              );
       break;
    case NIFTI_TYPE_FLOAT64:
-      reg_getNMIValue<double>
+      reg_getNMIJointHistogram<double>
             (this->referenceImagePointer,
              this->warpedFloatingImagePointer,
              this->activeTimePoint,
              this->referenceBinNumber,
              this->floatingBinNumber,
              this->totalBinNumber,
-             this->forwardJointHistogramLog,
-             this->forwardJointHistogramPro,
-             this->forwardEntropyValues,
-             this->referenceMaskPointer
+             this->storedJointHistogram,
+             this->referenceMaskPointer,
+             this->referenceActiveVoxels
              );
       break;
    default:
-      reg_print_fct_error("reg_nmi::GetSimilarityMeasureValue()");
+      reg_print_fct_error("reg_nmi::StoreJointHistogram()");
       reg_print_msg_error("Unsupported datatype");
       reg_exit();
    }
-
-   if(this->isSymmetric)
+#ifndef NDEBUG
+   reg_print_msg_debug("reg_nmi::StoreJointHistogram called");
+#endif
+}
+/* *************************************************************** */
+/* *************************************************************** */
+double reg_nmi::GetLocalSimilarityMeasureValue(nifti_image *localWarpedImage,
+                                               int *referenceIndex)
+{
+   if(this->storedJointHistogram==NULL)
    {
-      // Check that all the specified image are of the same datatype
-      if(this->floatingImagePointer->datatype !=this->warpedReferenceImagePointer->datatype)
-      {
-         reg_print_fct_error("reg_nmi::GetSimilarityMeasureValue()");
-         reg_print_msg_error("Both input images are exepected to have the same type");
-         reg_exit();
-      }
-      switch(this->floatingImagePointer->datatype)
-      {
-      case NIFTI_TYPE_FLOAT32:
-         reg_getNMIValue<float>
-               (this->floatingImagePointer,
-                this->warpedReferenceImagePointer,
-                this->activeTimePoint,
-                this->floatingBinNumber,
-                this->referenceBinNumber,
-                this->totalBinNumber,
-                this->backwardJointHistogramLog,
-                this->backwardJointHistogramPro,
-                this->backwardEntropyValues,
-                this->floatingMaskPointer
-                );
-         break;
-      case NIFTI_TYPE_FLOAT64:
-         reg_getNMIValue<double>
-               (this->floatingImagePointer,
-                this->warpedReferenceImagePointer,
-                this->activeTimePoint,
-                this->floatingBinNumber,
-                this->referenceBinNumber,
-                this->totalBinNumber,
-                this->backwardJointHistogramLog,
-                this->backwardJointHistogramPro,
-                this->backwardEntropyValues,
-                this->floatingMaskPointer
-                );
-         break;
-      default:
-         reg_print_fct_error("reg_nmi::GetSimilarityMeasureValue()");
-         reg_print_msg_error("Unsupported datatype");
-         reg_exit();
-      }
+      reg_print_fct_error("reg_nmi::GetLocalSimilarityMeasureValue()");
+      reg_print_msg_error("No joint histogram has been stored");
+      reg_exit();
+   }
+   if(localWarpedImage->datatype !=this->referenceImagePointer->datatype)
+   {
+      reg_print_fct_error("reg_nmi::GetLocalSimilarityMeasureValue()");
+      reg_print_msg_error("Both input images are exepected to have the same type");
+      reg_exit();
    }
+   switch(this->referenceImagePointer->datatype)
+   {
+   case NIFTI_TYPE_FLOAT32:
+      reg_updateNMIJointHistogram<float>
+            (this->referenceImagePointer,
+             this->warpedFloatingImagePointer,
+             localWarpedImage,
+             referenceIndex,
+             this->activeTimePoint,
+             this->referenceBinNumber,
+             this->floatingBinNumber,
+             this->totalBinNumber,
+             this->storedJointHistogram,
+             this->forwardJointHistogramPro
+             );
+      break;
+   case NIFTI_TYPE_FLOAT64:
+      reg_updateNMIJointHistogram<double>
+            (this->referenceImagePointer,
+             this->warpedFloatingImagePointer,
+             localWarpedImage,
+             referenceIndex,
+             this->activeTimePoint,
+             this->referenceBinNumber,
+             this->floatingBinNumber,
+             this->totalBinNumber,
+             this->storedJointHistogram,
+             this->forwardJointHistogramPro
+             );
+      break;
+   default:
+      reg_print_fct_error("reg_nmi::GetLocalSimilarityMeasureValue()");
+      reg_print_msg_error("Unsupported datatype");
+      reg_exit();
+   }
+   // Only the smoothing and the entropies are computed over the bins
+   reg_getNMIEntropies(this->referenceTimePoint,
+                       this->activeTimePoint,
+                       this->referenceBinNumber,
+                       this->floatingBinNumber,
+                       this->totalBinNumber,
+                       this->forwardJointHistogramLog,
+                       this->forwardJointHistogramPro,
+                       this->forwardEntropyValues);
 
-   double nmi_value_forward=0.;
-   double nmi_value_backward=0.;
+   double nmi_value=0.;
    for(int t=0; t<this->referenceTimePoint; ++t)
    {
       if(this->activeTimePoint[t])
-      {
-         nmi_value_forward += (this->forwardEntropyValues[t][0] +
+         nmi_value += (this->forwardEntropyValues[t][0] +
                this->forwardEntropyValues[t][1] ) /
                this->forwardEntropyValues[t][2];
-         if(this->isSymmetric)
-            nmi_value_backward += (this->backwardEntropyValues[t][0] +
-                  this->backwardEntropyValues[t][1] ) /
-                  this->backwardEntropyValues[t][2];
-      }
    }
 #ifndef NDEBUG
-   reg_print_msg_debug("reg_nmi::GetSimilarityMeasureValue called");
+   reg_print_msg_debug("reg_nmi::GetLocalSimilarityMeasureValue called");
 #endif
-   return nmi_value_forward+nmi_value_backward;
+   return nmi_value;
 }
 /* *************************************************************** */
-template <class DTYPE>
-void reg_getVoxelBasedNMIGradient2D(nifti_image *referenceImage,
-                                    nifti_image *warpedImage,
-                                    unsigned short *referenceBinNumber,
-                                    unsigned short *floatingBinNumber,
-                                    double **jointHistogramLog,
-                                    double **entropyValues,
-                                    nifti_image *warImgGradient,
-                                    nifti_image *measureGradientImage,
-                                    int *referenceMask,
-                                    int current_timepoint
-                                    )
+template <class DTYPE, class GradTYPE>
+void reg_getVoxelBasedNMIGradient2D1(nifti_image *referenceImage,
+                                     nifti_image *warpedImage,
+                                     unsigned short *referenceBinNumber,
+                                     unsigned short *floatingBinNumber,
+                                     double **jointHistogramLog,
+                                     double **entropyValues,
+                                     nifti_image *warImgGradient,
+                                     nifti_image *measureGradientImage,
+                                     int *referenceMask,
+                                     int current_timepoint,
+                                     _reg_activeVoxelList *activeVoxels
+                                     )
 {
    if(current_timepoint<0 || current_timepoint>=referenceImage->nt){
       reg_print_fct_error("reg_getVoxelBasedNMIGradient2D");
@@ -585,8 +874,8 @@ void reg_getVoxelBasedNMIGradient2D(nifti_image *referenceImage,
    DTYPE *warPtr = &warImagePtr[current_timepoint*voxelNumber];
 
    // Pointers to the spatial gradient of the warped image
-   DTYPE *warGradPtrX = static_cast<DTYPE *>(warImgGradient->data);
-   DTYPE *warGradPtrY = &warGradPtrX[voxelNumber];
+   GradTYPE *warGradPtrX = static_cast<GradTYPE *>(warImgGradient->data);
+   GradTYPE *warGradPtrY = &warGradPtrX[voxelNumber];
 
    // Pointers to the measure of similarity gradient
    DTYPE *measureGradPtrX = static_cast<DTYPE *>(measureGradientImage->data);
@@ -598,9 +887,13 @@ void reg_getVoxelBasedNMIGradient2D(nifti_image *referenceImage,
    double nmi = (entropyPtr[0]+entropyPtr[1])/entropyPtr[2];
    size_t referenceOffset=referenceBinNumber[current_timepoint]*floatingBinNumber[current_timepoint];
    size_t floatingOffset=referenceOffset+referenceBinNumber[current_timepoint];
+   // Only the listed voxels are visited when a compact mask is provided
+   int *activeIndex = activeVoxels!=NULL ? activeVoxels->index : NULL;
+   size_t loopNumber = activeVoxels!=NULL ? activeVoxels->number : voxelNumber;
    // Iterate over all voxel
-   for(size_t i=0; i<voxelNumber; ++i)
+   for(size_t n=0; n<loopNumber; ++n)
    {
+      size_t i = activeIndex!=NULL ? activeIndex[n] : n;
       // Check if the voxel belongs to the image mask
       if(referenceMask[i]>-1)
       {
@@ -652,13 +945,8 @@ void reg_getVoxelBasedNMIGradient2D(nifti_image *referenceImage,
    } // loop over all voxel
 }
 /* *************************************************************** */
-template void reg_getVoxelBasedNMIGradient2D<float>
-(nifti_image *,nifti_image *,unsigned short *,unsigned short *,double **,double **,nifti_image *,nifti_image *,int *, int);
-template void reg_getVoxelBasedNMIGradient2D<double>
-(nifti_image *,nifti_image *,unsigned short *,unsigned short *,double **,double **,nifti_image *,nifti_image *,int *, int);
-/* *************************************************************** */
 template <class DTYPE>
-void reg_getVoxelBasedNMIGradient3D(nifti_image *referenceImage,
+void reg_getVoxelBasedNMIGradient2D(nifti_image *referenceImage,
                                     nifti_image *warpedImage,
                                     unsigned short *referenceBinNumber,
                                     unsigned short *floatingBinNumber,
@@ -667,8 +955,38 @@ void reg_getVoxelBasedNMIGradient3D(nifti_image *referenceImage,
                                     nifti_image *warImgGradient,
                                     nifti_image *measureGradientImage,
                                     int *referenceMask,
-                                    int current_timepoint
+                                    int current_timepoint,
+                                    _reg_activeVoxelList *activeVoxels
                                     )
+{
+   // The warped image gradient is either of the same type as the images or
+   // stored in half precision, in which case it is converted as it is read
+   if(warImgGradient->datatype==REG_TYPE_FLOAT16)
+      reg_getVoxelBasedNMIGradient2D1<DTYPE,reg_half>
+            (referenceImage,warpedImage,referenceBinNumber,floatingBinNumber,jointHistogramLog,entropyValues,warImgGradient,measureGradientImage,referenceMask,current_timepoint,activeVoxels);
+   else
+      reg_getVoxelBasedNMIGradient2D1<DTYPE,DTYPE>
+            (referenceImage,warpedImage,referenceBinNumber,floatingBinNumber,jointHistogramLog,entropyValues,warImgGradient,measureGradientImage,referenceMask,current_timepoint,activeVoxels);
+}
+/* *************************************************************** */
+template void reg_getVoxelBasedNMIGradient2D<float>
+(nifti_image *,nifti_image *,unsigned short *,unsigned short *,double **,double **,nifti_image *,nifti_image *,int *, int, _reg_activeVoxelList *);
+template void reg_getVoxelBasedNMIGradient2D<double>
+(nifti_image *,nifti_image *,unsigned short *,unsigned short *,double **,double **,nifti_image *,nifti_image *,int *, int, _reg_activeVoxelList *);
+/* *************************************************************** */
+template <class DTYPE, class GradTYPE>
+void reg_getVoxelBasedNMIGradient3D1(nifti_image *referenceImage,
+                                     nifti_image *warpedImage,
+                                     unsigned short *referenceBinNumber,
+                                     unsigned short *floatingBinNumber,
+                                     double **jointHistogramLog,
+                                     double **entropyValues,
+                                     nifti_image *warImgGradient,
+                                     nifti_image *measureGradientImage,
+                                     int *referenceMask,
+                                     int current_timepoint,
+                                     _reg_activeVoxelList *activeVoxels
+                                     )
 {
    if(current_timepoint<0 || current_timepoint>=referenceImage->nt){
       reg_print_fct_error("reg_getVoxelBasedNMIGradient3D");
@@ -677,12 +995,16 @@ void reg_getVoxelBasedNMIGradient3D(nifti_image *referenceImage,
    }
    //
 #ifdef WIN32
-   long i;
+   long i, n;
    long voxelNumber = (long)referenceImage->nx*referenceImage->ny*referenceImage->nz;
+   long loopNumber = activeVoxels!=NULL ? (long)activeVoxels->number : voxelNumber;
 #else
-   size_t i;
+   size_t i, n;
    size_t voxelNumber = (size_t)referenceImage->nx*referenceImage->ny*referenceImage->nz;
+   size_t loopNumber = activeVoxels!=NULL ? activeVoxels->number : voxelNumber;
 #endif
+   // Only the listed voxels are visited when a compact mask is provided
+   int *activeIndex = activeVoxels!=NULL ? activeVoxels->index : NULL;
    // Pointers to the image data
    DTYPE *refImagePtr = static_cast<DTYPE *>(referenceImage->data);
    DTYPE *refPtr = &refImagePtr[current_timepoint*voxelNumber];
@@ -690,9 +1012,9 @@ void reg_getVoxelBasedNMIGradient3D(nifti_image *referenceImage,
    DTYPE *warPtr = &warImagePtr[current_timepoint*voxelNumber];
 
    // Pointers to the spatial gradient of the warped image
-   DTYPE *warGradPtrX = static_cast<DTYPE *>(warImgGradient->data);
-   DTYPE *warGradPtrY = &warGradPtrX[voxelNumber];
-   DTYPE *warGradPtrZ = &warGradPtrY[voxelNumber];
+   GradTYPE *warGradPtrX = static_cast<GradTYPE *>(warImgGradient->data);
+   GradTYPE *warGradPtrY = &warGradPtrX[voxelNumber];
+   GradTYPE *warGradPtrZ = &warGradPtrY[voxelNumber];
 
    // Pointers to the measure of similarity gradient
    DTYPE *measureGradPtrX = static_cast<DTYPE *>(measureGradientImage->data);
@@ -711,14 +1033,15 @@ void reg_getVoxelBasedNMIGradient3D(nifti_image *referenceImage,
    // Iterate over all voxel
 #if defined (_OPENMP)
 #pragma omp parallel for default(none) \
-   private(i,r,w,refValue,warValue,gradX,gradY,gradZ, \
+   private(n,i,r,w,refValue,warValue,gradX,gradY,gradZ, \
    jointDeriv,refDeriv,warDeriv,commun,jointLog,refLog,warLog) \
-   shared(voxelNumber,referenceMask,refPtr,warPtr,referenceBinNumber,floatingBinNumber, \
+   shared(loopNumber,activeIndex,referenceMask,refPtr,warPtr,referenceBinNumber,floatingBinNumber, \
    logHistoPtr,referenceOffset,floatingOffset,measureGradPtrX,measureGradPtrY,measureGradPtrZ, \
    warGradPtrX,warGradPtrY,warGradPtrZ,entropyPtr,nmi,current_timepoint)
 #endif // _OPENMP
-   for(i=0; i<voxelNumber; ++i)
+   for(n=0; n<loopNumber; ++n)
    {
+      i = activeIndex!=NULL ? activeIndex[n] : n;
       // Check if the voxel belongs to the image mask
       if(referenceMask[i]>-1)
       {
@@ -777,10 +1100,34 @@ void reg_getVoxelBasedNMIGradient3D(nifti_image *referenceImage,
    } // loop over all voxel
 }
 /* *************************************************************** */
+template <class DTYPE>
+void reg_getVoxelBasedNMIGradient3D(nifti_image *referenceImage,
+                                    nifti_image *warpedImage,
+                                    unsigned short *referenceBinNumber,
+                                    unsigned short *floatingBinNumber,
+                                    double **jointHistogramLog,
+                                    double **entropyValues,
+                                    nifti_image *warImgGradient,
+                                    nifti_image *measureGradientImage,
+                                    int *referenceMask,
+                                    int current_timepoint,
+                                    _reg_activeVoxelList *activeVoxels
+                                    )
+{
+   // The warped image gradient is either of the same type as the images or
+   // stored in half precision, in which case it is converted as it is read
+   if(warImgGradient->datatype==REG_TYPE_FLOAT16)
+      reg_getVoxelBasedNMIGradient3D1<DTYPE,reg_half>
+            (referenceImage,warpedImage,referenceBinNumber,floatingBinNumber,jointHistogramLog,entropyValues,warImgGradient,measureGradientImage,referenceMask,current_timepoint,activeVoxels);
+   else
+      reg_getVoxelBasedNMIGradient3D1<DTYPE,DTYPE>
+            (referenceImage,warpedImage,referenceBinNumber,floatingBinNumber,jointHistogramLog,entropyValues,warImgGradient,measureGradientImage,referenceMask,current_timepoint,activeVoxels);
+}
+/* *************************************************************** */
 template void reg_getVoxelBasedNMIGradient3D<float>
-(nifti_image *,nifti_image *,unsigned short *,unsigned short *,double **,double **,nifti_image *,nifti_image *,int *, int);
+(nifti_image *,nifti_image *,unsigned short *,unsigned short *,double **,double **,nifti_image *,nifti_image *,int *, int, _reg_activeVoxelList *);
 template void reg_getVoxelBasedNMIGradient3D<double>
-(nifti_image *,nifti_image *,unsigned short *,unsigned short *,double **,double **,nifti_image *,nifti_image *,int *, int);
+(nifti_image *,nifti_image *,unsigned short *,unsigned short *,double **,double **,nifti_image *,nifti_image *,int *, int, _reg_activeVoxelList *);
 /* *************************************************************** */
 void reg_nmi::GetVoxelBasedSimilarityMeasureGradient(int current_timepoint)
 {
@@ -789,10 +1136,12 @@ void reg_nmi::GetVoxelBasedSimilarityMeasureGradient(int current_timepoint)
    if(this->activeTimePoint[current_timepoint]==false)
       return;
 
-   // Check if all required input images are of the same data type
+   // Check if all required input images are of the same data type, apart
+   // from the warped image gradients, which may be stored in half precision
    int dtype = this->referenceImagePointer->datatype;
    if(this->warpedFloatingImagePointer->datatype != dtype ||
-         this->warpedFloatingGradientImagePointer->datatype != dtype ||
+         (this->warpedFloatingGradientImagePointer->datatype != dtype &&
+          this->warpedFloatingGradientImagePointer->datatype != REG_TYPE_FLOAT16) ||
          this->forwardVoxelBasedGradientImagePointer->datatype != dtype
          )
    {
@@ -801,161 +1150,190 @@ void reg_nmi::GetVoxelBasedSimilarityMeasureGradient(int current_timepoint)
       reg_exit();
    }
 
-   // Call compute similarity measure to calculate joint histogram
-   this->GetSimilarityMeasureValue();
-
-   // Compute the gradient of the nmi for the forward transformation
-   if(this->referenceImagePointer->nz>1)  // 3D input images
-   {
-      switch(dtype)
-      {
-      case NIFTI_TYPE_FLOAT32:
-         reg_getVoxelBasedNMIGradient3D<float>(this->referenceImagePointer,
-                                               this->warpedFloatingImagePointer,
-                                               this->referenceBinNumber,
-                                               this->floatingBinNumber,
-                                               this->forwardJointHistogramLog,
-                                               this->forwardEntropyValues,
-                                               this->warpedFloatingGradientImagePointer,
-                                               this->forwardVoxelBasedGradientImagePointer,
-                                               this->referenceMaskPointer,
-                                               current_timepoint);
-         break;
-      case NIFTI_TYPE_FLOAT64:
-         reg_getVoxelBasedNMIGradient3D<double>(this->referenceImagePointer,
-                                                this->warpedFloatingImagePointer,
-                                                this->referenceBinNumber,
-                                                this->floatingBinNumber,
-                                                this->forwardJointHistogramLog,
-                                                this->forwardEntropyValues,
-                                                this->warpedFloatingGradientImagePointer,
-                                                this->forwardVoxelBasedGradientImagePointer,
-                                                this->referenceMaskPointer,
-                                                current_timepoint);
-         break;
-      default:
-         reg_print_fct_error("reg_nmi::GetVoxelBasedSimilarityMeasureGradient()");
-         reg_print_msg_error("Unsupported datatype");
-         reg_exit();
-      }
-   }
-   else  // 2D input images
-   {
-      switch(dtype)
-      {
-      case NIFTI_TYPE_FLOAT32:
-         reg_getVoxelBasedNMIGradient2D<float>(this->referenceImagePointer,
-                                               this->warpedFloatingImagePointer,
-                                               this->referenceBinNumber,
-                                               this->floatingBinNumber,
-                                               this->forwardJointHistogramLog,
-                                               this->forwardEntropyValues,
-                                               this->warpedFloatingGradientImagePointer,
-                                               this->forwardVoxelBasedGradientImagePointer,
-                                               this->referenceMaskPointer,
-                                               current_timepoint);
-         break;
-      case NIFTI_TYPE_FLOAT64:
-         reg_getVoxelBasedNMIGradient2D<double>(this->referenceImagePointer,
-                                                this->warpedFloatingImagePointer,
-                                                this->referenceBinNumber,
-                                                this->floatingBinNumber,
-                                                this->forwardJointHistogramLog,
-                                                this->forwardEntropyValues,
-                                                this->warpedFloatingGradientImagePointer,
-                                                this->forwardVoxelBasedGradientImagePointer,
-                                                this->referenceMaskPointer,
-                                                current_timepoint);
-         break;
-      default:
-         reg_print_fct_error("reg_nmi::GetVoxelBasedSimilarityMeasureGradient()");
-         reg_print_msg_error("Unsupported datatype");
-         reg_exit();
-      }
-   }
-
+   int backwardDtype = dtype;
    if(this->isSymmetric)
    {
-      dtype = this->floatingImagePointer->datatype;
-      if(this->warpedReferenceImagePointer->datatype != dtype ||
-            this->warpedReferenceGradientImagePointer->datatype != dtype ||
-            this->backwardVoxelBasedGradientImagePointer->datatype != dtype
+      backwardDtype = this->floatingImagePointer->datatype;
+      if(this->warpedReferenceImagePointer->datatype != backwardDtype ||
+            (this->warpedReferenceGradientImagePointer->datatype != backwardDtype &&
+             this->warpedReferenceGradientImagePointer->datatype != REG_TYPE_FLOAT16) ||
+            this->backwardVoxelBasedGradientImagePointer->datatype != backwardDtype
             )
       {
          reg_print_fct_error("reg_nmi::GetVoxelBasedSimilarityMeasureGradient()");
          reg_print_msg_error("Input images are exepected to be of the same type");
          reg_exit();
       }
-      // Compute the gradient of the nmi for the backward transformation
-      if(this->floatingImagePointer->nz>1)  // 3D input images
+   }
+
+   // Call compute similarity measure to calculate joint histogram
+   this->GetSimilarityMeasureValue();
+
+   // The forward and backward gradients are independent and are computed
+   // concurrently when enough threads are available
+   int previousLevels;
+   bool concurrent=this->isSymmetric && reg_beginConcurrentSections(&previousLevels);
+#pragma omp parallel sections num_threads(2) if(concurrent)
+   {
+#pragma omp section
       {
-         switch(dtype)
+         reg_setSectionThreadNumber(concurrent, 0);
+         // Compute the gradient of the nmi for the forward transformation
+         if(this->referenceImagePointer->nz>1)  // 3D input images
          {
-         case NIFTI_TYPE_FLOAT32:
-            reg_getVoxelBasedNMIGradient3D<float>(this->floatingImagePointer,
-                                                  this->warpedReferenceImagePointer,
-                                                  this->floatingBinNumber,
-                                                  this->referenceBinNumber,
-                                                  this->backwardJointHistogramLog,
-                                                  this->backwardEntropyValues,
-                                                  this->warpedReferenceGradientImagePointer,
-                                                  this->backwardVoxelBasedGradientImagePointer,
-                                                  this->floatingMaskPointer,
-                                                  current_timepoint);
-            break;
-         case NIFTI_TYPE_FLOAT64:
-            reg_getVoxelBasedNMIGradient3D<double>(this->floatingImagePointer,
-                                                   this->warpedReferenceImagePointer,
-                                                   this->floatingBinNumber,
-                                                   this->referenceBinNumber,
-                                                   this->backwardJointHistogramLog,
-                                                   this->backwardEntropyValues,
-                                                   this->warpedReferenceGradientImagePointer,
-                                                   this->backwardVoxelBasedGradientImagePointer,
-                                                   this->floatingMaskPointer,
-                                                   current_timepoint);
-            break;
-         default:
-            reg_print_fct_error("reg_nmi::GetVoxelBasedSimilarityMeasureGradient()");
-            reg_print_msg_error("Unsupported datatype");
-            reg_exit();
+            switch(dtype)
+            {
+            case NIFTI_TYPE_FLOAT32:
+               reg_getVoxelBasedNMIGradient3D<float>(this->referenceImagePointer,
+                                                     this->warpedFloatingImagePointer,
+                                                     this->referenceBinNumber,
+                                                     this->floatingBinNumber,
+                                                     this->forwardJointHistogramLog,
+                                                     this->forwardEntropyValues,
+                                                     this->warpedFloatingGradientImagePointer,
+                                                     this->forwardVoxelBasedGradientImagePointer,
+                                                     this->referenceMaskPointer,
+                                                     current_timepoint,
+                                                     this->referenceActiveVoxels);
+               break;
+            case NIFTI_TYPE_FLOAT64:
+               reg_getVoxelBasedNMIGradient3D<double>(this->referenceImagePointer,
+                                                      this->warpedFloatingImagePointer,
+                                                      this->referenceBinNumber,
+                                                      this->floatingBinNumber,
+                                                      this->forwardJointHistogramLog,
+                                                      this->forwardEntropyValues,
+                                                      this->warpedFloatingGradientImagePointer,
+                                                      this->forwardVoxelBasedGradientImagePointer,
+                                                      this->referenceMaskPointer,
+                                                      current_timepoint,
+                                                      this->referenceActiveVoxels);
+               break;
+            default:
+               reg_print_fct_error("reg_nmi::GetVoxelBasedSimilarityMeasureGradient()");
+               reg_print_msg_error("Unsupported datatype");
+               reg_exit();
+            }
+         }
+         else  // 2D input images
+         {
+            switch(dtype)
+            {
+            case NIFTI_TYPE_FLOAT32:
+               reg_getVoxelBasedNMIGradient2D<float>(this->referenceImagePointer,
+                                                     this->warpedFloatingImagePointer,
+                                                     this->referenceBinNumber,
+                                                     this->floatingBinNumber,
+                                                     this->forwardJointHistogramLog,
+                                                     this->forwardEntropyValues,
+                                                     this->warpedFloatingGradientImagePointer,
+                                                     this->forwardVoxelBasedGradientImagePointer,
+                                                     this->referenceMaskPointer,
+                                                     current_timepoint,
+                                                     this->referenceActiveVoxels);
+               break;
+            case NIFTI_TYPE_FLOAT64:
+               reg_getVoxelBasedNMIGradient2D<double>(this->referenceImagePointer,
+                                                      this->warpedFloatingImagePointer,
+                                                      this->referenceBinNumber,
+                                                      this->floatingBinNumber,
+                                                      this->forwardJointHistogramLog,
+                                                      this->forwardEntropyValues,
+                                                      this->warpedFloatingGradientImagePointer,
+                                                      this->forwardVoxelBasedGradientImagePointer,
+                                                      this->referenceMaskPointer,
+                                                      current_timepoint,
+                                                      this->referenceActiveVoxels);
+               break;
+            default:
+               reg_print_fct_error("reg_nmi::GetVoxelBasedSimilarityMeasureGradient()");
+               reg_print_msg_error("Unsupported datatype");
+               reg_exit();
+            }
          }
       }
-      else  // 2D input images
+#pragma omp section
       {
-         switch(dtype)
+         if(this->isSymmetric)
          {
-         case NIFTI_TYPE_FLOAT32:
-            reg_getVoxelBasedNMIGradient2D<float>(this->floatingImagePointer,
-                                                  this->warpedReferenceImagePointer,
-                                                  this->floatingBinNumber,
-                                                  this->referenceBinNumber,
-                                                  this->backwardJointHistogramLog,
-                                                  this->backwardEntropyValues,
-                                                  this->warpedReferenceGradientImagePointer,
-                                                  this->backwardVoxelBasedGradientImagePointer,
-                                                  this->floatingMaskPointer,
-                                                  current_timepoint);
-            break;
-         case NIFTI_TYPE_FLOAT64:
-            reg_getVoxelBasedNMIGradient2D<double>(this->floatingImagePointer,
-                                                   this->warpedReferenceImagePointer,
-                                                   this->floatingBinNumber,
-                                                   this->referenceBinNumber,
-                                                   this->backwardJointHistogramLog,
-                                                   this->backwardEntropyValues,
-                                                   this->warpedReferenceGradientImagePointer,
-                                                   this->backwardVoxelBasedGradientImagePointer,
-                                                   this->floatingMaskPointer,
-                                                   current_timepoint);
-            break;
-         default:
-            reg_print_fct_error("reg_nmi::GetVoxelBasedSimilarityMeasureGradient()");
-            reg_print_msg_error("Unsupported datatype");
-            reg_exit();
+            reg_setSectionThreadNumber(concurrent, 1);
+            // Compute the gradient of the nmi for the backward transformation
+            if(this->floatingImagePointer->nz>1)  // 3D input images
+            {
+               switch(backwardDtype)
+               {
+               case NIFTI_TYPE_FLOAT32:
+                  reg_getVoxelBasedNMIGradient3D<float>(this->floatingImagePointer,
+                                                        this->warpedReferenceImagePointer,
+                                                        this->floatingBinNumber,
+                                                        this->referenceBinNumber,
+                                                        this->backwardJointHistogramLog,
+                                                        this->backwardEntropyValues,
+                                                        this->warpedReferenceGradientImagePointer,
+                                                        this->backwardVoxelBasedGradientImagePointer,
+                                                        this->floatingMaskPointer,
+                                                        current_timepoint,
+                                                        this->floatingActiveVoxels);
+                  break;
+               case NIFTI_TYPE_FLOAT64:
+                  reg_getVoxelBasedNMIGradient3D<double>(this->floatingImagePointer,
+                                                         this->warpedReferenceImagePointer,
+                                                         this->floatingBinNumber,
+                                                         this->referenceBinNumber,
+                                                         this->backwardJointHistogramLog,
+                                                         this->backwardEntropyValues,
+                                                         this->warpedReferenceGradientImagePointer,
+                                                         this->backwardVoxelBasedGradientImagePointer,
+                                                         this->floatingMaskPointer,
+                                                         current_timepoint,
+                                                         this->floatingActiveVoxels);
+                  break;
+               default:
+                  reg_print_fct_error("reg_nmi::GetVoxelBasedSimilarityMeasureGradient()");
+                  reg_print_msg_error("Unsupported datatype");
+                  reg_exit();
+               }
+            }
+            else  // 2D input images
+            {
+               switch(backwardDtype)
+               {
+               case NIFTI_TYPE_FLOAT32:
+                  reg_getVoxelBasedNMIGradient2D<float>(this->floatingImagePointer,
+                                                        this->warpedReferenceImagePointer,
+                                                        this->floatingBinNumber,
+                                                        this->referenceBinNumber,
+                                                        this->backwardJointHistogramLog,
+                                                        this->backwardEntropyValues,
+                                                        this->warpedReferenceGradientImagePointer,
+                                                        this->backwardVoxelBasedGradientImagePointer,
+                                                        this->floatingMaskPointer,
+                                                        current_timepoint,
+                                                        this->floatingActiveVoxels);
+                  break;
+               case NIFTI_TYPE_FLOAT64:
+                  reg_getVoxelBasedNMIGradient2D<double>(this->floatingImagePointer,
+                                                         this->warpedReferenceImagePointer,
+                                                         this->floatingBinNumber,
+                                                         this->referenceBinNumber,
+                                                         this->backwardJointHistogramLog,
+                                                         this->backwardEntropyValues,
+                                                         this->warpedReferenceGradientImagePointer,
+                                                         this->backwardVoxelBasedGradientImagePointer,
+                                                         this->floatingMaskPointer,
+                                                         current_timepoint,
+                                                         this->floatingActiveVoxels);
+                  break;
+               default:
+                  reg_print_fct_error("reg_nmi::GetVoxelBasedSimilarityMeasureGradient()");
+                  reg_print_msg_error("Unsupported datatype");
+                  reg_exit();
+               }
+            }
          }
       }
    }
+   reg_endConcurrentSections(concurrent, previousLevels);
 #ifndef NDEBUG
    reg_print_msg_debug("reg_nmi::GetVoxelBasedSimilarityMeasureGradient called");
 #endif
@@ -38,6 +38,15 @@ public:
                           nifti_image *bckVoxBasedGraPtr = NULL);
    /// @brief Returns the nmi value
    double GetSimilarityMeasureValue();
+   /// @brief Stores the joint histogram of bin counts for the current
+   /// warped image, against which local changes can then be evaluated
+   void StoreJointHistogram();
+   /// @brief Returns the nmi value obtained if some reference voxels took
+   /// the values of a smaller warped image, without warping the whole image.
+   /// referenceIndex gives the reference voxel of each local voxel, or -1 if
+   /// it should be ignored; the stored histogram itself is left unchanged
+   double GetLocalSimilarityMeasureValue(nifti_image *localWarpedImage,
+                                         int *referenceIndex);
    /// @brief Compute the voxel based nmi gradient
    void GetVoxelBasedSimilarityMeasureGradient(int current_timepoint);
    void SetRefAndFloatBinNumbers(unsigned short refBinNumber,
@@ -76,6 +85,7 @@ protected:
    double **backwardJointHistogramPro;
    double **backwardJointHistogramLog;
    double **backwardEntropyValues;
+   double **storedJointHistogram;
 
    void ClearHistogram();
 };
@@ -91,9 +101,35 @@ void reg_getNMIValue(nifti_image *referenceImage,
                      double **jointHistogramLog,
                      double **jointhistogramPro,
                      double **entropyValues,
-                     int *referenceMask
+                     int *referenceMask,
+                     _reg_activeVoxelList *activeVoxels = NULL
                     );
 /* *************************************************************** */
+/// @brief Fills the joint histograms with the bin counts of the active voxels
+extern "C++" template <class DTYPE>
+void reg_getNMIJointHistogram(nifti_image *referenceImage,
+                              nifti_image *warpedImage,
+                              bool *activeTimePoint,
+                              unsigned short *referenceBinNumber,
+                              unsigned short *floatingBinNumber,
+                              unsigned short *totalBinNumber,
+                              double **jointHistogram,
+                              int *referenceMask,
+                              _reg_activeVoxelList *activeVoxels = NULL
+                             );
+/* *************************************************************** */
+/// @brief Smooths and normalises joint histograms of bin counts, in place,
+/// and computes their marginal and joint entropies
+void reg_getNMIEntropies(int timePointNumber,
+                         bool *activeTimePoint,
+                         unsigned short *referenceBinNumber,
+                         unsigned short *floatingBinNumber,
+                         unsigned short *totalBinNumber,
+                         double **jointHistogramLog,
+                         double **jointhistogramPro,
+                         double **entropyValues
+                        );
+/* *************************************************************** */
 extern "C++" template <class DTYPE>
 void reg_getVoxelBasedNMIGradient2D(nifti_image *referenceImage,
                                     nifti_image *warpedImage,
@@ -104,7 +140,8 @@ void reg_getVoxelBasedNMIGradient2D(nifti_image *referenceImage,
                                     nifti_image *warImgGradient,
                                     nifti_image *nmiGradientImage,
                                     int *referenceMask,
-                                    int current_timepoint
+                                    int current_timepoint,
+                                    _reg_activeVoxelList *activeVoxels = NULL
                                    );
 /* *************************************************************** */
 extern "C++" template <class DTYPE>
@@ -117,7 +154,8 @@ void reg_getVoxelBasedNMIGradient3D(nifti_image *referenceImage,
                                     nifti_image *warImgGradient,
                                     nifti_image *nmiGradientImage,
                                     int *referenceMask,
-                                    int current_timepoint
+                                    int current_timepoint,
+                                    _reg_activeVoxelList *activeVoxels = NULL
                                    );
 /* *************************************************************** */
 /* *************************************************************** */
@@ -472,6 +472,55 @@ void reg_conjugateGradient<T>::Perturbation(float length)
 /* *************************************************************** */
 /* *************************************************************** */
 template <class T>
+void reg_conjugateGradient<T>::GetState(std::vector<double> &state)
+{
+   // The conjugate directions are stored after a flag for the first call
+   state.assign(1, this->firstcall?1.0:0.0);
+   if(this->firstcall)
+      return;
+   state.insert(state.end(), this->array1, this->array1+this->dofNumber);
+   state.insert(state.end(), this->array2, this->array2+this->dofNumber);
+   if(this->dofNumber_b>0)
+   {
+      state.insert(state.end(), this->array1_b, this->array1_b+this->dofNumber_b);
+      state.insert(state.end(), this->array2_b, this->array2_b+this->dofNumber_b);
+   }
+}
+/* *************************************************************** */
+/* *************************************************************** */
+template <class T>
+void reg_conjugateGradient<T>::SetState(const std::vector<double> &state)
+{
+   if(state.empty() || state[0]!=0.0)
+   {
+      this->firstcall=true;
+      return;
+   }
+   size_t expected = 1 + 2*this->dofNumber;
+   if(this->dofNumber_b>0)
+      expected += 2*this->dofNumber_b;
+   if(state.size()!=expected)
+   {
+      reg_print_fct_error("reg_conjugateGradient<T>::SetState()");
+      reg_print_msg_error("The optimiser state does not match the number of parameters");
+      reg_exit();
+   }
+   std::vector<double>::const_iterator it = state.begin() + 1;
+   std::copy(it, it+this->dofNumber, this->array1);
+   it += this->dofNumber;
+   std::copy(it, it+this->dofNumber, this->array2);
+   it += this->dofNumber;
+   if(this->dofNumber_b>0)
+   {
+      std::copy(it, it+this->dofNumber_b, this->array1_b);
+      it += this->dofNumber_b;
+      std::copy(it, it+this->dofNumber_b, this->array2_b);
+   }
+   this->firstcall=false;
+}
+/* *************************************************************** */
+/* *************************************************************** */
+template <class T>
 void reg_conjugateGradient<T>::reg_test_optimiser()
 {
    this->UpdateGradientValues();
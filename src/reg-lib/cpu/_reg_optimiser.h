@@ -10,6 +10,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <time.h>
+#include <vector>
 
 /* *************************************************************** */
 /* *************************************************************** */
@@ -148,6 +149,21 @@ public:
    {
       this->currentIterationNumber++;
    }
+   virtual void SetCurrentIterationNumber(size_t i)
+   {
+      this->currentIterationNumber=i;
+   }
+   /// @brief Returns any internal values, beyond the current and best
+   /// positions, that are needed to continue the optimisation exactly
+   virtual void GetState(std::vector<double> &state)
+   {
+      state.clear();
+   }
+   /// @brief Restores values previously returned by GetState()
+   virtual void SetState(const std::vector<double> &)
+   {
+      return;
+   }
    virtual void Initialise(size_t nvox,
                            int dim,
                            bool optX,
@@ -206,6 +222,8 @@ public:
                          T smallLength,
                          T &startLength);
    virtual void Perturbation(float length);
+   virtual void GetState(std::vector<double> &state);
+   virtual void SetState(const std::vector<double> &state);
 
    // Function used for testing
    virtual void reg_test_optimiser();
@@ -165,8 +165,8 @@ void reg_dti_resampling_preprocessing(nifti_image *floatingImage,
 #if defined (_OPENMP)
       mat33 diffTensor[16];
       int max_thread_number = omp_get_max_threads();
-      if(max_thread_number>16) omp_set_num_threads(16);
-#pragma omp parallel for default(none) \
+      if(max_thread_number>16) max_thread_number=16;
+#pragma omp parallel for default(none) num_threads(max_thread_number) \
    private(floatingIndex, tid) \
    shared(floatingVoxelNumber,floatingIntensityXX,floatingIntensityYY, \
    floatingIntensityZZ,floatingIntensityXY,floatingIntensityXZ, \
@@ -201,9 +201,6 @@ void reg_dti_resampling_preprocessing(nifti_image *floatingImage,
          floatingIntensityYZ[floatingIndex] = static_cast<DTYPE>(diffTensor[tid].m[1][2]);
          floatingIntensityZZ[floatingIndex] = static_cast<DTYPE>(diffTensor[tid].m[2][2]);
       }
-#if defined (_OPENMP)
-      omp_set_num_threads(max_thread_number);
-#endif
 #ifndef NDEBUG
       reg_print_msg_debug("Tensors have been logged");
 #endif
@@ -262,8 +259,8 @@ void reg_dti_resampling_postprocessing(nifti_image *inputImage,
 #if defined (_OPENMP)
          mat33 inputTensor[16], warpedTensor[16], RotMat[16], RotMatT[16];
          int max_thread_number = omp_get_max_threads();
-         if(max_thread_number>16) omp_set_num_threads(16);
-#pragma omp parallel for default(none) \
+         if(max_thread_number>16) max_thread_number=16;
+#pragma omp parallel for default(none) num_threads(max_thread_number) \
    private(warpedIndex, testSum, col, row, tid) \
    shared(voxelNumber,inputIntensityXX,inputIntensityYY,inputIntensityZZ, \
    warpedXX, warpedXY, warpedXZ, warpedYY, warpedYZ, warpedZZ, warpedImage, \
@@ -345,9 +342,6 @@ void reg_dti_resampling_postprocessing(nifti_image *inputImage,
                }
             }
          }
-#if defined (_OPENMP)
-      omp_set_num_threads(max_thread_number);
-#endif
       }
 #ifndef NDEBUG
       reg_print_msg_debug("Exponentiated and rotated all voxels");
@@ -361,14 +355,15 @@ void ResampleImage3D(nifti_image *floatingImage,
                      nifti_image *warpedImage,
                      int *mask,
                      FieldTYPE paddingValue,
-                     int kernel)
+                     int kernel,
+                     _reg_activeVoxelList *activeVoxels)
 {
 #ifdef _WIN32
-   long  index;
+   long  index, n;
    long warpedVoxelNumber = (long)warpedImage->nx*warpedImage->ny*warpedImage->nz;
    long floatingVoxelNumber = (long)floatingImage->nx*floatingImage->ny*floatingImage->nz;
 #else
-   size_t  index;
+   size_t  index, n;
    size_t warpedVoxelNumber = (size_t)warpedImage->nx*warpedImage->ny*warpedImage->nz;
    size_t floatingVoxelNumber = (size_t)floatingImage->nx*floatingImage->ny*floatingImage->nz;
 #endif
@@ -379,6 +374,13 @@ void ResampleImage3D(nifti_image *floatingImage,
    FieldTYPE *deformationFieldPtrZ = &deformationFieldPtrY[warpedVoxelNumber];
 
    int *maskPtr = &mask[0];
+   // Only the listed voxels are visited when a compact mask is provided
+   int *activeIndex = activeVoxels!=NULL ? activeVoxels->index : NULL;
+#ifdef _WIN32
+   long loopNumber = activeVoxels!=NULL ? (long)activeVoxels->number : warpedVoxelNumber;
+#else
+   size_t loopNumber = activeVoxels!=NULL ? activeVoxels->number : warpedVoxelNumber;
+#endif
 
    mat44 *floatingIJKMatrix;
    if(floatingImage->sform_code>0)
@@ -412,61 +414,75 @@ void ResampleImage3D(nifti_image *floatingImage,
       break; // cubic spline interpolation
    }
 
-   // Iteration over the different volume along the 4th axis
-   for(size_t t=0; t<(size_t)warpedImage->nt*warpedImage->nu; t++)
-   {
+   // The location and interpolation weights of each warped voxel are computed
+   // once, and shared by all of the volumes along the 4th axis
+#ifdef _WIN32
+   long t, volumeNumber = (long)warpedImage->nt*warpedImage->nu;
+#else
+   size_t t, volumeNumber = (size_t)warpedImage->nt*warpedImage->nu;
+#endif
 #ifndef NDEBUG
-      char text[255];
-      snprintf(text, 255, "3D resampling of volume number %lu",t);
-      reg_print_msg_debug(text);
+   char text[255];
+   snprintf(text, 255, "3D resampling of %lu volume(s)", (unsigned long)volumeNumber);
+   reg_print_msg_debug(text);
 #endif
 
-      FloatingTYPE *warpedIntensity = &warpedIntensityPtr[t*warpedVoxelNumber];
-      FloatingTYPE *floatingIntensity = &floatingIntensityPtr[t*floatingVoxelNumber];
+   FloatingTYPE *warpedIntensity, *floatingIntensity;
 
-      int a, b, c, Y, Z, previous[3];
+   int a, b, c, Y, Z, previous[3];
 
-      FloatingTYPE *zPointer, *xyzPointer;
-      double xBasis[SINC_KERNEL_SIZE], yBasis[SINC_KERNEL_SIZE], zBasis[SINC_KERNEL_SIZE], relative[3];
-      double xTempNewValue, yTempNewValue, intensity;
-      float world[3], position[3];
+   FloatingTYPE *zPointer, *xyzPointer;
+   double xBasis[SINC_KERNEL_SIZE], yBasis[SINC_KERNEL_SIZE], zBasis[SINC_KERNEL_SIZE], relative[3];
+   double xTempNewValue, yTempNewValue, intensity;
+   float world[3], position[3];
 #if defined (_OPENMP)
 #pragma omp parallel for default(none) \
-   private(index, intensity, world, position, previous, xBasis, yBasis, zBasis, relative, \
-   a, b, c, Y, Z, zPointer, xyzPointer, xTempNewValue, yTempNewValue) \
-   shared(floatingIntensity, warpedIntensity, warpedVoxelNumber, floatingVoxelNumber, \
-   deformationFieldPtrX, deformationFieldPtrY, deformationFieldPtrZ, maskPtr, \
-   floatingIJKMatrix, floatingImage, paddingValue, kernel_size, kernel_offset, kernelCompFctPtr)
+   private(n, t, index, intensity, world, position, previous, xBasis, yBasis, zBasis, relative, \
+   a, b, c, Y, Z, zPointer, xyzPointer, xTempNewValue, yTempNewValue, \
+   floatingIntensity, warpedIntensity) \
+   shared(floatingIntensityPtr, warpedIntensityPtr, warpedVoxelNumber, floatingVoxelNumber, \
+   volumeNumber, deformationFieldPtrX, deformationFieldPtrY, deformationFieldPtrZ, maskPtr, \
+   activeIndex, loopNumber, floatingIJKMatrix, floatingImage, paddingValue, kernel_size, \
+   kernel_offset, kernelCompFctPtr)
 #endif // _OPENMP
-      for(index=0; index<warpedVoxelNumber; index++)
+   for(n=0; n<loopNumber; n++)
+   {
+      index = activeIndex!=NULL ? activeIndex[n] : n;
+
+      if((maskPtr[index])>-1)
       {
+         world[0]=static_cast<float>(deformationFieldPtrX[index]);
+         world[1]=static_cast<float>(deformationFieldPtrY[index]);
+         world[2]=static_cast<float>(deformationFieldPtrZ[index]);
 
-         intensity=paddingValue;
+         // real -> voxel; floating space
+         reg_mat44_mul(floatingIJKMatrix, world, position);
 
-         if((maskPtr[index])>-1)
-         {
-            world[0]=static_cast<float>(deformationFieldPtrX[index]);
-            world[1]=static_cast<float>(deformationFieldPtrY[index]);
-            world[2]=static_cast<float>(deformationFieldPtrZ[index]);
+         previous[0] = static_cast<int>(reg_floor(position[0]));
+         previous[1] = static_cast<int>(reg_floor(position[1]));
+         previous[2] = static_cast<int>(reg_floor(position[2]));
 
-            // real -> voxel; floating space
-            reg_mat44_mul(floatingIJKMatrix, world, position);
+         relative[0]=static_cast<double>(position[0])-static_cast<double>(previous[0]);
+         relative[1]=static_cast<double>(position[1])-static_cast<double>(previous[1]);
+         relative[2]=static_cast<double>(position[2])-static_cast<double>(previous[2]);
 
-            previous[0] = static_cast<int>(reg_floor(position[0]));
-            previous[1] = static_cast<int>(reg_floor(position[1]));
-            previous[2] = static_cast<int>(reg_floor(position[2]));
+         (*kernelCompFctPtr)(relative[0], xBasis);
+         (*kernelCompFctPtr)(relative[1], yBasis);
+         (*kernelCompFctPtr)(relative[2], zBasis);
+         previous[0]-=kernel_offset;
+         previous[1]-=kernel_offset;
+         previous[2]-=kernel_offset;
+      }
 
-            relative[0]=static_cast<double>(position[0])-static_cast<double>(previous[0]);
-            relative[1]=static_cast<double>(position[1])-static_cast<double>(previous[1]);
-            relative[2]=static_cast<double>(position[2])-static_cast<double>(previous[2]);
+      for(t=0; t<volumeNumber; t++)
+      {
+         warpedIntensity = &warpedIntensityPtr[t*warpedVoxelNumber];
+         floatingIntensity = &floatingIntensityPtr[t*floatingVoxelNumber];
 
-            (*kernelCompFctPtr)(relative[0], xBasis);
-            (*kernelCompFctPtr)(relative[1], yBasis);
-            (*kernelCompFctPtr)(relative[2], zBasis);
-            previous[0]-=kernel_offset;
-            previous[1]-=kernel_offset;
-            previous[2]-=kernel_offset;
+         intensity=paddingValue;
 
+         if((maskPtr[index])>-1)
+         {
             intensity=0.0;
             for(c=0; c<kernel_size; c++)
             {
@@ -541,14 +557,15 @@ void ResampleImage2D(nifti_image *floatingImage,
                      nifti_image *warpedImage,
                      int *mask,
                      FieldTYPE paddingValue,
-                     int kernel)
+                     int kernel,
+                     _reg_activeVoxelList *activeVoxels)
 {
 #ifdef _WIN32
-   long  index;
+   long  index, n;
    long warpedVoxelNumber = (long)warpedImage->nx*warpedImage->ny;
    long floatingVoxelNumber = (long)floatingImage->nx*floatingImage->ny;
 #else
-   size_t  index;
+   size_t  index, n;
    size_t warpedVoxelNumber = (size_t)warpedImage->nx*warpedImage->ny;
    size_t floatingVoxelNumber = (size_t)floatingImage->nx*floatingImage->ny;
 #endif
@@ -558,6 +575,13 @@ void ResampleImage2D(nifti_image *floatingImage,
    FieldTYPE *deformationFieldPtrY = &deformationFieldPtrX[warpedVoxelNumber];
 
    int *maskPtr = &mask[0];
+   // Only the listed voxels are visited when a compact mask is provided
+   int *activeIndex = activeVoxels!=NULL ? activeVoxels->index : NULL;
+#ifdef _WIN32
+   long loopNumber = activeVoxels!=NULL ? (long)activeVoxels->number : warpedVoxelNumber;
+#else
+   size_t loopNumber = activeVoxels!=NULL ? activeVoxels->number : warpedVoxelNumber;
+#endif
 
    mat44 *floatingIJKMatrix;
    if(floatingImage->sform_code>0)
@@ -590,55 +614,64 @@ void ResampleImage2D(nifti_image *floatingImage,
       break; // cubic spline interpolation
    }
 
-   // Iteration over the different volume along the 4th axis
-   for(size_t t=0; t<(size_t)warpedImage->nt*warpedImage->nu; t++)
-   {
+   // The location and interpolation weights of each warped pixel are computed
+   // once, and shared by all of the volumes along the 4th axis
+#ifdef _WIN32
+   long t, volumeNumber = (long)warpedImage->nt*warpedImage->nu;
+#else
+   size_t t, volumeNumber = (size_t)warpedImage->nt*warpedImage->nu;
+#endif
 #ifndef NDEBUG
-      char text[255];
-      snprintf(text, 255, "2D resampling of volume number %lu",t);
-      reg_print_msg_debug(text);
+   char text[255];
+   snprintf(text, 255, "2D resampling of %lu volume(s)", (unsigned long)volumeNumber);
+   reg_print_msg_debug(text);
 #endif
-      FloatingTYPE *warpedIntensity = &warpedIntensityPtr[t*warpedVoxelNumber];
-      FloatingTYPE *floatingIntensity = &floatingIntensityPtr[t*floatingVoxelNumber];
 
-      int a, b, Y, previous[2];
+   FloatingTYPE *warpedIntensity, *floatingIntensity;
+
+   int a, b, Y, previous[2];
 
-      FloatingTYPE *xyzPointer;
-      double xBasis[SINC_KERNEL_SIZE], yBasis[SINC_KERNEL_SIZE], relative[2];
-      double xTempNewValue, intensity;
-      float world[3] = {0.0, 0.0, 0.0};
-      float position[3] = {0.0, 0.0, 0.0};
+   FloatingTYPE *xyzPointer;
+   double xBasis[SINC_KERNEL_SIZE], yBasis[SINC_KERNEL_SIZE], relative[2];
+   double xTempNewValue, intensity;
+   float world[3] = {0.0, 0.0, 0.0};
+   float position[3] = {0.0, 0.0, 0.0};
 #if defined (_OPENMP)
 #pragma omp parallel for default(none) \
-   private(index, intensity, world, position, previous, xBasis, yBasis, relative, \
-   a, b, Y, xyzPointer, xTempNewValue) \
-   shared(floatingIntensity, warpedIntensity, warpedVoxelNumber, floatingVoxelNumber, \
-   deformationFieldPtrX, deformationFieldPtrY, maskPtr, \
+   private(n, t, index, intensity, world, position, previous, xBasis, yBasis, relative, \
+   a, b, Y, xyzPointer, xTempNewValue, floatingIntensity, warpedIntensity) \
+   shared(floatingIntensityPtr, warpedIntensityPtr, warpedVoxelNumber, floatingVoxelNumber, \
+   volumeNumber, deformationFieldPtrX, deformationFieldPtrY, maskPtr, activeIndex, loopNumber, \
    floatingIJKMatrix, floatingImage, paddingValue, kernel_size, kernel_offset, kernelCompFctPtr)
 #endif // _OPENMP
-      for(index=0; index<warpedVoxelNumber; index++)
+   for(n=0; n<loopNumber; n++)
+   {
+      index = activeIndex!=NULL ? activeIndex[n] : n;
+
+      if((maskPtr[index])>-1)
       {
+         world[0] = static_cast<float>(deformationFieldPtrX[index]);
+         world[1] = static_cast<float>(deformationFieldPtrY[index]);
+         world[2] = 0;
 
-         intensity=paddingValue;
-         if((maskPtr[index])>-1)
-         {
-            world[0] = static_cast<float>(deformationFieldPtrX[index]);
-            world[1] = static_cast<float>(deformationFieldPtrY[index]);
-            world[2] = 0;
+         // real -> voxel; floating space
+         reg_mat44_mul(floatingIJKMatrix, world, position);
 
-            // real -> voxel; floating space
-            reg_mat44_mul(floatingIJKMatrix, world, position);
+         previous[0] = static_cast<int>(reg_floor(position[0]));
+         previous[1] = static_cast<int>(reg_floor(position[1]));
 
-            previous[0] = static_cast<int>(reg_floor(position[0]));
-            previous[1] = static_cast<int>(reg_floor(position[1]));
+         relative[0] = static_cast<double>(position[0])-static_cast<double>(previous[0]);
+         relative[1] = static_cast<double>(position[1])-static_cast<double>(previous[1]);
 
-            relative[0] = static_cast<double>(position[0])-static_cast<double>(previous[0]);
-            relative[1] = static_cast<double>(position[1])-static_cast<double>(previous[1]);
+         (*kernelCompFctPtr)(relative[0], xBasis);
+         (*kernelCompFctPtr)(relative[1], yBasis);
+         previous[0]-=kernel_offset;
+         previous[1]-=kernel_offset;
 
-            (*kernelCompFctPtr)(relative[0], xBasis);
-            (*kernelCompFctPtr)(relative[1], yBasis);
-            previous[0]-=kernel_offset;
-            previous[1]-=kernel_offset;
+         for(t=0; t<volumeNumber; t++)
+         {
+            warpedIntensity = &warpedIntensityPtr[t*warpedVoxelNumber];
+            floatingIntensity = &floatingIntensityPtr[t*floatingVoxelNumber];
 
             intensity=0.0;
             for(b=0; b<kernel_size; b++)
@@ -714,7 +747,8 @@ void reg_resampleImage2(nifti_image *floatingImage,
                         int interp,
                         FieldTYPE paddingValue,
                         int *dtIndicies,
-                        mat33 * jacMat)
+                        mat33 * jacMat,
+                        _reg_activeVoxelList *activeVoxels)
 {
    // The floating image data is copied in case one deal with DTI
    void *originalFloatingData=NULL;
@@ -731,7 +765,8 @@ void reg_resampleImage2(nifti_image *floatingImage,
                                               warpedImage,
                                               mask,
                                               paddingValue,
-                                              interp);
+                                              interp,
+                                              activeVoxels);
    }
    else
    {
@@ -740,7 +775,8 @@ void reg_resampleImage2(nifti_image *floatingImage,
                                               warpedImage,
                                               mask,
                                               paddingValue,
-                                              interp);
+                                              interp,
+                                              activeVoxels);
    }
    // The temporary logged floating array is deleted and the original restored
    if(originalFloatingData!=NULL)
@@ -764,7 +800,8 @@ void reg_resampleImage(nifti_image *floatingImage,
                        int interp,
                        float paddingValue,
                        bool *dti_timepoint,
-                       mat33 * jacMat)
+                       mat33 * jacMat,
+                       _reg_activeVoxelList *activeVoxels)
 {
    if(floatingImage->datatype != warpedImage->datatype)
    {
@@ -827,7 +864,8 @@ void reg_resampleImage(nifti_image *floatingImage,
                                                  interp,
                                                  paddingValue,
                                                  dtIndicies,
-                                                 jacMat);
+                                                 jacMat,
+                                                 activeVoxels);
          break;
       case NIFTI_TYPE_INT8:
          reg_resampleImage2<float,char>(floatingImage,
@@ -837,7 +875,8 @@ void reg_resampleImage(nifti_image *floatingImage,
                                         interp,
                                         paddingValue,
                                         dtIndicies,
-                                        jacMat);
+                                        jacMat,
+                                        activeVoxels);
          break;
       case NIFTI_TYPE_UINT16:
          reg_resampleImage2<float,unsigned short>(floatingImage,
@@ -847,7 +886,8 @@ void reg_resampleImage(nifti_image *floatingImage,
                                                   interp,
                                                   paddingValue,
                                                   dtIndicies,
-                                                  jacMat);
+                                                  jacMat,
+                                                  activeVoxels);
          break;
       case NIFTI_TYPE_INT16:
          reg_resampleImage2<float,short>(floatingImage,
@@ -857,7 +897,8 @@ void reg_resampleImage(nifti_image *floatingImage,
                                          interp,
                                          paddingValue,
                                          dtIndicies,
-                                         jacMat);
+                                         jacMat,
+                                         activeVoxels);
          break;
       case NIFTI_TYPE_UINT32:
          reg_resampleImage2<float,unsigned int>(floatingImage,
@@ -867,7 +908,8 @@ void reg_resampleImage(nifti_image *floatingImage,
                                                 interp,
                                                 paddingValue,
                                                 dtIndicies,
-                                                jacMat);
+                                                jacMat,
+                                                activeVoxels);
          break;
       case NIFTI_TYPE_INT32:
          reg_resampleImage2<float,int>(floatingImage,
@@ -877,7 +919,8 @@ void reg_resampleImage(nifti_image *floatingImage,
                                        interp,
                                        paddingValue,
                                        dtIndicies,
-                                       jacMat);
+                                       jacMat,
+                                       activeVoxels);
          break;
       case NIFTI_TYPE_FLOAT32:
          reg_resampleImage2<float,float>(floatingImage,
@@ -887,7 +930,8 @@ void reg_resampleImage(nifti_image *floatingImage,
                                          interp,
                                          paddingValue,
                                          dtIndicies,
-                                         jacMat);
+                                         jacMat,
+                                         activeVoxels);
          break;
       case NIFTI_TYPE_FLOAT64:
          reg_resampleImage2<float,double>(floatingImage,
@@ -897,7 +941,8 @@ void reg_resampleImage(nifti_image *floatingImage,
                                           interp,
                                           paddingValue,
                                           dtIndicies,
-                                          jacMat);
+                                          jacMat,
+                                          activeVoxels);
          break;
       default:
          reg_print_msg_error("floating pixel type unsupported.");
@@ -915,7 +960,8 @@ void reg_resampleImage(nifti_image *floatingImage,
                                                   interp,
                                                   paddingValue,
                                                   dtIndicies,
-                                                  jacMat);
+                                                  jacMat,
+                                                  activeVoxels);
          break;
       case NIFTI_TYPE_INT8:
          reg_resampleImage2<double,char>(floatingImage,
@@ -925,7 +971,8 @@ void reg_resampleImage(nifti_image *floatingImage,
                                          interp,
                                          paddingValue,
                                          dtIndicies,
-                                         jacMat);
+                                         jacMat,
+                                         activeVoxels);
          break;
       case NIFTI_TYPE_UINT16:
          reg_resampleImage2<double,unsigned short>(floatingImage,
@@ -935,7 +982,8 @@ void reg_resampleImage(nifti_image *floatingImage,
                                                    interp,
                                                    paddingValue,
                                                    dtIndicies,
-                                                   jacMat);
+                                                   jacMat,
+                                                   activeVoxels);
          break;
       case NIFTI_TYPE_INT16:
          reg_resampleImage2<double,short>(floatingImage,
@@ -945,7 +993,8 @@ void reg_resampleImage(nifti_image *floatingImage,
                                           interp,
                                           paddingValue,
                                           dtIndicies,
-                                          jacMat);
+                                          jacMat,
+                                          activeVoxels);
          break;
       case NIFTI_TYPE_UINT32:
          reg_resampleImage2<double,unsigned int>(floatingImage,
@@ -955,7 +1004,8 @@ void reg_resampleImage(nifti_image *floatingImage,
                                                  interp,
                                                  paddingValue,
                                                  dtIndicies,
-                                                 jacMat );
+                                                 jacMat,
+                                                 activeVoxels);
          break;
       case NIFTI_TYPE_INT32:
          reg_resampleImage2<double,int>(floatingImage,
@@ -965,7 +1015,8 @@ void reg_resampleImage(nifti_image *floatingImage,
                                         interp,
                                         paddingValue,
                                         dtIndicies,
-                                        jacMat);
+                                        jacMat,
+                                        activeVoxels);
          break;
       case NIFTI_TYPE_FLOAT32:
          reg_resampleImage2<double,float>(floatingImage,
@@ -975,7 +1026,8 @@ void reg_resampleImage(nifti_image *floatingImage,
                                           interp,
                                           paddingValue,
                                           dtIndicies,
-                                          jacMat);
+                                          jacMat,
+                                          activeVoxels);
          break;
       case NIFTI_TYPE_FLOAT64:
          reg_resampleImage2<double,double>(floatingImage,
@@ -985,7 +1037,8 @@ void reg_resampleImage(nifti_image *floatingImage,
                                            interp,
                                            paddingValue,
                                            dtIndicies,
-                                           jacMat);
+                                           jacMat,
+                                           activeVoxels);
          break;
       default:
          reg_print_msg_error("floating pixel type unsupported.");
@@ -2521,7 +2574,8 @@ void TrilinearImageGradient(nifti_image *floatingImage,
                             nifti_image *warImgGradient,
                             int *mask,
                             float paddingValue,
-                            int active_timepoint)
+                            int active_timepoint,
+                            _reg_activeVoxelList *activeVoxels)
 {
    if(active_timepoint<0 || active_timepoint>=floatingImage->nt){
       reg_print_fct_error("TrilinearImageGradient");
@@ -2529,11 +2583,11 @@ void TrilinearImageGradient(nifti_image *floatingImage,
       reg_exit();
    }
 #ifdef _WIN32
-   long index;
+   long index, n;
    long referenceVoxelNumber = (long)warImgGradient->nx*warImgGradient->ny*warImgGradient->nz;
    long floatingVoxelNumber = (long)floatingImage->nx*floatingImage->ny*floatingImage->nz;
 #else
-   size_t index;
+   size_t index, n;
    size_t referenceVoxelNumber = (size_t)warImgGradient->nx*warImgGradient->ny*warImgGradient->nz;
    size_t floatingVoxelNumber = (size_t)floatingImage->nx*floatingImage->ny*floatingImage->nz;
 #endif
@@ -2549,6 +2603,13 @@ void TrilinearImageGradient(nifti_image *floatingImage,
    GradientTYPE *warpedGradientPtrZ = &warpedGradientPtrY[referenceVoxelNumber];
 
    int *maskPtr = &mask[0];
+   // Only the listed voxels are visited when a compact mask is provided
+   int *activeIndex = activeVoxels!=NULL ? activeVoxels->index : NULL;
+#ifdef _WIN32
+   long loopNumber = activeVoxels!=NULL ? (long)activeVoxels->number : referenceVoxelNumber;
+#else
+   size_t loopNumber = activeVoxels!=NULL ? activeVoxels->number : referenceVoxelNumber;
+#endif
 
    mat44 *floatingIJKMatrix;
    if(floatingImage->sform_code>0)
@@ -2571,14 +2632,15 @@ void TrilinearImageGradient(nifti_image *floatingImage,
    FloatingTYPE *zPointer, *xyzPointer;
 #if defined (_OPENMP)
 #pragma omp parallel for default(none) \
-   private(index, world, position, previous, xBasis, yBasis, zBasis, relative, grad, coeff, \
+   private(n, index, world, position, previous, xBasis, yBasis, zBasis, relative, grad, coeff, \
    a, b, c, X, Y, Z, zPointer, xyzPointer, xTempNewValue, yTempNewValue, xxTempNewValue, yyTempNewValue, zzTempNewValue) \
    shared(floatingIntensity, referenceVoxelNumber, floatingVoxelNumber, deriv, paddingValue, \
-   deformationFieldPtrX, deformationFieldPtrY, deformationFieldPtrZ, maskPtr, \
+   deformationFieldPtrX, deformationFieldPtrY, deformationFieldPtrZ, maskPtr, activeIndex, loopNumber, \
    floatingIJKMatrix, floatingImage, warpedGradientPtrX, warpedGradientPtrY, warpedGradientPtrZ)
 #endif // _OPENMP
-   for(index=0; index<referenceVoxelNumber; index++)
+   for(n=0; n<loopNumber; n++)
    {
+      index = activeIndex!=NULL ? activeIndex[n] : n;
 
       grad[0]=0.0;
       grad[1]=0.0;
@@ -2717,7 +2779,8 @@ void BilinearImageGradient(nifti_image *floatingImage,
                            nifti_image *warImgGradient,
                            int *mask,
                            float paddingValue,
-                           int active_timepoint)
+                           int active_timepoint,
+                           _reg_activeVoxelList *activeVoxels)
 {
    if(active_timepoint<0 || active_timepoint>=floatingImage->nt){
       reg_print_fct_error("TrilinearImageGradient");
@@ -2725,11 +2788,11 @@ void BilinearImageGradient(nifti_image *floatingImage,
       reg_exit();
    }
 #ifdef _WIN32
-   long index;
+   long index, n;
    long referenceVoxelNumber = (long)warImgGradient->nx*warImgGradient->ny;
    long floatingVoxelNumber = (long)floatingImage->nx*floatingImage->ny;
 #else
-   size_t index;
+   size_t index, n;
    size_t referenceVoxelNumber = (size_t)warImgGradient->nx*warImgGradient->ny;
    size_t floatingVoxelNumber = (size_t)floatingImage->nx*floatingImage->ny;
 #endif
@@ -2744,6 +2807,13 @@ void BilinearImageGradient(nifti_image *floatingImage,
    GradientTYPE *warpedGradientPtrY = &warpedGradientPtrX[referenceVoxelNumber];
 
    int *maskPtr = &mask[0];
+   // Only the listed voxels are visited when a compact mask is provided
+   int *activeIndex = activeVoxels!=NULL ? activeVoxels->index : NULL;
+#ifdef _WIN32
+   long loopNumber = activeVoxels!=NULL ? (long)activeVoxels->number : referenceVoxelNumber;
+#else
+   size_t loopNumber = activeVoxels!=NULL ? activeVoxels->number : referenceVoxelNumber;
+#endif
 
    mat44 floatingIJKMatrix;
    if(floatingImage->sform_code>0)
@@ -2767,14 +2837,15 @@ void BilinearImageGradient(nifti_image *floatingImage,
 
 #if defined (_OPENMP)
 #pragma omp parallel for default(none) \
-   private(index, world, position, previous, xBasis, yBasis, relative, grad, coeff, \
+   private(n, index, world, position, previous, xBasis, yBasis, relative, grad, coeff, \
    a, b, X, Y, xyPointer, xTempNewValue, yTempNewValue) \
    shared(floatingIntensity, referenceVoxelNumber, floatingVoxelNumber, deriv, \
-   deformationFieldPtrX, deformationFieldPtrY, maskPtr, paddingValue, \
+   deformationFieldPtrX, deformationFieldPtrY, maskPtr, activeIndex, loopNumber, paddingValue, \
    floatingIJKMatrix, floatingImage, warpedGradientPtrX, warpedGradientPtrY)
 #endif // _OPENMP
-   for(index=0; index<referenceVoxelNumber; index++)
+   for(n=0; n<loopNumber; n++)
    {
+      index = activeIndex!=NULL ? activeIndex[n] : n;
 
       grad[0]=0.0;
       grad[1]=0.0;
@@ -2851,7 +2922,8 @@ void CubicSplineImageGradient3D(nifti_image *floatingImage,
                                 nifti_image *warImgGradient,
                                 int *mask,
                                 float paddingValue,
-                                int active_timepoint)
+                                int active_timepoint,
+                                _reg_activeVoxelList *activeVoxels)
 {
    if(active_timepoint<0 || active_timepoint>=floatingImage->nt){
       reg_print_fct_error("TrilinearImageGradient");
@@ -2859,11 +2931,11 @@ void CubicSplineImageGradient3D(nifti_image *floatingImage,
       reg_exit();
    }
 #ifdef _WIN32
-   long index;
+   long index, n;
    long referenceVoxelNumber = (long)warImgGradient->nx*warImgGradient->ny*warImgGradient->nz;
    long floatingVoxelNumber = (long)floatingImage->nx*floatingImage->ny*floatingImage->nz;
 #else
-   size_t index;
+   size_t index, n;
    size_t referenceVoxelNumber = (size_t)warImgGradient->nx*warImgGradient->ny*warImgGradient->nz;
    size_t floatingVoxelNumber = (size_t)floatingImage->nx*floatingImage->ny*floatingImage->nz;
 #endif
@@ -2879,6 +2951,13 @@ void CubicSplineImageGradient3D(nifti_image *floatingImage,
    GradientTYPE *warpedGradientPtrZ = &warpedGradientPtrY[referenceVoxelNumber];
 
    int *maskPtr = &mask[0];
+   // Only the listed voxels are visited when a compact mask is provided
+   int *activeIndex = activeVoxels!=NULL ? activeVoxels->index : NULL;
+#ifdef _WIN32
+   long loopNumber = activeVoxels!=NULL ? (long)activeVoxels->number : referenceVoxelNumber;
+#else
+   size_t loopNumber = activeVoxels!=NULL ? activeVoxels->number : referenceVoxelNumber;
+#endif
 
    mat44 *floatingIJKMatrix;
    if(floatingImage->sform_code>0)
@@ -2899,20 +2978,21 @@ void CubicSplineImageGradient3D(nifti_image *floatingImage,
       FloatingTYPE *zPointer, *yzPointer, *xyzPointer;
 #if defined (_OPENMP)
 #pragma omp parallel for default(none) \
-   private(index, world, position, previous, xBasis, yBasis, zBasis, xDeriv, yDeriv, zDeriv, relative, grad, coeff, \
+   private(n, index, world, position, previous, xBasis, yBasis, zBasis, xDeriv, yDeriv, zDeriv, relative, grad, coeff, \
    a, b, c, Y, Z, zPointer, yzPointer, xyzPointer, xTempNewValue, yTempNewValue, xxTempNewValue, yyTempNewValue, zzTempNewValue) \
    shared(floatingIntensity, referenceVoxelNumber, floatingVoxelNumber, paddingValue, \
-   deformationFieldPtrX, deformationFieldPtrY, deformationFieldPtrZ, maskPtr, \
+   deformationFieldPtrX, deformationFieldPtrY, deformationFieldPtrZ, maskPtr, activeIndex, loopNumber, \
    floatingIJKMatrix, floatingImage, warpedGradientPtrX, warpedGradientPtrY, warpedGradientPtrZ)
 #endif // _OPENMP
-      for(index=0; index<referenceVoxelNumber; index++)
+      for(n=0; n<loopNumber; n++)
       {
+         index = activeIndex!=NULL ? activeIndex[n] : n;
 
          grad[0]=0.0;
          grad[1]=0.0;
          grad[2]=0.0;
 
-         if((*maskPtr++)>-1)
+         if(maskPtr[index]>-1)
          {
 
             world[0]=(FieldTYPE) deformationFieldPtrX[index];
@@ -3015,7 +3095,8 @@ void CubicSplineImageGradient2D(nifti_image *floatingImage,
                                 nifti_image *warImgGradient,
                                 int *mask,
                                 float paddingValue,
-                                int active_timepoint)
+                                int active_timepoint,
+                                _reg_activeVoxelList *activeVoxels)
 {
    if(active_timepoint<0 || active_timepoint>=floatingImage->nt){
       reg_print_fct_error("TrilinearImageGradient");
@@ -3023,11 +3104,11 @@ void CubicSplineImageGradient2D(nifti_image *floatingImage,
       reg_exit();
    }
 #ifdef _WIN32
-   long index;
+   long index, n;
    long referenceVoxelNumber = (long)warImgGradient->nx*warImgGradient->ny;
    long floatingVoxelNumber = (long)floatingImage->nx*floatingImage->ny;
 #else
-   size_t index;
+   size_t index, n;
    size_t referenceVoxelNumber = (size_t)warImgGradient->nx*warImgGradient->ny;
    size_t floatingVoxelNumber = (size_t)floatingImage->nx*floatingImage->ny;
 #endif
@@ -3041,6 +3122,13 @@ void CubicSplineImageGradient2D(nifti_image *floatingImage,
    GradientTYPE *warpedGradientPtrY = &warpedGradientPtrX[referenceVoxelNumber];
 
    int *maskPtr = &mask[0];
+   // Only the listed voxels are visited when a compact mask is provided
+   int *activeIndex = activeVoxels!=NULL ? activeVoxels->index : NULL;
+#ifdef _WIN32
+   long loopNumber = activeVoxels!=NULL ? (long)activeVoxels->number : referenceVoxelNumber;
+#else
+   size_t loopNumber = activeVoxels!=NULL ? activeVoxels->number : referenceVoxelNumber;
+#endif
 
    mat44 *floatingIJKMatrix;
    if(floatingImage->sform_code>0)
@@ -3059,14 +3147,15 @@ void CubicSplineImageGradient2D(nifti_image *floatingImage,
    FloatingTYPE *yPointer, *xyPointer;
 #if defined (_OPENMP)
 #pragma omp parallel for default(none) \
-   private(index, world, position, previous, xBasis, yBasis, xDeriv, yDeriv, relative, grad, coeff, \
+   private(n, index, world, position, previous, xBasis, yBasis, xDeriv, yDeriv, relative, grad, coeff, \
    a, b, Y, yPointer, xyPointer, xTempNewValue, yTempNewValue) \
    shared(floatingIntensity, referenceVoxelNumber, floatingVoxelNumber, \
-   deformationFieldPtrX, deformationFieldPtrY, maskPtr, paddingValue, \
+   deformationFieldPtrX, deformationFieldPtrY, maskPtr, activeIndex, loopNumber, paddingValue, \
    floatingIJKMatrix, floatingImage, warpedGradientPtrX, warpedGradientPtrY)
 #endif // _OPENMP
-   for(index=0; index<referenceVoxelNumber; index++)
+   for(n=0; n<loopNumber; n++)
    {
+      index = activeIndex!=NULL ? activeIndex[n] : n;
 
       grad[0]=0.0;
       grad[1]=0.0;
@@ -3149,7 +3238,8 @@ void reg_getImageGradient3(nifti_image *floatingImage,
                            int active_timepoint,
                            int *dtIndicies,
                            mat33 *jacMat,
-                           nifti_image *warpedImage = NULL
+                           nifti_image *warpedImage,
+                           _reg_activeVoxelList *activeVoxels
       )
 {
    // The floating image data is copied in case one deal with DTI
@@ -3169,7 +3259,8 @@ void reg_getImageGradient3(nifti_image *floatingImage,
                                                      warImgGradient,
                                                      mask,
                                                      paddingValue,
-                                                     active_timepoint);
+                                                     active_timepoint,
+                                                     activeVoxels);
       }
       else
       {
@@ -3179,7 +3270,8 @@ void reg_getImageGradient3(nifti_image *floatingImage,
                                                      warImgGradient,
                                                      mask,
                                                      paddingValue,
-                                                     active_timepoint);
+                                                     active_timepoint,
+                                                     activeVoxels);
       }
    }
    else  // trilinear interpolation [ by default ]
@@ -3192,7 +3284,8 @@ void reg_getImageGradient3(nifti_image *floatingImage,
                                                      warImgGradient,
                                                      mask,
                                                      paddingValue,
-                                                     active_timepoint);
+                                                     active_timepoint,
+                                                     activeVoxels);
       }
       else
       {
@@ -3202,7 +3295,8 @@ void reg_getImageGradient3(nifti_image *floatingImage,
                                                      warImgGradient,
                                                      mask,
                                                      paddingValue,
-                                                     active_timepoint);
+                                                     active_timepoint,
+                                                     activeVoxels);
       }
    }
    // The temporary logged floating array is deleted
@@ -3231,18 +3325,24 @@ void reg_getImageGradient2(nifti_image *floatingImage,
                            int active_timepoint,
                            int *dtIndicies,
                            mat33 *jacMat,
-                           nifti_image *warpedImage
+                           nifti_image *warpedImage,
+                           _reg_activeVoxelList *activeVoxels
                            )
 {
    switch(warImgGradient->datatype)
    {
    case NIFTI_TYPE_FLOAT32:
       reg_getImageGradient3<FieldTYPE,FloatingTYPE,float>
-            (floatingImage,warImgGradient,deformationField,mask,interp,paddingValue,active_timepoint,dtIndicies,jacMat, warpedImage);
+            (floatingImage,warImgGradient,deformationField,mask,interp,paddingValue,active_timepoint,dtIndicies,jacMat, warpedImage, activeVoxels);
       break;
    case NIFTI_TYPE_FLOAT64:
       reg_getImageGradient3<FieldTYPE,FloatingTYPE,double>
-            (floatingImage,warImgGradient,deformationField,mask,interp,paddingValue,active_timepoint,dtIndicies,jacMat, warpedImage);
+            (floatingImage,warImgGradient,deformationField,mask,interp,paddingValue,active_timepoint,dtIndicies,jacMat, warpedImage, activeVoxels);
+      break;
+   case REG_TYPE_FLOAT16:
+      // Each gradient value is rounded to half precision as it is stored
+      reg_getImageGradient3<FieldTYPE,FloatingTYPE,reg_half>
+            (floatingImage,warImgGradient,deformationField,mask,interp,paddingValue,active_timepoint,dtIndicies,jacMat, warpedImage, activeVoxels);
       break;
    default:
       reg_print_fct_error("reg_getImageGradient2");
@@ -3261,42 +3361,43 @@ void reg_getImageGradient1(nifti_image *floatingImage,
                            int active_timepoint,
                            int *dtIndicies,
                            mat33 *jacMat,
-                           nifti_image *warpedImage
+                           nifti_image *warpedImage,
+                           _reg_activeVoxelList *activeVoxels
                            )
 {
    switch(floatingImage->datatype)
    {
    case NIFTI_TYPE_UINT8:
       reg_getImageGradient2<FieldTYPE,unsigned char>
-            (floatingImage,warImgGradient,deformationField,mask,interp,paddingValue,active_timepoint,dtIndicies,jacMat, warpedImage);
+            (floatingImage,warImgGradient,deformationField,mask,interp,paddingValue,active_timepoint,dtIndicies,jacMat, warpedImage, activeVoxels);
       break;
    case NIFTI_TYPE_INT8:
       reg_getImageGradient2<FieldTYPE,char>
-            (floatingImage,warImgGradient,deformationField,mask,interp,paddingValue,active_timepoint,dtIndicies,jacMat, warpedImage);
+            (floatingImage,warImgGradient,deformationField,mask,interp,paddingValue,active_timepoint,dtIndicies,jacMat, warpedImage, activeVoxels);
       break;
    case NIFTI_TYPE_UINT16:
       reg_getImageGradient2<FieldTYPE,unsigned short>
-            (floatingImage,warImgGradient,deformationField,mask,interp,paddingValue,active_timepoint,dtIndicies,jacMat, warpedImage);
+            (floatingImage,warImgGradient,deformationField,mask,interp,paddingValue,active_timepoint,dtIndicies,jacMat, warpedImage, activeVoxels);
       break;
    case NIFTI_TYPE_INT16:
       reg_getImageGradient2<FieldTYPE,short>
-            (floatingImage,warImgGradient,deformationField,mask,interp,paddingValue,active_timepoint,dtIndicies,jacMat, warpedImage);
+            (floatingImage,warImgGradient,deformationField,mask,interp,paddingValue,active_timepoint,dtIndicies,jacMat, warpedImage, activeVoxels);
       break;
    case NIFTI_TYPE_UINT32:
       reg_getImageGradient2<FieldTYPE,unsigned int>
-            (floatingImage,warImgGradient,deformationField,mask,interp,paddingValue,active_timepoint,dtIndicies,jacMat, warpedImage);
+            (floatingImage,warImgGradient,deformationField,mask,interp,paddingValue,active_timepoint,dtIndicies,jacMat, warpedImage, activeVoxels);
       break;
    case NIFTI_TYPE_INT32:
       reg_getImageGradient2<FieldTYPE,int>
-            (floatingImage,warImgGradient,deformationField,mask,interp,paddingValue,active_timepoint,dtIndicies,jacMat, warpedImage);
+            (floatingImage,warImgGradient,deformationField,mask,interp,paddingValue,active_timepoint,dtIndicies,jacMat, warpedImage, activeVoxels);
       break;
    case NIFTI_TYPE_FLOAT32:
       reg_getImageGradient2<FieldTYPE,float>
-            (floatingImage,warImgGradient,deformationField,mask,interp,paddingValue,active_timepoint,dtIndicies,jacMat, warpedImage);
+            (floatingImage,warImgGradient,deformationField,mask,interp,paddingValue,active_timepoint,dtIndicies,jacMat, warpedImage, activeVoxels);
       break;
    case NIFTI_TYPE_FLOAT64:
       reg_getImageGradient2<FieldTYPE,double>
-            (floatingImage,warImgGradient,deformationField,mask,interp,paddingValue,active_timepoint,dtIndicies,jacMat, warpedImage);
+            (floatingImage,warImgGradient,deformationField,mask,interp,paddingValue,active_timepoint,dtIndicies,jacMat, warpedImage, activeVoxels);
       break;
    default:
       reg_print_fct_error("reg_getImageGradient1");
@@ -3314,7 +3415,8 @@ void reg_getImageGradient(nifti_image *floatingImage,
                           int active_timepoint,
                           bool *dti_timepoint,
                           mat33 *jacMat,
-                          nifti_image *warpedImage
+                          nifti_image *warpedImage,
+                          _reg_activeVoxelList *activeVoxels
                           )
 {
    // a mask array is created if no mask is specified
@@ -3356,11 +3458,11 @@ void reg_getImageGradient(nifti_image *floatingImage,
    {
    case NIFTI_TYPE_FLOAT32:
       reg_getImageGradient1<float>
-            (floatingImage,warImgGradient,deformationField,mask,interp,paddingValue,active_timepoint,dtIndicies,jacMat, warpedImage);
+            (floatingImage,warImgGradient,deformationField,mask,interp,paddingValue,active_timepoint,dtIndicies,jacMat, warpedImage, activeVoxels);
       break;
    case NIFTI_TYPE_FLOAT64:
       reg_getImageGradient1<double>
-            (floatingImage,warImgGradient,deformationField,mask,interp,paddingValue,active_timepoint,dtIndicies,jacMat, warpedImage);
+            (floatingImage,warImgGradient,deformationField,mask,interp,paddingValue,active_timepoint,dtIndicies,jacMat, warpedImage, activeVoxels);
       break;
    default:
       reg_print_fct_error("reg_getImageGradient");
@@ -14,6 +14,7 @@
 #define _REG_RESAMPLING_H
 
 #include "nifti1_io.h"
+#include "_reg_tools.h"
 
 /** @brief This function resample a floating image into the space of a reference/warped image.
  * The deformation is provided by a 4D nifti image which is in the space of the reference image.
@@ -32,6 +33,8 @@
  * reference image space.
  * @param dtIndicies Array of 6 integers that correspond to the "time" indicies of the diffusion tensor
  * components in the order xx,yy,zz,xy,xz,yz. If there are no DT images, pass an array of -1's
+ * @param activeVoxels Optional compact list of the active voxels of the mask. When specified, only
+ * the listed voxels are resampled and the other warped voxels are left untouched
  */
 extern "C++"
 void reg_resampleImage(nifti_image *floatingImage,
@@ -41,7 +44,8 @@ void reg_resampleImage(nifti_image *floatingImage,
                        int interp,
                        float paddingValue,
                        bool *dti_timepoint = NULL,
-                       mat33 * jacMat = NULL);
+                       mat33 * jacMat = NULL,
+                       _reg_activeVoxelList *activeVoxels = NULL);
 extern "C++"
 void reg_resampleImage_PSF(nifti_image *floatingImage,
                            nifti_image *warpedImage,
@@ -60,6 +64,10 @@ void reg_resampleGradient(nifti_image *gradientImage,
                           int interp,
                           float paddingValue);
 
+/** @brief Compute the spatial gradient of the warped floating image
+ * @param activeVoxels Optional compact list of the active voxels of the mask. When specified, only
+ * the listed voxels are computed and the other gradient voxels are left untouched
+ */
 extern "C++"
 void reg_getImageGradient(nifti_image *floatingImage,
                           nifti_image *warImgGradient,
@@ -70,8 +78,22 @@ void reg_getImageGradient(nifti_image *floatingImage,
                           int active_timepoint,
                           bool *dti_timepoint = NULL,
                           mat33 *jacMat = NULL,
-                          nifti_image *warpedImage = NULL);
+                          nifti_image *warpedImage = NULL,
+                          _reg_activeVoxelList *activeVoxels = NULL);
 extern "C++"
 nifti_image *reg_makeIsotropic(nifti_image *, int);
 
+/** @brief Interpolation kernels used by the resampling functions. Each one
+ * fills the basis values for a relative position between 0 and 1 within the
+ * voxel: two values for nearest neighbour and linear interpolation, starting
+ * at the current voxel, and four for cubic spline interpolation, starting at
+ * the previous voxel
+ */
+extern "C++"
+void interpNearestNeighKernel(double relative, double *basis);
+extern "C++"
+void interpLinearKernel(double relative, double *basis);
+extern "C++"
+void interpCubicSplineKernel(double relative, double *basis);
+
 #endif
@@ -16,6 +16,10 @@
 #include <cmath>
 #include "_reg_tools.h"
 
+#if defined (__linux__)
+#include <sys/mman.h>
+#endif
+
 /* *************************************************************** */
 /* *************************************************************** */
 void reg_checkAndCorrectDimension(nifti_image *image)
@@ -464,7 +468,7 @@ void reg_tools_changeDatatype1(nifti_image *image,int type)
    }
    free(image->data);
    image->nbyper = sizeof(NewTYPE);
-   image->data = (void *)calloc(image->nvox,sizeof(NewTYPE));
+   reg_tools_allocateImageData(image);
    NewTYPE *dataPtr = static_cast<NewTYPE *>(image->data);
    for (size_t i = 0; i < image->nvox; i++) {
        dataPtr[i] = (NewTYPE)(initialValue[i]);
@@ -1649,34 +1653,93 @@ void reg_tools_kernelConvolution(nifti_image *image,
 }
 /* *************************************************************** */
 /* *************************************************************** */
-template <class PrecisionTYPE, class ImageTYPE>
-void reg_downsampleImage1(nifti_image *image, int type, bool *downsampleAxis)
-{
-   if(type==1)
-   {
-      /* the input image is first smooth */
-      float *sigma=new float[image->nt];
-      for(int i=0; i<image->nt; ++i) sigma[i]=-0.7355f;
-      reg_tools_kernelConvolution(image,sigma,GAUSSIAN_KERNEL);
-      delete []sigma;
-   }
-
-   /* the values are copied */
-   ImageTYPE *oldValues = (ImageTYPE *)malloc(image->nvox * image->nbyper);
-   ImageTYPE *imagePtr = static_cast<ImageTYPE *>(image->data);
-   memcpy(oldValues, imagePtr, image->nvox*image->nbyper);
-   free(image->data);
+/* Convolve the intensity and density values along one axis, only evaluating
+ * the result at the positions that are kept after decimation. When no
+ * density is provided, it is derived from the input intensities and the
+ * non-finite values are ignored.
+ */
+template <class PrecisionTYPE, class InputTYPE>
+void reg_downsampleImage_reduceAxis(InputTYPE *inputIntensity,
+                                    PrecisionTYPE *inputDensity,
+                                    PrecisionTYPE *outputIntensity,
+                                    PrecisionTYPE *outputDensity,
+                                    int *inputDim,
+                                    int axis,
+                                    int step,
+                                    float *kernel,
+                                    int radius)
+{
+   int inputLength=inputDim[axis];
+   int outputLength=(inputLength-1)/step+1;
+   // Number of voxels between two consecutive voxels along the axis
+   int inner=1;
+   for(int i=0; i<axis; ++i) inner*=inputDim[i];
+   int outer=1;
+   for(int i=axis+1; i<3; ++i) outer*=inputDim[i];
+#ifdef WIN32
+   long line;
+   long lineNumber=(long)inner*outer;
+#else
+   size_t line;
+   size_t lineNumber=(size_t)inner*outer;
+#endif
+   size_t inputIndex, outputIndex;
+   int o, k, shiftPre, shiftPst;
+   PrecisionTYPE intensitySum, densitySum, value, density;
+   float *kernelPtr;
 
-   // Keep the previous real to voxel qform
-   mat44 real2Voxel_qform;
-   for(int i=0; i<4; i++)
+#if defined (_OPENMP)
+#pragma omp parallel for default(none) \
+   shared(inputIntensity, inputDensity, outputIntensity, outputDensity, \
+   inputLength, outputLength, inner, lineNumber, step, kernel, radius) \
+   private(line, inputIndex, outputIndex, o, k, shiftPre, shiftPst, \
+   intensitySum, densitySum, value, density, kernelPtr)
+#endif
+   for(line=0; line<lineNumber; ++line)
    {
-      for(int j=0; j<4; j++)
+      inputIndex=(size_t)(line/inner)*inner*inputLength + line%inner;
+      outputIndex=(size_t)(line/inner)*inner*outputLength + line%inner;
+      for(o=0; o<outputLength; ++o)
       {
-         real2Voxel_qform.m[i][j]=image->qto_ijk.m[i][j];
+         // Define the kernel boundaries around the kept position
+         shiftPre=o*step-radius;
+         shiftPst=o*step+radius+1;
+         kernelPtr=&kernel[0];
+         if(shiftPre<0)
+         {
+            kernelPtr=&kernel[-shiftPre];
+            shiftPre=0;
+         }
+         if(shiftPst>inputLength) shiftPst=inputLength;
+         intensitySum=0;
+         densitySum=0;
+         for(k=shiftPre; k<shiftPst; ++k)
+         {
+            value=static_cast<PrecisionTYPE>(inputIntensity[inputIndex+(size_t)k*inner]);
+            if(inputDensity==NULL)
+            {
+               density=value==value?1:0;
+               if(density==0) value=0;
+            }
+            else density=inputDensity[inputIndex+(size_t)k*inner];
+            intensitySum += *kernelPtr * value;
+            densitySum += *kernelPtr * density;
+            ++kernelPtr;
+         }
+         outputIntensity[outputIndex+(size_t)o*inner]=intensitySum;
+         outputDensity[outputIndex+(size_t)o*inner]=densitySum;
       }
    }
-
+}
+/* *************************************************************** */
+/* *************************************************************** */
+/* Downsample the values of an image, which are read from a separate array
+ * of the original size, so that the new data array of the image can be of a
+ * different type and the original array is neither modified nor freed.
+ */
+template <class PrecisionTYPE, class InputTYPE, class ImageTYPE>
+void reg_downsampleImage_core(nifti_image *image, InputTYPE *oldValues, int type, bool *downsampleAxis)
+{
    // Update the axis dimension
    int oldDim[4];
    for(int i=1; i<4; i++)
@@ -1695,6 +1758,7 @@ void reg_downsampleImage1(nifti_image *image, int type, bool *downsampleAxis)
    if(image->nu<1 || image->dim[5]<1) image->nu=image->dim[5]=1;
    if(image->nv<1 || image->dim[6]<1) image->nv=image->dim[6]=1;
    if(image->nw<1 || image->dim[7]<1) image->nw=image->dim[7]=1;
+   size_t smoothedVolumeNumber=(size_t)image->nt*image->nu;
 
    // update the qform matrix
    image->qto_xyz=nifti_quatern_to_mat44(image->quatern_b,
@@ -1743,128 +1807,140 @@ void reg_downsampleImage1(nifti_image *image, int type, bool *downsampleAxis)
          (size_t)image->nu*
          (size_t)image->nv*
          (size_t)image->nw;
-   image->data=(void *)calloc(image->nvox, image->nbyper);
-   imagePtr = static_cast<ImageTYPE *>(image->data);
+   reg_tools_allocateImageData(image);
+   ImageTYPE *imagePtr = static_cast<ImageTYPE *>(image->data);
 
-   PrecisionTYPE real[3], position[3], relative, xBasis[2], yBasis[2], zBasis[2], intensity;
-   int previous[3];
+   // The new voxel (x,y,z) lies on the old voxel (x,y,z)*step as the origin
+   // is preserved and the spacing is doubled along the downsampled axes
+   int step[3], newDim[3]={image->nx,image->ny,image->nz};
+   for(int i=0; i<3; ++i)
+      step[i]=downsampleAxis[i+1]?2:1;
+   size_t oldVoxelNumber=(size_t)oldDim[1]*oldDim[2]*oldDim[3];
+   size_t newVoxelNumber=(size_t)newDim[0]*newDim[1]*newDim[2];
+
+   // The Gaussian kernel of 0.7355 voxel standard deviation
+   // used as anti-aliasing filter
+   float kernel[5];
+   int radius=0;
+   PrecisionTYPE *intensityBuffer[2]={NULL,NULL};
+   PrecisionTYPE *densityBuffer[2]={NULL,NULL};
+   if(type==1)
+   {
+      double sigma=0.7355;
+      radius=static_cast<int>(sigma*3.0);
+      for(int i=-radius; i<=radius; i++)
+      {
+         // 2.506... = sqrt(2*pi)
+         kernel[radius+i]=static_cast<float>(exp(-(double)(i*i)/(2.0*reg_pow2(sigma))) /
+                                             (sigma*2.506628274631));
+      }
+      // Each buffer holds the output of one separable pass
+      size_t bufferSize[2]=
+      {
+         (size_t)newDim[0]*oldDim[2]*oldDim[3],
+         (size_t)newDim[0]*newDim[1]*oldDim[3]
+      };
+      for(int i=0; i<2; ++i)
+      {
+         intensityBuffer[i]=(PrecisionTYPE *)malloc(bufferSize[i]*sizeof(PrecisionTYPE));
+         densityBuffer[i]=(PrecisionTYPE *)malloc(bufferSize[i]*sizeof(PrecisionTYPE));
+      }
+   }
 
-   // qform is used for resampling
+#ifdef WIN32
+   long index;
+   long voxelNumber=(long)newVoxelNumber;
+#else
+   size_t index;
+   size_t voxelNumber=newVoxelNumber;
+#endif
+   int x, y, z;
+   size_t oldIndex;
+   PrecisionTYPE intensity;
    for(size_t tuvw=0; tuvw<(size_t)image->nt*image->nu*image->nv*image->nw; tuvw++)
    {
-      ImageTYPE *valuesPtrTUVW = &oldValues[tuvw*oldDim[1]*oldDim[2]*oldDim[3]];
-      for(int z=0; z<image->nz; z++)
+      InputTYPE *valuesPtrTUVW = &oldValues[tuvw*oldVoxelNumber];
+      ImageTYPE *newValuesPtr = &imagePtr[tuvw*newVoxelNumber];
+      // Only the time points and the fifth dimension are smoothed
+      bool smooth = type==1 && tuvw<smoothedVolumeNumber;
+      PrecisionTYPE *smoothedIntensity=NULL;
+      PrecisionTYPE *smoothedDensity=NULL;
+      if(smooth)
       {
-         for(int y=0; y<image->ny; y++)
+         // The smoothing is only evaluated at the decimated positions,
+         // one axis at a time
+         int passDim[3]={oldDim[1],oldDim[2],oldDim[3]};
+         reg_downsampleImage_reduceAxis<PrecisionTYPE,InputTYPE>
+               (valuesPtrTUVW, NULL, intensityBuffer[0], densityBuffer[0],
+                passDim, 0, step[0], kernel, radius);
+         passDim[0]=newDim[0];
+         reg_downsampleImage_reduceAxis<PrecisionTYPE,PrecisionTYPE>
+               (intensityBuffer[0], densityBuffer[0], intensityBuffer[1], densityBuffer[1],
+                passDim, 1, step[1], kernel, radius);
+         passDim[1]=newDim[1];
+         reg_downsampleImage_reduceAxis<PrecisionTYPE,PrecisionTYPE>
+               (intensityBuffer[1], densityBuffer[1], intensityBuffer[0], densityBuffer[0],
+                passDim, 2, step[2], kernel, radius);
+         smoothedIntensity=intensityBuffer[0];
+         smoothedDensity=densityBuffer[0];
+      }
+#if defined (_OPENMP)
+#pragma omp parallel for default(none) \
+   shared(voxelNumber, newDim, oldDim, step, smooth, smoothedIntensity, smoothedDensity, \
+   valuesPtrTUVW, newValuesPtr, image) \
+   private(index, x, y, z, oldIndex, intensity)
+#endif
+      for(index=0; index<voxelNumber; ++index)
+      {
+         x=index%newDim[0];
+         y=(index/newDim[0])%newDim[1];
+         z=index/((size_t)newDim[0]*newDim[1]);
+         oldIndex=((size_t)z*step[2]*oldDim[2]+y*step[1])*oldDim[1]+x*step[0];
+         if(!smooth)
          {
-            for(int x=0; x<image->nx; x++)
-            {
-               // Extract the voxel coordinate in mm
-               real[0]=x*image->qto_xyz.m[0][0] +
-                     y*image->qto_xyz.m[0][1] +
-                     z*image->qto_xyz.m[0][2] +
-                     image->qto_xyz.m[0][3];
-               real[1]=x*image->qto_xyz.m[1][0] +
-                     y*image->qto_xyz.m[1][1] +
-                     z*image->qto_xyz.m[1][2] +
-                     image->qto_xyz.m[1][3];
-               real[2]=x*image->qto_xyz.m[2][0] +
-                     y*image->qto_xyz.m[2][1] +
-                     z*image->qto_xyz.m[2][2] +
-                     image->qto_xyz.m[2][3];
-               // Extract the position in voxel in the old image;
-               position[0]=real[0]*real2Voxel_qform.m[0][0] + real[1]*real2Voxel_qform.m[0][1] + real[2]*real2Voxel_qform.m[0][2] + real2Voxel_qform.m[0][3];
-               position[1]=real[0]*real2Voxel_qform.m[1][0] + real[1]*real2Voxel_qform.m[1][1] + real[2]*real2Voxel_qform.m[1][2] + real2Voxel_qform.m[1][3];
-               position[2]=real[0]*real2Voxel_qform.m[2][0] + real[1]*real2Voxel_qform.m[2][1] + real[2]*real2Voxel_qform.m[2][2] + real2Voxel_qform.m[2][3];
-               /* trilinear interpolation */
-               previous[0] = (int)reg_round(position[0]);
-               previous[1] = (int)reg_round(position[1]);
-               previous[2] = (int)reg_round(position[2]);
-
-               // basis values along the x axis
-               relative=position[0]-(PrecisionTYPE)previous[0];
-               if(relative<0) relative=0.0; // reg_rounding error correction
-               xBasis[0]= (PrecisionTYPE)(1.0-relative);
-               xBasis[1]= relative;
-               // basis values along the y axis
-               relative=position[1]-(PrecisionTYPE)previous[1];
-               if(relative<0) relative=0.0; // reg_rounding error correction
-               yBasis[0]= (PrecisionTYPE)(1.0-relative);
-               yBasis[1]= relative;
-               // basis values along the z axis
-               relative=position[2]-(PrecisionTYPE)previous[2];
-               if(relative<0) relative=0.0; // reg_rounding error correction
-               zBasis[0]= (PrecisionTYPE)(1.0-relative);
-               zBasis[1]= relative;
-               intensity=0;
-               for(short c=0; c<2; c++)
-               {
-                  short Z= previous[2]+c;
-                  if(-1<Z && Z<oldDim[3])
-                  {
-                     ImageTYPE *zPointer = &valuesPtrTUVW[Z*oldDim[1]*oldDim[2]];
-                     PrecisionTYPE yTempNewValue=0.0;
-                     for(short b=0; b<2; b++)
-                     {
-                        short Y= previous[1]+b;
-                        if(-1<Y && Y<oldDim[2])
-                        {
-                           ImageTYPE *yzPointer = &zPointer[Y*oldDim[1]];
-                           ImageTYPE *xyzPointer = &yzPointer[previous[0]];
-                           PrecisionTYPE xTempNewValue=0.0;
-                           for(short a=0; a<2; a++)
-                           {
-                              if(-1<(previous[0]+a) && (previous[0]+a)<oldDim[1])
-                              {
-                                 const ImageTYPE coeff = *xyzPointer;
-                                 xTempNewValue +=  (PrecisionTYPE)(coeff * xBasis[a]);
-                              } // X in range
-                              else if(xBasis[a]>0.f)
-                              {
-                                 xTempNewValue=std::numeric_limits<ImageTYPE>::quiet_NaN();
-                              }
-                              xyzPointer++;
-                           }
-                           yTempNewValue += (xTempNewValue * yBasis[b]);
-                        } // Y in range
-                        else if(yBasis[b]>0.f)
-                        {
-                           yTempNewValue=std::numeric_limits<ImageTYPE>::quiet_NaN();
-                        }
-                     }
-                     intensity += yTempNewValue * zBasis[c];
-                  } // Z in range
-                  else if(zBasis[c]>0.f)
-                  {
-                     intensity=std::numeric_limits<ImageTYPE>::quiet_NaN();
-                  }
-               }
-               switch(image->datatype)
-               {
-               case NIFTI_TYPE_FLOAT32:
-                  (*imagePtr)=(ImageTYPE)intensity;
-                  break;
-               case NIFTI_TYPE_FLOAT64:
-                  (*imagePtr)=(ImageTYPE)intensity;
-                  break;
-               case NIFTI_TYPE_UINT8:
-                  (*imagePtr)=(ImageTYPE)(intensity>0?reg_round(intensity):0);
-                  break;
-               case NIFTI_TYPE_UINT16:
-                  (*imagePtr)=(ImageTYPE)(intensity>0?reg_round(intensity):0);
-                  break;
-               case NIFTI_TYPE_UINT32:
-                  (*imagePtr)=(ImageTYPE)(intensity>0?reg_round(intensity):0);
-                  break;
-               default:
-                  (*imagePtr)=(ImageTYPE)reg_round(intensity);
-                  break;
-               }
-               imagePtr++;
-            }
+            newValuesPtr[index]=valuesPtrTUVW[oldIndex];
+            continue;
+         }
+         // Non-finite values are preserved
+         if(valuesPtrTUVW[oldIndex]!=valuesPtrTUVW[oldIndex])
+            intensity=std::numeric_limits<PrecisionTYPE>::quiet_NaN();
+         else intensity=smoothedIntensity[index]/smoothedDensity[index];
+         switch(image->datatype)
+         {
+         case NIFTI_TYPE_FLOAT32:
+            newValuesPtr[index]=(ImageTYPE)intensity;
+            break;
+         case NIFTI_TYPE_FLOAT64:
+            newValuesPtr[index]=(ImageTYPE)intensity;
+            break;
+         case NIFTI_TYPE_UINT8:
+            newValuesPtr[index]=(ImageTYPE)(intensity>0?reg_round(intensity):0);
+            break;
+         case NIFTI_TYPE_UINT16:
+            newValuesPtr[index]=(ImageTYPE)(intensity>0?reg_round(intensity):0);
+            break;
+         case NIFTI_TYPE_UINT32:
+            newValuesPtr[index]=(ImageTYPE)(intensity>0?reg_round(intensity):0);
+            break;
+         default:
+            newValuesPtr[index]=(ImageTYPE)reg_round(intensity);
+            break;
          }
       }
    }
+   for(int i=0; i<2; ++i)
+   {
+      if(intensityBuffer[i]!=NULL) free(intensityBuffer[i]);
+      if(densityBuffer[i]!=NULL) free(densityBuffer[i]);
+   }
+}
+/* *************************************************************** */
+template <class PrecisionTYPE, class ImageTYPE>
+void reg_downsampleImage1(nifti_image *image, int type, bool *downsampleAxis)
+{
+   // The previous values are kept while the new image is allocated
+   ImageTYPE *oldValues = static_cast<ImageTYPE *>(image->data);
+   reg_downsampleImage_core<PrecisionTYPE,ImageTYPE,ImageTYPE>(image, oldValues, type, downsampleAxis);
    free(oldValues);
 }
 /* *************************************************************** */
@@ -1906,6 +1982,74 @@ void reg_downsampleImage(nifti_image *image, int type, bool *downsampleAxis)
 template void reg_downsampleImage<float>(nifti_image *, int, bool *);
 template void reg_downsampleImage<double>(nifti_image *, int, bool *);
 /* *************************************************************** */
+template <class PrecisionTYPE, class InputTYPE>
+void reg_downsampleImageCopy1(nifti_image *inputImage, nifti_image *image, int type, bool *downsampleAxis)
+{
+   InputTYPE *inputValues = static_cast<InputTYPE *>(inputImage->data);
+   switch(image->datatype)
+   {
+   case NIFTI_TYPE_FLOAT32:
+      reg_downsampleImage_core<PrecisionTYPE,InputTYPE,float>(image, inputValues, type, downsampleAxis);
+      break;
+   case NIFTI_TYPE_FLOAT64:
+      reg_downsampleImage_core<PrecisionTYPE,InputTYPE,double>(image, inputValues, type, downsampleAxis);
+      break;
+   default:
+      reg_downsampleImage_core<PrecisionTYPE,InputTYPE,InputTYPE>(image, inputValues, type, downsampleAxis);
+   }
+}
+/* *************************************************************** */
+/* Return a downsampled copy of an image, whose data type is either the one
+ * of the input image or a floating-point type. The input values are read
+ * directly, so no copy of the image is made at its original resolution.
+ */
+template <class PrecisionTYPE>
+nifti_image *reg_downsampleImageCopy(nifti_image *inputImage, int datatype, int type, bool *downsampleAxis)
+{
+   if(datatype!=inputImage->datatype && datatype!=NIFTI_TYPE_FLOAT32 && datatype!=NIFTI_TYPE_FLOAT64)
+   {
+      reg_print_fct_error("reg_downsampleImageCopy");
+      reg_print_msg_error("The requested data type is not supported");
+      reg_exit();
+   }
+   nifti_image *image=nifti_copy_nim_info(inputImage);
+   image->datatype=datatype;
+   if(datatype==NIFTI_TYPE_FLOAT32) image->nbyper=sizeof(float);
+   else if(datatype==NIFTI_TYPE_FLOAT64) image->nbyper=sizeof(double);
+   switch(inputImage->datatype)
+   {
+   case NIFTI_TYPE_UINT8:
+      reg_downsampleImageCopy1<PrecisionTYPE,unsigned char>(inputImage, image, type, downsampleAxis);
+      break;
+   case NIFTI_TYPE_INT8:
+      reg_downsampleImageCopy1<PrecisionTYPE,char>(inputImage, image, type, downsampleAxis);
+      break;
+   case NIFTI_TYPE_UINT16:
+      reg_downsampleImageCopy1<PrecisionTYPE,unsigned short>(inputImage, image, type, downsampleAxis);
+      break;
+   case NIFTI_TYPE_INT16:
+      reg_downsampleImageCopy1<PrecisionTYPE,short>(inputImage, image, type, downsampleAxis);
+      break;
+   case NIFTI_TYPE_UINT32:
+      reg_downsampleImageCopy1<PrecisionTYPE,unsigned int>(inputImage, image, type, downsampleAxis);
+      break;
+   case NIFTI_TYPE_INT32:
+      reg_downsampleImageCopy1<PrecisionTYPE,int>(inputImage, image, type, downsampleAxis);
+      break;
+   case NIFTI_TYPE_FLOAT32:
+      reg_downsampleImageCopy1<PrecisionTYPE,float>(inputImage, image, type, downsampleAxis);
+      break;
+   case NIFTI_TYPE_FLOAT64:
+      reg_downsampleImageCopy1<PrecisionTYPE,double>(inputImage, image, type, downsampleAxis);
+      break;
+   default:
+      reg_print_fct_error("reg_downsampleImageCopy");
+      reg_print_msg_error("The image data type is not supported");
+      reg_exit();
+   }
+   return image;
+}
+/* *************************************************************** */
 /* *************************************************************** */
 template <class DTYPE>
 void reg_tools_binarise_image1(nifti_image *image)
@@ -2058,6 +2202,33 @@ void reg_tools_binaryImage2int(nifti_image *image, int *array, int &activeVoxelN
    }
 }
 /* *************************************************************** */
+_reg_activeVoxelList *reg_tools_getActiveVoxelList(int *mask, size_t voxelNumber)
+{
+   if(mask==NULL) return NULL;
+   // Count the active voxels first to allocate the exact amount of memory
+   size_t activeNumber=0;
+   for(size_t i=0; i<voxelNumber; ++i)
+      if(mask[i]>-1) ++activeNumber;
+   if(activeNumber==voxelNumber) return NULL;
+
+   _reg_activeVoxelList *list = new _reg_activeVoxelList;
+   list->number=activeNumber;
+   if(activeNumber>0)
+   {
+      list->index=(int *)malloc(activeNumber*sizeof(int));
+      size_t n=0;
+      for(size_t i=0; i<voxelNumber; ++i)
+         if(mask[i]>-1) list->index[n++]=static_cast<int>(i);
+   }
+#ifndef NDEBUG
+   char text[255];
+   snprintf(text, 255, "Active voxel list: %lu out of %lu voxels",
+            (unsigned long)activeNumber, (unsigned long)voxelNumber);
+   reg_print_msg_debug(text);
+#endif
+   return list;
+}
+/* *************************************************************** */
 /* *************************************************************** */
 template <class ATYPE,class BTYPE>
 double reg_tools_getMeanRMS2(nifti_image *imageA, nifti_image *imageB)
@@ -2162,10 +2333,7 @@ int reg_createImagePyramid(nifti_image *inputImage, nifti_image **pyramid, int u
 {
    // FINEST LEVEL OF REGISTRATION
    pyramid[levelToPerform-1]=nifti_copy_nim_info(inputImage);
-   pyramid[levelToPerform-1]->data = (void *)calloc(pyramid[levelToPerform-1]->nvox,
-         pyramid[levelToPerform-1]->nbyper);
-   memcpy(pyramid[levelToPerform-1]->data, inputImage->data,
-         pyramid[levelToPerform-1]->nvox* pyramid[levelToPerform-1]->nbyper);
+   reg_tools_allocateImageData(pyramid[levelToPerform-1], inputImage->data);
    reg_tools_changeDatatype<DTYPE>(pyramid[levelToPerform-1]);
    reg_tools_removeSCLInfo(pyramid[levelToPerform-1]);
 
@@ -2184,11 +2352,7 @@ int reg_createImagePyramid(nifti_image *inputImage, nifti_image **pyramid, int u
    {
       // Allocation of the image
       pyramid[l]=nifti_copy_nim_info(pyramid[l+1]);
-      pyramid[l]->data = (void *)calloc(pyramid[l]->nvox,
-                                        pyramid[l]->nbyper);
-
-      memcpy(pyramid[l]->data, pyramid[l+1]->data,
-            pyramid[l]->nvox* pyramid[l]->nbyper);
+      reg_tools_allocateImageData(pyramid[l], pyramid[l+1]->data);
 
       // Downsample the image if appropriate
       bool downsampleAxis[8]= {false,true,true,true,false,false,false,false};
@@ -2266,6 +2430,206 @@ int reg_createMaskPyramid(nifti_image *inputMaskImage, int **maskPyramid, int un
 template int reg_createMaskPyramid<float>(nifti_image *, int **, unsigned int , unsigned int , int *);
 template int reg_createMaskPyramid<double>(nifti_image *, int **, unsigned int , unsigned int , int *);
 /* *************************************************************** */
+template <class DTYPE>
+int reg_createImagePyramidLevel(nifti_image *inputImage, nifti_image **pyramid, int unsigned levelNumber, int unsigned levelToPerform, int unsigned level)
+{
+   // The same sequence of downsampling steps as in reg_createImagePyramid is
+   // applied, so that both approaches yield the same images. The first step
+   // reads the input image directly, so that only the finest level requires
+   // a copy of the image at its original resolution
+   const unsigned int stepNumber = (levelNumber-levelToPerform) + (levelToPerform-1-level);
+   const int datatype = sizeof(DTYPE)==sizeof(float) ? NIFTI_TYPE_FLOAT32 : NIFTI_TYPE_FLOAT64;
+   nifti_image *image=NULL;
+   for(unsigned int l=0; l<stepNumber; l++)
+   {
+      nifti_image *current = (image==NULL) ? inputImage : image;
+      bool downsampleAxis[8]= {false,true,true,true,false,false,false,false};
+      if((current->nx/2) < 32) downsampleAxis[1]=false;
+      if((current->ny/2) < 32) downsampleAxis[2]=false;
+      if((current->nz/2) < 32) downsampleAxis[3]=false;
+      if(image==NULL)
+         image=reg_downsampleImageCopy<DTYPE>(inputImage, datatype, 1, downsampleAxis);
+      else reg_downsampleImage<DTYPE>(image, 1, downsampleAxis);
+   }
+   if(image==NULL)
+   {
+      image=nifti_copy_nim_info(inputImage);
+      reg_tools_allocateImageData(image, inputImage->data);
+      reg_tools_changeDatatype<DTYPE>(image);
+   }
+   // The intensity scaling is applied once the image is at its final size
+   reg_tools_removeSCLInfo(image);
+   pyramid[level]=image;
+   return EXIT_SUCCESS;
+}
+template int reg_createImagePyramidLevel<float>(nifti_image *, nifti_image **, unsigned int , unsigned int , unsigned int);
+template int reg_createImagePyramidLevel<double>(nifti_image *, nifti_image **, unsigned int , unsigned int , unsigned int);
+/* *************************************************************** */
+template <class DTYPE>
+int reg_createMaskPyramidLevel(nifti_image *inputMaskImage, int **maskPyramid, int unsigned levelNumber, int unsigned levelToPerform, int unsigned level, int *activeVoxelNumber)
+{
+   // The mask is subsampled before being binarised, which gives the same
+   // result as the opposite order as no interpolation is involved
+   const unsigned int stepNumber = (levelNumber-levelToPerform) + (levelToPerform-1-level);
+   nifti_image *maskImage=NULL;
+   for(unsigned int l=0; l<stepNumber; l++)
+   {
+      nifti_image *current = (maskImage==NULL) ? inputMaskImage : maskImage;
+      bool downsampleAxis[8]= {false,true,true,true,false,false,false,false};
+      if((current->nx/2) < 32) downsampleAxis[1]=false;
+      if((current->ny/2) < 32) downsampleAxis[2]=false;
+      if((current->nz/2) < 32) downsampleAxis[3]=false;
+      if(maskImage==NULL)
+         maskImage=reg_downsampleImageCopy<DTYPE>(inputMaskImage, inputMaskImage->datatype, 0, downsampleAxis);
+      else reg_downsampleImage<DTYPE>(maskImage, 0, downsampleAxis);
+   }
+   if(maskImage==NULL)
+   {
+      maskImage=nifti_copy_nim_info(inputMaskImage);
+      reg_tools_allocateImageData(maskImage, inputMaskImage->data);
+   }
+   reg_tools_binarise_image(maskImage);
+   reg_tools_changeDatatype<unsigned char>(maskImage);
+
+   activeVoxelNumber[level]=maskImage->nx*maskImage->ny*maskImage->nz;
+   maskPyramid[level]=(int *)malloc(activeVoxelNumber[level] * sizeof(int));
+   reg_tools_binaryImage2int(maskImage,
+                             maskPyramid[level],
+                             activeVoxelNumber[level]);
+   nifti_image_free(maskImage);
+   return EXIT_SUCCESS;
+}
+template int reg_createMaskPyramidLevel<float>(nifti_image *, int **, unsigned int , unsigned int , unsigned int , int *);
+template int reg_createMaskPyramidLevel<double>(nifti_image *, int **, unsigned int , unsigned int , unsigned int , int *);
+/* *************************************************************** */
+size_t reg_tools_getImageMemory(nifti_image *image)
+{
+   if(image==NULL || image->data==NULL)
+      return 0;
+   return image->nvox * image->nbyper;
+}
+/* *************************************************************** */
+uint64_t reg_tools_getImageDataHash(nifti_image *image)
+{
+   if(image==NULL || image->data==NULL)
+      return 0;
+   const unsigned char *bytes = static_cast<const unsigned char *>(image->data);
+   const size_t byteNumber = image->nvox * image->nbyper;
+   uint64_t hash = 14695981039346656037ULL;
+   for(size_t i=0; i<byteNumber; ++i)
+   {
+      hash ^= bytes[i];
+      hash *= 1099511628211ULL;
+   }
+   return hash;
+}
+/* *************************************************************** */
+// Arrays smaller than this are allocated and initialised serially
+#define REG_FIRST_TOUCH_BYTES 1048576
+// Size and alignment of a transparent huge page
+#define REG_HUGE_PAGE_BYTES 2097152
+static bool reg_firstTouchAllocation=false;
+static bool reg_hugePageAllocation=false;
+/* *************************************************************** */
+void reg_tools_setFirstTouchAllocation(bool enabled)
+{
+   reg_firstTouchAllocation=enabled;
+}
+/* *************************************************************** */
+bool reg_tools_getFirstTouchAllocation()
+{
+   return reg_firstTouchAllocation;
+}
+/* *************************************************************** */
+void reg_tools_setHugePageAllocation(bool enabled)
+{
+   reg_hugePageAllocation=enabled;
+}
+/* *************************************************************** */
+bool reg_tools_getHugePageAllocation()
+{
+   return reg_hugePageAllocation;
+}
+/* *************************************************************** */
+void reg_tools_allocateImageData(nifti_image *image, const void *source)
+{
+   const size_t byteNumber=image->nvox*image->nbyper;
+   int threadNumber=1;
+#if defined (_OPENMP)
+   threadNumber=omp_get_max_threads();
+#endif
+   // Parallel initialisation is only used on request
+   const bool firstTouch=reg_firstTouchAllocation &&
+         byteNumber>=REG_FIRST_TOUCH_BYTES && threadNumber>1;
+   void *data=NULL;
+   if(!firstTouch)
+   {
+      if(source==NULL)
+         data=calloc(image->nvox, image->nbyper);
+      else if((data=malloc(byteNumber))!=NULL)
+         memcpy(data, source, byteNumber);
+   }
+   else
+   {
+#if defined (__linux__)
+      // The array is aligned to a huge page boundary and advised before it
+      // is touched, so that the kernel can back it with huge pages
+      if(reg_hugePageAllocation)
+      {
+         if(posix_memalign(&data, REG_HUGE_PAGE_BYTES, byteNumber)!=0)
+            data=NULL;
+#if defined (MADV_HUGEPAGE)
+         else if(byteNumber>=REG_HUGE_PAGE_BYTES)
+            madvise(data, byteNumber-byteNumber%REG_HUGE_PAGE_BYTES, MADV_HUGEPAGE);
+#endif
+      }
+#endif
+      if(data==NULL)
+         data=malloc(byteNumber);
+   }
+   if(data==NULL)
+   {
+      reg_print_fct_error("reg_tools_allocateImageData");
+      reg_print_msg_error("Failed to allocate the image data array");
+      reg_exit();
+   }
+   image->data=data;
+   if(!firstTouch)
+      return;
+
+   // Each volume is split into one block of voxels per thread, matching the
+   // partition of a statically scheduled loop over the voxels of one volume
+   size_t voxelNumber=(size_t)image->nx*image->ny*image->nz;
+   if(voxelNumber==0 || image->nvox%voxelNumber!=0)
+      voxelNumber=image->nvox;
+   const size_t volumeNumber=image->nvox/voxelNumber;
+   const size_t voxelBytes=image->nbyper;
+   char *dataPtr=static_cast<char *>(data);
+   const char *sourcePtr=static_cast<const char *>(source);
+   int t;
+   size_t v, start, end;
+#if defined (_OPENMP)
+#pragma omp parallel for default(none) schedule(static) num_threads(threadNumber) \
+   private(t, v, start, end) \
+   shared(threadNumber, voxelNumber, volumeNumber, voxelBytes, dataPtr, sourcePtr)
+#endif
+   for(t=0; t<threadNumber; ++t)
+   {
+      start=voxelNumber*t/threadNumber;
+      end=voxelNumber*(t+1)/threadNumber;
+      for(v=0; v<volumeNumber; ++v)
+      {
+         const size_t offset=(v*voxelNumber+start)*voxelBytes;
+         if(sourcePtr==NULL)
+            memset(dataPtr+offset, 0, (end-start)*voxelBytes);
+         else memcpy(dataPtr+offset, sourcePtr+offset, (end-start)*voxelBytes);
+      }
+   }
+#ifndef NDEBUG
+   reg_print_fct_debug("reg_tools_allocateImageData");
+#endif
+}
+/* *************************************************************** */
 /* *************************************************************** */
 template <class TYPE1, class TYPE2>
 int reg_tools_nanMask_image2(nifti_image *image, nifti_image *maskImage, nifti_image *outputImage)
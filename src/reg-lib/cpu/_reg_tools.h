@@ -16,6 +16,7 @@
 
 #include <fstream>
 #include <map>
+#include <stdint.h>
 #include "_reg_maths.h"
 
 typedef enum
@@ -118,7 +119,8 @@ void reg_tools_labelKernelConvolution(nifti_image *image,
  * @param image Image to be downsampled
  * @param type The image is first smoothed  using a Gaussian
  * kernel of 0.7 voxel standard deviation before being downsample
- * if type is set to true.
+ * if type is set to true. The separable smoothing is only evaluated
+ * at the voxels that are kept after decimation.
  * @param axis Boolean array to specify which axis have to be
  * downsampled. The array follow the dim array of the nifti header.
  */
@@ -266,6 +268,44 @@ void reg_tools_binaryImage2int(nifti_image *img,
                                int *array,
                                int &activeVoxelNumber);
 
+/* *************************************************************** */
+/** @brief Compact representation of a mask, storing the sorted
+ * indices of the active voxels only. Kernels that receive such a
+ * list only visit the listed voxels, so that their cost scales with
+ * the masked volume rather than with the full field of view.
+ */
+typedef struct _reg_activeVoxelList
+{
+   /// Sorted linear indices of the active voxels
+   int *index;
+   /// Number of active voxels
+   size_t number;
+
+   _reg_activeVoxelList()
+      : index(NULL),
+        number(0)
+   {}
+   ~_reg_activeVoxelList()
+   {
+      if(this->index!=NULL)
+         free(this->index);
+      this->index=NULL;
+   }
+} _reg_activeVoxelList;
+
+/* *************************************************************** */
+/** @brief Build the compact list of active voxels from a dense mask
+ * array, where active voxels are those with a value greater than -1
+ * @param mask Dense mask array
+ * @param voxelNumber Number of voxels in the mask array
+ * @return A newly allocated list, or NULL if no mask is defined or
+ * if all the voxels are active. In the latter case the kernels fall
+ * back on their dense loop, which is then equivalent and cheaper.
+ */
+extern "C++"
+_reg_activeVoxelList *reg_tools_getActiveVoxelList(int *mask,
+                                                   size_t voxelNumber);
+
 /* *************************************************************** */
 /** @brief Compute the mean root mean squared error between
  * two vector images
@@ -361,6 +401,84 @@ int reg_createMaskPyramid(nifti_image *input,
                           unsigned int levelToPerform,
                           int *activeVoxelNumber);
 /* *************************************************************** */
+/** @brief Generate a single level of an image pyramid from the input
+ * image. The level is identical to the one that reg_createImagePyramid
+ * would create, but the other levels are neither allocated nor
+ * computed, so that pyramid levels can be created on demand.
+ * @param input Input image to be downsampled
+ * @param pyramid Array of images whose entry at index level is allocated
+ * @param levelNumber Number of level to use to create the pyramid.
+ * @param levelToPerform Number to level that will be perform during
+ * the registration.
+ * @param level Index of the level to generate, 0 being the coarsest
+ */
+extern "C++" template<class DTYPE>
+int reg_createImagePyramidLevel(nifti_image *input,
+                                nifti_image **pyramid,
+                                unsigned int levelNumber,
+                                unsigned int levelToPerform,
+                                unsigned int level);
+/* *************************************************************** */
+/** @brief Generate a single level of a mask pyramid from the input
+ * mask image. See reg_createImagePyramidLevel.
+ * @param activeVoxelNumber Array whose entry at index level is updated
+ * with the number of active voxels
+ */
+extern "C++" template<class DTYPE>
+int reg_createMaskPyramidLevel(nifti_image *input,
+                               int **pyramid,
+                               unsigned int levelNumber,
+                               unsigned int levelToPerform,
+                               unsigned int level,
+                               int *activeVoxelNumber);
+/* *************************************************************** */
+/** @brief Return the number of bytes used by the data array of an image,
+ * or 0 if the image or its data array is not allocated
+ */
+extern "C++"
+size_t reg_tools_getImageMemory(nifti_image *image);
+/* *************************************************************** */
+/** @brief Return a 64-bit FNV-1a hash of the data array of an image,
+ * which changes with any of its values, or 0 if the data array is not
+ * allocated
+ */
+extern "C++"
+uint64_t reg_tools_getImageDataHash(nifti_image *image);
+/* *************************************************************** */
+/** @brief Allocate the data array of an image, either zero-initialised
+ * or as a copy of an existing array. If requested through
+ * reg_tools_setFirstTouchAllocation(), large arrays are first touched in
+ * parallel, each thread initialising the voxels that a statically
+ * scheduled loop over the voxels would assign to it, and each volume of a
+ * multi-volume image, such as a vector field, is split in the same way.
+ * On NUMA systems, each page is then placed on the node of the thread
+ * that later uses it. The array can be released using free().
+ * @param image Image whose data array is allocated, using its nvox and
+ * nbyper fields. Any existing array is not released
+ * @param source Array to copy into the new one, or NULL
+ */
+extern "C++"
+void reg_tools_allocateImageData(nifti_image *image,
+                                 const void *source=NULL);
+/* *************************************************************** */
+/** @brief Request that large image arrays allocated by
+ * reg_tools_allocateImageData() be initialised in parallel. Otherwise they
+ * are allocated with calloc() or copied serially
+ */
+extern "C++"
+void reg_tools_setFirstTouchAllocation(bool enabled);
+extern "C++"
+bool reg_tools_getFirstTouchAllocation();
+/* *************************************************************** */
+/** @brief Request that large image arrays initialised in parallel by
+ * reg_tools_allocateImageData() be backed by transparent huge pages, where
+ * the system supports them
+ */
+extern "C++"
+void reg_tools_setHugePageAllocation(bool enabled);
+extern "C++"
+bool reg_tools_getHugePageAllocation();
+/* *************************************************************** */
 /** @brief this function will threshold an image to the values provided,
  * set the scl_slope and sct_inter of the image to 1 and 0
  * (SSD uses actual image data values),